@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The vector decoder stores 32 bytes at a time and keeps 24, so the output
+// buffer needs this much room past the decoded length.
+#define BASE64_OUT_SLACK 8
+
+/// @brief Decoded length of len base64 characters, at most.
+inline size_t base64_decoded_max(size_t len) { return len / 4 * 3 + BASE64_OUT_SLACK; }
+
+/// @brief Decode standard base64 ('+', '/', '=' padding), with AVX2 if the
+/// CPU has it.
+/// @param out Room for base64_decoded_max(len) bytes.
+/// @return The decoded length, or -1 if the input isn't valid base64.
+long decode_base64_fast(const char *in, size_t len, uint8_t *out);
+
+/// @brief Table driven decoder, for the tail of the input and for CPUs
+/// without AVX2.
+long decode_base64_scalar(const char *in, size_t len, uint8_t *out);
+
+/// @brief Whether decode_base64_fast uses AVX2 on this CPU.
+bool base64_has_avx2();
+
+void test_base64();
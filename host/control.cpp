@@ -0,0 +1,263 @@
+/*
+Send a runtime control command (see main/control.h) to a device, and wait for
+its acknowledgement in the output stream.
+
+    control [-t seconds] port ping
+    control port outputs <mask>       OUTPUT_* bits: 1 full rate windows,
+                                      2 middle, 4 slow, 8 every full rate block
+    control port channels <mask>      bit 0 is side 0 x, bit 5 side 1 z
+    control port trace <level>        0 data only, 1 reports, 2 every read
+    control port rate <odr> <gyro decimation>
+                                      slower than the build's, by powers of two
+    control -T                        self test, against a device on a pty
+
+The port is read from as well, so stop ingest on it first, or send through a
+pty that stands in for it.  Exits 0 if the command was accepted.
+*/
+
+#include <assert.h>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <termios.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "control.h"
+
+// Matches Serial.begin(8 * 115200) in main/main.cpp.
+#define SERIAL_BAUD B921600
+
+static const char *const status_names[] = {"ok", "bad crc", "unknown command", "bad length",
+                                           "out of range", "unsupported by this build", "busy"};
+
+static int64_t monotonic_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// @brief Put a serial port, or a pty, in raw mode at the device's baud rate.
+static void configure_tty(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+        return;
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, SERIAL_BAUD);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+/// @brief Send a frame, and read lines until its acknowledgement arrives.
+/// @return false on timeout, or a write error.
+static bool send_command(int fd, uint8_t seq, uint8_t command, const uint8_t *payload, uint8_t length,
+                         double timeout, ControlAck *ack)
+{
+    uint8_t frame[5 + CONTROL_MAX_PAYLOAD];
+    size_t n = control_frame(seq, command, payload, length, frame);
+    if (write(fd, frame, n) != (ssize_t)n)
+        return false;
+
+    std::string line;
+    int64_t deadline = monotonic_usec() + (int64_t)(timeout * 1e6);
+    while (monotonic_usec() < deadline)
+    {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 10) <= 0)
+            continue;
+        char buf[4096];
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got <= 0)
+            return false;
+        for (ssize_t i = 0; i < got; i++)
+        {
+            if (buf[i] != '\n')
+            {
+                // Output lines are short.  Anything longer isn't an ack.
+                if (line.size() < 256)
+                    line += buf[i];
+                continue;
+            }
+            if (parse_control_ack(line.c_str(), ack) && ack->seq == seq)
+                return true;
+            line.clear();
+        }
+    }
+    return false;
+}
+
+/// @brief Parse a command and its values into a payload.
+/// @return false if it isn't one.
+static bool parse_command(int argc, char **argv, uint8_t *command, uint8_t *payload, uint8_t *length)
+{
+    if (argc < 1)
+        return false;
+    std::string name = argv[0];
+    if (name == "ping" && argc == 1)
+    {
+        *command = CONTROL_PING;
+        *length = 0;
+        return true;
+    }
+    if ((name == "outputs" || name == "channels" || name == "trace") && argc == 2)
+    {
+        *command = name == "outputs" ? CONTROL_OUTPUTS : name == "channels" ? CONTROL_CHANNELS : CONTROL_TRACE;
+        payload[0] = (uint8_t)strtoul(argv[1], nullptr, 0);
+        *length = 1;
+        return true;
+    }
+    if (name == "rate" && argc == 3)
+    {
+        unsigned odr = strtoul(argv[1], nullptr, 0);
+        *command = CONTROL_RATE;
+        payload[0] = odr & 0xFF;
+        payload[1] = odr >> 8;
+        payload[2] = (uint8_t)strtoul(argv[2], nullptr, 0);
+        *length = 3;
+        return true;
+    }
+    return false;
+}
+
+static void write_to_fd(const void *data, size_t bytes, void *context)
+{
+    ssize_t n = write(*(int *)context, data, bytes);
+    (void)n;
+}
+
+/// @brief A device on the master side of a pty: feeds what it reads to a
+/// ControlChannel, and outputs a slow tier line per block of 8 samples every
+/// few msec, applying settings between blocks, as the merger does.
+static void run_device(int fd, std::atomic<bool> &stop)
+{
+    ControlChannel control(1920, 4);
+    control.set_sink(write_to_fd, &fd);
+    long index = 0;
+    while (!stop)
+    {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 4) > 0)
+        {
+            uint8_t buf[256];
+            ssize_t got = read(fd, buf, sizeof(buf));
+            for (ssize_t i = 0; i < got; i++)
+                control.feed(buf[i], monotonic_usec());
+        }
+        control.apply(index);
+        char line[64];
+        int n = snprintf(line, sizeof(line), "S %ld 0 0 0 0 0\n", index);
+        write_to_fd(line, n, &fd);
+        index += 8;
+    }
+}
+
+/// @brief Talk to a device stand-in through a pty, as to a serial port.
+static void test_pty()
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    assert(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    int port = open(ptsname(master), O_RDWR | O_NOCTTY);
+    assert(port >= 0);
+    configure_tty(port);
+    std::atomic<bool> stop{false};
+    std::thread device(run_device, master, std::ref(stop));
+
+    ControlAck ack;
+    uint8_t payload[CONTROL_MAX_PAYLOAD];
+    uint8_t command, length;
+    char outputs[] = "outputs", mask[] = "0xC";
+    char *argv[] = {outputs, mask};
+    assert(parse_command(2, argv, &command, payload, &length));
+    assert(send_command(port, 1, command, payload, length, 2, &ack));
+    assert(ack.status == CONTROL_OK && ack.index >= 0 && ack.index % 8 == 0);
+    assert(ack.settings.outputs == (OUTPUT_SLOW | OUTPUT_FULL_ALL));
+
+    // Rejected straight away.
+    payload[0] = 9;
+    assert(send_command(port, 2, CONTROL_TRACE, payload, 1, 2, &ack));
+    assert(ack.status == CONTROL_RANGE && ack.index == -1 && ack.settings.trace == TRACE_INFO);
+    char rate[] = "rate", odr[] = "3840", decimation[] = "4";
+    char *rate_argv[] = {rate, odr, decimation};
+    assert(parse_command(3, rate_argv, &command, payload, &length));
+    assert(send_command(port, 3, command, payload, length, 2, &ack) && ack.status == CONTROL_UNSUPPORTED);
+
+    // Slower is accepted, at a block boundary.
+    char slower[] = "960", sparser[] = "8";
+    char *slower_argv[] = {rate, slower, sparser};
+    assert(parse_command(3, slower_argv, &command, payload, &length));
+    assert(send_command(port, 4, command, payload, length, 2, &ack) && ack.status == CONTROL_OK);
+    assert(ack.index >= 0 && ack.settings.odr == 960 && ack.settings.gyro_decimation == 8);
+
+    // Line noise, then a command.
+    uint8_t noise[] = {CONTROL_SYNC, 0xFF, 0x00};
+    assert(write(port, noise, sizeof(noise)) == sizeof(noise));
+    assert(send_command(port, 5, CONTROL_PING, nullptr, 0, 2, &ack));
+    assert(ack.seq == 5 && ack.status == CONTROL_OK && ack.settings.outputs == (OUTPUT_SLOW | OUTPUT_FULL_ALL));
+
+    stop = true;
+    device.join();
+    close(port);
+    close(master);
+    printf("Control over a pty: ok\n");
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: control [-t seconds] port ping|outputs <mask>|channels <mask>|trace <level>|rate <odr> <decimation>\n"
+            "       control -T\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double timeout = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:T")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': timeout = atof(optarg); break;
+        case 'T':
+            test_control();
+            test_pty();
+            return 0;
+        default: usage();
+        }
+    }
+    uint8_t command, length;
+    uint8_t payload[CONTROL_MAX_PAYLOAD];
+    if (optind + 1 >= argc || !parse_command(argc - optind - 1, argv + optind + 1, &command, payload, &length))
+        usage();
+
+    int fd = open(argv[optind], O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (isatty(fd))
+        configure_tty(fd);
+    // A sequence number that differs from run to run, so an old ack isn't taken for this one.
+    uint8_t seq = (uint8_t)(monotonic_usec() / 1000);
+    ControlAck ack;
+    if (!send_command(fd, seq, command, payload, length, timeout, &ack))
+    {
+        fprintf(stderr, "No acknowledgement from %s\n", argv[optind]);
+        return 1;
+    }
+    printf("%s at %ld: outputs 0x%X, channels 0x%X, trace %d, %d Hz, gyro 1/%d\n",
+           ack.status < (int)(sizeof(status_names) / sizeof(status_names[0])) ? status_names[ack.status] : "?",
+           ack.index, ack.settings.outputs, ack.settings.channels, ack.settings.trace, ack.settings.odr,
+           ack.settings.gyro_decimation);
+    return ack.status == CONTROL_OK ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+/*
+Render the device's TFT dashboard (see main/dashboard.h) on the host, into a
+framebuffer that stands in for the panel.
+
+    dashboard -o dash.ppm          a sample screen, as an image
+    dashboard -T                   self tests
+
+The stand-in completes transfers late, as SPI DMA does, so the tests catch a
+strip that is rendered into while still on the bus.
+*/
+
+#include <assert.h>
+#include <deque>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "dashboard.h"
+
+/// @brief A framebuffer in place of the TFT.  With deferred set, each
+/// transfer is only copied when it completes, in wait(), like DMA reading
+/// the strip after draw() has returned.
+class FramebufferPanel : public DashboardPanel
+{
+public:
+    bool deferred = true;
+    std::vector<uint16_t> pixels = std::vector<uint16_t>(DASHBOARD_WIDTH * DASHBOARD_HEIGHT, 0xAAAA);
+
+    bool draw(int x, int y, int w, int h, const uint16_t *data) override
+    {
+        assert(x >= 0 && y >= 0 && w > 0 && h > 0 && x + w <= DASHBOARD_WIDTH && y + h <= DASHBOARD_HEIGHT);
+        // As many transfers in flight as the TFT's queue depth.
+        assert(pending.size() < 2);
+        pending.push_back({x, y, w, h, data});
+        if (!deferred)
+            wait();
+        return true;
+    }
+
+    uint32_t done() const override { return completed; }
+
+    void wait() override
+    {
+        assert(!pending.empty());
+        Transfer t = pending.front();
+        pending.pop_front();
+        for (int row = 0; row < t.h; row++)
+            memcpy(&pixels[(t.y + row) * DASHBOARD_WIDTH + t.x], t.data + row * t.w, t.w * sizeof(uint16_t));
+        completed++;
+    }
+
+    void flush()
+    {
+        while (!pending.empty())
+            wait();
+    }
+
+    /// @brief Read a row of text back from the pixels, and its colour.
+    std::string text(int row, uint16_t *color)
+    {
+        std::string line;
+        *color = DASHBOARD_BLACK;
+        for (int col = 0; col < DASHBOARD_COLS; col++)
+        {
+            uint8_t columns[5] = {};
+            for (int gx = 0; gx < 5; gx++)
+                for (int gy = 0; gy < 7; gy++)
+                {
+                    int x = col * DASHBOARD_CELL_W + gx * DASHBOARD_SCALE;
+                    int y = row * DASHBOARD_CELL_H + gy * DASHBOARD_SCALE;
+                    uint16_t p = pixels[y * DASHBOARD_WIDTH + x];
+                    if (p != DASHBOARD_BLACK)
+                    {
+                        columns[gx] |= 1 << gy;
+                        *color = p;
+                    }
+                }
+            char c = '?';
+            for (char g = ' '; g <= 'Z'; g++)
+                if (memcmp(Dashboard::glyph(g), columns, 5) == 0)
+                {
+                    c = g;
+                    break;
+                }
+            line += c;
+        }
+        return line;
+    }
+
+    bool write_ppm(const char *path)
+    {
+        FILE *f = fopen(path, "wb");
+        if (f == nullptr)
+            return false;
+        fprintf(f, "P6\n%d %d\n255\n", DASHBOARD_WIDTH, DASHBOARD_HEIGHT);
+        for (uint16_t p : pixels)
+        {
+            uint16_t c = (uint16_t)((p >> 8) | (p << 8)); // Panel order is big endian.
+            uint8_t rgb[3] = {(uint8_t)(c >> 11 << 3), (uint8_t)((c >> 5 & 0x3f) << 2), (uint8_t)((c & 0x1f) << 3)};
+            fwrite(rgb, 1, 3, f);
+        }
+        return fclose(f) == 0;
+    }
+
+private:
+    struct Transfer
+    {
+        int x, y, w, h;
+        const uint16_t *data;
+    };
+    std::deque<Transfer> pending;
+    uint32_t completed = 0;
+};
+
+static uint16_t strip_memory[2][DASHBOARD_STRIP_PIXELS];
+static uint16_t *strips[2] = {strip_memory[0], strip_memory[1]};
+
+static DashboardStats sample_stats()
+{
+    DashboardStats stats;
+    stats.now = 3723LL * 1000000;
+    stats.merging = true;
+    stats.left_hz = 1920.37f;
+    stats.right_hz = 1920.11f;
+    stats.skew_ppm = 135.4f;
+    stats.queued = 3;
+    stats.queue_depth = 40;
+    stats.strikes = 212;
+    stats.last_strike = stats.now - 2400000;
+    stats.strike_peak = 4512;
+    stats.has_angle = true;
+    stats.angle = -12.5f;
+    return stats;
+}
+
+/// @brief Check that the screen shows exactly what format() says.
+static void check_screen(FramebufferPanel &panel, const DashboardStats &stats)
+{
+    char lines[DASHBOARD_ROWS][DASHBOARD_COLS + 1];
+    uint16_t colors[DASHBOARD_ROWS];
+    Dashboard::format(stats, lines, colors);
+    panel.flush();
+    for (int row = 0; row < DASHBOARD_ROWS; row++)
+    {
+        uint16_t color;
+        std::string text = panel.text(row, &color);
+        if (text != lines[row])
+            printf("Row %d shows '%s', expected '%s'\n", row, text.c_str(), lines[row]);
+        assert(text == lines[row]);
+        assert(color == colors[row] || text.find_first_not_of(' ') == std::string::npos);
+    }
+}
+
+static void test_dashboard()
+{
+    static FramebufferPanel panel;
+    static Dashboard dashboard(panel, strips);
+    dashboard.clear();
+    panel.flush();
+    for (uint16_t p : panel.pixels)
+        assert(p == DASHBOARD_BLACK);
+    const int strip_w = DASHBOARD_STRIP_CELLS * DASHBOARD_CELL_W;
+    long clear_transfers = ((DASHBOARD_HEIGHT + DASHBOARD_CELL_H - 1) / DASHBOARD_CELL_H) *
+                           ((DASHBOARD_WIDTH + strip_w - 1) / strip_w);
+    assert(dashboard.transfers == clear_transfers);
+
+    // The first update draws every row.
+    DashboardStats stats = sample_stats();
+    stats.last_strike = -1;
+    dashboard.show(stats);
+    check_screen(panel, stats);
+    long full = dashboard.pixels - DASHBOARD_WIDTH * DASHBOARD_HEIGHT;
+    assert(full == (long)DASHBOARD_ROWS * DASHBOARD_COLS * DASHBOARD_CELL_W * DASHBOARD_CELL_H);
+
+    // A second later, only the seconds digit of the uptime changes.
+    long transfers = dashboard.transfers;
+    long pixels = dashboard.pixels;
+    stats.now += 1000000;
+    dashboard.show(stats);
+    check_screen(panel, stats);
+    assert(dashboard.transfers == transfers + 1);
+    assert(dashboard.pixels == pixels + DASHBOARD_CELL_W * DASHBOARD_CELL_H);
+
+    // Nothing changed, nothing drawn.
+    transfers = dashboard.transfers;
+    dashboard.show(stats);
+    assert(dashboard.transfers == transfers);
+
+    // Two digits close together go as one run.
+    stats.strikes = 219;
+    dashboard.show(stats);
+    check_screen(panel, stats);
+    assert(dashboard.transfers == transfers + 1);
+
+    // A backlog turns the queue row red, which redraws the whole row.
+    transfers = dashboard.transfers;
+    stats.queued = 30;
+    dashboard.show(stats);
+    check_screen(panel, stats);
+    uint16_t color;
+    panel.text(3, &color);
+    assert(color == DASHBOARD_RED);
+    assert(dashboard.transfers == transfers + (DASHBOARD_COLS + DASHBOARD_STRIP_CELLS - 1) / DASHBOARD_STRIP_CELLS);
+
+    // A strike, while still fitting, and lost samples.
+    stats = sample_stats();
+    stats.merging = false;
+    stats.lost[1] = 17;
+    dashboard.show(stats);
+    check_screen(panel, stats);
+
+    long updates = 0;
+    pixels = dashboard.pixels;
+    for (int i = 0; i < 240; i++, updates++)
+    {
+        stats.now += DASHBOARD_PERIOD_USEC;
+        dashboard.show(stats);
+    }
+    check_screen(panel, stats);
+    printf("Dashboard: %ld transfers, %.0f bytes per update over a minute, vs %d for the screen\n",
+           dashboard.transfers, 2.0 * (dashboard.pixels - pixels) / updates,
+           2 * DASHBOARD_WIDTH * DASHBOARD_HEIGHT);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: dashboard -o out.ppm\n"
+                    "       dashboard -T\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:T")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o': output = optarg; break;
+        case 'T':
+            test_dashboard();
+            return 0;
+        default: usage();
+        }
+    }
+    if (output == nullptr || optind != argc)
+        usage();
+
+    static FramebufferPanel panel;
+    static Dashboard dashboard(panel, strips);
+    dashboard.clear();
+    dashboard.show(sample_stats());
+    panel.flush();
+    if (!panel.write_ppm(output))
+    {
+        perror(output);
+        return 1;
+    }
+    printf("%s: %d x %d, %ld transfers\n", output, DASHBOARD_WIDTH, DASHBOARD_HEIGHT, dashboard.transfers);
+    return 0;
+}
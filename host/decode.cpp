@@ -0,0 +1,483 @@
+#include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64_simd.h"
+#include "control.h"
+#include "decode.h"
+#include "metrics.h"
+
+int64_t monotonic_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool ColumnFile::open(const std::string &path, bool truncate)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND), 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    buffer.reserve(COLUMN_BUFFER_BYTES);
+    return true;
+}
+
+void ColumnFile::append(const void *data, size_t bytes)
+{
+    if (buffer.size() + bytes > COLUMN_BUFFER_BYTES)
+        flush();
+    const uint8_t *p = (const uint8_t *)data;
+    buffer.insert(buffer.end(), p, p + bytes);
+}
+
+void ColumnFile::flush()
+{
+    size_t done = 0;
+    while (fd >= 0 && done < buffer.size())
+    {
+        ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            fprintf(stderr, "Column write failed: %s\n", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    buffer.clear();
+}
+
+void ColumnFile::close()
+{
+    flush();
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+static const char *const column_names[COL_COUNT] = {
+    "mid_s0x.i16", "mid_s0y.i16", "mid_s0z.i16", "mid_s1x.i16", "mid_s1y.i16", "mid_s1z.i16",
+    "slow_s0x.i16", "slow_s0y.i16", "slow_s0z.i16", "slow_s1x.i16", "slow_s1y.i16", "slow_s1z.i16",
+    "angle.i16", "rate.i16", "gap.i32", "gyro.i32", "control.i32", "metrics.i32", "events.i32"};
+
+static void write_to_file(const void *data, size_t bytes, void *context)
+{
+    ((ColumnFile *)context)->append(data, bytes);
+}
+
+bool StreamDecoder::open(const std::string &dir, int odr)
+{
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", dir.c_str(), strerror(errno));
+        return false;
+    }
+    for (int c = 0; c < COL_COUNT; c++)
+        if (!columns[c].open(dir + "/" + column_names[c]))
+            return false;
+    // Until the device sends its clock model, assume the nominal rate.
+    if (!full_file.open(dir + "/full.rec", true))
+        return false;
+    full.set_time({0, 0, 1e6f / odr});
+    full.begin(odr, write_to_file, &full_file);
+    partial.reserve(MAX_LINE);
+    path = dir;
+    return true;
+}
+
+void StreamDecoder::finish()
+{
+    full.finish();
+    full_file.flush();
+    blackbox_file.flush();
+    for (auto &c : columns)
+        c.flush();
+}
+
+void StreamDecoder::feed(const char *data, size_t len)
+{
+    auto start = monotonic_usec();
+    stats.bytes.fetch_add(len, std::memory_order_relaxed);
+    const char *end = data + len;
+    while (data < end)
+    {
+        const char *nl = (const char *)memchr(data, '\n', end - data);
+        if (nl == nullptr)
+        {
+            // Keep the partial line, unless it is too long to be one of ours.
+            if (partial.size() + (end - data) <= MAX_LINE)
+                partial.append(data, end);
+            else
+                partial.assign(MAX_LINE + 1, ' ');
+            break;
+        }
+        if (partial.empty())
+            line(data, nl);
+        else
+        {
+            if (partial.size() + (nl - data) <= MAX_LINE)
+            {
+                partial.append(data, nl);
+                line(partial.data(), partial.data() + partial.size());
+            }
+            else
+                stats.other_lines.fetch_add(1, std::memory_order_relaxed);
+            partial.clear();
+        }
+        data = nl + 1;
+    }
+    stats.decode_nsec.fetch_add(1000 * (monotonic_usec() - start), std::memory_order_relaxed);
+}
+
+void StreamDecoder::advance(int64_t position)
+{
+    if (stats.position.load(std::memory_order_relaxed) < 0)
+        stats.first_usec.store(monotonic_usec(), std::memory_order_relaxed);
+    if (position > stats.position.load(std::memory_order_relaxed))
+        stats.position.store(position, std::memory_order_relaxed);
+}
+
+/// @brief Parse count space separated decimal integers, and nothing else.
+bool StreamDecoder::values(const char *s, const char *end, int32_t *out, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        while (s < end && *s == ' ')
+            s++;
+        bool negative = s < end && *s == '-';
+        if (negative)
+            s++;
+        if (s == end || *s < '0' || *s > '9')
+            return false;
+        int64_t v = 0;
+        while (s < end && *s >= '0' && *s <= '9' && v < 0x80000000LL)
+            v = v * 10 + (*s++ - '0');
+        out[i] = (int32_t)(negative ? -v : v);
+    }
+    while (s < end && *s == ' ')
+        s++;
+    return s == end;
+}
+
+bool StreamDecoder::block(const char *s, const char *end)
+{
+    int64_t index = 0;
+    if (s == end || *s < '0' || *s > '9')
+        return false;
+    while (s < end && *s >= '0' && *s <= '9')
+        index = index * 10 + (*s++ - '0');
+    if (s == end || *s++ != ' ')
+        return false;
+
+    raw.resize(base64_decoded_max(end - s));
+    long bytes = decode_base64_fast(s, end - s, raw.data());
+    const int row = MERGED_CHANNELS * sizeof(int16_t);
+    if (bytes <= 0 || bytes % row != 0)
+        return false;
+
+    size_t n = bytes / row;
+    full.add(index, (const int16_t *)raw.data(), n);
+    stats.blocks.fetch_add(1, std::memory_order_relaxed);
+    stats.samples.fetch_add(n, std::memory_order_relaxed);
+    advance(index + n);
+    return true;
+}
+
+/// @brief Parse "<index> <decimation> <base64>", and write a row per gyro
+/// sample, on the merged index it was placed at.
+bool StreamDecoder::gyro(const char *s, const char *end)
+{
+    int64_t header[2] = {0, 0};
+    for (int i = 0; i < 2; i++)
+    {
+        if (s == end || *s < '0' || *s > '9')
+            return false;
+        while (s < end && *s >= '0' && *s <= '9')
+            header[i] = header[i] * 10 + (*s++ - '0');
+        if (s == end || *s++ != ' ')
+            return false;
+    }
+    if (header[1] < 1)
+        return false;
+
+    raw.resize(base64_decoded_max(end - s));
+    long bytes = decode_base64_fast(s, end - s, raw.data());
+    const int row = 3 * sizeof(int16_t);
+    if (bytes <= 0 || bytes % row != 0)
+        return false;
+    const int16_t *samples = (const int16_t *)raw.data();
+    for (long i = 0; i < bytes / row; i++)
+    {
+        int32_t out[4] = {(int32_t)(header[0] + i * header[1]), samples[3 * i], samples[3 * i + 1],
+                          samples[3 * i + 2]};
+        columns[COL_GYRO].append(out, sizeof(out));
+    }
+    return true;
+}
+
+/// @brief Decode a piece of a black box dump.  A capture header starts a new
+/// dump, which replaces the last one.
+bool StreamDecoder::dump(const char *s, const char *end)
+{
+    raw.resize(base64_decoded_max(end - s));
+    long bytes = decode_base64_fast(s, end - s, raw.data());
+    if (bytes <= 0)
+        return false;
+    if (bytes == sizeof(CaptureHeader) && ((const CaptureHeader *)raw.data())->magic == CAPTURE_MAGIC)
+    {
+        blackbox_file.close();
+        blackbox_open = blackbox_file.open(path + "/blackbox.cap", true);
+    }
+    else if (bytes < (long)sizeof(CaptureMessage))
+        return false;
+    if (!blackbox_open)
+        return false;
+    blackbox_file.append(raw.data(), bytes);
+    return true;
+}
+
+/// @brief Decode a metrics frame into a row.
+bool StreamDecoder::metrics(const char *s, const char *end)
+{
+    raw.resize(base64_decoded_max(end - s));
+    long bytes = decode_base64_fast(s, end - s, raw.data());
+    int32_t row[METRICS_FIELDS];
+    if (bytes <= 0 || !metrics_row(raw.data(), bytes, row))
+        return false;
+    columns[COL_METRICS].append(row, sizeof(row));
+    return true;
+}
+
+/// @brief Parse "<index> <usec> <period>", and use it for the chunks that follow.
+bool StreamDecoder::time_model(const char *s, const char *end)
+{
+    char text[64];
+    if (end - s >= (long)sizeof(text))
+        return false;
+    memcpy(text, s, end - s);
+    text[end - s] = '\0';
+    long long index, usec;
+    float period;
+    int used = 0;
+    if (sscanf(text, "%lld %lld %f%n", &index, &usec, &period, &used) != 3 || used != end - s || period <= 0)
+        return false;
+    full.set_time({index, usec, period});
+    return true;
+}
+
+void StreamDecoder::line(const char *s, const char *end)
+{
+    stats.lines.fetch_add(1, std::memory_order_relaxed);
+    if (end > s && end[-1] == '\r')
+        end--;
+    if (end - s < 2 || s[1] != ' ')
+    {
+        stats.other_lines.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    int32_t v[MERGED_CHANNELS];
+    bool ok = true;
+    switch (s[0])
+    {
+    case 'B':
+        ok = block(s + 2, end);
+        break;
+    case 'Y':
+        ok = gyro(s + 2, end);
+        break;
+    case 'K':
+        ok = dump(s + 2, end);
+        break;
+    case 'T':
+        ok = time_model(s + 2, end);
+        break;
+    case 'P':
+        ok = metrics(s + 2, end);
+        break;
+    case 'C':
+    {
+        // Settings changes, at the index they took effect.
+        char text[64];
+        ControlAck ack;
+        ok = end - s < (long)sizeof(text);
+        if (ok)
+        {
+            memcpy(text, s, end - s);
+            text[end - s] = '\0';
+            ok = parse_control_ack(text, &ack);
+        }
+        if (ok && ack.status == CONTROL_OK && ack.index >= 0)
+        {
+            int32_t row[6] = {(int32_t)ack.index, ack.settings.outputs, ack.settings.channels,
+                              ack.settings.trace, ack.settings.odr, ack.settings.gyro_decimation};
+            columns[COL_CONTROL].append(row, sizeof(row));
+        }
+        break;
+    }
+    case 'M':
+    case 'S':
+        ok = values(s + 2, end, v, MERGED_CHANNELS);
+        if (ok)
+        {
+            int base = s[0] == 'M' ? COL_MID : COL_SLOW;
+            for (int c = 0; c < MERGED_CHANNELS; c++)
+            {
+                int16_t x = (int16_t)v[c];
+                columns[base + c].append(&x, sizeof(x));
+            }
+            if (s[0] == 'S')
+                advance(++slow_samples * SLOW_DECIMATION);
+        }
+        break;
+    case 'A':
+        ok = values(s + 2, end, v, 2);
+        if (ok)
+        {
+            int16_t angle = (int16_t)v[0];
+            int16_t rate = (int16_t)v[1];
+            columns[COL_ANGLE].append(&angle, sizeof(angle));
+            columns[COL_RATE].append(&rate, sizeof(rate));
+        }
+        break;
+    case 'G':
+        ok = values(s + 2, end, v, 4);
+        if (ok)
+            columns[COL_GAP].append(v, 4 * sizeof(int32_t));
+        break;
+    case 'E':
+        // Activity events from the sensor (see main/activity.h).
+        ok = values(s + 2, end, v, 5);
+        if (ok)
+            columns[COL_EVENT].append(v, 5 * sizeof(int32_t));
+        break;
+    default:
+        stats.other_lines.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (!ok)
+        stats.bad_lines.fetch_add(1, std::memory_order_relaxed);
+}
+
+static std::vector<uint8_t> read_file(const std::string &path)
+{
+    std::vector<uint8_t> data;
+    FILE *f = fopen(path.c_str(), "rb");
+    assert(f != nullptr);
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+/// @brief Decode a made up stream, fed a few bytes at a time so lines split
+/// across reads, and check the recording and columns.
+void test_stream_decoder()
+{
+    char dir[] = "/tmp/ingest_testXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+
+    // Two samples: 1..6 and -1..-6, as encoded by the firmware.
+    const char *text =
+        "Min stack: 1234\n"
+        "S     1     2     3     4     5     6\r\n"
+        "T 512 5000000 500.0\n"
+        "B 640 AQACAAMABAAFAAYA///+//3//P/7//r/\n"
+        "A   1234    -56\n"
+        "M    -7     8    -9    10   -11    12\n"
+        "G 1 700 12 4\n"
+        "E 704 2 1 1 128\n"
+        "Y 641 4 AQACAAMA///+//3/\n"
+        "K 6AMAAAAAAAABAAAAAQAAABABAAIAAwAA\n"
+        "C 3 0 648 12 7 1 960 8\n"
+        "C 4 4 -1 12 7 1 960 8\n"
+        "P AwDoA4gTAAD6AJABFAD//ywBGAECACgADAAjAIQD8AAIUgAAAAADAAQAAQAAAAwA\n"
+        "K RlNDMQEAAACABwAA0AcAAA==\n"
+        "K 6AMAAAAAAAABAAAAAQAAABABAAIAAwAA\n"
+        "B 642 AQACAAMABAAFAA!!\n"
+        "S 1 2 3\n"
+        "partial line at the end";
+
+    {
+        StreamDecoder decoder;
+        assert(decoder.open(dir, 1920));
+        size_t len = strlen(text);
+        for (size_t i = 0; i < len; i += 5)
+            decoder.feed(text + i, len - i < 5 ? len - i : 5);
+        decoder.finish();
+
+        assert(decoder.stats.lines == 17);
+        assert(decoder.stats.other_lines == 1);
+        assert(decoder.stats.bad_lines == 3);
+        assert(decoder.stats.blocks == 1);
+        assert(decoder.stats.samples == 2);
+        assert(decoder.stats.position == 642);
+    }
+
+    std::string d = dir;
+    auto full = read_file(d + "/full.rec");
+    RecordingReader reader;
+    int16_t rows[RECORDING_CHUNK_SAMPLES * RECORDING_CHANNELS];
+    assert(reader.open(full.data(), full.size()) && !reader.scanned());
+    assert(reader.chunks() == 1 && reader.decode(0, rows) == 2);
+    assert(reader.entry(0).first_index == 640 && reader.entry(0).first_usec == 5000000 + 128 * 500);
+    for (int c = 0; c < MERGED_CHANNELS; c++)
+    {
+        assert(rows[c] == c + 1 && rows[MERGED_CHANNELS + c] == -(c + 1));
+        auto slow = read_file(d + "/" + column_names[COL_SLOW + c]);
+        assert(slow.size() == 2 && *(int16_t *)slow.data() == c + 1);
+    }
+    auto angle = read_file(d + "/angle.i16");
+    auto rate = read_file(d + "/rate.i16");
+    assert(*(int16_t *)angle.data() == 1234 && *(int16_t *)rate.data() == -56);
+    auto mid = read_file(d + "/mid_s1z.i16");
+    assert(*(int16_t *)mid.data() == 12);
+    auto gap = read_file(d + "/gap.i32");
+    assert(gap.size() == 16 && ((int32_t *)gap.data())[1] == 700);
+    auto events = read_file(d + "/events.i32");
+    const int32_t *e = (const int32_t *)events.data();
+    assert(events.size() == 20 && e[0] == 704 && e[1] == 2 && e[2] == 1 && e[3] == 1 && e[4] == 128);
+    auto gyro = read_file(d + "/gyro.i32");
+    const int32_t *g = (const int32_t *)gyro.data();
+    assert(gyro.size() == 32 && g[0] == 641 && g[1] == 1 && g[3] == 3 && g[4] == 645 && g[7] == -3);
+
+    auto control = read_file(d + "/control.i32");
+    const int32_t *c = (const int32_t *)control.data();
+    assert(control.size() == 24 && c[0] == 648 && c[1] == 12 && c[2] == 7 && c[3] == 1 && c[4] == 960 && c[5] == 8);
+
+    auto metrics = read_file(d + "/metrics.i32");
+    const int32_t *m = (const int32_t *)metrics.data();
+    assert(metrics.size() == METRICS_FIELDS * sizeof(int32_t) && m[METRICS_TIME_MSEC] == 5000);
+    assert(m[METRICS_CPU_LOGGER] == 400 && m[METRICS_CPU_PHASE] == -1 && m[METRICS_BUS_IMU2] == 280);
+    assert(m[METRICS_MERGE_WORST_USEC] == 900 && m[METRICS_BLOCKS_PER_SEC] == 240);
+    assert(m[METRICS_OUTPUT_BYTES_PER_SEC] == 21000 && m[METRICS_SHORT_IMU2] == 3);
+    assert(m[METRICS_INSERTED] == 4 && m[METRICS_DROPPED] == 1 && m[METRICS_LOST] == 12);
+
+    // The read before the dump's header is dropped.
+    auto blackbox = read_file(d + "/blackbox.cap");
+    CaptureReader capture;
+    assert(capture.open(blackbox.data(), blackbox.size()) && capture.header().odr == 1920);
+    const CaptureMessage *msg = capture.next();
+    assert(msg != nullptr && msg->read_time == 1000 && msg->count == 1 && msg->imu == 1);
+    assert(CaptureReader::records(msg)[0] == 0x10 && capture.next() == nullptr);
+
+    for (int c = 0; c < COL_COUNT; c++)
+        unlink((d + "/" + column_names[c]).c_str());
+    unlink((d + "/full.rec").c_str());
+    unlink((d + "/blackbox.cap").c_str());
+    rmdir(dir);
+    printf("Stream decoder: ok\n");
+}
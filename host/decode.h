@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "capture.h"
+#include "recording.h"
+
+// Merged channels: side 0 then side 1, x, y, z, as in MergeMessage.
+#define MERGED_CHANNELS 6
+// Merged samples per slow tier sample, TIER_DECIMATION^2 in main/tiers.h.
+#define SLOW_DECIMATION 64
+// Longest line kept.  A 7680 Hz full rate block is about 650 characters.
+#define MAX_LINE 2048
+// Bytes buffered per column before a write.
+#define COLUMN_BUFFER_BYTES (64 * 1024)
+
+/// @brief Monotonic time, in usec.
+int64_t monotonic_usec();
+
+/// @brief One column of a device recording: a flat file of little endian
+/// values, appended through a buffer.
+class ColumnFile
+{
+public:
+    ~ColumnFile() { close(); }
+    /// @param truncate Start the file afresh, rather than appending to it.
+    bool open(const std::string &path, bool truncate = false);
+    void append(const void *data, size_t bytes);
+    void flush();
+    void close();
+
+private:
+    int fd = -1;
+    std::vector<uint8_t> buffer;
+};
+
+// The columns written for each device, and their file names.  Full rate
+// blocks go to a chunked recording instead, full.rec (see recording.h).
+enum Column
+{
+    COL_MID, // MERGED_CHANNELS int16 columns, one row per sample.
+    COL_SLOW = COL_MID + MERGED_CHANNELS,
+    COL_ANGLE = COL_SLOW + MERGED_CHANNELS, // int16, 0.01 degree.
+    COL_RATE,                               // int16, 0.1 dps.
+    COL_GAP,                                // int32 rows of side, index, samples, lost.
+    COL_GYRO,                               // int32 rows of merged index, x, y, z.
+    COL_CONTROL,                            // int32 rows of merged index, outputs, channels, trace, odr,
+                                            // gyro decimation.
+    COL_METRICS,                            // int32 rows of METRICS_FIELDS, see main/metrics.h.
+    COL_EVENT,                              // int32 rows of merged index, type, source, slot, detail.
+    COL_COUNT
+};
+
+/// @brief Counters for one stream, written by its worker and read by the
+/// reporter.
+struct StreamStats
+{
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> lines{0};
+    std::atomic<uint64_t> blocks{0};       // Full rate blocks.
+    std::atomic<uint64_t> samples{0};      // Full rate samples.
+    std::atomic<uint64_t> bad_lines{0};    // Lines that looked like data, but didn't parse.
+    std::atomic<uint64_t> other_lines{0};  // Log lines.
+    std::atomic<uint64_t> decode_nsec{0};  // Time spent in feed().
+    std::atomic<int64_t> position{-1};     // Merged samples the device has sent, as far as we know.
+    std::atomic<int64_t> first_usec{0};    // When position was first known.
+};
+
+/// @brief Decodes the Merger's output lines from one device, and writes them
+/// to a recording and per-column files.
+///
+///     B <index> <base64>       full rate block, MERGED_CHANNELS int16 per sample
+///     T <index> <usec> <period>  reference clock model, once per recording chunk
+///     M <6 values>             middle tier sample
+///     S <6 values>             slow tier sample
+///     A <angle> <rate>         bell angle, after each merged block
+///     Y <index> <decimation> <base64>  imu1 gyro, int16 x, y, z per sample,
+///                              one per decimation merged samples
+///     G <side> <index> <samples> <lost>
+///     K <base64>               a piece of a black box dump, a capture (see
+///                              main/capture.h), written to blackbox.cap
+///     C <seq> <status> <index> <outputs> <channels> <trace> <odr> <gyro decimation>
+///                              a control command's acknowledgement (see
+///                              main/control.h), kept if it changed settings
+///     P <base64>               a metrics frame (see main/metrics.h)
+///
+/// Anything else is a log line, and is counted but not kept.
+class StreamDecoder
+{
+public:
+    /// @brief Create the device directory, its recording and columns.
+    bool open(const std::string &dir, int odr);
+    /// @brief Decode as much as there is.  A partial line is kept for the next call.
+    void feed(const char *data, size_t len);
+    /// @brief Finish the recording, with its index, and flush the columns.
+    void finish();
+
+    StreamStats stats;
+
+private:
+    void line(const char *s, const char *end);
+    bool block(const char *s, const char *end);
+    bool gyro(const char *s, const char *end);
+    bool time_model(const char *s, const char *end);
+    bool dump(const char *s, const char *end);
+    bool metrics(const char *s, const char *end);
+    bool values(const char *s, const char *end, int32_t *out, int count);
+    void advance(int64_t position);
+
+    ColumnFile columns[COL_COUNT];
+    ColumnFile full_file;
+    ColumnFile blackbox_file;
+    std::string path;
+    bool blackbox_open = false;
+    RecordingWriter full;
+    std::string partial;
+    std::vector<uint8_t> raw;
+    int64_t slow_samples = 0;
+};
+
+void test_stream_decoder();
@@ -0,0 +1,430 @@
+/*
+Host ingest daemon for many frames.
+
+Each frame sends the Merger's output lines (see decode.h) over its serial
+port.  A monitor program reading one port at a time tops out around 20k
+characters/sec, which is one frame at best.  This reads any number of ports,
+sharded over a few worker threads that each wait on their own epoll set, so a
+busy port never holds up the others, and nothing is handed between threads.
+Each worker decodes what it reads straight into the device's recording (see
+main/recording.h) and column files.
+
+The main thread reports, per stream and in total, the input rate, the decode
+throughput, and the lag: how far the decoded stream has fallen behind real
+time since it was most nearly caught up, from the merged sample index.  It
+also reports bytes still queued in the kernel for each port.
+
+    ingest [-o dir] [-w workers] [-r odr] [-i seconds] [-v] port...
+    ingest -s devices [-t seconds] ...   simulated devices over pipes
+    ingest -T                            run the self tests
+
+Ports can also be ptys, fifos or files, as local stand-ins for serial ports.
+*/
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "base64_encode.hpp"
+#include "base64_simd.h"
+#include "decode.h"
+
+// Matches Serial.begin(8 * 115200) in main/main.cpp.
+#define SERIAL_BAUD B921600
+// Bytes read from a stream per wakeup, so one busy stream can't starve others.
+#define READ_CHUNK (64 * 1024)
+#define MAX_EVENTS 64
+
+static std::atomic<bool> stop{false};
+
+struct Stream
+{
+    std::string name;
+    int fd = -1;
+    bool pollable = true; // False for regular files, which epoll won't take.
+    std::atomic<bool> done{false};
+    StreamDecoder decoder;
+    int64_t min_lag_usec = INT64_MAX; // Reporter only.
+    uint64_t last_bytes = 0;          // Reporter only.
+};
+
+/// @brief Put a serial port in raw mode at the device's baud rate.
+static void configure_tty(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+        return;
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, SERIAL_BAUD);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+/// @brief Reads and decodes a share of the streams.
+class Worker
+{
+public:
+    bool add(Stream *s)
+    {
+        if (epfd < 0)
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+        {
+            if (errno != EPERM)
+            {
+                fprintf(stderr, "Can't poll %s: %s\n", s->name.c_str(), strerror(errno));
+                return false;
+            }
+            // A regular file is always readable.
+            s->pollable = false;
+            files.push_back(s);
+        }
+        active++;
+        return true;
+    }
+
+    void start() { thread = std::thread([this] { run(); }); }
+    void join() { thread.join(); }
+
+private:
+    /// @brief Read one chunk, and retire the stream at end of file.
+    void read_stream(Stream *s)
+    {
+        ssize_t n = read(s->fd, buffer.data(), buffer.size());
+        if (n > 0)
+        {
+            s->decoder.feed(buffer.data(), n);
+            return;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n < 0)
+            fprintf(stderr, "Read failed on %s: %s\n", s->name.c_str(), strerror(errno));
+        // The fd stays open until the reporter is done with it.
+        if (s->pollable)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, nullptr);
+        s->decoder.finish();
+        s->done = true;
+        active--;
+    }
+
+    void run()
+    {
+        buffer.resize(READ_CHUNK);
+        struct epoll_event events[MAX_EVENTS];
+        while (active > 0 && !stop)
+        {
+            for (Stream *s : files)
+                if (!s->done)
+                    read_stream(s);
+            int n = epoll_wait(epfd, events, MAX_EVENTS, files.empty() ? 100 : 0);
+            for (int i = 0; i < n; i++)
+                read_stream((Stream *)events[i].data.ptr);
+        }
+    }
+
+    int epfd = -1;
+    int active = 0;
+    std::vector<Stream *> files;
+    std::vector<char> buffer;
+    std::thread thread;
+};
+
+/// @brief Writes worst case device output, full rate blocks and all tiers, to
+/// one pipe per device, in real time.
+class Simulator
+{
+public:
+    Simulator(int devices, int odr, double seconds)
+        : odr(odr), block_samples(odr / 192), seconds(seconds)
+    {
+        for (int d = 0; d < devices; d++)
+        {
+            int fds[2];
+            if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+            {
+                perror("pipe2");
+                exit(1);
+            }
+            readers.push_back(fds[0]);
+            writers.push_back(fds[1]);
+        }
+    }
+
+    void start() { thread = std::thread([this] { run(); }); }
+    void join() { thread.join(); }
+
+    std::vector<int> readers;
+    long blocks = 0;  // Blocks generated, per device.
+    long dropped = 0; // Writes that found the pipe full, as a UART overrun would.
+
+private:
+    void run()
+    {
+        std::vector<int16_t> samples(block_samples * MERGED_CHANNELS);
+        std::vector<unsigned char> text(encode_base64_length(samples.size() * 2) + 1);
+        std::string out;
+        int64_t period = (int64_t)block_samples * 1000000 / odr;
+        int64_t next = monotonic_usec();
+        int64_t end = next + (int64_t)(seconds * 1e6);
+        for (long index = 0; next < end && !stop; index += block_samples, next += period)
+        {
+            int64_t wait = next - monotonic_usec();
+            if (wait > 0)
+                usleep(wait);
+            for (size_t d = 0; d < writers.size(); d++)
+            {
+                for (int i = 0; i < block_samples; i++)
+                    for (int c = 0; c < MERGED_CHANNELS; c++)
+                        samples[i * MERGED_CHANNELS + c] = (int16_t)((index + i) * 7 + c * 1000 + d);
+                encode_base64((const unsigned char *)samples.data(), samples.size() * 2, text.data());
+                out.clear();
+                if (index % RECORDING_CHUNK_SAMPLES < block_samples)
+                    out += "T " + std::to_string(index) + " " + std::to_string(index * 1000000 / odr) + " " +
+                           std::to_string(1e6 / odr) + "\n";
+                out += "B " + std::to_string(index) + " " + (const char *)text.data() + "\n";
+                for (int i = 0; i < block_samples; i++)
+                {
+                    const int16_t *s = &samples[i * MERGED_CHANNELS];
+                    char line[64];
+                    if ((index + i) % 8 == 0)
+                        out += std::string(line, snprintf(line, sizeof(line), "M %5d %5d %5d %5d %5d %5d\n",
+                                                          s[0], s[1], s[2], s[3], s[4], s[5]));
+                    if ((index + i) % SLOW_DECIMATION == SLOW_DECIMATION - 1)
+                        out += std::string(line, snprintf(line, sizeof(line), "S %5d %5d %5d %5d %5d %5d\n",
+                                                          s[0], s[1], s[2], s[3], s[4], s[5]));
+                }
+                if (write(writers[d], out.data(), out.size()) < 0)
+                    dropped++;
+            }
+            blocks++;
+        }
+        for (int fd : writers)
+            close(fd);
+    }
+
+    int odr;
+    int block_samples;
+    double seconds;
+    std::vector<int> writers;
+    std::thread thread;
+};
+
+/// @brief Print one report line, for a stream or the total.
+static void report_line(const char *name, double mbps, double decode_mbps, double blocks_per_sec,
+                        double lag_ms, int queued, uint64_t bad)
+{
+    fprintf(stderr, "%-12s %7.3f MB/s  decode %7.1f MB/s  %8.0f blocks/s  lag %7.1f ms  queued %7d  bad %lu\n",
+            name, mbps, decode_mbps, blocks_per_sec, lag_ms, queued, (unsigned long)bad);
+}
+
+/// @brief Report each stream (if verbose) and the totals since the last call.
+static void report(std::vector<Stream *> &streams, int odr, double interval, bool verbose,
+                   std::vector<uint64_t> &last_blocks)
+{
+    int64_t now = monotonic_usec();
+    uint64_t bytes = 0, blocks = 0, nsec = 0, bad = 0;
+    int64_t worst_lag = 0;
+    int worst_queued = 0;
+    const char *worst = "";
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        Stream *s = streams[i];
+        auto &st = s->decoder.stats;
+        uint64_t b = st.bytes.load(std::memory_order_relaxed);
+        uint64_t k = st.blocks.load(std::memory_order_relaxed);
+        int64_t position = st.position.load(std::memory_order_relaxed);
+        int64_t lag = 0;
+        if (position >= 0 && !s->done)
+        {
+            lag = now - st.first_usec.load(std::memory_order_relaxed) - position * 1000000 / odr;
+            if (lag < s->min_lag_usec)
+                s->min_lag_usec = lag;
+            lag -= s->min_lag_usec;
+        }
+        int queued = 0;
+        if (s->pollable && !s->done)
+            ioctl(s->fd, FIONREAD, &queued);
+
+        if (verbose)
+            report_line(s->name.c_str(), (b - s->last_bytes) / interval / 1e6, 0,
+                        (k - last_blocks[i]) / interval, lag / 1000.0, queued, st.bad_lines);
+        bytes += b - s->last_bytes;
+        blocks += k - last_blocks[i];
+        nsec += st.decode_nsec.load(std::memory_order_relaxed);
+        bad += st.bad_lines.load(std::memory_order_relaxed);
+        s->last_bytes = b;
+        last_blocks[i] = k;
+        if (lag > worst_lag)
+        {
+            worst_lag = lag;
+            worst = s->name.c_str();
+        }
+        if (queued > worst_queued)
+            worst_queued = queued;
+    }
+
+    uint64_t total_bytes = 0;
+    for (Stream *s : streams)
+        total_bytes += s->decoder.stats.bytes.load(std::memory_order_relaxed);
+    char label[32];
+    snprintf(label, sizeof(label), "%zu streams", streams.size());
+    report_line(label, bytes / interval / 1e6, nsec ? total_bytes * 1e3 / nsec : 0,
+                blocks / interval, worst_lag / 1000.0, worst_queued, bad);
+    if (worst_lag > 0 && verbose)
+        fprintf(stderr, "  most lag: %s\n", worst);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: ingest [-o dir] [-w workers] [-r odr] [-i seconds] [-v] port...\n"
+            "       ingest -s devices [-t seconds] [options]\n"
+            "       ingest -T\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    std::string out_dir = "ingest";
+    int workers = 4;
+    int odr = 1920;
+    double interval = 5;
+    bool verbose = false;
+    int simulate = 0;
+    double seconds = 30;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:w:r:i:vs:t:T")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o': out_dir = optarg; break;
+        case 'w': workers = atoi(optarg); break;
+        case 'r': odr = atoi(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        case 'v': verbose = true; break;
+        case 's': simulate = atoi(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'T':
+            test_base64();
+            test_recording();
+            test_stream_decoder();
+            return 0;
+        default: usage();
+        }
+    }
+    if (workers < 1 || odr < 192 || interval <= 0 || (simulate == 0 && optind == argc))
+        usage();
+
+    signal(SIGINT, [](int) { stop = true; });
+    signal(SIGTERM, [](int) { stop = true; });
+    signal(SIGPIPE, SIG_IGN);
+    if (mkdir(out_dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", out_dir.c_str(), strerror(errno));
+        return 1;
+    }
+
+    Simulator *sim = simulate > 0 ? new Simulator(simulate, odr, seconds) : nullptr;
+    std::vector<Stream *> streams;
+    for (int i = 0; i < simulate; i++)
+    {
+        Stream *s = new Stream;
+        char name[16];
+        snprintf(name, sizeof(name), "sim%03d", i);
+        s->name = name;
+        s->fd = sim->readers[i];
+        streams.push_back(s);
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        Stream *s = new Stream;
+        const char *slash = strrchr(argv[i], '/');
+        s->name = slash ? slash + 1 : argv[i];
+        s->fd = open(argv[i], O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        if (s->fd < 0)
+        {
+            fprintf(stderr, "Can't open %s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        if (isatty(s->fd))
+            configure_tty(s->fd);
+        streams.push_back(s);
+    }
+
+    std::vector<Worker> pool(workers);
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        if (!streams[i]->decoder.open(out_dir + "/" + streams[i]->name, odr) || !pool[i % workers].add(streams[i]))
+            return 1;
+    }
+    fprintf(stderr, "Ingesting %zu streams on %d workers, base64 %s\n", streams.size(), workers,
+            base64_has_avx2() ? "AVX2" : "scalar");
+    if (sim)
+        sim->start();
+    for (auto &w : pool)
+        w.start();
+
+    std::vector<uint64_t> last_blocks(streams.size());
+    int64_t start = monotonic_usec();
+    int64_t last = start;
+    auto all_done = [&] {
+        for (Stream *s : streams)
+            if (!s->done)
+                return false;
+        return true;
+    };
+    while (!stop && !all_done())
+    {
+        usleep(100000);
+        int64_t now = monotonic_usec();
+        if (now - last >= interval * 1e6)
+        {
+            report(streams, odr, (now - last) / 1e6, verbose, last_blocks);
+            last = now;
+        }
+    }
+    stop = true;
+    if (sim)
+        sim->join();
+    for (auto &w : pool)
+        w.join();
+
+    uint64_t samples = 0, bytes = 0, nsec = 0;
+    for (Stream *s : streams)
+    {
+        s->decoder.finish();
+        close(s->fd);
+        samples += s->decoder.stats.samples;
+        bytes += s->decoder.stats.bytes;
+        nsec += s->decoder.stats.decode_nsec;
+    }
+    double elapsed = (monotonic_usec() - start) / 1e6;
+    fprintf(stderr, "Done: %lu full rate samples, %.1f MB in %.1f s, decode %.1f MB/s per core\n",
+            (unsigned long)samples, bytes / 1e6, elapsed, nsec ? bytes * 1e3 / nsec : 0);
+    if (sim)
+    {
+        long expected = sim->blocks * (odr / 192) * (long)streams.size();
+        fprintf(stderr, "Simulated %zu devices: %ld blocks each, %ld writes dropped, %ld samples missing\n",
+                streams.size(), sim->blocks, sim->dropped, expected - (long)samples);
+        return samples + sim->dropped * (odr / 192) >= (uint64_t)expected ? 0 : 1;
+    }
+    return 0;
+}
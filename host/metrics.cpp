@@ -0,0 +1,209 @@
+/*
+Plot the metrics frames (see main/metrics.h) that ingest wrote for each device.
+
+    metrics [-w width] [-f field,...] dir...   a strip chart per field, per device
+    metrics -c dir                             the rows as CSV, e.g. for gnuplot
+    metrics -T                                 self test
+
+Each dir is a device's directory, e.g. recordings/ttyUSB0.  A strip column is
+the largest value of the frames it covers, so short peaks, e.g. of the queue
+or the worst merge time, still show.
+*/
+
+#include <algorithm>
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "metrics.h"
+
+// Eighths of a character cell.
+static const char *const levels[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+
+/// @brief Read a device's metrics.i32 rows.
+static std::vector<int32_t> read_rows(const std::string &dir)
+{
+    std::vector<int32_t> rows;
+    FILE *f = fopen((dir + "/metrics.i32").c_str(), "rb");
+    if (f == nullptr)
+        return rows;
+    int32_t row[METRICS_FIELDS];
+    while (fread(row, sizeof(row), 1, f) == 1)
+        rows.insert(rows.end(), row, row + METRICS_FIELDS);
+    fclose(f);
+    return rows;
+}
+
+static std::string label(int field, int32_t top)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "%-20s %8d ", metrics_field_names[field], top);
+    return text;
+}
+
+/// @brief One field as a strip of width characters, scaled from 0 to its
+/// largest value.  Unknown values, -1, are blank.
+static std::string strip(const std::vector<int32_t> &rows, int field, int width)
+{
+    size_t count = rows.size() / METRICS_FIELDS;
+    int32_t top = 0;
+    for (size_t r = 0; r < count; r++)
+        top = std::max(top, rows[r * METRICS_FIELDS + field]);
+    int columns = (int)std::min<size_t>(width, count);
+    std::string out = label(field, top);
+    for (int c = 0; c < columns; c++)
+    {
+        int32_t peak = -1;
+        for (size_t r = c * count / columns; r < (c + 1) * count / columns; r++)
+            peak = std::max(peak, rows[r * METRICS_FIELDS + field]);
+        if (peak < 0)
+            out += ' ';
+        else
+            out += levels[top > 0 ? (int)((int64_t)peak * 7 / top) : 0];
+    }
+    return out + "\n";
+}
+
+/// @brief Strip charts of fields for one device.
+static std::string plot(const std::string &dir, const std::vector<int> &fields, int width)
+{
+    std::vector<int32_t> rows = read_rows(dir);
+    size_t count = rows.size() / METRICS_FIELDS;
+    char heading[256];
+    if (count == 0)
+    {
+        snprintf(heading, sizeof(heading), "%s: no metrics\n", dir.c_str());
+        return heading;
+    }
+    snprintf(heading, sizeof(heading), "%s: %zu frames, %.1f to %.1f seconds\n", dir.c_str(), count,
+             rows[METRICS_TIME_MSEC] / 1e3, rows[(count - 1) * METRICS_FIELDS + METRICS_TIME_MSEC] / 1e3);
+    std::string out = heading;
+    for (int field : fields)
+        out += strip(rows, field, width);
+    return out;
+}
+
+static void print_csv(const std::string &dir)
+{
+    std::vector<int32_t> rows = read_rows(dir);
+    for (int f = 0; f < METRICS_FIELDS; f++)
+        printf("%s%s", f > 0 ? "," : "", metrics_field_names[f]);
+    printf("\n");
+    for (size_t i = 0; i < rows.size(); i++)
+        printf("%d%s", rows[i], (i + 1) % METRICS_FIELDS == 0 ? "\n" : ",");
+}
+
+/// @brief Parse a comma separated list of field names.
+static bool parse_fields(const char *list, std::vector<int> &fields)
+{
+    fields.clear();
+    std::string s = list;
+    size_t start = 0;
+    while (start <= s.size())
+    {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos)
+            end = s.size();
+        std::string name = s.substr(start, end - start);
+        int f = 0;
+        while (f < METRICS_FIELDS && name != metrics_field_names[f])
+            f++;
+        if (f == METRICS_FIELDS)
+        {
+            fprintf(stderr, "Unknown field %s\n", name.c_str());
+            return false;
+        }
+        fields.push_back(f);
+        start = end + 1;
+    }
+    return true;
+}
+
+/// @brief Plot made up rows: a ramp, a peak narrower than a column, and a
+/// field that is never known.
+static void test_plot()
+{
+    test_metrics();
+    char dir[] = "/tmp/metrics_testXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/metrics.i32";
+    FILE *f = fopen(path.c_str(), "wb");
+    assert(f != nullptr);
+    for (int i = 0; i < 100; i++)
+    {
+        int32_t row[METRICS_FIELDS] = {};
+        row[METRICS_TIME_MSEC] = 1000 * (i + 1);
+        row[METRICS_CPU_READER] = 10 * i;
+        row[METRICS_CPU_PHASE] = -1;
+        row[METRICS_QUEUE_HIGH] = i == 37 ? 20 : 1;
+        fwrite(row, sizeof(row), 1, f);
+    }
+    fclose(f);
+
+    std::vector<int> fields;
+    assert(parse_fields("cpu_reader,cpu_phase,queue_high", fields) && fields.size() == 3);
+    assert(!parse_fields("cpu_reader,bogus", fields));
+    assert(parse_fields("cpu_reader,cpu_phase,queue_high", fields));
+    std::string out = plot(dir, fields, 10);
+    assert(out.find("100 frames, 1.0 to 100.0 seconds") != std::string::npos);
+    // The ramp rises from the lowest level to the highest, over 10 columns.
+    std::string low = levels[0], high = levels[7];
+    assert(out.find(label(METRICS_CPU_READER, 990) + low) != std::string::npos);
+    assert(out.find(high + "\n" + label(METRICS_CPU_PHASE, 0) + std::string(10, ' ') + "\n") != std::string::npos);
+    // The peak shows in its column, the fourth.
+    assert(out.find(label(METRICS_QUEUE_HIGH, 20) + low + low + low + high + low) != std::string::npos);
+    printf("%s", out.c_str());
+
+    unlink(path.c_str());
+    rmdir(dir);
+    printf("Metrics plot: ok\n");
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: metrics [-w width] [-f field,...] dir...\n"
+                    "       metrics -c dir\n"
+                    "       metrics -T\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int width = 72;
+    bool csv = false;
+    std::vector<int> fields;
+    for (int f = METRICS_CPU_READER; f < METRICS_FIELDS; f++)
+        if (f != METRICS_QUEUE_DEPTH)
+            fields.push_back(f);
+    int opt;
+    while ((opt = getopt(argc, argv, "w:f:cT")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w': width = atoi(optarg); break;
+        case 'f':
+            if (!parse_fields(optarg, fields))
+                return 2;
+            break;
+        case 'c': csv = true; break;
+        case 'T': test_plot(); return 0;
+        default: usage();
+        }
+    }
+    if (optind >= argc || width < 1 || (csv && optind + 1 != argc))
+        usage();
+    if (csv)
+    {
+        print_csv(argv[optind]);
+        return 0;
+    }
+    for (int i = optind; i < argc; i++)
+        printf("%s", plot(argv[i], fields, width).c_str());
+    return 0;
+}
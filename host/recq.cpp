@@ -0,0 +1,124 @@
+/*
+Query a recording (see main/recording.h) without decoding all of it.
+
+    recq file                      summary
+    recq -s level file             chunks where any channel spans more than level
+    recq -t seconds [-d seconds] file
+                                   samples from a time, relative to the first chunk
+
+The file is mapped, and only the index and the chunks asked for are touched,
+so finding one strike in an eight hour recording reads a few kB.
+*/
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "recording.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: recq [-s level | -t seconds [-d seconds]] file\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int level = -1;
+    double start = -1;
+    double duration = 0.1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': level = atoi(optarg); break;
+        case 't': start = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    RecordingReader reader;
+    if (!reader.open(data, st.st_size))
+    {
+        fprintf(stderr, "%s is not a recording\n", argv[optind]);
+        return 1;
+    }
+    if (reader.chunks() == 0)
+    {
+        printf("No chunks\n");
+        return 0;
+    }
+    const ChunkIndexEntry &first = reader.entry(0);
+    const ChunkIndexEntry &last = reader.entry(reader.chunks() - 1);
+
+    if (level >= 0)
+    {
+        for (size_t i = 0; i < reader.chunks(); i++)
+        {
+            const ChunkIndexEntry &e = reader.entry(i);
+            int span = 0;
+            for (int c = 0; c < RECORDING_CHANNELS; c++)
+                if (e.max[c] - e.min[c] > span)
+                    span = e.max[c] - e.min[c];
+            if (span > level)
+                printf("%10.3f s  index %9lld  span %5d\n", (e.first_usec - first.first_usec) / 1e6,
+                       (long long)e.first_index, span);
+        }
+    }
+    else if (start >= 0)
+    {
+        int64_t from = first.first_usec + (int64_t)(start * 1e6);
+        int64_t to = from + (int64_t)(duration * 1e6);
+        static int16_t rows[RECORDING_CHUNK_SAMPLES * RECORDING_CHANNELS];
+        for (size_t i = reader.find(from); i < reader.chunks() && reader.entry(i).first_usec < to; i++)
+        {
+            int n = reader.decode(i, rows);
+            if (n < 0)
+            {
+                fprintf(stderr, "Chunk %zu is corrupt\n", i);
+                return 1;
+            }
+            for (int k = 0; k < n; k++)
+            {
+                int64_t t = reader.time_of(i, k);
+                if (t < from || t >= to)
+                    continue;
+                const int16_t *r = &rows[k * RECORDING_CHANNELS];
+                printf("%lld %lld %6d %6d %6d %6d %6d %6d\n", (long long)t,
+                       (long long)(reader.entry(i).first_index + k), r[0], r[1], r[2], r[3], r[4], r[5]);
+            }
+        }
+    }
+    else
+    {
+        printf("%s: %u Hz, %zu chunks%s, indices %lld to %lld, %.1f s\n", argv[optind],
+               reader.header().odr, reader.chunks(), reader.scanned() ? " (no index, scanned)" : "",
+               (long long)first.first_index, (long long)last.first_index,
+               (last.end_usec - first.first_usec) / 1e6);
+    }
+    munmap(data, st.st_size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,563 @@
+/*
+Re-merge raw captures (see main/capture.h) offline.
+
+The device merges as samples arrive, so it can only fit each sensor's clock
+from past reads, and it interpolates the slower sensor linearly.  Offline the
+whole capture is available, so this:
+ - fits each sensor's clock from both sides of every read (ClockMap), which
+   halves the fit's lag and smooths the read jitter over twice as many reads,
+ - interpolates the slower sensor onto the faster one's sample times with a
+   32 tap windowed sinc (resample.h), which is flat to well above any bell
+   frequency, where linear interpolation loses several percent at 100 Hz,
+ - counts gaps exactly as the device does (TagCounter), and writes zeros
+   wherever the filter would reach a missing sample.
+
+One thread parses a capture, in order, since gap counting and the clock fits
+are sequential.  The reference samples are then cut into segments of about a
+minute, which are decoded and resampled in parallel, and written in order to
+a recording (main/recording.h), so recq reads the output.  Several captures
+are re-merged at once.
+
+    remerge [-j jobs] [-l] [-o out.rec] capture...
+                                      writes capture.rec, or out.rec for one capture
+    remerge -g seconds out.cap        writes a synthetic capture
+    remerge -T                        runs the self tests
+
+-l interpolates linearly, as the device does, for comparison.
+*/
+
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "capture.h"
+#include "fitter.h"
+#include "recording.h"
+#include "resample.h"
+
+// Reference samples per segment, a whole number of chunks.  About a minute at
+// 1920 Hz.
+#define SEGMENT_SAMPLES (225 * RECORDING_CHUNK_SAMPLES)
+// Extra samples of the other sensor decoded beyond each end of a segment, for
+// the filter taps and for the two clocks drifting within the segment.
+#define SEGMENT_MARGIN 256
+
+static int64_t monotonic_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// @brief A message's records, in the mapped capture.
+struct Span
+{
+    const uint8_t *records;
+    uint16_t count;   // Records of every tag.
+    uint16_t samples; // Accelerometer records.
+    int64_t first;    // Sample index of the first accelerometer record.
+};
+
+/// @brief One sensor's messages, gaps and clock.
+class SensorTrack
+{
+public:
+    SensorTrack(float alpha) : causal(alpha) {}
+
+    /// @brief Count the samples lost before a message, as IMUTracker::gap()
+    /// does, and add its records.
+    void add(const CaptureMessage *msg)
+    {
+        const uint8_t *records = CaptureReader::records(msg);
+        int tag_missing = 0;
+        int samples = 0;
+        for (int i = 0; i < msg->count; i++)
+        {
+            uint8_t tag = records[i * CAPTURE_RECORD_BYTES];
+            if (CAPTURE_TAG_SENSOR(tag) != CAPTURE_TAG_XL_NC)
+                continue;
+            tag_missing += tags.next(CAPTURE_TAG_CNT(tag));
+            samples++;
+        }
+        if (samples == 0)
+            return;
+        long missing = tag_missing;
+        if ((msg->flags & CAPTURE_OVERRUN) && messages >= 2)
+        {
+            auto [k, frac] = causal.sample_for(msg->read_time);
+            long predicted = k + (frac >= 0.5f ? 1 : 0) - msg->backlog - (next + samples);
+            missing = TagCounter::resolve(predicted, tag_missing);
+        }
+        messages++;
+        if (missing > 0)
+        {
+            gaps++;
+            lost += missing;
+        }
+        next += missing;
+        spans.push_back({records, msg->count, (uint16_t)samples, next});
+        next += samples;
+        causal.coord(next + msg->backlog, msg->read_time);
+        // A read that woke late was timed late, so it only adds noise to the
+        // offline fit.
+        if (!(msg->flags & CAPTURE_DELAYED))
+            clock.add(next + msg->backlog, msg->read_time);
+    }
+
+    /// @brief Decode samples from to to - 1, one array per axis.
+    /// @param valid Set to the running count of samples present, as resample3 takes it.
+    void decode(int64_t from, int64_t to, float *const ch[3], uint32_t *valid) const
+    {
+        size_t n = to - from;
+        for (int c = 0; c < 3; c++)
+            memset(ch[c], 0, n * sizeof(float));
+        memset(valid, 0, (n + 1) * sizeof(uint32_t));
+        auto span = std::upper_bound(spans.begin(), spans.end(), from,
+                                     [](int64_t k, const Span &s) { return k < s.first; });
+        if (span != spans.begin())
+            span--;
+        for (; span != spans.end() && span->first < to; span++)
+        {
+            int64_t k = span->first;
+            for (int i = 0; i < span->count; i++)
+            {
+                const uint8_t *r = span->records + i * CAPTURE_RECORD_BYTES;
+                if (CAPTURE_TAG_SENSOR(r[0]) != CAPTURE_TAG_XL_NC)
+                    continue;
+                if (k >= from && k < to)
+                {
+                    for (int c = 0; c < 3; c++)
+                        ch[c][k - from] = (int16_t)(r[1 + 2 * c] | r[2 + 2 * c] << 8);
+                    valid[k - from + 1] = 1;
+                }
+                k++;
+            }
+        }
+        for (size_t i = 0; i < n; i++)
+            valid[i + 1] += valid[i];
+    }
+
+    std::vector<Span> spans;
+    ClockMap clock;
+    int64_t next = 0; // Index of the next sample.
+    long messages = 0;
+    long gaps = 0;
+    long lost = 0;
+
+private:
+    TagCounter tags;
+    TimeFitter causal; // As on the device, to size overrun gaps.
+};
+
+struct RemergeOptions
+{
+    int jobs = 1;        // Segments in flight.
+    bool linear = false; // Interpolate as the device does.
+};
+
+struct RemergeStats
+{
+    int reference = 0;       // Side of the faster sensor.
+    int64_t samples = 0;     // Merged samples written.
+    long segments = 0;
+    long zeroed = 0;         // Merged samples with either side missing.
+    long gaps[2] = {0, 0};   // By side: 0 is imu1 (left), as in MergeMessage.
+    long lost[2] = {0, 0};
+    double period[2] = {0, 0}; // Fitted usec per sample.
+};
+
+/// @brief A segment's merged rows, RECORDING_CHANNELS values each.
+struct Segment
+{
+    int64_t first;
+    std::vector<int16_t> rows;
+    long zeroed = 0;
+};
+
+static int16_t to_int16(float v)
+{
+    return (int16_t)std::clamp(lrintf(v), -32768L, 32767L);
+}
+
+/// @brief Merge reference samples first to end - 1: the reference sensor's own
+/// samples on one side, and the other sensor interpolated onto their times.
+static Segment merge_segment(const SensorTrack &ref, const SensorTrack &other, int ref_side,
+                             int64_t first, int64_t end, bool linear)
+{
+    Segment seg;
+    seg.first = first;
+    size_t n = end - first;
+    size_t ref_hint = 0, other_hint = 0;
+    int64_t lo = (int64_t)floor(other.clock.index_at(ref.clock.time_at(first, ref_hint), other_hint)) - SEGMENT_MARGIN;
+    int64_t hi = (int64_t)ceil(other.clock.index_at(ref.clock.time_at(end, ref_hint), other_hint)) + SEGMENT_MARGIN;
+    lo = std::max<int64_t>(lo, 0);
+    hi = std::max(std::min(hi, other.next), lo);
+    size_t m = hi - lo;
+
+    std::vector<float> buffer(3 * n + 3 * m + 3 * n);
+    float *ref_ch[3], *other_ch[3], *out[3];
+    for (int c = 0; c < 3; c++)
+    {
+        ref_ch[c] = &buffer[c * n];
+        other_ch[c] = &buffer[3 * n + c * m];
+        out[c] = &buffer[3 * n + 3 * m + c * n];
+    }
+    std::vector<uint32_t> ref_valid(n + 1), other_valid(m + 1);
+    ref.decode(first, end, ref_ch, ref_valid.data());
+    other.decode(lo, hi, other_ch, other_valid.data());
+
+    std::vector<double> pos(n);
+    ref_hint = other_hint = 0;
+    for (size_t i = 0; i < n; i++)
+        pos[i] = other.clock.index_at(ref.clock.time_at((double)(first + i), ref_hint), other_hint) - lo;
+    if (linear)
+        resample3_linear(other_ch, other_valid.data(), m, pos.data(), n, out);
+    else
+        resample3(other_ch, other_valid.data(), m, pos.data(), n, out);
+
+    // A missing sample on the reference side is zero on both sides, as the
+    // device's gap records are.
+    seg.rows.assign(n * RECORDING_CHANNELS, 0);
+    int other_side = 1 - ref_side;
+    for (size_t i = 0; i < n; i++)
+    {
+        int16_t *row = &seg.rows[i * RECORDING_CHANNELS];
+        bool ref_present = ref_valid[i + 1] != ref_valid[i];
+        bool other_present = false;
+        for (int c = 0; c < 3; c++)
+        {
+            row[3 * ref_side + c] = ref_present ? (int16_t)ref_ch[c][i] : 0;
+            row[3 * other_side + c] = ref_present ? to_int16(out[c][i]) : 0;
+            other_present |= out[c][i] != 0;
+        }
+        if (!ref_present || !other_present)
+            seg.zeroed++;
+    }
+    return seg;
+}
+
+/// @brief Re-merge a capture in memory into a recording.
+/// @return false if the capture is unreadable, or too short to fit clocks to.
+static bool remerge(const void *data, size_t size, RecordingWriter::Sink sink, void *context,
+                    const RemergeOptions &options, RemergeStats &stats)
+{
+    CaptureReader reader;
+    if (!reader.open(data, size))
+        return false;
+    const CaptureHeader header = reader.header();
+    // The device's fit decays over about 4 seconds of reads.
+    float alpha = header.read_interval_usec / 4000000.0f;
+    SensorTrack tracks[2] = {SensorTrack(alpha), SensorTrack(alpha)}; // By side.
+    while (const CaptureMessage *msg = reader.next())
+        tracks[msg->imu ? 0 : 1].add(msg);
+    if (tracks[0].clock.size() < 4 || tracks[1].clock.size() < 4)
+        return false;
+
+    auto fit = std::async(std::launch::async, [&] { tracks[1].clock.fit(); });
+    tracks[0].clock.fit();
+    fit.get();
+    for (int side = 0; side < 2; side++)
+    {
+        stats.gaps[side] = tracks[side].gaps;
+        stats.lost[side] = tracks[side].lost;
+        stats.period[side] = tracks[side].clock.period();
+    }
+    stats.reference = stats.period[0] <= stats.period[1] ? 0 : 1;
+    const SensorTrack &ref = tracks[stats.reference];
+    const SensorTrack &other = tracks[1 - stats.reference];
+
+    // Only merge where the other sensor's filter is fully inside its samples.
+    size_t ref_hint = 0, other_hint = 0;
+    int64_t first = (int64_t)ceil(ref.clock.index_at(other.clock.time_at(SINC_TAPS, other_hint), ref_hint));
+    int64_t end = (int64_t)floor(
+        ref.clock.index_at(other.clock.time_at((double)(other.next - SINC_TAPS), other_hint), ref_hint));
+    first = std::max<int64_t>(first, 0);
+    end = std::min(end, ref.next);
+
+    RecordingWriter *writer = new RecordingWriter;
+    writer->begin(header.odr, sink, context);
+    auto write = [&](const Segment &seg) {
+        size_t hint = 0;
+        int64_t n = seg.rows.size() / RECORDING_CHANNELS;
+        for (int64_t k = 0; k < n; k += RECORDING_CHUNK_SAMPLES)
+        {
+            int count = (int)std::min<int64_t>(RECORDING_CHUNK_SAMPLES, n - k);
+            int64_t index = seg.first + k;
+            double t0 = ref.clock.time_at((double)index, hint);
+            double t1 = ref.clock.time_at((double)(index + count), hint);
+            writer->set_time({index, llround(t0), (float)((t1 - t0) / count)});
+            writer->add(index, &seg.rows[k * RECORDING_CHANNELS], count);
+        }
+        stats.samples += n;
+        stats.zeroed += seg.zeroed;
+        stats.segments++;
+    };
+
+    std::deque<std::future<Segment>> pending;
+    for (int64_t k = first; k < end; k += SEGMENT_SAMPLES)
+    {
+        if ((int)pending.size() >= std::max(options.jobs, 1))
+        {
+            write(pending.front().get());
+            pending.pop_front();
+        }
+        int64_t seg_end = std::min<int64_t>(k + SEGMENT_SAMPLES, end);
+        pending.push_back(std::async(std::launch::async, merge_segment, std::cref(ref), std::cref(other),
+                                     stats.reference, k, seg_end, options.linear));
+    }
+    for (auto &f : pending)
+        write(f.get());
+    writer->finish();
+    delete writer;
+    return true;
+}
+
+// Synthetic captures: two sensors with skewed clocks see the same motion.
+#define SYNTH_FIFO_DEPTH 256 // Samples the FIFO holds before it overruns.
+#define SYNTH_MAX_RECORDS 32 // Records per read, RATE.max_records at 1920 Hz.
+#define SYNTH_TIMESTAMP_TAG 0x04
+
+static const double synth_freq[3] = {2.0, 25.0, 90.0}; // Hz.
+static const double synth_amp[3] = {8000, 6000, 4000};
+
+static double synth_value(int c, double usec)
+{
+    return synth_amp[c] * sin(2 * M_PI * synth_freq[c] * usec * 1e-6 + c);
+}
+
+/// @brief Write a capture of seconds of ping pong reads, with read jitter,
+/// occasional late reads, and one overrun of imu1 (side 0) at 40% of the way.
+/// @return Samples lost to the overrun.
+static long synthesize(double seconds, uint32_t odr, CaptureWriter::Sink sink, void *context)
+{
+    const uint32_t interval = 4000;
+    const double period[2] = {1e6 / odr * (1 + 60e-6), 1e6 / odr * (1 - 45e-6)};
+    const double start[2] = {1234.5, 987.25};
+    int64_t next[2] = {0, 0}; // Next sample to read.
+    long lost = 0;
+    CaptureWriter writer;
+    writer.begin(odr, interval, sink, context);
+    srand(7);
+    uint8_t records[(SYNTH_MAX_RECORDS + 1) * CAPTURE_RECORD_BYTES];
+    int64_t stall_from = (int64_t)(seconds * 0.4e6), stall_to = stall_from + 300000;
+    for (int64_t slot = 0; slot * (interval / 2) < seconds * 1e6; slot++)
+    {
+        int side = slot & 1;
+        int64_t now = 10000 + slot * (interval / 2) + rand() % 400 - 200;
+        uint8_t flags = 0;
+        if (rand() % 100 == 0)
+        {
+            now += 1500;
+            flags |= CAPTURE_DELAYED;
+        }
+        if (side == 0 && now >= stall_from && now < stall_to)
+            continue;
+        int64_t acquired = (int64_t)floor((now - start[side]) / period[side]) + 1;
+        if (acquired - next[side] > SYNTH_FIFO_DEPTH)
+        {
+            lost += acquired - SYNTH_FIFO_DEPTH - next[side];
+            next[side] = acquired - SYNTH_FIFO_DEPTH;
+            flags |= CAPTURE_OVERRUN;
+        }
+        int count = (int)std::min<int64_t>(acquired - next[side], SYNTH_MAX_RECORDS);
+        memset(records, 0, CAPTURE_RECORD_BYTES);
+        records[0] = SYNTH_TIMESTAMP_TAG << 3;
+        for (int i = 0; i < count; i++)
+        {
+            int64_t k = next[side] + i;
+            uint8_t *r = records + (i + 1) * CAPTURE_RECORD_BYTES;
+            r[0] = CAPTURE_TAG_XL_NC << 3 | (k & 3) << 1;
+            for (int c = 0; c < 3; c++)
+            {
+                int16_t v = (int16_t)lrint(synth_value(c, start[side] + k * period[side]));
+                r[1 + 2 * c] = v & 0xFF;
+                r[2 + 2 * c] = (uint16_t)v >> 8;
+            }
+        }
+        next[side] += count;
+        writer.add(side == 0, now, (uint16_t)(acquired - next[side]), flags, records, count + 1);
+    }
+    return lost;
+}
+
+static void append_to_vector(const void *data, size_t bytes, void *context)
+{
+    auto *v = (std::vector<uint8_t> *)context;
+    v->insert(v->end(), (const uint8_t *)data, (const uint8_t *)data + bytes);
+}
+
+static void write_file(const void *data, size_t bytes, void *context)
+{
+    fwrite(data, 1, bytes, (FILE *)context);
+}
+
+/// @brief RMS difference between the two sides of a recording, over samples
+/// where neither side is zeroed.
+static double side_difference(const std::vector<uint8_t> &recording)
+{
+    RecordingReader reader;
+    assert(reader.open(recording.data(), recording.size()));
+    static int16_t rows[RECORDING_CHUNK_SAMPLES * RECORDING_CHANNELS];
+    double sum = 0;
+    long count = 0;
+    for (size_t i = 0; i < reader.chunks(); i++)
+    {
+        int n = reader.decode(i, rows);
+        assert(n > 0);
+        for (int k = 0; k < n; k++)
+        {
+            const int16_t *r = &rows[k * RECORDING_CHANNELS];
+            if (r[0] == 0 || r[3] == 0)
+                continue;
+            for (int c = 0; c < 3; c++)
+                sum += (double)(r[c] - r[3 + c]) * (r[c] - r[3 + c]);
+            count += 3;
+        }
+    }
+    return sqrt(sum / count);
+}
+
+/// @brief Re-merge a synthetic capture both ways.  Both sensors saw the same
+/// motion, so the sides should agree, far better with the sinc.
+static void test_remerge()
+{
+    std::vector<uint8_t> capture;
+    long lost = synthesize(60, 1920, append_to_vector, &capture);
+    double diff[2];
+    for (int linear = 0; linear < 2; linear++)
+    {
+        std::vector<uint8_t> recording;
+        RemergeOptions options;
+        options.jobs = 4;
+        options.linear = linear;
+        RemergeStats stats;
+        assert(remerge(capture.data(), capture.size(), append_to_vector, &recording, options, stats));
+        // Side 1's clock is faster, and the overrun is counted exactly.
+        assert(stats.reference == 1);
+        assert(stats.gaps[0] == 1 && stats.lost[0] == lost && stats.gaps[1] == 0);
+        assert(fabs(stats.period[0] / stats.period[1] - (1 + 60e-6) / (1 - 45e-6)) < 2e-6);
+        diff[linear] = side_difference(recording);
+        printf("Remerge %s: %ld samples, %ld zeroed, %ld lost, sides differ by %.2f RMS\n",
+               linear ? "linear" : "sinc", (long)stats.samples, stats.zeroed, lost, diff[linear]);
+        // The overrun zeroes its own length, plus the filter's reach.
+        assert(stats.zeroed >= lost && stats.zeroed < lost + 64);
+    }
+    assert(diff[0] < diff[1] / 2);
+    assert(diff[0] < 8);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: remerge [-j jobs] [-l] [-o out.rec] capture...\n"
+                    "       remerge -g seconds out.cap\n"
+                    "       remerge -T\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    RemergeOptions options;
+    options.jobs = std::max(1u, std::thread::hardware_concurrency());
+    const char *output = nullptr;
+    double generate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:lo:g:T")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j': options.jobs = atoi(optarg); break;
+        case 'l': options.linear = true; break;
+        case 'o': output = optarg; break;
+        case 'g': generate = atof(optarg); break;
+        case 'T':
+            test_resample();
+            test_capture();
+            test_recording();
+            test_remerge();
+            return 0;
+        default: usage();
+        }
+    }
+    int files = argc - optind;
+    if (files < 1 || options.jobs < 1 || (output && files > 1) || (generate > 0 && files != 1))
+        usage();
+
+    if (generate > 0)
+    {
+        FILE *f = fopen(argv[optind], "wb");
+        if (f == nullptr)
+        {
+            perror(argv[optind]);
+            return 1;
+        }
+        long lost = synthesize(generate, 1920, write_file, f);
+        fclose(f);
+        printf("%s: %.0f s, %ld samples lost to an overrun\n", argv[optind], generate, lost);
+        return 0;
+    }
+
+    // Each capture gets its own parser thread, and a share of the segment jobs.
+    RemergeOptions shared = options;
+    shared.jobs = std::max(1, options.jobs / files);
+    std::vector<std::future<int>> results;
+    for (int i = optind; i < argc; i++)
+    {
+        std::string in = argv[i];
+        std::string out = output ? output : in.substr(0, in.rfind(".cap") == in.size() - 4 ? in.size() - 4 : in.size()) + ".rec";
+        results.push_back(std::async(std::launch::async, [in, out, shared] {
+            int fd = open(in.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+            {
+                perror(in.c_str());
+                return 1;
+            }
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            FILE *f = data == MAP_FAILED ? nullptr : fopen(out.c_str(), "wb");
+            if (f == nullptr)
+            {
+                perror(data == MAP_FAILED ? "mmap" : out.c_str());
+                return 1;
+            }
+            int64_t begin = monotonic_usec();
+            RemergeStats stats;
+            bool ok = remerge(data, st.st_size, write_file, f, shared, stats);
+            fclose(f);
+            munmap(data, st.st_size);
+            close(fd);
+            if (!ok)
+            {
+                fprintf(stderr, "%s is not a capture, or is too short\n", in.c_str());
+                return 1;
+            }
+            double elapsed = (monotonic_usec() - begin) / 1e6;
+            double seconds = stats.samples * stats.period[stats.reference] / 1e6;
+            printf("%s: %lld samples (%.0f s) in %.2f s, %.0fx real time, %.1f M samples/s, %s\n"
+                   "  reference side %d, usec per sample %.5f and %.5f\n"
+                   "  gaps %ld and %ld, lost %ld and %ld, %ld merged samples zeroed\n",
+                   out.c_str(), (long long)stats.samples, seconds, elapsed, seconds / elapsed,
+                   stats.samples / elapsed / 1e6, shared.linear ? "linear" : resample_has_avx2() ? "sinc, AVX2" : "sinc",
+                   stats.reference, stats.period[0], stats.period[1], stats.gaps[0], stats.gaps[1], stats.lost[0],
+                   stats.lost[1], stats.zeroed);
+            return 0;
+        }));
+    }
+    int status = 0;
+    for (auto &r : results)
+        status |= r.get();
+    return status;
+}
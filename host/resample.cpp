@@ -0,0 +1,306 @@
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "resample.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86 1
+#endif
+
+void ClockMap::add(int64_t sample, int64_t time)
+{
+    // Reads that added no samples don't move the clock.
+    if (!k.empty() && sample <= k.back())
+        return;
+    k.push_back(sample);
+    raw.push_back(time);
+}
+
+/// @brief An exponentially weighted least squares line, as TimeFitter keeps,
+/// but in double.  TimeFitter's float sums are fine for a device's few second
+/// fit, but lose several usec over the longer offline fits.
+struct LineFit
+{
+    double n = 0, k = 0, t = 0, kk = 0, kt = 0;
+
+    void add(double x, double y, double alpha)
+    {
+        n += 1 - n * alpha;
+        k += x - k * alpha;
+        t += y - t * alpha;
+        kk += x * x - kk * alpha;
+        kt += x * y - kt * alpha;
+    }
+
+    double at(double x) const
+    {
+        double sxx = kk - k * k / n;
+        double slope = sxx > 0 ? (kt - k * t / n) / sxx : 0;
+        return t / n + slope * (x - k / n);
+    }
+};
+
+void ClockMap::fit(float alpha)
+{
+    size_t n = k.size();
+    t.assign(n, 0);
+    // Points are relative to the first, to keep the sums small.  Each side's
+    // estimate is weighted by the points in its fit, so near the ends, where
+    // one side has seen only a few, the other side dominates.
+    std::vector<double> weight(n);
+    LineFit forward;
+    for (size_t i = 0; i < n; i++)
+    {
+        forward.add(k[i] - k[0], raw[i] - raw[0], alpha);
+        t[i] = i < 2 ? raw[i] : raw[0] + forward.at(k[i] - k[0]);
+        weight[i] = i < 2 ? 0 : forward.n;
+    }
+    LineFit backward;
+    for (size_t i = n; i-- > 0;)
+    {
+        backward.add(k[i] - k[0], raw[i] - raw[0], alpha);
+        if (n - i <= 2)
+            continue;
+        double b = raw[0] + backward.at(k[i] - k[0]);
+        t[i] = (t[i] * weight[i] + b * backward.n) / (weight[i] + backward.n);
+    }
+}
+
+double ClockMap::period() const
+{
+    if (k.size() < 2)
+        return 0;
+    return (t.back() - t.front()) / (double)(k.back() - k.front());
+}
+
+double ClockMap::time_at(double x, size_t &i) const
+{
+    size_t n = k.size();
+    if (i + 1 >= n)
+        i = 0;
+    while (i + 2 < n && k[i + 1] <= x)
+        i++;
+    while (i > 0 && k[i] > x)
+        i--;
+    return t[i] + (x - k[i]) * (t[i + 1] - t[i]) / (double)(k[i + 1] - k[i]);
+}
+
+double ClockMap::index_at(double time, size_t &i) const
+{
+    size_t n = k.size();
+    if (i + 1 >= n)
+        i = 0;
+    while (i + 2 < n && t[i + 1] <= time)
+        i++;
+    while (i > 0 && t[i] > time)
+        i--;
+    return k[i] + (time - t[i]) * (double)(k[i + 1] - k[i]) / (t[i + 1] - t[i]);
+}
+
+/// @brief Blackman windowed sinc filters, one per phase, each normalised to
+/// unity gain at DC.
+struct SincTable
+{
+    alignas(32) float taps[SINC_PHASES][SINC_TAPS];
+
+    SincTable()
+    {
+        const int half = SINC_TAPS / 2;
+        for (int p = 0; p < SINC_PHASES; p++)
+        {
+            double frac = (double)p / SINC_PHASES;
+            double sum = 0;
+            for (int j = 0; j < SINC_TAPS; j++)
+            {
+                // Tap j applies to the sample at floor(pos) - half + 1 + j.
+                double d = j - (half - 1) - frac;
+                double x = 2 * SINC_CUTOFF * d;
+                double sinc = x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+                double w = (d + half) / SINC_TAPS;
+                double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+                taps[p][j] = (float)(sinc * window);
+                sum += taps[p][j];
+            }
+            for (int j = 0; j < SINC_TAPS; j++)
+                taps[p][j] = (float)(taps[p][j] / sum);
+        }
+    }
+};
+
+static const SincTable table;
+
+/// @brief First sample and phase of the filter for a position, or false if the
+/// filter would reach past either end.
+static inline bool locate(double pos, size_t length, long &first, int &phase)
+{
+    double base = floor(pos);
+    phase = (int)((pos - base) * SINC_PHASES + 0.5);
+    if (phase == SINC_PHASES)
+    {
+        phase = 0;
+        base += 1;
+    }
+    first = (long)base - (SINC_TAPS / 2 - 1);
+    return first >= 0 && first + SINC_TAPS <= (long)length;
+}
+
+static size_t resample_scalar(const float *const ch[3], const uint32_t *valid, size_t length,
+                              const double *pos, size_t count, float *const out[3])
+{
+    size_t missing = 0;
+    for (size_t n = 0; n < count; n++)
+    {
+        long first;
+        int phase;
+        if (!locate(pos[n], length, first, phase) || valid[first + SINC_TAPS] - valid[first] != SINC_TAPS)
+        {
+            out[0][n] = out[1][n] = out[2][n] = 0;
+            missing++;
+            continue;
+        }
+        const float *h = table.taps[phase];
+        for (int c = 0; c < 3; c++)
+        {
+            const float *x = ch[c] + first;
+            float acc = 0;
+            for (int j = 0; j < SINC_TAPS; j++)
+                acc += h[j] * x[j];
+            out[c][n] = acc;
+        }
+    }
+    return missing;
+}
+
+#ifdef RESAMPLE_X86
+__attribute__((target("avx2,fma"))) static inline float sum8(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+/// @brief The same filters, with the taps loaded once for all three channels,
+/// and 8 multiply-adds per instruction.
+__attribute__((target("avx2,fma"))) static size_t resample_avx2(const float *const ch[3], const uint32_t *valid,
+                                                                size_t length, const double *pos, size_t count,
+                                                                float *const out[3])
+{
+    static_assert(SINC_TAPS == 32, "The AVX2 kernel is unrolled for 32 taps");
+    size_t missing = 0;
+    for (size_t n = 0; n < count; n++)
+    {
+        long first;
+        int phase;
+        if (!locate(pos[n], length, first, phase) || valid[first + SINC_TAPS] - valid[first] != SINC_TAPS)
+        {
+            out[0][n] = out[1][n] = out[2][n] = 0;
+            missing++;
+            continue;
+        }
+        const float *h = table.taps[phase];
+        __m256 h0 = _mm256_load_ps(h);
+        __m256 h1 = _mm256_load_ps(h + 8);
+        __m256 h2 = _mm256_load_ps(h + 16);
+        __m256 h3 = _mm256_load_ps(h + 24);
+        for (int c = 0; c < 3; c++)
+        {
+            const float *x = ch[c] + first;
+            __m256 a = _mm256_mul_ps(h0, _mm256_loadu_ps(x));
+            __m256 b = _mm256_mul_ps(h1, _mm256_loadu_ps(x + 8));
+            a = _mm256_fmadd_ps(h2, _mm256_loadu_ps(x + 16), a);
+            b = _mm256_fmadd_ps(h3, _mm256_loadu_ps(x + 24), b);
+            out[c][n] = sum8(_mm256_add_ps(a, b));
+        }
+    }
+    return missing;
+}
+#endif
+
+bool resample_has_avx2()
+{
+#ifdef RESAMPLE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+size_t resample3(const float *const ch[3], const uint32_t *valid, size_t length,
+                 const double *pos, size_t count, float *const out[3])
+{
+#ifdef RESAMPLE_X86
+    if (resample_has_avx2())
+        return resample_avx2(ch, valid, length, pos, count, out);
+#endif
+    return resample_scalar(ch, valid, length, pos, count, out);
+}
+
+size_t resample3_linear(const float *const ch[3], const uint32_t *valid, size_t length,
+                        const double *pos, size_t count, float *const out[3])
+{
+    size_t missing = 0;
+    for (size_t n = 0; n < count; n++)
+    {
+        long i = (long)floor(pos[n]);
+        if (i < 0 || i + 2 > (long)length || valid[i + 2] - valid[i] != 2)
+        {
+            out[0][n] = out[1][n] = out[2][n] = 0;
+            missing++;
+            continue;
+        }
+        float frac = (float)(pos[n] - i);
+        for (int c = 0; c < 3; c++)
+            out[c][n] = ch[c][i] + frac * (ch[c][i + 1] - ch[c][i]);
+    }
+    return missing;
+}
+
+/// @brief Interpolate tones well inside the passband at random positions, and
+/// check the result against the exact values, for both kernels.
+void test_resample()
+{
+    const size_t length = 4096;
+    const int count = 2000;
+    static float ch[3][length];
+    static uint32_t valid[length + 1];
+    static double pos[count];
+    static float a[3][count], b[3][count];
+    const double freq[3] = {0.01, 0.08, 0.3}; // Cycles per sample.
+    for (size_t i = 0; i < length; i++)
+    {
+        for (int c = 0; c < 3; c++)
+            ch[c][i] = (float)(1000 * sin(2 * M_PI * freq[c] * i + c));
+        valid[i + 1] = valid[i] + 1;
+    }
+    srand(2);
+    for (int n = 0; n < count; n++)
+        pos[n] = 20 + (double)rand() / RAND_MAX * (length - 40);
+
+    const float *in[3] = {ch[0], ch[1], ch[2]};
+    float *out_a[3] = {a[0], a[1], a[2]};
+    float *out_b[3] = {b[0], b[1], b[2]};
+    assert(resample_scalar(in, valid, length, pos, count, out_a) == 0);
+    assert(resample3(in, valid, length, pos, count, out_b) == 0);
+    double worst = 0;
+    for (int n = 0; n < count; n++)
+        for (int c = 0; c < 3; c++)
+        {
+            assert(fabsf(a[c][n] - b[c][n]) < 1e-2f);
+            double exact = 1000 * sin(2 * M_PI * freq[c] * pos[n] + c);
+            worst = fmax(worst, fabs(b[c][n] - exact));
+        }
+    printf("Resample: worst error %.3f in 1000, %s\n", worst, resample_has_avx2() ? "AVX2" : "scalar");
+    assert(worst < 2);
+
+    // A missing sample blanks the positions whose filters reach it.
+    for (size_t i = 1000; i <= length; i++)
+        valid[i] = valid[i - 1] + (i - 1 != 1000);
+    double near[3] = {1000.5, 1000 - SINC_TAPS / 2 - 0.5, 1000 + SINC_TAPS / 2 + 0.5};
+    assert(resample3(in, valid, length, near, 3, out_b) == 1);
+    assert(b[0][0] == 0 && b[0][1] != 0 && b[0][2] != 0);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Windowed sinc interpolation.  The taps of each filter straddle the
+// interpolation point, half on each side.
+#define SINC_TAPS 32
+// Fractional positions are rounded to 1/SINC_PHASES of a sample, which is
+// under 0.3 usec at 1920 Hz.
+#define SINC_PHASES 1024
+// Cutoff, as a fraction of the sample rate.  The sensor's own filter is well
+// below this at every ODR we use.
+#define SINC_CUTOFF 0.45
+
+// Decay per read of the offline clock fits.  The device has to follow drift
+// with a causal fit of about 4 seconds.  Offline, each side of a read is fitted
+// over about 4000 reads (16 seconds at 1920 Hz), which is still short beside
+// the thermal drift of the sensor clocks.
+#define REMERGE_FIT_ALPHA 2.5e-4f
+
+/// @brief A sensor's sample clock, fitted from both sides.
+///
+/// Each read gives a point (samples so far, read time), as in IMUTracker.  A
+/// decaying least squares fit, like TimeFitter's, runs forwards over the
+/// points, and another backwards, and the time of each point is the mean of
+/// the two, so it is smoothed over reads before and after it.  Between points,
+/// time is linear in the sample index.
+class ClockMap
+{
+public:
+    /// @brief Add a point.  Points must be in order of sample index.
+    void add(int64_t k, int64_t t);
+    void fit(float alpha = REMERGE_FIT_ALPHA);
+    size_t size() const { return k.size(); }
+
+    /// @brief Time of sample index x.  hint is a cursor into the points, for
+    /// calls in increasing order.
+    double time_at(double x, size_t &hint) const;
+    /// @brief Sample index at time t, the inverse of time_at.
+    double index_at(double t, size_t &hint) const;
+    /// @brief Mean usec per sample.
+    double period() const;
+
+private:
+    std::vector<int64_t> k;
+    std::vector<int64_t> raw;
+    std::vector<double> t; // Fitted time of each point.
+};
+
+/// @brief Interpolate three channels at fractional sample positions.
+/// @param channels Samples 0 to length - 1 of each channel.
+/// @param valid Running count of valid samples: valid[i] is the number of
+///              valid samples before i, so length + 1 entries.
+/// @param pos Positions to interpolate at, in samples.
+/// @param out Interpolated values.  A position whose filter reaches an
+///            invalid sample, or past the ends, gives 0 on every channel.
+/// @return The number of positions that gave 0 because of missing data.
+size_t resample3(const float *const channels[3], const uint32_t *valid, size_t length,
+                 const double *pos, size_t count, float *const out[3]);
+
+/// @brief resample3 by linear interpolation between the two nearest samples,
+/// as the device does, for comparison.
+size_t resample3_linear(const float *const channels[3], const uint32_t *valid, size_t length,
+                        const double *pos, size_t count, float *const out[3]);
+
+/// @brief Whether resample3 uses AVX2 on this CPU.
+bool resample_has_avx2();
+
+void test_resample();
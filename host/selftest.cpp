@@ -0,0 +1,35 @@
+/*
+Run the firmware's self tests and benchmarks that don't need a device, built
+from the same sources as the firmware.
+
+    selftest                 run them all
+
+The benchmarks time the host, so only their ratios mean much here.
+*/
+
+#include <stdio.h>
+
+#include "bell.h"
+#include "blackbox.h"
+#include "pacer.h"
+#include "tracker.h"
+#include "transport.h"
+#include "unpack.h"
+
+int main()
+{
+    test_unpack_records();
+    benchmark_unpack();
+    test_blackbox();
+    benchmark_blackbox();
+    test_mock_bus();
+    test_pacer_control();
+    test_reproject();
+    test_imu_tracker();
+    test_skew_scheduler();
+    test_gap_detection();
+    test_bell_integrator();
+    benchmark_bell();
+    printf("Self tests: ok\n");
+    return 0;
+}
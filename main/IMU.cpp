@@ -1,4 +1,12 @@
+#include <algorithm>
+#include <cassert>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_timer.h"
 #include "IMU.h"
+#include "hub.h"
+#include "memory.h"
+#include "sim.h"
 
 /**
  * @brief  Get the LSM6DSV16X FIFO raw data
@@ -25,31 +33,182 @@ LSM6DSV16XStatusTypeDef LSMExtension::FIFO_Get_Tag_And_Data(uint8_t *Data)
  */
 LSM6DSV16XStatusTypeDef LSMExtension::Read_FIFO_Data(uint16_t max, lsm6dsv16x_fifo_record_t *records, uint16_t *count)
 {
-    int status = FIFO_Get_Num_Samples(count);
+    batch_start = esp_timer_get_time();
+    // Read the level and the overrun flags together.
+    int status = lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_FIFO_STATUS1, fifo_status, 2);
     if (status != LSM6DSV16X_OK)
-        return LSM6DSV16X_ERROR;
-    if (*count > 0x1FF)
     {
-        printf("Bad Get_Num_Samples? %d\n", *count);
-        status = FIFO_Get_Num_Samples(count);
+        status_usec = 0;
+        return LSM6DSV16X_ERROR;
     }
-    if (*count == 0)
+    status_usec = clock();
+    uint16_t level = fifo_status[0] | ((fifo_status[1] & 0x01) << 8);
+    fifo_level = level;
+    uint16_t limit = compressed ? max / FIFO_COMPRESSION_MAX : max;
+    uint16_t entries = level > limit ? limit : level;
+    fifo_known = level - entries;
+    *count = 0;
+    if (entries == 0)
     {
+        bus_usec = bus_usec + (uint32_t)(esp_timer_get_time() - batch_start);
         return LSM6DSV16X_OK;
     }
-    if (*count > max)
-        *count = max;
-    // If we read more than this, i2c doesn't seem to actually read all the data.
-    if (*count > 32)
-        *count = 32;
-    status = lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_FIFO_DATA_OUT_TAG, (uint8_t *)records, *count * 7);
-    return (LSM6DSV16XStatusTypeDef)status;
+    // Compressed entries are read into the end of records, and decoded to the start.
+    lsm6dsv16x_fifo_record_t *in = compressed ? records + max - entries : records;
+    // If we read more than MAX_FIFO_BURST records at once, i2c doesn't seem to
+    // actually read all the data, so split longer reads into bursts.
+    for (uint16_t done = 0; done < entries; done += MAX_FIFO_BURST)
+    {
+        uint16_t burst = entries - done;
+        if (burst > MAX_FIFO_BURST)
+            burst = MAX_FIFO_BURST;
+        status = lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_FIFO_DATA_OUT_TAG, (uint8_t *)&in[done], burst * 7);
+        if (status != LSM6DSV16X_OK)
+            return (LSM6DSV16XStatusTypeDef)status;
+    }
+    bus_usec = bus_usec + (uint32_t)(esp_timer_get_time() - batch_start);
+    *count = entries;
+    if (compressed)
+    {
+        if (FIFO_Overrun())
+            decompressor.reset();
+        *count = decompressor.decode(in, entries, records);
+    }
+    return LSM6DSV16X_OK;
+}
+
+static int32_t transport_write(void *handle, uint8_t reg, const uint8_t *data, uint16_t len)
+{
+    return ((Transport *)handle)->write(reg, data, len);
 }
 
-static DMA_ATTR lsm6dsv16x_fifo_record_t records[32];
+static int32_t transport_read(void *handle, uint8_t reg, uint8_t *data, uint16_t len)
+{
+    return ((Transport *)handle)->read(reg, data, len);
+}
+
+void LSMExtension::Use_Transport(Transport *t)
+{
+    transport = t;
+    reg_ctx.write_reg = transport_write;
+    reg_ctx.read_reg = transport_read;
+    reg_ctx.handle = t;
+}
+
+void LSMExtension::batch_done(void *arg, int32_t status)
+{
+    LSMExtension *imu = (LSMExtension *)arg;
+    imu->bus_usec = imu->bus_usec + (uint32_t)(esp_timer_get_time() - imu->batch_start);
+    imu->batch_status = status;
+    imu->status_usec = status == 0 ? imu->clock() : 0;
+    imu->batch_cb(imu->batch_arg, status);
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Read_FIFO_Batch(uint16_t max, lsm6dsv16x_fifo_record_t *records,
+                                                      BusDoneCallback done, void *arg)
+{
+    // Read everything left over from the last batch, plus what has certainly
+    // arrived since its status was read, at the slowest the ODR runs.  That
+    // was before the last batch finished, so this is a little short, and the
+    // rest is picked up next time.  Timestamp records are left out, for the
+    // same reason.
+    uint32_t expected = 0;
+    int64_t now = clock();
+    if (status_usec > 0 && now > status_usec)
+    {
+        uint32_t samples = (uint64_t)(now - status_usec) * stream_odr * FIFO_ODR_MIN_PERCENT / 100 / 1000000;
+        expected = samples;
+        if (gyro_decimation > 0)
+            expected += samples / gyro_decimation;
+        if (hub_decimation > 0)
+            expected += samples / hub_decimation;
+    }
+    uint16_t limit = max;
+    if (compressed)
+    {
+        // Entries hold up to FIFO_COMPRESSION_MAX samples, so at least this
+        // many have arrived, however well the samples compress.
+        expected /= FIFO_COMPRESSION_MAX;
+        limit = max / FIFO_COMPRESSION_MAX;
+    }
+    uint16_t burst = std::min<uint32_t>(fifo_known + expected, limit);
+    // Whole words for SPI DMA.  Whatever is cut waits for the next read.
+    burst -= burst % SENSOR_BURST_RECORDS;
+    batch_records = burst;
+    batch_out = records;
+    // A compressed burst lands at the end of the buffer, still word aligned.
+    batch_in = compressed ? records + (max - max % SENSOR_BURST_RECORDS) - burst : records;
+    batch_cb = done;
+    batch_arg = arg;
+
+    batch[0] = {LSM6DSV16X_FIFO_STATUS1, false, 2, fifo_status};
+    batch[1] = {LSM6DSV16X_FIFO_DATA_OUT_TAG, false, (uint16_t)(burst * 7), (uint8_t *)batch_in};
+    uint8_t count = burst > 0 ? 2 : 1;
+
+    int32_t status;
+    batch_start = esp_timer_get_time();
+    if (transport != nullptr)
+        status = transport->submit(batch, count, batch_done, this);
+    else
+    {
+        // Without a transport, run the batch through the register context.
+        status = 0;
+        for (uint8_t i = 0; i < count && status == 0; i++)
+            status = lsm6dsv16x_read_reg(&reg_ctx, batch[i].reg, batch[i].data, batch[i].len);
+        batch_done(this, status);
+        status = 0;
+    }
+    return status == 0 ? LSM6DSV16X_OK : LSM6DSV16X_ERROR;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Finish_FIFO_Batch(uint16_t *count)
+{
+    *count = 0;
+    if (transport != nullptr && transport->collect() != 0)
+        batch_status = -1;
+    if (batch_status != 0)
+    {
+        fifo_known = 0;
+        return LSM6DSV16X_ERROR;
+    }
+    // The status was read before the burst, so it includes the records just read.
+    uint16_t level = fifo_status[0] | ((fifo_status[1] & 0x01) << 8);
+    fifo_level = level;
+    if (level < batch_records)
+    {
+        // The burst reached past the records the status counted, which only
+        // happens if the ODR runs slower than FIFO_ODR_MIN_PERCENT.  Those
+        // records may have arrived since, but can't be told from reads of an
+        // empty FIFO, so they are dropped.
+        short_batches++;
+        batch_records = level;
+    }
+    fifo_known = level - batch_records;
+    *count = batch_records;
+    if (compressed)
+    {
+        // Entries lost to an overrun may hold the reference samples.
+        if (FIFO_Overrun())
+            decompressor.reset();
+        *count = decompressor.decode(batch_in, batch_records, batch_out);
+    }
+    return LSM6DSV16X_OK;
+}
+
+// FIFO_STATUS2 overrun flags.  OVR_LATCHED is cleared by reading FIFO_STATUS2.
+#define FIFO_STATUS2_OVR_IA 0x40
+#define FIFO_STATUS2_OVR_LATCHED 0x08
+
+bool LSMExtension::FIFO_Overrun() const
+{
+    return (fifo_status[1] & (FIFO_STATUS2_OVR_IA | FIFO_STATUS2_OVR_LATCHED)) != 0;
+}
 
 LSM6DSV16XStatusTypeDef LSMExtension::Slow()
 {
+    // Reads after this start from a fresh status.
+    status_usec = 0;
+    fifo_known = 0;
     LSM6DSV16XStatusTypeDef status = Set_SFLP_ODR(LSM6DSV16X_ODR_AT_1Hz875);
     if (status != LSM6DSV16X_OK)
         return status;
@@ -81,7 +240,8 @@ void LSMExtension::HandleSlow()
 {
     // The driver will only read 32 records at a time - 16 samples at 1.875 Hz is about 8 seconds.
     uint16_t samples_read = 0;
-    LSM6DSV16XStatusTypeDef status = Read_FIFO_Data(32, &records[0], &samples_read);
+    lsm6dsv16x_fifo_record_t *records = dma_arena.slow;
+    LSM6DSV16XStatusTypeDef status = Read_FIFO_Data(MAX_FIFO_BURST, &records[0], &samples_read);
 
     if (status != LSM6DSV16X_OK)
     {
@@ -111,9 +271,243 @@ void LSMExtension::HandleSlow()
 // about 7 blocks per second.  We need to read the sensor about every 5 msec though,
 // to keep from overflowing the FIFO.
 // So we might need to offload the flash writing to a task on the other processor.
-#define SENSOR_ODR 1920
+// SENSOR_ODR is defined in rate.h.
+
+// CTRL6 FS_G and CTRL8 FS_XL codes.
+#define FS_G_1000DPS 0x03
+#define FS_XL_16G 0x03
+// FIFO_CTRL4 fields.
+#define FIFO_MODE_MASK 0x07
+#define FIFO_CTRL4_STREAM 0x06
+#define FIFO_CTRL4_TEMP_1Hz875 (0x01 << 4)
+#define FIFO_CTRL4_TS_DEC_32 (0x03 << 6)
+// CTRL3 fields.
+#define CTRL3_BDU 0x40
+#define CTRL3_IF_INC 0x04
+
+LSM6DSV16XStatusTypeDef LSMExtension::Write_Config(bool gyro)
+{
+    // The library only records the ODR while the sensor is disabled, so this
+    // keeps its state consistent without touching the device.
+    Set_X_ODR(stream_odr);
+    Set_G_ODR((float)stream_odr / stream_gyro_decimation);
+    uint8_t odr_code = rate_odr_code(stream_odr);
+    uint8_t gyro_odr_code = odr_code - rate_shift(stream_gyro_decimation);
+
+    // CTRL1 through CTRL8 in one read and one write.
+    uint8_t ctrl[8];
+    if (lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_CTRL1, ctrl, sizeof(ctrl)) != 0)
+        return LSM6DSV16X_ERROR;
+    ctrl[0] = odr_code;                   // CTRL1: high performance mode, ODR_XL
+    ctrl[1] = gyro ? gyro_odr_code : 0;   // CTRL2: high performance mode, ODR_G
+    ctrl[2] |= CTRL3_BDU | CTRL3_IF_INC;  // CTRL3
+    ctrl[5] = (ctrl[5] & 0xF0) | FS_G_1000DPS; // CTRL6: need minimum of 600 dps.
+    ctrl[7] = (ctrl[7] & 0xFC) | FS_XL_16G;    // CTRL8: to handle large impulses from clapper.
+    if (lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_CTRL1, ctrl, sizeof(ctrl)) != 0)
+        return LSM6DSV16X_ERROR;
+
+    // Bypass mode empties the FIFO, then FIFO_CTRL1 through FIFO_CTRL4 in one write.
+    uint8_t fifo[4];
+    if (lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_FIFO_CTRL1, fifo, sizeof(fifo)) != 0)
+        return LSM6DSV16X_ERROR;
+    fifo[3] &= ~FIFO_MODE_MASK;
+    if (lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_FIFO_CTRL4, &fifo[3], 1) != 0)
+        return LSM6DSV16X_ERROR;
+    fifo[2] = (gyro ? gyro_odr_code << 4 : 0) | odr_code; // FIFO_CTRL3: BDR_GY, BDR_XL
+    fifo[3] = FIFO_CTRL4_TS_DEC_32 | FIFO_CTRL4_TEMP_1Hz875 | FIFO_CTRL4_STREAM;
+    if (lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_FIFO_CTRL1, fifo, sizeof(fifo)) != 0)
+        return LSM6DSV16X_ERROR;
+
+    acc_is_enabled = 1;
+    gyro_is_enabled = gyro ? 1 : 0;
+    gyro_decimation = gyro ? stream_gyro_decimation : 0;
+    // Nothing is left from earlier reads.
+    fifo_known = 0;
+    status_usec = 0;
+    return LSM6DSV16X_OK;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Enable_FIFO_Compression()
+{
+    if (lsm6dsv16x_fifo_compress_algo_set(&reg_ctx, LSM6DSV16X_CMP_16_TO_1) != 0)
+        return LSM6DSV16X_ERROR;
+    if (lsm6dsv16x_fifo_compress_algo_real_time_set(&reg_ctx, 1) != 0)
+        return LSM6DSV16X_ERROR;
+    compressed = true;
+    decompressor.reset();
+    return LSM6DSV16X_OK;
+}
+
+/// @brief Read, modify and write a register in the current bank.
+static int32_t update_reg(stmdev_ctx_t *ctx, uint8_t reg, uint8_t clear, uint8_t set)
+{
+    uint8_t value;
+    int32_t status = lsm6dsv16x_read_reg(ctx, reg, &value, 1);
+    if (status == 0)
+    {
+        value = (value & ~clear) | set;
+        status = lsm6dsv16x_write_reg(ctx, reg, &value, 1);
+    }
+    return status;
+}
+
+/// @brief Read, modify and write a sensor hub bank register.
+static int32_t write_hub_reg(stmdev_ctx_t *ctx, uint8_t reg, uint8_t clear, uint8_t set)
+{
+    int32_t status = lsm6dsv16x_mem_bank_set(ctx, LSM6DSV16X_SENSOR_HUB_MEM_BANK);
+    if (status == 0)
+        status = update_reg(ctx, reg, clear, set);
+    // Always try to get back to the main bank.
+    status |= lsm6dsv16x_mem_bank_set(ctx, LSM6DSV16X_MAIN_MEM_BANK);
+    return status;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Set_Sensor_Hub_Pass_Through(bool on)
+{
+    int32_t status = write_hub_reg(&reg_ctx, LSM6DSV16X_MASTER_CONFIG,
+                                   MASTER_CONFIG_MASTER_ON | MASTER_CONFIG_PASS_THROUGH,
+                                   on ? MASTER_CONFIG_PASS_THROUGH : 0);
+    return status == 0 ? LSM6DSV16X_OK : LSM6DSV16X_ERROR;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Enable_Sensor_Hub(uint8_t address)
+{
+    // Target 0 reads 6 bytes from OUTX_L_A, batched, at HUB_ODR.
+    uint8_t slv0[3] = {
+        (uint8_t)(address | SLV0_ADD_READ),
+        LSM6DSV16X_OUTX_L_A,
+        (uint8_t)(6 | SLV0_CONFIG_BATCH | HUB_ODR_CODE << SLV0_CONFIG_SHUB_ODR_SHIFT),
+    };
+    int32_t status = lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_SENSOR_HUB_MEM_BANK);
+    if (status == 0)
+        status = lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_SLV0_ADD, slv0, sizeof(slv0));
+    status |= lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_MAIN_MEM_BANK);
+    // One target, triggered by the accelerometer data ready, so the reads
+    // are on this sensor's clock.
+    if (status == 0)
+        status = write_hub_reg(&reg_ctx, LSM6DSV16X_MASTER_CONFIG,
+                               MASTER_CONFIG_AUX_SENS_MASK | MASTER_CONFIG_PASS_THROUGH | MASTER_CONFIG_START_CONFIG,
+                               MASTER_CONFIG_MASTER_ON);
+    if (status != 0)
+        return LSM6DSV16X_ERROR;
+    hub_decimation = HUB_DECIMATION;
+    return LSM6DSV16X_OK;
+}
+
+// Attempts, a msec apart, for a UCF poll to see its bits.
+#define UCF_POLL_TRIES 100
+
+/// @brief Run one UCF line.
+static int32_t run_ucf_line(stmdev_ctx_t *ctx, const ucf_line_ext_t &line)
+{
+    uint8_t value = line.data;
+    switch (line.op)
+    {
+    case MEMS_UCF_OP_WRITE:
+        return lsm6dsv16x_write_reg(ctx, line.address, &value, 1);
+    case MEMS_UCF_OP_DELAY:
+        delay(line.data);
+        return 0;
+    case MEMS_UCF_OP_POLL_SET:
+    case MEMS_UCF_OP_POLL_RESET:
+        for (int i = 0; i < UCF_POLL_TRIES; i++)
+        {
+            int32_t status = lsm6dsv16x_read_reg(ctx, line.address, &value, 1);
+            if (status != 0)
+                return status;
+            uint8_t bits = value & line.data;
+            if (line.op == MEMS_UCF_OP_POLL_SET ? bits == line.data : bits == 0)
+                return 0;
+            delay(1);
+        }
+        printf("Problem: UCF poll of register 0x%02X timed out\n", line.address);
+        return -1;
+    default:
+        // MEMS_UCF_OP_READ only checks that the device answers.
+        return lsm6dsv16x_read_reg(ctx, line.address, &value, 1);
+    }
+}
 
-LSMExtension init_lsm(TwoWire *wire, uint8_t address)
+LSM6DSV16XStatusTypeDef LSMExtension::Load_Program(const ActivityProgram &p)
+{
+    int32_t status = 0;
+    for (uint16_t i = 0; i < p.count && status == 0; i++)
+        status = run_ucf_line(&reg_ctx, p.lines[i]);
+
+    // Route the interrupts of the outputs that report events.
+    uint8_t fsm_int = 0;
+    uint8_t mlc_int = 0;
+    for (int i = 0; i < ACTIVITY_FSMS; i++)
+        fsm_int |= p.fsm_type[i] != ACTIVITY_NONE ? 1 << i : 0;
+    for (int i = 0; i < ACTIVITY_MLC_TREES; i++)
+        mlc_int |= p.mlc_type[i] != ACTIVITY_NONE ? 1 << i : 0;
+    if (status == 0)
+        status = lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_EMBED_FUNC_MEM_BANK);
+    if (status == 0)
+        status = lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_FSM_INT1, &fsm_int, 1);
+    if (status == 0)
+        status = lsm6dsv16x_write_reg(&reg_ctx, LSM6DSV16X_MLC_INT1, &mlc_int, 1);
+    status |= lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_MAIN_MEM_BANK);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_FUNCTIONS_ENABLE, 0, FUNCTIONS_ENABLE_INTERRUPTS);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_MD1_CFG, 0, MD1_CFG_INT1_EMB_FUNC);
+    if (status != 0)
+        return LSM6DSV16X_ERROR;
+    program = &p;
+    return LSM6DSV16X_OK;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Enable_Wake_Up(uint8_t threshold)
+{
+    // Latched, so the source is still there after the MCU wakes, and
+    // without a minimum duration, so a single sample over threshold counts.
+    int32_t status = update_reg(&reg_ctx, LSM6DSV16X_FUNCTIONS_ENABLE, 0, FUNCTIONS_ENABLE_INTERRUPTS);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_TAP_CFG0, 0, TAP_CFG0_LIR);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_WAKE_UP_DUR, 0x60, WAKE_UP_DUR_WAKE_THS_W);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_WAKE_UP_THS, 0x3F, threshold & 0x3F);
+    if (status == 0)
+        status = update_reg(&reg_ctx, LSM6DSV16X_MD1_CFG, 0, MD1_CFG_INT1_WU);
+    return status == 0 ? LSM6DSV16X_OK : LSM6DSV16X_ERROR;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Disable_Wake_Up()
+{
+    return update_reg(&reg_ctx, LSM6DSV16X_MD1_CFG, MD1_CFG_INT1_WU, 0) == 0 ? LSM6DSV16X_OK : LSM6DSV16X_ERROR;
+}
+
+LSM6DSV16XStatusTypeDef LSMExtension::Read_Activity(ActivityEvent *events, int *count)
+{
+    *count = 0;
+    uint8_t block[ACTIVITY_STATUS_BYTES];
+    if (lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_WAKE_UP_SRC, block, sizeof(block)) != 0)
+        return LSM6DSV16X_ERROR;
+    ActivityStatus s = {};
+    s.wake_up_src = block[0];
+    s.fsm_status = block[LSM6DSV16X_FSM_STATUS_MAINPAGE - LSM6DSV16X_WAKE_UP_SRC];
+    s.mlc_status = block[LSM6DSV16X_MLC_STATUS_MAINPAGE - LSM6DSV16X_WAKE_UP_SRC];
+    if (program != nullptr && (s.fsm_status | s.mlc_status) != 0)
+    {
+        // The program's outputs are in the embedded functions bank.
+        int32_t status = lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_EMBED_FUNC_MEM_BANK);
+        if (status == 0 && s.fsm_status != 0)
+            status = lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_FSM_OUTS1, s.fsm_outs, sizeof(s.fsm_outs));
+        if (status == 0 && s.mlc_status != 0)
+            status = lsm6dsv16x_read_reg(&reg_ctx, LSM6DSV16X_MLC1_SRC, s.mlc_src, sizeof(s.mlc_src));
+        status |= lsm6dsv16x_mem_bank_set(&reg_ctx, LSM6DSV16X_MAIN_MEM_BANK);
+        if (status != 0)
+            return LSM6DSV16X_ERROR;
+    }
+    *count = decode_activity(s, program, events);
+    return LSM6DSV16X_OK;
+}
+
+static void configure_lsm(LSMExtension &LSM, bool gyro, bool compress);
+
+LSMExtension init_lsm(TwoWire *wire, uint8_t address, bool gyro, bool compress)
 {
     // Initialize i2c.
     // We need to read roughly 7*2*2khz = 28k bytes per second from the LSM6DSV16X.
@@ -121,6 +515,20 @@ LSMExtension init_lsm(TwoWire *wire, uint8_t address)
     // 100k bytes/sec.  So we will be running around 30% duty cycle just reading the data.
     LSMExtension LSM(wire, address);
     printf("LSM (extension) created\n");
+    configure_lsm(LSM, gyro, compress);
+    return LSM;
+}
+
+LSMExtension init_lsm(Transport *transport, bool gyro, bool compress)
+{
+    LSMExtension LSM(transport);
+    printf("LSM (extension) created on transport\n");
+    configure_lsm(LSM, gyro, compress);
+    return LSM;
+}
+
+static void configure_lsm(LSMExtension &LSM, bool gyro, bool compress)
+{
     if (LSM6DSV16X_OK != LSM.begin())
     {
         printf("LSM.begin() Error\n");
@@ -137,39 +545,16 @@ LSMExtension init_lsm(TwoWire *wire, uint8_t address)
 
     // We should probably be just fine using FS=2000, which gives more headroom for shocks.
 
+    // Compression first, so that Write_Config's trip through bypass mode
+    // starts the FIFO empty, with the compressor's reference reset.
+    if (status == 0 && compress)
+        status |= LSM.Enable_FIFO_Compression();
+    // Full scale, ODR, BDR, temperature batching, timestamp decimation (every
+    // 32 samples, about 60 Hz) and FIFO stream mode, in a few block writes.
     if (status == 0)
-        status |= LSM.Set_G_FS(1000); // Need minimum of 600 dps.
-    if (status == 0)
-        status |= LSM.Set_X_FS(16); // To handle large impulses from clapper.
-    if (status == 0)
-        status |= LSM.Set_X_ODR(SENSOR_ODR);
-    if (status == 0)
-        status |= LSM.Set_G_ODR(SENSOR_ODR);
-    if (status == 0)
-        status |= LSM.Set_Temp_ODR(LSM6DSV16X_TEMP_BATCHED_AT_1Hz875);
-
-    // Set FIFO to timestamp data at 20 Hz
+        status |= LSM.Write_Config(gyro);
     if (status == 0)
         status |= LSM.FIFO_Enable_Timestamp();
-    if (status == 0)
-        status |= LSM.FIFO_Set_Timestamp_Decimation(LSM6DSV16X_TMSTMP_DEC_32);
-    if (status == 0)
-        status |= LSM.FIFO_Set_Mode(LSM6DSV16X_BYPASS_MODE);
-
-    // Configure FIFO BDR for acc and gyro
-    if (status == 0)
-        status |= LSM.FIFO_Set_X_BDR(SENSOR_ODR);
-    if (status == 0)
-        status |= LSM.FIFO_Set_G_BDR(SENSOR_ODR);
-
-    // Set FIFO in Continuous mode
-    if (status == 0)
-        status |= LSM.FIFO_Set_Mode(LSM6DSV16X_STREAM_MODE);
-
-    if (status == 0)
-        status |= LSM.Enable_G();
-    if (status == 0)
-        status |= LSM.Enable_X();
     if (status == 0)
         status |= LSM.Enable_Gravity_Vector();
     if (status == 0)
@@ -192,6 +577,228 @@ LSMExtension init_lsm(TwoWire *wire, uint8_t address)
     //     delay(1000);
     //     LSM.HandleSlow();
     // }
+}
 
-    return LSM;
+#if SELF_TEST
+/// @brief Check the batched configuration against the mock bus registers, and
+/// that it takes only a handful of transactions.
+void test_batched_config()
+{
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static MockBus bus(&sim);
+    LSMExtension imu(&bus);
+
+    assert(imu.Write_Config(false) == LSM6DSV16X_OK);
+    printf("Batched config: %ld transactions, %ld bytes\n", bus.transactions, bus.bytes);
+    assert(bus.transactions <= 5);
+    assert(bus.reg(LSM6DSV16X_CTRL1) == RATE.odr_code);
+    assert(bus.reg(LSM6DSV16X_CTRL2) == 0);
+    assert((bus.reg(LSM6DSV16X_CTRL3) & (CTRL3_BDU | CTRL3_IF_INC)) == (CTRL3_BDU | CTRL3_IF_INC));
+    assert((bus.reg(LSM6DSV16X_CTRL6) & 0x0F) == FS_G_1000DPS);
+    assert((bus.reg(LSM6DSV16X_CTRL8) & 0x03) == FS_XL_16G);
+    assert(bus.reg(LSM6DSV16X_FIFO_CTRL3) == RATE.odr_code);
+    assert((bus.reg(LSM6DSV16X_FIFO_CTRL4) & FIFO_MODE_MASK) == FIFO_CTRL4_STREAM);
+
+    assert(imu.Write_Config(true) == LSM6DSV16X_OK);
+    assert(bus.reg(LSM6DSV16X_CTRL2) == RATE.gyro_odr_code);
+    assert(bus.reg(LSM6DSV16X_FIFO_CTRL3) == (RATE.gyro_odr_code << 4 | RATE.odr_code));
+
+    // Half the ODR, with the gyro at an eighth of that, as CONTROL_RATE can ask.
+    imu.Set_Rate(RATE.odr / 2, 8);
+    assert(imu.Write_Config(true) == LSM6DSV16X_OK);
+    assert(bus.reg(LSM6DSV16X_CTRL1) == RATE.odr_code - 1);
+    assert(bus.reg(LSM6DSV16X_FIFO_CTRL3) == ((RATE.odr_code - 4) << 4 | (RATE.odr_code - 1)));
+}
+
+static void test_done(void *arg, int32_t status)
+{
+    *(int32_t *)arg = status;
+}
+
+/// @brief Exercise LSMExtension over the mock bus, synchronously and with a deferred batch.
+void test_transport()
+{
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static MockBus bus(&sim);
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    LSMExtension imu(&bus);
+
+    // Blocking reads through the stm32duino register context.
+    sim.advance(4000);
+    uint16_t count = 0;
+    assert(imu.Read_FIFO_Data(RATE.max_records, records, &count) == LSM6DSV16X_OK);
+    assert(count > 0);
+    for (int i = 0; i < count; i++)
+    {
+        assert(records[i].tag.tag_sensor == SIM_TAG_XL_NC);
+        assert(records[i].data[0] == sim.value(i, 0));
+    }
+    long next = count;
+
+    // A deferred batch doesn't complete until the bus says so.
+    bus.deferred = true;
+    for (int cycle = 0; cycle < 10; cycle++)
+    {
+        sim.advance(8000 + cycle * RATE.read_interval_usec());
+        int32_t status = 1;
+        assert(imu.Read_FIFO_Batch(RATE.max_records, records, test_done, &status) == LSM6DSV16X_OK);
+        assert(status == 1);
+        bus.complete();
+        assert(status == 0);
+        assert(imu.Finish_FIFO_Batch(&count) == LSM6DSV16X_OK);
+        for (int i = 0; i < count; i++)
+        {
+            if (records[i].tag.tag_sensor != SIM_TAG_XL_NC)
+                continue;
+            assert(records[i].data[2] == sim.value(next, 2));
+            next++;
+        }
+    }
+    printf("Transport test: %ld samples read, FIFO level %d\n", next, sim.fifo_level());
+    bus.deferred = false;
+}
+
+/// @brief Run LSMExtension over SPITransport, with the mock bus decoding the SPI frames.
+void test_spi_transport()
+{
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static MockBus bus(&sim);
+    static SPITransport spi(&bus);
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    LSMExtension imu(&spi);
+
+    long next = 0;
+    for (int cycle = 0; cycle < 10; cycle++)
+    {
+        // Finish_FIFO_Batch must collect reads the bus holds back.
+        bus.bounce = cycle >= 5;
+        sim.advance((cycle + 1) * RATE.read_interval_usec());
+        int32_t status = 1;
+        assert(imu.Read_FIFO_Batch(RATE.max_records, records, test_done, &status) == LSM6DSV16X_OK);
+        assert(status == 0);
+        uint16_t count = 0;
+        assert(imu.Finish_FIFO_Batch(&count) == LSM6DSV16X_OK);
+        for (int i = 0; i < count; i++)
+        {
+            if (records[i].tag.tag_sensor != SIM_TAG_XL_NC)
+                continue;
+            assert(records[i].data[1] == sim.value(next, 1));
+            next++;
+        }
+    }
+    // Each batch is a status frame and a single FIFO burst frame.
+    assert(bus.spi_frames <= 20);
+    printf("SPI transport test: %ld samples in %ld frames, %ld bytes\n", next, bus.spi_frames, bus.bytes);
+}
+
+// Simulated time, for LSMExtension::Set_Clock.
+static int64_t sim_now = 0;
+static int64_t sim_clock() { return sim_now; }
+
+/// @brief Read a simulated sensor through LSMExtension, and check that every
+/// accelerometer sample decodes exactly, in order, with its own tag_cnt.
+/// After an overrun, decoding must resume within FIFO_UNCOMPRESSED_EVERY
+/// samples of the last one lost.
+/// @param stall_at Read to stall before, long enough to overrun, or -1.
+/// @return bus bytes per accelerometer sample.
+static float check_fifo_reads(SimulatedLSM &sim, MockBus &bus, bool gyro, bool compress, int reads, int stall_at)
+{
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    LSMExtension imu(&bus);
+    imu.Set_Clock(sim_clock);
+    if (compress)
+        assert(imu.Enable_FIFO_Compression() == LSM6DSV16X_OK);
+    assert(imu.Write_Config(gyro) == LSM6DSV16X_OK);
+    assert(sim.compressed() == compress);
+
+    long next = 0; // The next accelerometer sample expected.
+    long checked = 0;
+    long gyro_samples = 0;
+    long start_bytes = bus.bytes;
+    int64_t now = 0;
+    for (int r = 0; r < reads; r++)
+    {
+        if (r == stall_at)
+            now += 2000LL * SIM_FIFO_DEPTH * 1000 / RATE.odr;
+        now += RATE.read_interval_usec();
+        long lost = sim.lost();
+        sim.advance(now);
+        sim_now = now;
+        lost = sim.lost() - lost;
+        assert(imu.Read_FIFO_Batch(RATE.max_records, records, [](void *, int32_t) {}, nullptr) == LSM6DSV16X_OK);
+        uint16_t count;
+        assert(imu.Finish_FIFO_Batch(&count) == LSM6DSV16X_OK);
+        assert(count <= RATE.max_records);
+        bool resync = imu.FIFO_Overrun();
+        for (uint16_t i = 0; i < count; i++)
+        {
+            uint8_t tag = records[i].tag.tag_sensor;
+            assert(tag == LSM6DSV16X_XL_NC_TAG || tag == LSM6DSV16X_GY_NC_TAG || fifo_entry_samples(tag) == 0);
+            if (tag == LSM6DSV16X_GY_NC_TAG)
+                gyro_samples++;
+            if (tag != LSM6DSV16X_XL_NC_TAG)
+                continue;
+            if (resync)
+            {
+                // The first sample after the overrun, found by value.  Those
+                // lost are followed by differences from them, which are skipped.
+                long k = next;
+                while (k < sim.samples() && (records[i].data[0] != sim.value(k, 0) ||
+                                             records[i].data[1] != sim.value(k, 1) ||
+                                             records[i].data[2] != sim.value(k, 2)))
+                    k++;
+                assert(k >= next + lost && k <= next + lost + FIFO_UNCOMPRESSED_EVERY);
+                next = k;
+                resync = false;
+            }
+            assert(records[i].tag.tag_cnt == (next & 3));
+            for (int a = 0; a < 3; a++)
+                assert(records[i].data[a] == sim.value(next, a));
+            next++;
+            checked++;
+        }
+    }
+    // All but what is still in the FIFO, or held by the compressor.
+    assert(next >= sim.samples() - sim.fifo_samples() - 2);
+    assert(!gyro || labs(gyro_samples - checked / GYRO_DECIMATION) < RATE.max_records);
+    return (float)(bus.bytes - start_bytes) / checked;
+}
+
+/// @brief Check that compressed FIFO reads decode exactly, for quiet and
+/// swinging signals, that a quiet signal takes half the bus bytes or less,
+/// and that decoding recovers after an overrun.
+void test_fifo_compression()
+{
+    const int reads = 2000;
+    // A quiet sensor, with differences that fit in 5 bits.
+    static SimulatedLSM plain(RATE.odr, 1.0f);
+    static MockBus plain_bus(&plain);
+    plain.set_amplitude(150);
+    float plain_bytes = check_fifo_reads(plain, plain_bus, false, false, reads, -1);
+    static SimulatedLSM quiet(RATE.odr, 1.0f);
+    static MockBus quiet_bus(&quiet);
+    quiet.set_amplitude(150);
+    float quiet_bytes = check_fifo_reads(quiet, quiet_bus, false, true, reads, -1);
+    assert((quiet_bus.reg(LSM6DSV16X_FIFO_CTRL2) & FIFO_CTRL2_UNCOMPR_RATE_MASK) == LSM6DSV16X_CMP_16_TO_1 << 1);
+    assert(quiet.written[LSM6DSV16X_XL_3XC_TAG] > 0);
+
+    // A swinging bell, with gyro, and differences up to 8 bits.
+    static SimulatedLSM swinging(RATE.odr, 1.0f);
+    static MockBus swinging_bus(&swinging);
+    swinging.set_amplitude(2000);
+    swinging.enable_bell(0, 30, 2.0f, 12);
+    float swinging_bytes = check_fifo_reads(swinging, swinging_bus, true, true, reads, -1);
+    assert(swinging.written[LSM6DSV16X_XL_2XC_TAG] > 0 && swinging.written[LSM6DSV16X_GY_3XC_TAG] > 0);
+
+    // A strike, with differences too large to compress, and an overrun.
+    static SimulatedLSM loud(RATE.odr, 1.0f);
+    static MockBus loud_bus(&loud);
+    float loud_bytes = check_fifo_reads(loud, loud_bus, false, true, reads, reads / 2);
+    assert(loud.lost() > 0);
+    assert(loud.written[LSM6DSV16X_XL_NC_T_2_TAG] > 0 && loud.written[LSM6DSV16X_XL_NC_T_1_TAG] > 0);
+
+    printf("FIFO compression: %.1f bus bytes per sample uncompressed, %.1f quiet, %.1f swinging with gyro, %.1f loud\n",
+           plain_bytes, quiet_bytes, swinging_bytes, loud_bytes);
+    assert(quiet_bytes <= plain_bytes / 2);
 }
+#endif
@@ -3,21 +3,77 @@
 #define IMU_H
 
 #include "LSM6DSV16XSensor.h"
+#include "esp_timer.h"
+#include "activity.h"
+#include "compression.h"
+#include "rate.h"
+#include "record.h"
+#include "transport.h"
 
-typedef struct __attribute__((packed)) lsm6dsv16x_fifo_record_t
-{
-    lsm6dsv16x_fifo_data_out_tag_t tag;
-    int16_t data[3];
-} lsm6dsv16x_fifo_record_t;
+// The slowest the sensor ODR runs, as a percentage of nominal, for
+// Read_FIFO_Batch to count the samples certain to have arrived.
+#define FIFO_ODR_MIN_PERCENT 97
 
 class LSMExtension : public LSM6DSV16XSensor
 {
 public:
     using LSM6DSV16XSensor::LSM6DSV16XSensor;
 
+    /// @brief Create a sensor that talks through a Transport instead of TwoWire.
+    explicit LSMExtension(Transport *transport) : LSM6DSV16XSensor((TwoWire *)nullptr)
+    {
+        Use_Transport(transport);
+    }
+
+    /// @brief Route all register access through the transport.
+    void Use_Transport(Transport *transport);
+
     LSM6DSV16XStatusTypeDef FIFO_Get_Data(uint8_t *Data);
     LSM6DSV16XStatusTypeDef FIFO_Get_Tag_And_Data(uint8_t *Data);
     LSM6DSV16XStatusTypeDef Read_FIFO_Data(uint16_t max, lsm6dsv16x_fifo_record_t *records, uint16_t *count);
+
+    /// @brief Queue a FIFO status read and a burst of records as a single batch.
+    /// The burst only covers records certain to be in the FIFO when the status
+    /// is read: those the last status counted and the last burst left, and
+    /// those the ODR must have added since.  So it never reaches past the
+    /// records the status counts, which the status can't tell from those that
+    /// arrive after it.  done is called when the batch completes, possibly from ISR
+    /// context, and then Finish_FIFO_Batch must be called.  With compression,
+    /// at most max / FIFO_COMPRESSION_MAX entries are read, into the end of
+    /// records, and Finish_FIFO_Batch decodes them to the start.
+    LSM6DSV16XStatusTypeDef Read_FIFO_Batch(uint16_t max, lsm6dsv16x_fifo_record_t *records,
+                                            BusDoneCallback done, void *arg);
+    /// @brief Complete a batch started by Read_FIFO_Batch, in the task, once
+    /// done has been called.  The records are only in place after the
+    /// transport collects them (see Transport::collect).
+    /// @param count Count of records read.
+    LSM6DSV16XStatusTypeDef Finish_FIFO_Batch(uint16_t *count);
+    /// @brief Whether the FIFO overran before the last read, so the oldest
+    /// samples were lost.  From the status read with the last batch or
+    /// Read_FIFO_Data.
+    bool FIFO_Overrun() const;
+    /// @brief FIFO entries when the last read started, and those it left.
+    uint16_t FIFO_Level() const { return fifo_level; }
+    uint16_t FIFO_Left() const { return fifo_known; }
+    /// @brief When the last read started, by esp_timer_get_time().
+    int64_t Read_Start() const { return batch_start; }
+    /// @brief Where Read_FIFO_Batch gets the time, esp_timer_get_time() by
+    /// default, so tests on simulated time size bursts as the device does.
+    void Set_Clock(int64_t (*now)()) { clock = now; }
+    /// @brief Samples left in the FIFO after the last read.  One record in
+    /// 32 samples is a timestamp, one in gyro_decimation a gyro sample, and
+    /// one in hub_decimation a hub sample.
+    /// With compression, entries hold a varying number of samples, so this
+    /// is estimated from the last read.
+    uint16_t FIFO_Backlog() const
+    {
+        if (compressed)
+            return decompressor.samples_in(fifo_known);
+        // Records per 32 samples, including gyro and sensor hub records.
+        uint16_t records = 32 + 1 + (gyro_decimation > 0 ? 32 / gyro_decimation : 0) +
+                           (hub_decimation > 0 ? 32 / hub_decimation : 0);
+        return fifo_known * 32 / records;
+    }
     float Get_Rate_Adjustment()
     {
         int8_t adj;
@@ -25,6 +81,61 @@ public:
         return 1.0 + adj * 0.0013;
     }
 
+    /// @brief Write the accelerometer, gyro and FIFO configuration as a few
+    /// register blocks, rather than a read-modify-write per setting.
+    /// Leaves the FIFO empty, in stream mode.
+    /// @param gyro Whether to enable the gyro, and batch it into the FIFO, at
+    /// the ODR over the gyro decimation.
+    LSM6DSV16XStatusTypeDef Write_Config(bool gyro);
+    /// @brief Stream at odr, and batch the gyro at odr / gyro_decimation, from
+    /// the next Write_Config().  SENSOR_ODR and GYRO_DECIMATION until then.
+    /// odr is 1920 Hz times a power of two (see CONTROL_RATE).
+    void Set_Rate(uint16_t odr, uint8_t gyro_decimation)
+    {
+        stream_odr = odr;
+        stream_gyro_decimation = gyro_decimation;
+    }
+
+    /// @brief Have the device compress samples in the FIFO (see compression.h),
+    /// forcing an uncompressed sample every FIFO_UNCOMPRESSED_EVERY.  Reads
+    /// then return one NC record per sample, as without compression.
+    LSM6DSV16XStatusTypeDef Enable_FIFO_Compression();
+    /// @brief Entries decoded, and difference entries skipped after overruns.
+    const FifoDecompressor &Decompressor() const { return decompressor; }
+
+    /// @brief Connect the auxiliary I2C bus to the main bus, or disconnect it,
+    /// so the host can configure a sensor behind the hub (see hub.h).
+    /// Turns the hub master off.
+    LSM6DSV16XStatusTypeDef Set_Sensor_Hub_Pass_Through(bool on);
+    /// @brief Have the sensor hub read the accelerometer of the LSM6DSV16X at
+    /// address (8 bit, as LSM6DSV16X_I2C_ADD_H) every HUB_DECIMATION samples,
+    /// into the FIFO as SENSORHUB_TARGET0 records.
+    LSM6DSV16XStatusTypeDef Enable_Sensor_Hub(uint8_t address);
+
+    /// @brief Run program's UCF lines, which load and start its FSMs or MLC
+    /// trees, then route the interrupts of the outputs it names to INT1 (see
+    /// activity.h).  program must outlive the sensor.
+    LSM6DSV16XStatusTypeDef Load_Program(const ActivityProgram &program);
+    /// @brief Raise INT1, latched, when the acceleration changes by more than
+    /// threshold, in FS/256 (62.5 mg at 16 g), up to 63.
+    LSM6DSV16XStatusTypeDef Enable_Wake_Up(uint8_t threshold);
+    /// @brief Take the wake up detector off INT1, so that while streaming
+    /// only a loaded program raises it.
+    LSM6DSV16XStatusTypeDef Disable_Wake_Up();
+    /// @brief Read what raised INT1, which clears it, and decode it into up
+    /// to ACTIVITY_MAX_EVENTS events.  One transaction, unless a loaded
+    /// program's outputs need reading.
+    LSM6DSV16XStatusTypeDef Read_Activity(ActivityEvent *events, int *count);
+
+    /// @brief Discard the FIFO contents, by cycling through bypass mode.
+    LSM6DSV16XStatusTypeDef FIFO_Flush()
+    {
+        LSM6DSV16XStatusTypeDef status = FIFO_Set_Mode(LSM6DSV16X_BYPASS_MODE);
+        if (status != LSM6DSV16X_OK)
+            return status;
+        return FIFO_Set_Mode(LSM6DSV16X_STREAM_MODE);
+    }
+
     LSM6DSV16XStatusTypeDef Fast()
     {
         LSM6DSV16XStatusTypeDef status = Enable_G();
@@ -54,8 +165,55 @@ public:
 
     // Query the IMU in slow mode.
     void HandleSlow();
+
+    /// @brief Usec FIFO reads have spent on the bus, from submit to
+    /// completion, including any wait for a shared bus.  Wraps.  Updated from
+    /// the bus callback, and read by the logger for metrics (see metrics.h).
+    volatile uint32_t bus_usec = 0;
+    /// @brief Batches whose burst reached past the records in the FIFO, and
+    /// were cut to the level read with them.
+    long short_batches = 0;
+
+private:
+    static void batch_done(void *arg, int32_t status);
+
+    Transport *transport = nullptr;
+
+    // State of the batch in flight.
+    BusTransaction batch[2];
+    uint8_t fifo_status[2] = {0, 0};
+    uint16_t batch_records = 0;
+    lsm6dsv16x_fifo_record_t *batch_out = nullptr; // Where the caller wants the records.
+    lsm6dsv16x_fifo_record_t *batch_in = nullptr;  // Where the burst lands.
+    int32_t batch_status = 0;
+    BusDoneCallback batch_cb = nullptr;
+    void *batch_arg = nullptr;
+    int64_t batch_start = 0; // When the batch was submitted.
+    // Records in the FIFO when the last read started, and known to remain after it.
+    uint16_t fifo_level = 0;
+    uint16_t fifo_known = 0;
+    // When the last status read had certainly finished, by clock, or 0.
+    int64_t status_usec = 0;
+    int64_t (*clock)() = esp_timer_get_time;
+    // Samples per gyro record, or 0 when the gyro isn't batched.
+    uint8_t gyro_decimation = 0;
+    // What Write_Config() streams at (see Set_Rate()).
+    uint16_t stream_odr = RATE.odr;
+    uint8_t stream_gyro_decimation = GYRO_DECIMATION;
+    bool compressed = false;
+    FifoDecompressor decompressor;
+    // Samples per sensor hub record, or 0 without the hub.
+    uint8_t hub_decimation = 0;
+    // The FSM or MLC program loaded, if any.
+    const ActivityProgram *program = nullptr;
 };
 
-LSMExtension init_lsm(TwoWire *wire, uint8_t address = LSM6DSV16X_I2C_ADD_H);
+LSMExtension init_lsm(TwoWire *wire, uint8_t address = LSM6DSV16X_I2C_ADD_H, bool gyro = true, bool compress = false);
+LSMExtension init_lsm(Transport *transport, bool gyro = true, bool compress = false);
+
+void test_batched_config();
+void test_transport();
+void test_spi_transport();
+void test_fifo_compression();
 
 #endif // IMU_H
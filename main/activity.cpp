@@ -0,0 +1,114 @@
+#include <cassert>
+#include <stdio.h>
+
+#include "activity.h"
+#include "IMU.h"
+#include "sim.h"
+
+int decode_activity(const ActivityStatus &status, const ActivityProgram *program, ActivityEvent *events)
+{
+    int n = 0;
+    if (status.wake_up_src & WAKE_UP_SRC_WU_IA)
+        events[n++] = {ACTIVITY_SWING, ACTIVITY_SOURCE_WAKE_UP, 0, (uint8_t)(status.wake_up_src & WAKE_UP_SRC_AXES)};
+    if (program == nullptr)
+        return n;
+    for (int i = 0; i < ACTIVITY_FSMS; i++)
+    {
+        if ((status.fsm_status >> i & 1) && program->fsm_type[i] != ACTIVITY_NONE)
+            events[n++] = {program->fsm_type[i], ACTIVITY_SOURCE_FSM, (uint8_t)i, status.fsm_outs[i]};
+    }
+    // Class 0 is the tree's idle class.
+    for (int i = 0; i < ACTIVITY_MLC_TREES; i++)
+    {
+        if ((status.mlc_status >> i & 1) && program->mlc_type[i] != ACTIVITY_NONE && status.mlc_src[i] != 0)
+            events[n++] = {program->mlc_type[i], ACTIVITY_SOURCE_MLC, (uint8_t)i, status.mlc_src[i]};
+    }
+    return n;
+}
+
+#if SELF_TEST
+// A stand-in for a UCF program: enable FSM 1 and 2 in the embedded bank,
+// with a delay and a poll, as ST's tools generate.
+static const ucf_line_ext_t test_lines[] = {
+    {MEMS_UCF_OP_WRITE, LSM6DSV16X_FUNC_CFG_ACCESS, FUNC_CFG_EMB_FUNC_REG_ACCESS},
+    {MEMS_UCF_OP_WRITE, LSM6DSV16X_EMB_FUNC_EN_B, EMB_FUNC_EN_B_FSM_EN},
+    {MEMS_UCF_OP_WRITE, LSM6DSV16X_FSM_ENABLE, 0x03},
+    {MEMS_UCF_OP_POLL_SET, LSM6DSV16X_FSM_ENABLE, 0x02},
+    {MEMS_UCF_OP_WRITE, LSM6DSV16X_FUNC_CFG_ACCESS, 0x00},
+    {MEMS_UCF_OP_DELAY, 0, 5},
+};
+
+/// @brief Check program loading and interrupt routing against the mock bus
+/// registers, and that an interrupt decodes to the program's events in one
+/// or a few transactions.
+void test_activity()
+{
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static MockBus bus(&sim);
+    LSMExtension imu(&bus);
+    // FSM 1 detects a swing, FSM 2 a strike, and MLC tree 1 a strike.
+    static const ActivityProgram program = {
+        test_lines,
+        sizeof(test_lines) / sizeof(test_lines[0]),
+        {ACTIVITY_SWING, ACTIVITY_STRIKE},
+        {ACTIVITY_STRIKE},
+    };
+
+    assert(imu.Load_Program(program) == LSM6DSV16X_OK);
+    assert(bus.emb_reg(LSM6DSV16X_EMB_FUNC_EN_B) == EMB_FUNC_EN_B_FSM_EN);
+    assert(bus.emb_reg(LSM6DSV16X_FSM_ENABLE) == 0x03);
+    assert(bus.emb_reg(LSM6DSV16X_FSM_INT1) == 0x03);
+    assert(bus.emb_reg(LSM6DSV16X_MLC_INT1) == 0x01);
+    assert(bus.reg(LSM6DSV16X_MD1_CFG) & MD1_CFG_INT1_EMB_FUNC);
+    assert(bus.reg(LSM6DSV16X_FUNCTIONS_ENABLE) & FUNCTIONS_ENABLE_INTERRUPTS);
+    assert((bus.reg(LSM6DSV16X_FUNC_CFG_ACCESS) & FUNC_CFG_EMB_FUNC_REG_ACCESS) == 0);
+
+    assert(imu.Enable_Wake_Up(4) == LSM6DSV16X_OK);
+    assert((bus.reg(LSM6DSV16X_WAKE_UP_THS) & 0x3F) == 4);
+    assert(bus.reg(LSM6DSV16X_WAKE_UP_DUR) & WAKE_UP_DUR_WAKE_THS_W);
+    assert(bus.reg(LSM6DSV16X_TAP_CFG0) & TAP_CFG0_LIR);
+    assert(bus.reg(LSM6DSV16X_MD1_CFG) & MD1_CFG_INT1_WU);
+
+    ActivityEvent events[ACTIVITY_MAX_EVENTS];
+    int count;
+    // Nothing to report, in one transaction.
+    long start = bus.transactions;
+    assert(imu.Read_Activity(events, &count) == LSM6DSV16X_OK);
+    assert(count == 0 && bus.transactions - start == 1);
+
+    // The wake up detector, on Z.
+    bus.set_reg(LSM6DSV16X_WAKE_UP_SRC, WAKE_UP_SRC_WU_IA | 0x01);
+    start = bus.transactions;
+    assert(imu.Read_Activity(events, &count) == LSM6DSV16X_OK);
+    assert(bus.transactions - start == 1);
+    assert(count == 1 && events[0].type == ACTIVITY_SWING && events[0].source == ACTIVITY_SOURCE_WAKE_UP &&
+           events[0].detail == 0x01);
+    bus.set_reg(LSM6DSV16X_WAKE_UP_SRC, 0);
+
+    // FSM 2 and MLC tree 1, with FSM 3, which the program doesn't route.
+    bus.set_reg(LSM6DSV16X_FSM_STATUS_MAINPAGE, 0x06);
+    bus.set_reg(LSM6DSV16X_MLC_STATUS_MAINPAGE, 0x01);
+    bus.set_reg(LSM6DSV16X_FSM_OUTS1 + 1, 0x80, true);
+    bus.set_reg(LSM6DSV16X_MLC1_SRC, 3, true);
+    long reads = bus.transactions;
+    assert(imu.Read_Activity(events, &count) == LSM6DSV16X_OK);
+    reads = bus.transactions - reads;
+    assert((bus.reg(LSM6DSV16X_FUNC_CFG_ACCESS) & FUNC_CFG_EMB_FUNC_REG_ACCESS) == 0);
+    assert(count == 2);
+    assert(events[0].type == ACTIVITY_STRIKE && events[0].source == ACTIVITY_SOURCE_FSM && events[0].slot == 1 &&
+           events[0].detail == 0x80);
+    assert(events[1].type == ACTIVITY_STRIKE && events[1].source == ACTIVITY_SOURCE_MLC && events[1].slot == 0 &&
+           events[1].detail == 3);
+
+    // Streaming, only the program raises INT1.
+    assert(imu.Disable_Wake_Up() == LSM6DSV16X_OK);
+    assert((bus.reg(LSM6DSV16X_MD1_CFG) & (MD1_CFG_INT1_WU | MD1_CFG_INT1_EMB_FUNC)) == MD1_CFG_INT1_EMB_FUNC);
+
+    // Without a program, FSM interrupts aren't decoded.
+    ActivityStatus status = {};
+    status.fsm_status = 0x01;
+    assert(decode_activity(status, nullptr, events) == 0);
+
+    printf("Activity: program loaded, %ld transactions to read an FSM and MLC interrupt\n", reads);
+}
+#endif
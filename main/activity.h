@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+#include "lsm6dsv16x_reg.h"
+
+// Activity detection in the sensor (ACTIVITY_WAKE, see rate.h).  While the
+// bell is still, the sensors run in Slow() mode and the MCU light sleeps.
+// The sensor's wake up detector, and any finite state machine (FSM) or
+// machine learning core (MLC) program loaded into it, raise INT1 on a swing
+// or strike.  The MCU then reads one block of status registers, decodes them
+// into ActivityEvents, and starts streaming.  While streaming, the wake up
+// detector is off INT1, so only a program raises it, and the reader reads
+// its events the same way between reads.  Either way the reader hands the
+// events to the logger, which sends each as
+//
+//     E <index> <type> <source> <slot> <detail>
+//
+// at the merged index the output has reached, or resumes at after a sleep.
+//
+// FSM and MLC programs come from ST's tools as UCF files, converted to C
+// arrays of ucf_line_ext_t.  The types below match ST's generated headers,
+// so those can be included as they are.  A build loads one into imu1, before
+// it first goes into Slow() mode, with
+//   idf.py -DACTIVITY_PROGRAM=swing_fsm.h build
+// where swing_fsm.h, on the include path, defines
+//   static const ActivityProgram activity_program = {lines, count, {...}, {...}};
+// The program's interrupts should be latched (EMB_FUNC_LIR in the UCF), since
+// the reader only looks at INT1 once a period.
+
+#ifndef MEMS_UCF_SHARED_TYPES
+#define MEMS_UCF_SHARED_TYPES
+#define MEMS_UCF_OP_READ 0
+#define MEMS_UCF_OP_WRITE 1
+#define MEMS_UCF_OP_DELAY 2 // data is msec.
+#define MEMS_UCF_OP_POLL_SET 3
+#define MEMS_UCF_OP_POLL_RESET 4
+typedef struct
+{
+    uint8_t address;
+    uint8_t data;
+} ucf_line_t;
+typedef struct
+{
+    uint8_t op;
+    uint8_t address;
+    uint8_t data;
+} ucf_line_ext_t;
+#endif
+
+// FUNCTIONS_ENABLE, TAP_CFG0 and WAKE_UP_DUR fields.
+#define FUNCTIONS_ENABLE_INTERRUPTS 0x80
+#define TAP_CFG0_LIR 0x01 // Latch interrupts until the source is read.
+#define WAKE_UP_DUR_WAKE_THS_W 0x10 // WK_THS LSB is FS/256, rather than FS/64.
+// WAKE_UP_SRC fields.
+#define WAKE_UP_SRC_AXES 0x07
+#define WAKE_UP_SRC_WU_IA 0x08
+// MD1_CFG INT1 routes.
+#define MD1_CFG_INT1_EMB_FUNC 0x02
+#define MD1_CFG_INT1_WU 0x20
+// FUNC_CFG_ACCESS EMB_FUNC_REG_ACCESS, and EMB_FUNC_EN_B fields.
+#define FUNC_CFG_EMB_FUNC_REG_ACCESS 0x80
+#define EMB_FUNC_EN_B_FSM_EN 0x01
+#define EMB_FUNC_EN_B_MLC_EN 0x10
+
+// Seconds without motion or impact in the output tiers (see tiers.h) before
+// the sensors go back to sleep.
+#define ACTIVITY_IDLE_SECONDS 60
+
+// WAKE_UP_SRC to MLC_STATUS_MAINPAGE, read as one block after an interrupt.
+#define ACTIVITY_STATUS_BYTES (LSM6DSV16X_MLC_STATUS_MAINPAGE - LSM6DSV16X_WAKE_UP_SRC + 1)
+
+#define ACTIVITY_FSMS 8
+#define ACTIVITY_MLC_TREES 4
+// Events one status read can decode to.
+#define ACTIVITY_MAX_EVENTS (1 + ACTIVITY_FSMS + ACTIVITY_MLC_TREES)
+
+// Event types.
+#define ACTIVITY_NONE 0
+#define ACTIVITY_SWING 1
+#define ACTIVITY_STRIKE 2
+
+// Event sources.
+#define ACTIVITY_SOURCE_WAKE_UP 0
+#define ACTIVITY_SOURCE_FSM 1
+#define ACTIVITY_SOURCE_MLC 2
+
+/// @brief A swing or strike reported by the sensor.
+struct ActivityEvent
+{
+    uint8_t type;   // ACTIVITY_SWING or ACTIVITY_STRIKE.
+    uint8_t source; // ACTIVITY_SOURCE_*.
+    uint8_t slot;   // FSM or MLC tree, from 0.
+    uint8_t detail; // WAKE_UP_SRC axes, FSM_OUTS, or MLC class.
+};
+
+/// @brief An FSM or MLC program, and the event each of its outputs reports.
+struct ActivityProgram
+{
+    const ucf_line_ext_t *lines;
+    uint16_t count;
+    uint8_t fsm_type[ACTIVITY_FSMS];     // ACTIVITY_* for each FSM's interrupt.
+    uint8_t mlc_type[ACTIVITY_MLC_TREES]; // ACTIVITY_* for each tree's non-zero classes.
+};
+
+/// @brief Sensor registers behind an activity interrupt.
+struct ActivityStatus
+{
+    uint8_t wake_up_src;
+    uint8_t fsm_status;                   // FSM_STATUS_MAINPAGE, a bit per FSM.
+    uint8_t mlc_status;                   // MLC_STATUS_MAINPAGE, a bit per tree.
+    uint8_t fsm_outs[ACTIVITY_FSMS];      // Read only for FSMs that interrupted.
+    uint8_t mlc_src[ACTIVITY_MLC_TREES];  // Read only for trees that interrupted.
+};
+
+/// @brief Decode status into events.  The wake up detector reports a swing.
+/// FSM and MLC interrupts report the type program gives them, and are
+/// ignored without a program.
+/// @return The number of events written, at most ACTIVITY_MAX_EVENTS.
+int decode_activity(const ActivityStatus &status, const ActivityProgram *program, ActivityEvent *events);
+
+void test_activity();
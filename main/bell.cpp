@@ -0,0 +1,180 @@
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bell.h"
+#include "sim.h"
+#include "timing.h"
+
+// atan(2^-i), 2^32 per turn.
+static const uint32_t cordic_atan[16] = {
+    536870912, 316933406, 167458907, 85004756, 42667331, 21354465, 10679838, 5340245,
+    2670163, 1335087, 667544, 333772, 166886, 83443, 41722, 20861};
+
+uint32_t atan2_bam(int32_t y, int32_t x)
+{
+    uint32_t angle = 0;
+    if (x < 0)
+    {
+        // Rotate by half a turn, into the right half plane.
+        x = -x;
+        y = -y;
+        angle = 0x80000000u;
+    }
+    // Inputs are 16 bits, so there is room for 14 more bits of resolution,
+    // including the CORDIC gain of 1.65.
+    x <<= 14;
+    y <<= 14;
+    for (int i = 0; i < 16; i++)
+    {
+        int32_t dx = x >> i;
+        int32_t dy = y >> i;
+        if (y > 0)
+        {
+            x += dy;
+            y -= dx;
+            angle += cordic_atan[i];
+        }
+        else
+        {
+            x -= dy;
+            y += dx;
+            angle -= cordic_atan[i];
+        }
+    }
+    return angle;
+}
+
+// Phase increment per gyro sample, at SENSOR_ODR / GYRO_DECIMATION, for a
+// rate of 1/8 gyro LSB.
+constexpr int64_t GYRO_PHASE_SCALE =
+    (int64_t)(GYRO_MDPS_PER_LSB / 1000.0 / (1 << SFLP_BIAS_FRAC_BITS) / SENSOR_ODR * GYRO_DECIMATION *
+                  4294967296.0 / 360.0 * 65536.0 +
+              0.5);
+
+void BellIntegrator::add_gyro(const int16_t gyro[3])
+{
+    int32_t rate = ((int32_t)gyro[BELL_AXIS] << SFLP_BIAS_FRAC_BITS) - bias;
+    phase += rate * GYRO_PHASE_SCALE * gyro_periods;
+    rate_sum += rate;
+    rate_count++;
+    samples++;
+}
+
+void BellIntegrator::add_gravity(const int16_t gravity[3])
+{
+    uint32_t target = atan2_bam(gravity[(BELL_AXIS + 1) % 3], gravity[(BELL_AXIS + 2) % 3]);
+    if (!aligned)
+    {
+        phase = (uint64_t)target << 16;
+        aligned = true;
+        return;
+    }
+    int32_t error = (int32_t)(target - angle());
+    phase += ((int64_t)error << 16) >> BELL_GRAVITY_SHIFT;
+}
+
+void BellIntegrator::set_bias(const int16_t b[3])
+{
+    bias = b[BELL_AXIS];
+}
+
+void BellIntegrator::update(const lsm6dsv16x_fifo_record_t *records, uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++)
+    {
+        // Records are packed 7 byte structs, so copy the data out aligned
+        // rather than pointing into them.
+        int16_t data[3];
+        memcpy(data, records[i].data, sizeof(data));
+        switch (records[i].tag.tag_sensor)
+        {
+        case LSM6DSV16X_GY_NC_TAG:
+            add_gyro(data);
+            break;
+        case LSM6DSV16X_SFLP_GRAVITY_VECTOR_TAG:
+            add_gravity(data);
+            break;
+        case LSM6DSV16X_SFLP_GYROSCOPE_BIAS_TAG:
+            set_bias(data);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+BellState BellIntegrator::state()
+{
+    BellState s;
+    s.angle = (int16_t)(((int64_t)(int32_t)angle() * 36000) >> 32);
+    // 1/8 LSB is 4.375 mdps, which is 7/160 of 0.1 dps.
+    s.rate = rate_count > 0 ? (int16_t)(rate_sum * 7 / (160 * rate_count)) : 0;
+    rate_sum = 0;
+    rate_count = 0;
+    return s;
+}
+
+#if SELF_TEST
+/// @brief Run the integrator on a simulated swinging bell with a gyro bias,
+/// and check that it tracks the angle.
+void test_bell_integrator()
+{
+    assert(abs((int32_t)atan2_bam(0, 1000)) < 0x10000);
+    assert(abs((int32_t)(atan2_bam(1000, 0) - 0x40000000u)) < 0x10000);
+    assert(abs((int32_t)(atan2_bam(-1000, -1000) - 0xA0000000u)) < 0x10000);
+
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    static BellIntegrator bell;
+    sim.enable_bell(BELL_AXIS, 120.0f, 2.0f, 40);
+
+    const int64_t period = RATE.read_interval_usec();
+    float worst = 0;
+    for (int64_t now = period; now < 20000000; now += period)
+    {
+        sim.advance(now);
+        uint16_t n;
+        while ((n = sim.read_fifo(records, RATE.max_records)) > 0)
+            bell.update(records, n);
+        // Check once the gravity correction has settled.  The last gyro
+        // sample stands for its whole decimation interval, so compare at the
+        // middle of it.
+        if (now > 5000000)
+        {
+            long last_gyro = (sim.samples() - 1) / GYRO_DECIMATION * GYRO_DECIMATION;
+            float truth = sim.bell_angle(last_gyro + GYRO_DECIMATION / 2);
+            float error = fabsf(bell.state().angle / 100.0f - truth);
+            if (error > worst)
+                worst = error;
+        }
+    }
+    printf("Bell integrator: %ld samples, worst error %.3f degrees\n", bell.samples, worst);
+    assert(worst < 0.2f);
+}
+
+/// @brief Report the integrator cost per sample at the configured rate.
+void benchmark_bell()
+{
+    static SimulatedLSM sim(RATE.odr, 1.0f);
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    static BellIntegrator bell;
+    sim.enable_bell(BELL_AXIS, 120.0f, 2.0f, 40);
+
+    const int64_t period = RATE.read_interval_usec();
+    int64_t busy = 0;
+    for (int64_t now = period; now < 10000000; now += period)
+    {
+        sim.advance(now);
+        uint16_t n = sim.read_fifo(records, RATE.max_records);
+        auto start = now_usec();
+        bell.update(records, n);
+        bell.state();
+        busy += now_usec() - start;
+    }
+    printf("Bell benchmark at %d Hz: %.3f usec per sample, %.2f%% of one CPU\n",
+           RATE.odr, (float)busy / bell.samples, 100.0f * busy / 10000000);
+}
+#endif
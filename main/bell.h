@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include "record.h"
+#include "rate.h"
+
+// The bell's rotation axis, in sensor axes (0 = X).  The angle is zero when
+// gravity lies along the following axis, e.g. Z for rotation about X.
+#ifndef BELL_AXIS
+#define BELL_AXIS 0
+#endif
+
+// Gyro sensitivity at FS_G_1000DPS, mdps per LSB.
+#define GYRO_MDPS_PER_LSB 35
+// The SFLP gyro bias is reported at the 125 dps sensitivity, 4.375 mdps/LSB,
+// which is 1/8 of a 1000 dps LSB.
+#define SFLP_BIAS_FRAC_BITS 3
+// Each SFLP gravity vector moves the angle 1/2^n of the way to the gravity
+// angle.  At 15 Hz, 4 gives a time constant of about 1 second.
+#define BELL_GRAVITY_SHIFT 4
+
+/// @brief Bell angle and angular velocity, as output with each merged block.
+struct BellState
+{
+    int16_t angle; // Hundredths of a degree, -18000 to 17999.
+    int16_t rate;  // Tenths of a degree per second, averaged over the block.
+};
+
+/// @brief Fixed point bell angle integrator.
+///
+/// Integrates the bias corrected gyro rate about the bell axis, one sample at
+/// a time, and pulls the result towards the angle of the SFLP gravity vector,
+/// so that integration error doesn't accumulate.  The angle is a 32 bit binary
+/// angle (2^32 per turn) with 16 more fraction bits, so it wraps at a full
+/// turn for free.  A gyro sample costs a multiply and an add, and a gravity
+/// vector a fixed 16 step CORDIC, so the cost per sample is bounded.
+class BellIntegrator
+{
+public:
+    /// @brief Consume the gyro, gravity and bias records from a raw FIFO read.
+    void update(const lsm6dsv16x_fifo_record_t *records, uint16_t count);
+
+    void add_gyro(const int16_t gyro[3]);
+    void add_gravity(const int16_t gravity[3]);
+    /// @param bias SFLP gyro bias, at 125 dps sensitivity.
+    void set_bias(const int16_t bias[3]);
+    /// @brief Integrate each gyro sample over periods of the build's gyro
+    /// rate, SENSOR_ODR / GYRO_DECIMATION, after CONTROL_RATE slows it.
+    void set_gyro_periods(int periods) { gyro_periods = periods; }
+
+    /// @brief The current angle, with the mean rate since the last call.
+    BellState state();
+
+    /// @brief The current angle, 2^32 per turn.
+    uint32_t angle() const { return (uint32_t)(phase >> 16); }
+
+    long samples = 0; // Gyro samples integrated.
+
+private:
+    uint64_t phase = 0;       // Binary angle << 16.
+    int32_t bias = 0;         // Gyro bias, in 1/8 LSB.
+    int64_t rate_sum = 0;     // Sum of corrected gyro, in 1/8 LSB, since state().
+    int32_t rate_count = 0;   // Samples in rate_sum.
+    bool aligned = false;     // Whether a gravity vector has set the angle.
+    int gyro_periods = 1;     // Build gyro periods per gyro sample.
+};
+
+/// @brief Fixed point atan2, 2^32 per turn.
+uint32_t atan2_bam(int32_t y, int32_t x);
+
+void test_bell_integrator();
+void benchmark_bell();
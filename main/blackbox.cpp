@@ -0,0 +1,586 @@
+#include <algorithm>
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "base64_encode.hpp"
+#include "blackbox.h"
+#include "rate.h"
+#include "timing.h"
+
+// Packed read flags.  The capture flags are above these.
+#define BLACKBOX_IMU 1
+#define BLACKBOX_KEYFRAME 2
+#define BLACKBOX_FLAGS_SHIFT 2
+// Reads before the window a pump skips, at most, so a dump of the newest
+// reads doesn't hold up the logger walking the whole ring.
+#define BLACKBOX_SCAN_PER_PUMP 512
+
+void BlackBoxPredictor::reset()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint64_t *v)
+{
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    *v = value;
+    return p;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+void BlackBox::begin(uint8_t *storage, size_t bytes, uint32_t odr, uint32_t read_interval_usec,
+                     CaptureWriter::Sink s, void *ctx)
+{
+    assert(bytes >= 4 * BLACKBOX_MAX_PACKED_BYTES);
+    ring = storage;
+    size = bytes;
+    head = tail = cursor = 0;
+    last_keyframe = 0;
+    since_keyframe = 0;
+    newest = -1;
+    dump_to = -1;
+    header = {CAPTURE_MAGIC, CAPTURE_VERSION, 0, odr, read_interval_usec};
+    sink = s;
+    context = ctx;
+}
+
+/// @brief The position of the read at position, which is past the end of
+/// the ring if there is no room for a read before it.
+uint64_t BlackBox::skip_wrap(uint64_t position) const
+{
+    size_t room = size - position % size;
+    return room < BLACKBOX_MAX_PACKED_BYTES ? position + room : position;
+}
+
+/// @brief The read time a read predicts for the next one from the same imu.
+static int64_t predict_time(const BlackBoxPredictor &predictor, bool imu)
+{
+    return predictor.last_time[imu] + predictor.last_step[imu];
+}
+
+/// @brief Take a read's time as the prediction for the next one.
+static void update_time(BlackBoxPredictor &predictor, bool imu, int64_t read_time, bool keyframe)
+{
+    if (keyframe)
+    {
+        // Both sensors' next reads are predicted from this one.
+        predictor.last_time[0] = predictor.last_time[1] = read_time;
+        return;
+    }
+    predictor.last_step[imu] = read_time - predictor.last_time[imu];
+    predictor.last_time[imu] = read_time;
+}
+
+BlackBox::Packed BlackBox::peek(uint64_t position) const
+{
+    const uint8_t *start = ring + position % size;
+    uint64_t length, count, backlog, time;
+    const uint8_t *p = get_varint(start, &length);
+    Packed packed;
+    packed.bytes = p - start + length;
+    uint8_t flags = *p++;
+    packed.keyframe = flags & BLACKBOX_KEYFRAME;
+    p = get_varint(p, &count);
+    p = get_varint(p, &backlog);
+    packed.count = (uint16_t)count;
+    if (packed.keyframe)
+    {
+        memcpy(&packed.read_time, p, sizeof(packed.read_time));
+    }
+    else
+    {
+        get_varint(p, &time);
+        packed.read_time = predict_time(reader, flags & BLACKBOX_IMU) + unzigzag(time);
+    }
+    return packed;
+}
+
+/// @brief Drop the oldest reads, up to the next keyframe.
+uint64_t BlackBox::drop_keyframe()
+{
+    uint64_t length;
+    do
+    {
+        if (dumping() && tail >= cursor)
+            overtaken++;
+        const uint8_t *start = ring + tail % size;
+        tail = skip_wrap(tail + (get_varint(start, &length) - start) + length);
+        dropped++;
+    } while (tail < head && !(*get_varint(ring + tail % size, &length) & BLACKBOX_KEYFRAME));
+    return tail;
+}
+
+void BlackBox::add(bool imu, int64_t read_time, uint16_t backlog, uint8_t flags, const void *records, uint16_t count)
+{
+    if (ring == nullptr)
+        return;
+    assert(count <= RATE.max_records);
+    uint64_t start = skip_wrap(head);
+
+    // Drop the oldest reads until the largest read fits.
+    while (start + BLACKBOX_MAX_PACKED_BYTES - tail > size)
+    {
+        if (tail >= head)
+        {
+            tail = start;
+            break;
+        }
+        drop_keyframe();
+    }
+    if (tail >= head)
+        tail = start;
+    if (cursor < tail)
+        cursor = tail;
+
+    // A keyframe when the ring is empty, so the tail is always one.
+    bool keyframe = tail == start || since_keyframe >= BLACKBOX_KEYFRAME_READS || start - last_keyframe > size / 16;
+    if (keyframe)
+    {
+        writer.reset();
+        last_keyframe = start;
+        since_keyframe = 0;
+        keyframes++;
+    }
+    since_keyframe++;
+
+    // Packed after the length, which is only known at the end.
+    uint8_t *p = packing;
+    *p++ = (imu ? BLACKBOX_IMU : 0) | (keyframe ? BLACKBOX_KEYFRAME : 0) | flags << BLACKBOX_FLAGS_SHIFT;
+    p = put_varint(p, count);
+    p = put_varint(p, backlog);
+    if (keyframe)
+    {
+        memcpy(p, &read_time, sizeof(read_time));
+        p += sizeof(read_time);
+    }
+    else
+    {
+        p = put_varint(p, zigzag(read_time - predict_time(writer, imu)));
+    }
+    update_time(writer, imu, read_time, keyframe);
+
+    // The predicted tag bits, then the records.
+    uint8_t *predicted = p;
+    memset(predicted, 0, (count + 7) / 8);
+    p += (count + 7) / 8;
+    const uint8_t *in = (const uint8_t *)records;
+    uint8_t *next_tag = writer.next_tag[imu];
+    for (int i = 0; i < count; i++, in += CAPTURE_RECORD_BYTES)
+    {
+        uint8_t tag = in[0];
+        uint8_t &expected = next_tag[writer.last_tag[imu]];
+        if (tag == expected)
+        {
+            predicted[i / 8] |= 1 << i % 8;
+        }
+        else
+        {
+            expected = tag;
+            *p++ = tag;
+        }
+        writer.last_tag[imu] = tag;
+        int16_t axes[3];
+        memcpy(axes, in + 1, sizeof(axes));
+        int16_t *last = writer.last[imu][CAPTURE_TAG_SENSOR(tag)];
+        for (int a = 0; a < 3; a++)
+        {
+            p = put_varint(p, zigzag((int16_t)(uint16_t)(axes[a] - last[a])));
+            last[a] = axes[a];
+        }
+    }
+    size_t length = p - packing;
+    uint8_t *out = put_varint(ring + start % size, length);
+    memcpy(out, packing, length);
+    head = start + (out - (ring + start % size)) + length;
+    assert(head - start <= BLACKBOX_MAX_PACKED_BYTES);
+    newest = read_time;
+    messages++;
+}
+
+void BlackBox::unpack(uint64_t position)
+{
+    uint64_t length, count, backlog, time;
+    const uint8_t *p = get_varint(ring + position % size, &length);
+    uint8_t flags = *p++;
+    bool imu = flags & BLACKBOX_IMU;
+    bool keyframe = flags & BLACKBOX_KEYFRAME;
+    p = get_varint(p, &count);
+    p = get_varint(p, &backlog);
+    int64_t read_time;
+    if (keyframe)
+    {
+        reader.reset();
+        memcpy(&read_time, p, sizeof(read_time));
+        p += sizeof(read_time);
+    }
+    else
+    {
+        p = get_varint(p, &time);
+        read_time = predict_time(reader, imu) + unzigzag(time);
+    }
+    update_time(reader, imu, read_time, keyframe);
+
+    CaptureMessage msg = {read_time, (uint16_t)count, (uint16_t)backlog, (uint8_t)imu,
+                          (uint8_t)(flags >> BLACKBOX_FLAGS_SHIFT), 0};
+    memcpy(unpacked, &msg, sizeof(msg));
+    uint8_t *out = unpacked + sizeof(msg);
+    const uint8_t *predicted = p;
+    p += (count + 7) / 8;
+    uint8_t *next_tag = reader.next_tag[imu];
+    for (unsigned i = 0; i < count; i++, out += CAPTURE_RECORD_BYTES)
+    {
+        uint8_t &expected = next_tag[reader.last_tag[imu]];
+        if (!(predicted[i / 8] & 1 << i % 8))
+            expected = *p++;
+        uint8_t tag = expected;
+        reader.last_tag[imu] = tag;
+        out[0] = tag;
+        int16_t *last = reader.last[imu][CAPTURE_TAG_SENSOR(tag)];
+        for (int a = 0; a < 3; a++)
+        {
+            uint64_t delta;
+            p = get_varint(p, &delta);
+            last[a] = (int16_t)(uint16_t)(last[a] + unzigzag(delta));
+        }
+        memcpy(out + 1, last, 3 * sizeof(int16_t));
+    }
+    memset(out, 0, unpacked + capture_message_bytes(count) - out);
+}
+
+int64_t BlackBox::oldest_usec() const
+{
+    if (tail >= head)
+        return -1;
+    // The tail is a keyframe, with its own time.
+    return peek(tail).read_time;
+}
+
+void BlackBox::request(int64_t from_usec, int64_t to_usec)
+{
+    cursor = tail;
+    dump_from = from_usec;
+    dump_to = to_usec < 0 ? 0 : to_usec;
+    header_sent = false;
+    credit = 0;
+    last_pump = 0;
+}
+
+size_t BlackBox::pump_bytes(size_t budget)
+{
+    if (!dumping())
+        return 0;
+    size_t sent = 0;
+    if (!header_sent)
+    {
+        if (budget < sizeof(header))
+            return 0;
+        sink(&header, sizeof(header), context);
+        sent += sizeof(header);
+        header_sent = true;
+    }
+    int scanned = 0;
+    while (cursor < head)
+    {
+        Packed packed = peek(cursor);
+        if (packed.read_time > dump_to)
+            break;
+        // Reads before the window are unpacked too, to keep the prediction.
+        bool send = packed.read_time >= dump_from;
+        size_t bytes = capture_message_bytes(packed.count);
+        if (send && sent + bytes > budget)
+            break;
+        unpack(cursor);
+        cursor = skip_wrap(cursor + packed.bytes);
+        if (!send)
+        {
+            if (++scanned == BLACKBOX_SCAN_PER_PUMP)
+                break;
+            continue;
+        }
+        sink(unpacked, bytes, context);
+        sent += bytes;
+        dumped++;
+    }
+    dump_bytes += sent;
+    // Done once the reads have passed the window.
+    if (cursor < head ? peek(cursor).read_time > dump_to : newest >= dump_to)
+    {
+        printf("Black box: dumped %ld reads, %llu bytes, %ld overtaken\n", dumped, (unsigned long long)dump_bytes,
+               overtaken);
+        dump_to = -1;
+    }
+    return sent;
+}
+
+void BlackBox::pump(int64_t now)
+{
+    if (!dumping())
+        return;
+    if (last_pump > 0)
+        credit += (now - last_pump) * (BLACKBOX_DUMP_BYTES_PER_SEC / 1e6);
+    last_pump = now;
+    // Keep no more than a couple of reads in hand, so the dump doesn't burst.
+    credit = std::min(credit, (double)(sizeof(CaptureHeader) + 2 * BLACKBOX_MAX_READ_BYTES));
+    credit -= pump_bytes((size_t)credit);
+}
+
+bool BlackBox::command(const char *line, int64_t now)
+{
+    float ago, seconds;
+    int n = sscanf(line, "dump %f %f", &ago, &seconds);
+    if (n < 1)
+        return false;
+    int64_t from = now - (int64_t)(ago * 1e6f);
+    int64_t to = n == 2 ? from + (int64_t)(seconds * 1e6f) : now;
+    request(from, to);
+    printf("Black box: dumping %.1f to %.1f seconds, holding %.1f to %.1f\n", from / 1e6, to / 1e6,
+           oldest_usec() / 1e6, newest / 1e6);
+    return true;
+}
+
+void print_dump(const void *data, size_t bytes, void *context)
+{
+    static unsigned char text[BLACKBOX_DUMP_TEXT_BYTES];
+    assert(bytes <= BLACKBOX_MAX_READ_BYTES);
+    encode_base64((const unsigned char *)data, bytes, text);
+    int n = printf("K %s\n", text);
+    if (context != nullptr)
+        *(uint32_t *)context += n;
+}
+
+#if SELF_TEST
+static void append_to_vector(const void *data, size_t bytes, void *context)
+{
+    auto *v = (std::vector<uint8_t> *)context;
+    v->insert(v->end(), (const uint8_t *)data, (const uint8_t *)data + bytes);
+}
+
+/// @brief Read n of the test: n % (max_records + 1) records of bytes from n,
+/// every millisecond.
+static void add_read(BlackBox &box, long n, uint8_t *records)
+{
+    int count = n % (RATE.max_records + 1);
+    for (int i = 0; i < count * CAPTURE_RECORD_BYTES; i++)
+        records[i] = (uint8_t)(n * 7 + i);
+    box.add(n & 1, n * 1000, (uint16_t)n, n % 5 == 0 ? CAPTURE_OVERRUN : 0, records, count);
+}
+
+/// @brief Check a dump parses as a capture of consecutive test reads from
+/// first, or increasing ones if the writer overtook it.
+/// @return The number of reads.
+static long check_dump(const std::vector<uint8_t> &dump, long first, long last, bool consecutive)
+{
+    CaptureReader reader;
+    assert(reader.open(dump.data(), dump.size()) && reader.header().odr == RATE.odr);
+    long expected = first;
+    long reads = 0;
+    while (const CaptureMessage *msg = reader.next())
+    {
+        long n = msg->read_time / 1000;
+        assert(consecutive ? n == expected : n >= expected);
+        assert(n <= last && msg->count == n % (RATE.max_records + 1) && msg->backlog == (uint16_t)n);
+        assert(msg->imu == (n & 1) && (msg->flags == CAPTURE_OVERRUN) == (n % 5 == 0));
+        for (int i = 0; i < msg->count * CAPTURE_RECORD_BYTES; i++)
+            assert(CaptureReader::records(msg)[i] == (uint8_t)(n * 7 + i));
+        expected = n + 1;
+        reads++;
+    }
+    assert(reader.position() == dump.size());
+    return reads;
+}
+
+/// @brief Sensor like records for one read: accelerometer samples of a slow
+/// swing, with a few LSB of noise, and a timestamp every 32 samples.
+/// @return The number of records.
+static int sensor_read(uint8_t *records, bool imu, long first, int samples)
+{
+    static uint32_t seed = 1;
+    int n = 0;
+    for (long s = first; s < first + samples; s++)
+    {
+        uint8_t *r = records + n++ * CAPTURE_RECORD_BYTES;
+        if (s % 32 == 0)
+        {
+            // LSM6DSV16X_TIMESTAMP_TAG, with the sample as the time.
+            int16_t t[3] = {(int16_t)s, (int16_t)(s >> 16), 0};
+            r[0] = 0x04 << 3;
+            memcpy(r + 1, t, sizeof(t));
+            r = records + n++ * CAPTURE_RECORD_BYTES;
+        }
+        float phase = 2 * 3.14159265f * s / (2.0f * RATE.odr);
+        int16_t axes[3];
+        for (int a = 0; a < 3; a++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            int noise = (int)(seed >> 29) - 4;
+            axes[a] = (int16_t)(2048 * sinf(phase + a + imu) + noise);
+        }
+        r[0] = CAPTURE_TAG_XL_NC << 3 | (s & 3) << 1;
+        memcpy(r + 1, axes, sizeof(axes));
+    }
+    return n;
+}
+
+/// @brief Record into a small heap ring, many times over, and dump windows
+/// from it: all of it, part of it, while the writer overtakes the dump, and
+/// paced.  Then pack sensor like reads, and check they unpack exactly.
+void test_blackbox()
+{
+    const size_t bytes = 40 * BLACKBOX_MAX_READ_BYTES + 40;
+    uint8_t *storage = (uint8_t *)malloc(bytes);
+    static uint8_t records[RATE.max_records * CAPTURE_RECORD_BYTES];
+    static std::vector<uint8_t> dump;
+    static BlackBox box;
+    box.begin(storage, bytes, RATE.odr, RATE.read_interval_usec(), append_to_vector, &dump);
+    assert(box.capacity() == bytes && box.oldest_usec() == -1);
+
+    long n = 0;
+    for (; n < 2000; n++)
+        add_read(box, n, records);
+    assert(box.messages == n && box.dropped > 0 && box.newest_usec() == (n - 1) * 1000);
+    long oldest = box.oldest_usec() / 1000;
+    assert(oldest == box.dropped);
+
+    // Everything held.
+    box.request(0, box.newest_usec());
+    assert(box.pump_bytes(SIZE_MAX) > 0 && !box.dumping());
+    assert(check_dump(dump, oldest, n - 1, true) == n - oldest);
+
+    // A window in the middle.
+    dump.clear();
+    long from = oldest + 10, to = n - 20;
+    box.request(from * 1000, to * 1000);
+    box.pump_bytes(SIZE_MAX);
+    assert(!box.dumping() && check_dump(dump, from, to, true) == to - from + 1);
+
+    // A window into the future, dumped a read at a time while the writer
+    // runs ahead, and overtakes the dump.
+    dump.clear();
+    box.request(box.oldest_usec(), (n + 299) * 1000);
+    for (int i = 0; i < 300; i++)
+    {
+        box.pump_bytes(i % 3 == 0 ? BLACKBOX_MAX_READ_BYTES : 0);
+        add_read(box, n++, records);
+    }
+    box.pump_bytes(SIZE_MAX);
+    assert(box.overtaken > 0 && !box.dumping());
+    long reads = check_dump(dump, 0, n - 1, false);
+    assert(reads + box.overtaken >= 300);
+
+    // Paced: BLACKBOX_DUMP_BYTES_PER_SEC, to within a read, over a simulated
+    // 100 msec, which is less than the ring holds.
+    assert(box.capacity() > BLACKBOX_DUMP_BYTES_PER_SEC / 10 + 2 * BLACKBOX_MAX_READ_BYTES);
+    dump.clear();
+    uint64_t before = box.dump_bytes;
+    box.request(0, box.newest_usec());
+    int64_t t0 = 5000000;
+    for (int64_t t = t0; t <= t0 + 100000; t += 1000)
+        box.pump(t);
+    long paced = box.dump_bytes - before;
+    assert(box.dumping() && labs(paced - BLACKBOX_DUMP_BYTES_PER_SEC / 10) <= (long)BLACKBOX_MAX_READ_BYTES);
+
+    // Commands.
+    assert(box.command("dump 0.5", (n + 10) * 1000) && box.dumping());
+    assert(!box.command("bogus", 0));
+
+    // Sensor like reads, in a ring that holds a fraction of them, dump as
+    // exactly the end of the same reads written as a capture.
+    free(storage);
+    const size_t sensor_bytes = 64 * 1024;
+    storage = (uint8_t *)malloc(sensor_bytes);
+    box.begin(storage, sensor_bytes, RATE.odr, RATE.read_interval_usec(), append_to_vector, &dump);
+    std::vector<uint8_t> capture;
+    CaptureWriter writer;
+    writer.begin(RATE.odr, RATE.read_interval_usec(), append_to_vector, &capture);
+    long sample[2] = {};
+    for (int i = 0; i < 4000; i++)
+    {
+        bool imu = i & 1;
+        int count = sensor_read(records, imu, sample[imu], RATE.samples_per_read);
+        sample[imu] += RATE.samples_per_read;
+        int64_t t = i * RATE.read_interval_usec() / 2;
+        box.add(imu, t, (uint16_t)(i % 7), i == 3500 ? CAPTURE_DELAYED : 0, records, count);
+        writer.add(imu, t, (uint16_t)(i % 7), i == 3500 ? CAPTURE_DELAYED : 0, records, count);
+    }
+    dump.clear();
+    box.request(0, box.newest_usec());
+    box.pump_bytes(SIZE_MAX);
+    assert(box.dropped > 0 && box.keyframes > 1 && dump.size() > sizeof(CaptureHeader));
+    size_t reads_bytes = dump.size() - sizeof(CaptureHeader);
+    assert(memcmp(dump.data(), capture.data(), sizeof(CaptureHeader)) == 0);
+    assert(memcmp(dump.data() + sizeof(CaptureHeader), capture.data() + capture.size() - reads_bytes, reads_bytes) == 0);
+    // Under 4 bytes a record with its share of the read, where the capture
+    // takes 8 and a share of 16.
+    CaptureReader reader;
+    assert(reader.open(dump.data(), dump.size()));
+    long held = 0;
+    while (const CaptureMessage *msg = reader.next())
+        held += msg->count;
+    float per_record = (float)box.used() / held;
+    printf("Black box: %ld reads bit exact, %.2f bytes per record packed\n", box.dumped, per_record);
+    assert(per_record < 4.0f);
+    free(storage);
+    dump.clear();
+    dump.shrink_to_fit();
+}
+
+/// @brief Time packing sensor like reads, and report how long a ring in the
+/// Feather's 2 MB of PSRAM holds.
+void benchmark_blackbox()
+{
+    const size_t bytes = 256 * 1024;
+    uint8_t *storage = (uint8_t *)malloc(bytes);
+    static uint8_t records[RATE.max_records * CAPTURE_RECORD_BYTES];
+    static BlackBox box;
+    box.begin(storage, bytes, RATE.odr, RATE.read_interval_usec(), append_to_vector, nullptr);
+    const int iterations = 20000;
+    long sample[2] = {};
+    int64_t busy = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        bool imu = i & 1;
+        int count = sensor_read(records, imu, sample[imu], RATE.samples_per_read);
+        sample[imu] += RATE.samples_per_read;
+        int64_t start = now_usec();
+        box.add(imu, i * RATE.read_interval_usec() / 2, 0, 0, records, count);
+        busy += now_usec() - start;
+    }
+    // Two reads per read interval, one per sensor.
+    float per_second = (float)box.used() / (box.messages - box.dropped) * 2e6f / RATE.read_interval_usec();
+    printf("Black box benchmark: %.3f usec per %d sample read, %.1f kB a second, %.0f seconds in 2 MB\n",
+           (float)busy / iterations, RATE.samples_per_read, per_second / 1000,
+           (2 * 1024 * 1024 - BLACKBOX_RESERVE_BYTES) / per_second);
+    free(storage);
+}
+#endif
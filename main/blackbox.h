@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "capture.h"
+#include "rate.h"
+
+// Black box recorder.  The merger passes every raw read, as it would to a
+// CaptureWriter, to a BlackBox, which packs it into a ring of several
+// megabytes in PSRAM, dropping the oldest reads to make room.  Nothing is
+// sent until a dump is requested, e.g. with the console command
+// `dump <seconds ago> [<seconds>]`.  The dump is a capture (see capture.h) of
+// the reads in the window, unpacked again, sent as `K <base64>` lines, a
+// header then one read per line, at BLACKBOX_DUMP_BYTES_PER_SEC, so it shares
+// the link with the merged output.
+// The host writes them to blackbox.cap, which remerge reads.
+//
+// In the ring, a read is a few bytes of header, with its time as the change
+// from the time predicted from the sensor's last two reads, then its records.  A record's tag byte is left out
+// when it is the one that followed the previous tag last time, and each axis
+// is the change from the last record with the same tag_sensor, as a variable
+// length integer.  The sensor noise is a few LSB, so a record takes about 4
+// bytes with its share of the read, instead of 7 and a share of a 16 byte
+// header, and at 1920 Hz the ring fills at about 16 kB a second (see
+// benchmark_blackbox()).  The Feather's 2 MB of PSRAM holds about 2 minutes,
+// and 8 MB about 8.  Keyframes, with their absolute time,
+// start the prediction again, so a dump can start at one, and the oldest
+// reads are dropped a keyframe to the next.
+
+// Largest ring.  With less PSRAM, the ring takes what there is, less
+// BLACKBOX_RESERVE_BYTES.
+#define BLACKBOX_BYTES (8 * 1024 * 1024)
+#define BLACKBOX_RESERVE_BYTES (256 * 1024)
+// Capture bytes a second a dump sends.  As base64, about 40 kB of text, under
+// half of the 921600 baud console.
+#define BLACKBOX_DUMP_BYTES_PER_SEC 30000
+// Reads between keyframes, at most, about a second.  There is also one at
+// least every 1/16 of the ring.
+#define BLACKBOX_KEYFRAME_READS 256
+
+// The largest read, with its header and padding, as a dump sends it.
+constexpr size_t BLACKBOX_MAX_READ_BYTES =
+    sizeof(CaptureMessage) + (RATE.max_records * CAPTURE_RECORD_BYTES + 7) / 8 * 8;
+// The largest read in the ring: the length, flags, count, backlog and time,
+// the predicted tag bits, then a tag byte and three 3 byte axes per record.
+constexpr size_t BLACKBOX_MAX_PACKED_BYTES = 3 + 1 + 3 + 3 + 10 + (RATE.max_records + 7) / 8 + 10 * RATE.max_records;
+
+/// @brief What packing predicts from the reads before, kept alike by the
+/// writer and the dump.  Per imu, the tag byte that followed each tag byte
+/// last time, the last axes of each tag_sensor, and the next read time, a
+/// step on from the last.
+struct BlackBoxPredictor
+{
+    uint8_t next_tag[2][256];
+    uint8_t last_tag[2];
+    int16_t last[2][32][3];
+    int64_t last_time[2];
+    int64_t last_step[2];
+
+    void reset();
+};
+
+/// @brief A ring of packed raw reads, and the dump of a window as a capture.
+///
+/// Reads never straddle the end of the ring.  One starts again at the
+/// beginning when there is less than BLACKBOX_MAX_PACKED_BYTES left before
+/// the end.  Positions count bytes since begin(), so the dump can tell when
+/// the writer has overtaken it.  Everything runs on the logger task.
+class BlackBox
+{
+public:
+    /// @brief Record into storage.
+    /// @param sink Where dumps go.  See print_dump().
+    void begin(uint8_t *storage, size_t bytes, uint32_t odr, uint32_t read_interval_usec,
+               CaptureWriter::Sink sink, void *context);
+    bool active() const { return ring != nullptr; }
+
+    /// @brief Pack a raw read into the ring.  The arguments are as for
+    /// CaptureWriter::add().
+    void add(bool imu, int64_t read_time, uint16_t backlog, uint8_t flags, const void *records, uint16_t count);
+
+    /// @brief Dump the reads with read times from from_usec to to_usec,
+    /// replacing any dump in progress.
+    void request(int64_t from_usec, int64_t to_usec);
+    bool dumping() const { return dump_to >= 0; }
+
+    /// @brief Send the dump, paced at BLACKBOX_DUMP_BYTES_PER_SEC.
+    void pump(int64_t now);
+    /// @brief Send the dump's header, if it hasn't gone, then whole reads, up
+    /// to budget bytes in all.
+    /// @return Bytes sent.
+    size_t pump_bytes(size_t budget);
+
+    /// @brief Parse a console command.  `dump <seconds ago> [<seconds>]`
+    /// requests the window from seconds ago, for seconds, or up to now.
+    /// @return false if the line isn't a black box command.
+    bool command(const char *line, int64_t now);
+
+    /// @brief Read times of the oldest and newest reads held, or -1 if none.
+    int64_t oldest_usec() const;
+    int64_t newest_usec() const { return newest; }
+    size_t capacity() const { return size; }
+    /// @brief Bytes the reads held take in the ring.
+    size_t used() const { return tail < head ? head - tail : 0; }
+
+    long messages = 0;       // Reads recorded.
+    long dropped = 0;        // Reads dropped to make room.
+    long keyframes = 0;      // Reads packed as keyframes.
+    long dumped = 0;         // Reads sent by dumps.
+    long overtaken = 0;      // Reads a dump lost to the writer.
+    uint64_t dump_bytes = 0; // Bytes sent by dumps.
+
+private:
+    /// @brief A packed read's header.
+    struct Packed
+    {
+        size_t bytes;
+        bool keyframe;
+        uint16_t count;
+        int64_t read_time;
+    };
+    Packed peek(uint64_t position) const;
+    /// @brief Unpack the read at position into unpacked, as a capture message.
+    void unpack(uint64_t position);
+    uint64_t skip_wrap(uint64_t position) const;
+    uint64_t drop_keyframe();
+
+    uint8_t *ring = nullptr;
+    size_t size = 0;
+    uint64_t head = 0; // Where the next read goes.
+    uint64_t tail = 0; // The oldest read, a keyframe.
+    uint64_t last_keyframe = 0;
+    long since_keyframe = 0;
+    int64_t newest = -1;
+    CaptureHeader header = {};
+    BlackBoxPredictor writer;
+    uint8_t packing[BLACKBOX_MAX_PACKED_BYTES];
+
+    CaptureWriter::Sink sink = nullptr;
+    void *context = nullptr;
+    uint64_t cursor = 0;   // The next read to dump.
+    int64_t dump_from = 0;
+    int64_t dump_to = -1;  // -1 when not dumping.
+    bool header_sent = false;
+    int64_t last_pump = 0;
+    double credit = 0;     // Bytes the dump may send now.
+    BlackBoxPredictor reader;
+    alignas(8) uint8_t unpacked[BLACKBOX_MAX_READ_BYTES];
+};
+
+/// @brief The longest line print_dump() prints, as base64, less the `K `.
+constexpr size_t BLACKBOX_DUMP_TEXT_BYTES = (BLACKBOX_MAX_READ_BYTES + 2) / 3 * 4 + 1;
+
+/// @brief Dump sink that prints each piece as a `K <base64>` line.  context,
+/// if not nullptr, is a uint32_t count of bytes printed, which it adds to.
+void print_dump(const void *data, size_t bytes, void *context);
+
+void test_blackbox();
+void benchmark_blackbox();
@@ -0,0 +1,112 @@
+#include <cassert>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "capture.h"
+
+void CaptureWriter::begin(uint32_t odr, uint32_t read_interval_usec, Sink s, void *ctx)
+{
+    sink = s;
+    context = ctx;
+    messages = 0;
+    offset = 0;
+    CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION, 0, odr, read_interval_usec};
+    sink(&header, sizeof(header), context);
+    offset += sizeof(header);
+}
+
+void CaptureWriter::add(bool imu, int64_t read_time, uint16_t backlog, uint8_t flags, const void *records, uint16_t count)
+{
+    if (sink == nullptr)
+        return;
+    static const uint8_t padding[8] = {};
+    CaptureMessage msg = {read_time, count, backlog, (uint8_t)imu, flags, 0};
+    size_t bytes = count * CAPTURE_RECORD_BYTES;
+    sink(&msg, sizeof(msg), context);
+    sink(records, bytes, context);
+    size_t pad = capture_message_bytes(count) - sizeof(msg) - bytes;
+    if (pad > 0)
+        sink(padding, pad, context);
+    offset += capture_message_bytes(count);
+    messages++;
+}
+
+bool CaptureReader::open(const void *data, size_t length)
+{
+    base = (const uint8_t *)data;
+    size = length;
+    offset = sizeof(CaptureHeader);
+    return size >= sizeof(CaptureHeader) && header().magic == CAPTURE_MAGIC && header().version == CAPTURE_VERSION;
+}
+
+const CaptureMessage *CaptureReader::next()
+{
+    if (offset + sizeof(CaptureMessage) > size)
+        return nullptr;
+    const CaptureMessage *msg = (const CaptureMessage *)(base + offset);
+    size_t bytes = capture_message_bytes(msg->count);
+    if (offset + bytes > size)
+        return nullptr;
+    offset += bytes;
+    return msg;
+}
+
+#if SELF_TEST
+static void append_to_vector(const void *data, size_t bytes, void *context)
+{
+    auto *v = (std::vector<uint8_t> *)context;
+    v->insert(v->end(), (const uint8_t *)data, (const uint8_t *)data + bytes);
+}
+
+/// @brief Write messages of every padding length, read them back, and check
+/// the tag counter against known losses.
+void test_capture()
+{
+    static CaptureWriter writer;
+    static std::vector<uint8_t> file;
+    uint8_t records[10 * CAPTURE_RECORD_BYTES];
+    file.clear();
+    writer.begin(1920, 4000, append_to_vector, &file);
+    for (int n = 0; n <= 10; n++)
+    {
+        for (int i = 0; i < n * CAPTURE_RECORD_BYTES; i++)
+            records[i] = n + i;
+        writer.add(n & 1, 1000 * n, n, n == 3 ? CAPTURE_OVERRUN : 0, records, n);
+    }
+    assert(writer.offset == file.size());
+
+    CaptureReader reader;
+    assert(reader.open(file.data(), file.size()));
+    assert(reader.header().odr == 1920);
+    for (int n = 0; n <= 10; n++)
+    {
+        const CaptureMessage *msg = reader.next();
+        assert(msg != nullptr && msg->count == n && msg->backlog == n && msg->read_time == 1000 * n);
+        assert(msg->imu == (n & 1) && (msg->flags == CAPTURE_OVERRUN) == (n == 3));
+        for (int i = 0; i < n * CAPTURE_RECORD_BYTES; i++)
+            assert(CaptureReader::records(msg)[i] == (uint8_t)(n + i));
+    }
+    assert(reader.next() == nullptr);
+    // A message cut off by the end of the data is not returned.
+    assert(reader.open(file.data(), file.size() - 1));
+    for (int n = 0; n < 10; n++)
+        assert(reader.next() != nullptr);
+    assert(reader.next() == nullptr);
+
+    // Sample k has tag_cnt k & 3.  Samples 1, 2, then 5, so 3 and 4 were lost.
+    TagCounter tags;
+    assert(tags.next(1) == 0);
+    assert(tags.next(2) == 0);
+    assert(tags.next(1) == 2);
+    assert(tags.next(2) == 0);
+    // An overrun that lost 7 samples looks like 3 from the tags.
+    assert(TagCounter::resolve(7, 3) == 7);
+    assert(TagCounter::resolve(6, 3) == 7);
+    assert(TagCounter::resolve(8, 3) == 7);
+    assert(TagCounter::resolve(-2, 1) == 1);
+
+    file.clear();
+    file.shrink_to_fit();
+}
+#endif
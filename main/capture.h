@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared by the firmware and the host tools, so only standard headers here.
+//
+// A capture is the raw input to the merger: a CaptureHeader, then each
+// LoggerMsg as a CaptureMessage followed by its FIFO records, 7 bytes each as
+// read from the sensor, padded to 8 bytes.  Offline tools can re-merge a
+// capture with more care than the device can afford (see host/remerge.cpp).
+
+#define CAPTURE_MAGIC 0x31435346u // "FSC1"
+#define CAPTURE_VERSION 1
+
+// FIFO record layout: a tag byte, then three little endian int16.
+#define CAPTURE_RECORD_BYTES 7
+#define CAPTURE_TAG_SENSOR(tag) ((tag) >> 3)
+#define CAPTURE_TAG_CNT(tag) (((tag) >> 1) & 3)
+// LSM6DSV16X_XL_NC_TAG
+#define CAPTURE_TAG_XL_NC 2
+
+// CaptureMessage flags.
+#define CAPTURE_OVERRUN 1
+#define CAPTURE_DELAYED 2
+
+struct CaptureHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t odr;
+    uint32_t read_interval_usec;
+};
+
+struct CaptureMessage
+{
+    int64_t read_time; // usec, at the end of the read.
+    uint16_t count;    // Records that follow.
+    uint16_t backlog;  // Samples left in the FIFO.
+    uint8_t imu;       // 1 for imu1 (left), 0 for imu2 (right).
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(CaptureHeader) % 8 == 0 && sizeof(CaptureMessage) % 8 == 0,
+              "Capture structures must keep 8 byte alignment");
+
+/// @brief Counts the samples lost between accelerometer records from their 2
+/// bit tag_cnt.  This is the tag alignment the merger uses, shared so offline
+/// tools count gaps exactly the same way.
+class TagCounter
+{
+public:
+    /// @brief Samples missing just before a record with this tag_cnt.
+    int next(int cnt)
+    {
+        int missing = next_cnt >= 0 ? (cnt - next_cnt) & 3 : 0;
+        next_cnt = (cnt + 1) & 3;
+        return missing;
+    }
+
+    /// @brief After an overrun the tags only give the loss mod 4.  Take the
+    /// count nearest the clock fit's prediction that agrees with them, which
+    /// is exact while the prediction is within 2 samples.
+    static long resolve(long predicted, int tag_missing)
+    {
+        int d = (tag_missing - predicted) & 3;
+        if (d >= 2)
+            d -= 4;
+        long missing = predicted + d;
+        return missing < 0 ? tag_missing : missing;
+    }
+
+private:
+    int next_cnt = -1; // Expected tag_cnt of the next sample, or -1 before the first.
+};
+
+/// @brief Writes raw messages to a sink, as RecordingWriter does.
+class CaptureWriter
+{
+public:
+    typedef void (*Sink)(const void *data, size_t bytes, void *context);
+
+    /// @brief Start a capture, and send its header.
+    void begin(uint32_t odr, uint32_t read_interval_usec, Sink sink, void *context);
+    bool active() const { return sink != nullptr; }
+
+    /// @param records count FIFO records, CAPTURE_RECORD_BYTES each.
+    void add(bool imu, int64_t read_time, uint16_t backlog, uint8_t flags, const void *records, uint16_t count);
+    void end() { sink = nullptr; }
+
+    long messages = 0;
+    uint64_t offset = 0; // Bytes sent.
+
+private:
+    Sink sink = nullptr;
+    void *context = nullptr;
+};
+
+/// @brief Walks the messages of a capture in memory, e.g. a mapped file.
+class CaptureReader
+{
+public:
+    bool open(const void *data, size_t size);
+    const CaptureHeader &header() const { return *(const CaptureHeader *)base; }
+
+    /// @brief The next message, or nullptr at the end, or at a message cut off
+    /// by the end of the data.
+    const CaptureMessage *next();
+    static const uint8_t *records(const CaptureMessage *msg) { return (const uint8_t *)(msg + 1); }
+
+    /// @brief Bytes from the start of the capture to the next message.
+    size_t position() const { return offset; }
+
+private:
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+};
+
+/// @brief Bytes a message with count records takes, including its header and padding.
+inline size_t capture_message_bytes(uint16_t count)
+{
+    return sizeof(CaptureMessage) + (count * CAPTURE_RECORD_BYTES + 7) / 8 * 8;
+}
+
+void test_capture();
@@ -0,0 +1,69 @@
+#include <math.h>
+#include <stdio.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "clock_model.h"
+#include "rate.h"
+
+#define CLOCK_NAMESPACE "clock"
+#define CLOCK_KEY "model"
+
+ClockModel seed_clock_model(float left_adjustment, float right_adjustment)
+{
+    // The adjustment scales the ODR, so it divides the sample period.
+    float nominal = 1e6f / RATE.odr;
+    ClockModel model;
+    model.odr = RATE.odr;
+    model.left_period = nominal / left_adjustment;
+    model.right_period = nominal / right_adjustment;
+    model.skew = model.right_period / model.left_period - 1.0f;
+    return model;
+}
+
+static bool open_nvs(nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err == ESP_OK)
+        err = nvs_open(CLOCK_NAMESPACE, mode, handle);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND)
+        printf("NVS open failed: %s\n", esp_err_to_name(err));
+    return err == ESP_OK;
+}
+
+bool load_clock_model(ClockModel *model)
+{
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READONLY, &handle))
+        return false;
+    size_t len = sizeof(*model);
+    esp_err_t err = nvs_get_blob(handle, CLOCK_KEY, model, &len);
+    nvs_close(handle);
+    return err == ESP_OK && len == sizeof(*model) && model->odr == RATE.odr;
+}
+
+bool save_clock_model(const ClockModel &model)
+{
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle))
+        return false;
+    esp_err_t err = nvs_set_blob(handle, CLOCK_KEY, &model, sizeof(model));
+    if (err == ESP_OK)
+        err = nvs_commit(handle);
+    nvs_close(handle);
+    if (err != ESP_OK)
+        printf("Clock model save failed: %s\n", esp_err_to_name(err));
+    return err == ESP_OK;
+}
+
+bool clock_model_plausible(const ClockModel &saved, const ClockModel &seed)
+{
+    return saved.odr == seed.odr &&
+           fabsf(saved.left_period / seed.left_period - 1.0f) < 0.005f &&
+           fabsf(saved.right_period / seed.right_period - 1.0f) < 0.005f;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Weight of a seeded slope in the TimeFitter, in units of sample variance.
+// About the variance of 40 msec of reads, so real data takes over quickly.
+#define CLOCK_PRIOR_WEIGHT 1e4f
+
+/// @brief The fitted sample clocks of the two sensors, saved in NVS so that
+/// the merger can start aligned output right after boot, instead of waiting
+/// for the fitters to converge.
+struct ClockModel
+{
+    uint16_t odr;       // ODR the model was fitted at.
+    float left_period;  // usec per sample, imu1.
+    float right_period; // usec per sample, imu2.
+    float skew;         // right_period / left_period - 1.
+};
+
+/// @brief A model from the factory ODR trim, as reported by Get_Rate_Adjustment.
+ClockModel seed_clock_model(float left_adjustment, float right_adjustment);
+
+/// @brief Load the saved model, if there is one for the current ODR.
+bool load_clock_model(ClockModel *model);
+
+/// @brief Save the model to NVS.
+bool save_clock_model(const ClockModel &model);
+
+/// @brief Whether a saved model is consistent with the seed.  The trim is only
+/// good to about 0.13%, so anything further off belongs to other hardware.
+bool clock_model_plausible(const ClockModel &saved, const ClockModel &seed);
+
+/// @brief Seed the logger's merger, before the reader starts.
+void seed_merger(const ClockModel &model);
+
+/// @brief Save the logger's merger's fitted model, if it has one.  An NVS
+/// write stalls the flash cache, and with it any task running from flash, for
+/// milliseconds, so only call this when the sensors aren't streaming: going
+/// idle, or at shutdown.
+bool save_merger_clock_model();
@@ -0,0 +1,238 @@
+#include <cassert>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression.h"
+
+int fifo_entry_samples(uint8_t tag, bool *gyro)
+{
+    int samples;
+    bool g = false;
+    switch (tag)
+    {
+    case LSM6DSV16X_GY_NC_TAG:
+    case LSM6DSV16X_GY_NC_T_1_TAG:
+    case LSM6DSV16X_GY_NC_T_2_TAG:
+        g = true;
+        samples = 1;
+        break;
+    case LSM6DSV16X_XL_NC_TAG:
+    case LSM6DSV16X_XL_NC_T_1_TAG:
+    case LSM6DSV16X_XL_NC_T_2_TAG:
+        samples = 1;
+        break;
+    case LSM6DSV16X_GY_2XC_TAG:
+        g = true;
+        samples = 2;
+        break;
+    case LSM6DSV16X_XL_2XC_TAG:
+        samples = 2;
+        break;
+    case LSM6DSV16X_GY_3XC_TAG:
+        g = true;
+        samples = 3;
+        break;
+    case LSM6DSV16X_XL_3XC_TAG:
+        samples = 3;
+        break;
+    default:
+        samples = 0;
+    }
+    if (gyro != nullptr)
+        *gyro = g;
+    return samples;
+}
+
+static void set_tag(lsm6dsv16x_fifo_record_t &out, uint8_t tag, uint8_t cnt)
+{
+    memset(&out.tag, 0, sizeof(out.tag));
+    out.tag.tag_sensor = tag;
+    out.tag.tag_cnt = cnt & 3;
+}
+
+static void put(lsm6dsv16x_fifo_record_t &out, uint8_t tag, uint8_t cnt, const void *data)
+{
+    set_tag(out, tag, cnt);
+    memcpy(out.data, data, sizeof(out.data));
+}
+
+/// @brief Pack two samples as int8 differences, from prev and then from a.
+static void pack_2x(lsm6dsv16x_fifo_record_t &out, const int16_t prev[3], const int16_t a[3], const int16_t b[3])
+{
+    int8_t *d = (int8_t *)&out.data;
+    for (int i = 0; i < 3; i++)
+    {
+        d[i] = a[i] - prev[i];
+        d[3 + i] = b[i] - a[i];
+    }
+}
+
+/// @brief Whether every axis of b - a fits in a signed field of bits.
+static bool fits(const int16_t a[3], const int16_t b[3], int bits)
+{
+    int limit = 1 << (bits - 1);
+    for (int i = 0; i < 3; i++)
+    {
+        int d = b[i] - a[i];
+        if (d < -limit || d >= limit)
+            return false;
+    }
+    return true;
+}
+
+uint8_t FifoCompressor::tag(uint8_t xl_tag) const
+{
+    if (!gyro)
+        return xl_tag;
+    // The gyro's compressed tags are the accelerometer's plus 4.
+    return xl_tag == LSM6DSV16X_XL_NC_TAG ? LSM6DSV16X_GY_NC_TAG : xl_tag + 4;
+}
+
+int FifoCompressor::add(long slot, const int16_t data[3], lsm6dsv16x_fifo_record_t out[3])
+{
+    uint8_t t = slot & 3;
+    int n = 0;
+    if (!valid || slot % FIFO_UNCOMPRESSED_EVERY == 0)
+    {
+        // Flush the held samples, slots t-held to t-1, then this one uncompressed.
+        if (held == 2 && fits(last, pending[0], 8) && fits(pending[0], pending[1], 8))
+        {
+            pack_2x(out[n], last, pending[0], pending[1]);
+            set_tag(out[n++], tag(LSM6DSV16X_XL_2XC_TAG), t);
+        }
+        else
+            for (int i = 0; i < held; i++)
+                put(out[n++], tag(held - i == 2 ? LSM6DSV16X_XL_NC_T_2_TAG : LSM6DSV16X_XL_NC_T_1_TAG), t,
+                    pending[i]);
+        put(out[n++], tag(LSM6DSV16X_XL_NC_TAG), t, data);
+        memcpy(last, data, sizeof(last));
+        valid = true;
+        held = 0;
+        return n;
+    }
+    if (held < 2)
+    {
+        memcpy(pending[held++], data, sizeof(pending[0]));
+        return 0;
+    }
+
+    // Three samples, slots t-2 to t.
+    if (fits(last, pending[0], 5) && fits(pending[0], pending[1], 5) && fits(pending[1], data, 5))
+    {
+        const int16_t *samples[4] = {last, pending[0], pending[1], data};
+        uint8_t *b = (uint8_t *)&out[0].data;
+        for (int j = 0; j < 3; j++)
+        {
+            uint16_t word = 0;
+            for (int i = 0; i < 3; i++)
+                word |= ((samples[j + 1][i] - samples[j][i]) & 0x1F) << (5 * i);
+            b[2 * j] = word & 0xFF;
+            b[2 * j + 1] = word >> 8;
+        }
+        set_tag(out[0], tag(LSM6DSV16X_XL_3XC_TAG), t);
+        memcpy(last, data, sizeof(last));
+        held = 0;
+    }
+    else if (fits(last, pending[0], 8) && fits(pending[0], pending[1], 8))
+    {
+        pack_2x(out[0], last, pending[0], pending[1]);
+        set_tag(out[0], tag(LSM6DSV16X_XL_2XC_TAG), t);
+        memcpy(last, pending[1], sizeof(last));
+        memcpy(pending[0], data, sizeof(pending[0]));
+        held = 1;
+    }
+    else
+    {
+        put(out[0], tag(LSM6DSV16X_XL_NC_T_2_TAG), t, pending[0]);
+        memcpy(last, pending[0], sizeof(last));
+        memcpy(pending[0], pending[1], sizeof(pending[0]));
+        memcpy(pending[1], data, sizeof(pending[1]));
+    }
+    return 1;
+}
+
+void FifoDecompressor::reset()
+{
+    streams[0].valid = false;
+    streams[1].valid = false;
+}
+
+uint16_t FifoDecompressor::samples_in(uint16_t n) const
+{
+    if (last_entries == 0)
+        return n;
+    return (uint32_t)n * last_xl_samples / last_entries;
+}
+
+uint16_t FifoDecompressor::decode(const lsm6dsv16x_fifo_record_t *in, uint16_t n, lsm6dsv16x_fifo_record_t *out)
+{
+    uint16_t count = 0;
+    uint16_t xl_samples = 0;
+    for (uint16_t i = 0; i < n; i++)
+    {
+        // A copy, since decoding in place may overwrite the entry.
+        lsm6dsv16x_fifo_record_t entry = in[i];
+        uint8_t tag = entry.tag.tag_sensor;
+        bool gyro;
+        int samples = fifo_entry_samples(tag, &gyro);
+        if (samples == 0)
+        {
+            out[count++] = entry;
+            continue;
+        }
+        entries++;
+        Stream &s = streams[gyro];
+        uint8_t nc = gyro ? LSM6DSV16X_GY_NC_TAG : LSM6DSV16X_XL_NC_TAG;
+        uint8_t t = entry.tag.tag_cnt;
+        const uint8_t *b = (const uint8_t *)&entry.data;
+        if (samples == 1)
+        {
+            int offset = tag == LSM6DSV16X_XL_NC_T_2_TAG || tag == LSM6DSV16X_GY_NC_T_2_TAG   ? 2
+                         : tag == LSM6DSV16X_XL_NC_T_1_TAG || tag == LSM6DSV16X_GY_NC_T_1_TAG ? 1
+                                                                                              : 0;
+            memcpy(s.last, &entry.data, sizeof(s.last));
+            s.valid = true;
+            put(out[count++], nc, t - offset, s.last);
+        }
+        else if (!s.valid)
+        {
+            // The reference sample was lost.
+            skipped++;
+            continue;
+        }
+        else if (samples == 2)
+        {
+            // Slots t-2 and t-1, three int8 differences each.
+            for (int j = 0; j < 2; j++)
+            {
+                for (int a = 0; a < 3; a++)
+                    s.last[a] = (int16_t)(s.last[a] + (int8_t)b[3 * j + a]);
+                put(out[count++], nc, t - 2 + j, s.last);
+            }
+        }
+        else
+        {
+            // Slots t-2 to t, a 16 bit word each, of three 5 bit differences.
+            for (int j = 0; j < 3; j++)
+            {
+                uint16_t word = b[2 * j] | b[2 * j + 1] << 8;
+                for (int a = 0; a < 3; a++)
+                {
+                    int d = (word >> (5 * a)) & 0x1F;
+                    s.last[a] = (int16_t)(s.last[a] + ((d ^ 0x10) - 0x10));
+                }
+                put(out[count++], nc, t - 2 + j, s.last);
+            }
+        }
+        this->samples += samples;
+        if (!gyro)
+            xl_samples += samples;
+    }
+    if (n > 0)
+    {
+        last_entries = n;
+        last_xl_samples = xl_samples;
+    }
+    return count;
+}
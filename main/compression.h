@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include "record.h"
+
+// With compression on, each FIFO entry carries one to three samples of one
+// sensor.  Its tag_cnt is the time slot t it was written in.  NC is the
+// sample of slot t, NC_T_1 and NC_T_2 the samples of slots t-1 and t-2, 2xC
+// holds slots t-2 and t-1 as 8 bit differences, and 3xC holds slots t-2 to t
+// as 5 bit differences, each from the sample before.
+
+// FIFO_CTRL2 fields.
+#define FIFO_CTRL2_COMPR_RT_EN 0x40
+#define FIFO_CTRL2_UNCOMPR_RATE_MASK 0x06
+// The device forces an uncompressed sample every 16 (UNCOMPR_RATE 2,
+// LSM6DSV16X_CMP_16_TO_1), so after an overrun the decoder has a new
+// reference within 16 samples.
+#define FIFO_UNCOMPRESSED_EVERY 16
+// Samples per entry at best (3xC).  Compressed reads are limited to a third
+// of the buffer, so they always decode in place.
+#define FIFO_COMPRESSION_MAX 3
+
+/// @brief Samples carried by a FIFO entry with this tag, 0 for anything but
+/// accelerometer and gyro samples.
+/// @param gyro Set to whether they are gyro samples.
+int fifo_entry_samples(uint8_t tag, bool *gyro = nullptr);
+
+/// @brief The device's compression of one sensor's samples, for the simulator.
+/// Samples are held until three can go in one entry, and written
+/// uncompressed when their differences don't fit, or on every
+/// FIFO_UNCOMPRESSED_EVERY'th slot.
+class FifoCompressor
+{
+public:
+    explicit FifoCompressor(bool gyro) : gyro(gyro) {}
+
+    /// @brief Add the sample for time slot slot.
+    /// @return the number of entries, 0 to 3, written to out.
+    int add(long slot, const int16_t data[3], lsm6dsv16x_fifo_record_t out[3]);
+
+private:
+    /// @brief The tag for this sensor, given the accelerometer's.
+    uint8_t tag(uint8_t xl_tag) const;
+
+    bool gyro;
+    bool valid = false;      // Whether last holds a sample.
+    int16_t last[3] = {};    // Last sample written, the reference for differences.
+    int16_t pending[2][3];   // Samples held for the next entry, oldest first.
+    int held = 0;
+};
+
+/// @brief Turns compressed FIFO entries back into one NC record per sample,
+/// with the tag_cnt of the sample's own time slot, so the rest of the
+/// pipeline (gap detection, the merger and the bell integrator) sees the same
+/// records as without compression.  Other records pass through.
+class FifoDecompressor
+{
+public:
+    /// @brief Decode n entries into out.  Decodes in place if in starts at
+    /// out + 2 * n or later, since each entry only writes its samples once it
+    /// has been read, and no entry holds more than three.
+    /// @return the number of records written.
+    uint16_t decode(const lsm6dsv16x_fifo_record_t *in, uint16_t n, lsm6dsv16x_fifo_record_t *out);
+
+    /// @brief Forget the reference samples, after entries were lost.
+    /// Differences are skipped until the next uncompressed sample.
+    void reset();
+
+    /// @brief Estimate the accelerometer samples in entries FIFO entries,
+    /// from the ratio in the last decode.
+    uint16_t samples_in(uint16_t entries) const;
+
+    long entries = 0;  // Sample entries decoded.
+    long samples = 0;  // Samples decoded, both sensors.
+    long skipped = 0;  // Difference entries skipped for want of a reference.
+
+private:
+    struct Stream
+    {
+        bool valid = false;
+        int16_t last[3] = {};
+    };
+
+    Stream streams[2]; // Accelerometer, gyro.
+    uint16_t last_entries = 0;    // Entries in the last decode.
+    uint16_t last_xl_samples = 0; // Accelerometer samples in the last decode.
+};
+
@@ -0,0 +1,344 @@
+#include <cassert>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "control.h"
+
+static void print_ack(const void *data, size_t bytes, void *)
+{
+    fwrite(data, 1, bytes, stdout);
+}
+
+ControlChannel::ControlChannel(uint16_t odr, uint8_t gyro_decimation, bool fixed_rate)
+    : build_odr(odr), build_gyro_decimation(gyro_decimation), fixed_rate(fixed_rate), sink(print_ack)
+{
+    active.odr = odr;
+    active.gyro_decimation = gyro_decimation;
+}
+
+static bool power_of_two(uint32_t n)
+{
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+/// @brief Whether the sensors have an ODR code for odr: 1920 Hz times a power
+/// of two, from 7.5 Hz to 7680 Hz.
+static bool sensor_odr(uint32_t odr)
+{
+    if (odr < 8 || odr > 7680)
+        return false;
+    return odr >= 1920 ? odr % 1920 == 0 && power_of_two(odr / 1920) : 1920 % odr == 0 && power_of_two(1920 / odr);
+}
+
+uint8_t control_crc8(const uint8_t *data, size_t bytes)
+{
+    uint8_t crc = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++)
+            crc = crc & 0x80 ? (uint8_t)(crc << 1 ^ 0x07) : (uint8_t)(crc << 1);
+    }
+    return crc;
+}
+
+size_t control_frame(uint8_t seq, uint8_t command, const void *payload, uint8_t length, uint8_t *out)
+{
+    assert(length <= CONTROL_MAX_PAYLOAD);
+    out[0] = CONTROL_SYNC;
+    out[1] = seq;
+    out[2] = command;
+    out[3] = length;
+    if (length > 0)
+        memcpy(out + 4, payload, length);
+    out[4 + length] = control_crc8(out + 1, 3 + length);
+    return 5 + length;
+}
+
+bool ControlChannel::feed(uint8_t byte, int64_t now)
+{
+    if (received > 0 && now - frame_start > CONTROL_FRAME_TIMEOUT_USEC)
+    {
+        // The rest of the last frame never came.
+        errors++;
+        received = 0;
+    }
+    if (received == 0)
+    {
+        if (byte != CONTROL_SYNC)
+            return false;
+        frame_start = now;
+    }
+    frame[received++] = byte;
+    if (received < 4)
+        return true;
+    uint8_t length = frame[3];
+    if (length > CONTROL_MAX_PAYLOAD)
+    {
+        // Not a frame we could have sent.
+        ack(frame[1], CONTROL_BAD_LENGTH, -1, active);
+        resync();
+        return true;
+    }
+    if (received < 5u + length)
+        return true;
+    if (control_crc8(frame + 1, 3 + length) != frame[4 + length])
+    {
+        ack(frame[1], CONTROL_BAD_CRC, -1, active);
+        resync();
+        return true;
+    }
+    received = 0;
+    execute(frame[1], frame[2], frame + 4, length);
+    return true;
+}
+
+void ControlChannel::resync()
+{
+    // A frame may start after the bad one's sync byte, e.g. when line noise
+    // looked like a sync byte.
+    errors++;
+    uint8_t rest[sizeof(frame)];
+    size_t count = received - 1;
+    memcpy(rest, frame + 1, count);
+    received = 0;
+    for (size_t i = 0; i < count; i++)
+        feed(rest[i], frame_start);
+}
+
+void ControlChannel::execute(uint8_t seq, uint8_t command, const uint8_t *payload, uint8_t length)
+{
+    static const uint8_t lengths[] = {0, 1, 1, 1, 3};
+    uint8_t status = CONTROL_OK;
+    OutputSettings next = pending_count > 0 ? pending : active;
+    if (command >= sizeof(lengths))
+        status = CONTROL_UNKNOWN;
+    else if (length != lengths[command])
+        status = CONTROL_BAD_LENGTH;
+    else if (pending_count == CONTROL_MAX_PENDING)
+        status = CONTROL_BUSY;
+    else if (command == CONTROL_OUTPUTS)
+    {
+        // Every full rate block, as base64, is 4/3 of 12 bytes a sample.
+        if (payload[0] & ~(OUTPUT_FULL_WINDOWS | OUTPUT_MIDDLE | OUTPUT_SLOW | OUTPUT_FULL_ALL))
+            status = CONTROL_RANGE;
+        else if ((payload[0] & OUTPUT_FULL_ALL) && next.odr * 16 > CONTROL_LINK_BYTES_PER_SEC / 2)
+            status = CONTROL_RANGE;
+        else
+            next.outputs = payload[0];
+    }
+    else if (command == CONTROL_CHANNELS)
+    {
+        if (payload[0] & ~OUTPUT_ALL_CHANNELS)
+            status = CONTROL_RANGE;
+        else
+            next.channels = payload[0];
+    }
+    else if (command == CONTROL_TRACE)
+    {
+        if (payload[0] > TRACE_READS)
+            status = CONTROL_RANGE;
+        else
+            next.trace = payload[0];
+    }
+    else if (command == CONTROL_RATE)
+    {
+        // The rate profile sizes the reader, merger and output buffers for
+        // the build's rates (see rate.h).  Slower rates, and sparser gyro,
+        // fit in them.
+        uint16_t odr = payload[0] | payload[1] << 8;
+        uint8_t decimation = payload[2];
+        if (!sensor_odr(odr) || !power_of_two(decimation) || decimation > 8)
+            status = CONTROL_RANGE;
+        else if (fixed_rate || odr > build_odr || odr * CONTROL_MAX_SLOWDOWN < build_odr ||
+                 decimation < build_gyro_decimation)
+            status = CONTROL_UNSUPPORTED;
+        else if (rate_change())
+            status = CONTROL_BUSY; // One rate change at a time.
+        else if ((next.outputs & OUTPUT_FULL_ALL) && odr * 16 > CONTROL_LINK_BYTES_PER_SEC / 2)
+            status = CONTROL_RANGE;
+        else
+        {
+            next.odr = odr;
+            next.gyro_decimation = decimation;
+        }
+    }
+
+    if (status != CONTROL_OK)
+    {
+        errors++;
+        ack(seq, status, -1, pending_count > 0 ? pending : active);
+        return;
+    }
+    frames++;
+    pending = next;
+    pending_seq[pending_count++] = seq;
+}
+
+bool ControlChannel::apply(long index)
+{
+    if (pending_count == 0)
+        return false;
+    active = pending;
+    for (int i = 0; i < pending_count; i++)
+        ack(pending_seq[i], CONTROL_OK, index, active);
+    pending_count = 0;
+    return true;
+}
+
+void ControlChannel::ack(uint8_t seq, uint8_t status, long index, const OutputSettings &now)
+{
+    char line[64];
+    int n = snprintf(line, sizeof(line), "C %u %u %ld %u %u %u %u %u\n", seq, status, index, now.outputs,
+                     now.channels, now.trace, now.odr, now.gyro_decimation);
+    sink(line, n, context);
+}
+
+bool parse_control_ack(const char *line, ControlAck *ack)
+{
+    unsigned outputs, channels, trace, odr, decimation;
+    int used = 0;
+    if (sscanf(line, "C %d %d %ld %u %u %u %u %u%n", &ack->seq, &ack->status, &ack->index, &outputs, &channels,
+               &trace, &odr, &decimation, &used) != 8)
+        return false;
+    ack->settings.outputs = outputs;
+    ack->settings.channels = channels;
+    ack->settings.trace = trace;
+    ack->settings.odr = odr;
+    ack->settings.gyro_decimation = decimation;
+    return line[used] == '\0' || line[used] == '\n' || line[used] == '\r';
+}
+
+#if SELF_TEST
+static void append_to_string(const void *data, size_t bytes, void *context)
+{
+    ((std::string *)context)->append((const char *)data, bytes);
+}
+
+/// @brief Feed a frame a byte at a time, and return the acks it produced.
+/// Acks from later calls, e.g. apply(), go to the same string.
+static std::string send(ControlChannel &control, const uint8_t *frame, size_t bytes, int64_t now = 0)
+{
+    static std::string acks;
+    acks.clear();
+    control.set_sink(append_to_string, &acks);
+    for (size_t i = 0; i < bytes; i++)
+        assert(control.feed(frame[i], now));
+    return acks;
+}
+
+/// @brief Check framing, each command, rejection, the block boundary, and
+/// recovery from a garbled or cut off frame.
+void test_control()
+{
+    static ControlChannel control(1920, 4);
+    uint8_t frame[5 + CONTROL_MAX_PAYLOAD];
+    ControlAck ack;
+    static std::string acks;
+
+    // Text isn't taken.
+    assert(!control.feed('d', 0) && !control.feed('\n', 0));
+
+    // Accepted commands wait for a block boundary, and are acknowledged there.
+    uint8_t outputs = OUTPUT_SLOW | OUTPUT_FULL_ALL;
+    assert(send(control, frame, control_frame(1, CONTROL_OUTPUTS, &outputs, 1, frame)).empty());
+    uint8_t channels = 0x07;
+    assert(send(control, frame, control_frame(2, CONTROL_CHANNELS, &channels, 1, frame)).empty());
+    assert(control.settings().outputs == OUTPUT_DEFAULT);
+    control.set_sink(append_to_string, &acks);
+    assert(control.apply(640) && !control.apply(648));
+    assert(acks == "C 1 0 640 12 7 1 1920 4\nC 2 0 640 12 7 1 1920 4\n");
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 1 && ack.index == 640);
+    assert(ack.settings.outputs == outputs && ack.settings.channels == channels);
+    assert(control.settings().outputs == outputs && control.settings().channels == channels);
+
+    // Rejections are acknowledged straight away, with the settings unchanged.
+    uint8_t trace = 7;
+    acks = send(control, frame, control_frame(3, CONTROL_TRACE, &trace, 1, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 3 && ack.status == CONTROL_RANGE && ack.index == -1);
+    assert(ack.settings.outputs == outputs);
+    uint8_t rate[3] = {0x00, 0x0F, 4}; // 3840 Hz.
+    acks = send(control, frame, control_frame(4, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_UNSUPPORTED);
+    rate[0] = 0xE8, rate[1] = 0x03; // 1000 Hz, which the sensors don't have.
+    acks = send(control, frame, control_frame(4, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_RANGE);
+    rate[0] = 0x78, rate[1] = 0x00; // 120 Hz, slower than CONTROL_MAX_SLOWDOWN allows.
+    acks = send(control, frame, control_frame(4, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_UNSUPPORTED);
+    rate[0] = 0x80, rate[1] = 0x07, rate[2] = 2; // Denser gyro than the build's.
+    acks = send(control, frame, control_frame(4, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_UNSUPPORTED);
+    rate[2] = 4; // 1920 Hz, the build's.
+    assert(send(control, frame, control_frame(5, CONTROL_RATE, rate, 3, frame)).empty());
+    assert(!control.rate_change());
+    acks = send(control, frame, control_frame(6, 99, nullptr, 0, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_UNKNOWN);
+    acks = send(control, frame, control_frame(7, CONTROL_TRACE, nullptr, 0, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_BAD_LENGTH);
+
+    // A corrupted frame, then a good one.
+    trace = TRACE_READS;
+    size_t n = control_frame(8, CONTROL_TRACE, &trace, 1, frame);
+    frame[4] ^= 0x10;
+    acks = send(control, frame, n);
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 8 && ack.status == CONTROL_BAD_CRC);
+    assert(send(control, frame, control_frame(9, CONTROL_TRACE, &trace, 1, frame)).empty());
+
+    // Half a frame, then nothing for longer than the timeout: the next frame
+    // still goes through.
+    send(control, frame, 3, 1000);
+    n = control_frame(10, CONTROL_PING, nullptr, 0, frame);
+    assert(send(control, frame, n, 1000 + 2 * CONTROL_FRAME_TIMEOUT_USEC).empty());
+
+    // Noise that looks like the start of a frame, straight before a frame.
+    uint8_t noisy[3 + sizeof(frame)] = {CONTROL_SYNC, 0xFF, 0x00};
+    n = 3 + control_frame(11, CONTROL_PING, nullptr, 0, noisy + 3);
+    acks = send(control, noisy, n);
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 0xFF && ack.status == CONTROL_BAD_LENGTH);
+
+    acks.clear();
+    control.set_sink(append_to_string, &acks);
+    assert(control.apply(-1) && control.settings().trace == TRACE_READS);
+    assert(acks == "C 5 0 -1 12 7 2 1920 4\nC 9 0 -1 12 7 2 1920 4\nC 10 0 -1 12 7 2 1920 4\n"
+                   "C 11 0 -1 12 7 2 1920 4\n");
+
+    // A slower rate, with sparser gyro, is held as a rate change, and a
+    // second one waits for it.
+    rate[0] = 0xC0, rate[1] = 0x03, rate[2] = 8; // 960 Hz.
+    assert(send(control, frame, control_frame(12, CONTROL_RATE, rate, 3, frame)).empty());
+    assert(control.rate_change() && control.requested().odr == 960 && control.requested().gyro_decimation == 8);
+    acks = send(control, frame, control_frame(13, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_BUSY && ack.settings.odr == 960);
+    acks.clear();
+    control.set_sink(append_to_string, &acks);
+    assert(control.apply(1024) && !control.rate_change());
+    assert(acks == "C 12 0 1024 12 7 2 960 8\n");
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.settings.odr == 960 && ack.settings.gyro_decimation == 8);
+
+    // Too many pending.
+    for (int i = 0; i < CONTROL_MAX_PENDING; i++)
+        assert(send(control, frame, control_frame(20 + i, CONTROL_PING, nullptr, 0, frame)).empty());
+    acks = send(control, frame, control_frame(99, CONTROL_PING, nullptr, 0, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_BUSY);
+    assert(control.apply(0));
+
+    // Every full rate block doesn't fit the link at 7680 Hz, but does at 1920 Hz.
+    static ControlChannel fast(7680, 4);
+    acks = send(fast, frame, control_frame(1, CONTROL_OUTPUTS, &outputs, 1, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_RANGE);
+    rate[0] = 0x80, rate[1] = 0x07, rate[2] = 4;
+    assert(send(fast, frame, control_frame(2, CONTROL_RATE, rate, 3, frame)).empty());
+    assert(send(fast, frame, control_frame(3, CONTROL_OUTPUTS, &outputs, 1, frame)).empty());
+    assert(fast.apply(0) && fast.settings().odr == 1920 && fast.settings().outputs == outputs);
+
+    // Through the sensor hub, the rate is fixed.
+    static ControlChannel hub(1920, 4, true);
+    acks = send(hub, frame, control_frame(1, CONTROL_RATE, rate, 3, frame));
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.status == CONTROL_UNSUPPORTED);
+
+    printf("Control: %ld frames accepted, %ld rejected\n", control.frames, control.errors);
+    control.set_sink(print_ack, nullptr);
+}
+#endif
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared by the firmware and the host tools, so only standard headers here.
+//
+// Runtime control over the serial RX path.  A command is a binary frame:
+//
+//     CONTROL_SYNC <seq> <command> <length> <payload, length bytes> <crc8>
+//
+// with the CRC-8 (polynomial 0x07) over seq to the end of the payload.  The
+// sync byte isn't ASCII, so frames and console text lines (e.g. `dump 30`,
+// see blackbox.h) share the port.  Each frame is acknowledged in-band, in the
+// output stream, with
+//
+//     C <seq> <status> <index> <outputs> <channels> <trace> <odr> <gyro decimation>
+//
+// Accepted settings take effect at a block boundary, and index is the merged
+// index of the first block output with them, so the host can line up the
+// change with the data.  Rejected frames, and frames before merging starts,
+// are acknowledged straight away, with index -1.  The last five fields are
+// the settings the command leaves in effect.
+//
+// A rate change stops the sensors, so it waits at a block boundary for the
+// reader to take them down, and the merger starts afresh at the new rate, at
+// the next recording chunk, as after a sleep (see Merger::restart()).  Other
+// settings accepted meanwhile take effect with it.
+
+#define CONTROL_SYNC 0xC5
+#define CONTROL_MAX_PAYLOAD 8
+// Accepted commands waiting for a block boundary.  More are rejected with
+// CONTROL_BUSY.
+#define CONTROL_MAX_PENDING 8
+// A frame not finished within this is dropped, so a lost byte can't swallow
+// the console.
+#define CONTROL_FRAME_TIMEOUT_USEC 100000
+// The link, 8 * 115200 baud, in bytes a second.  Full rate output of every
+// block must fit in half of it.
+#define CONTROL_LINK_BYTES_PER_SEC (8 * 115200 / 10)
+// CONTROL_RATE can slow the sensors to the build's ODR over this, at the
+// slowest.  Reads stay as large, so the fitters' time constants stretch with
+// the period, to about 30 seconds.
+#define CONTROL_MAX_SLOWDOWN 8
+
+enum ControlCommand : uint8_t
+{
+    CONTROL_PING = 0,     // No payload.  Acknowledges with the settings.
+    CONTROL_OUTPUTS = 1,  // uint8 OUTPUT_* mask.
+    CONTROL_CHANNELS = 2, // uint8 mask of the six merged channels, side 0 x first.
+    CONTROL_TRACE = 3,    // uint8 TRACE_* level.
+    CONTROL_RATE = 4,     // uint16 ODR in Hz, uint8 gyro decimation.  At most the
+                          // build's ODR, at least its gyro decimation (see rate.h).
+};
+
+enum ControlStatus : uint8_t
+{
+    CONTROL_OK = 0,
+    CONTROL_BAD_CRC = 1,
+    CONTROL_UNKNOWN = 2,     // Unknown command.
+    CONTROL_BAD_LENGTH = 3,  // Wrong payload length for the command.
+    CONTROL_RANGE = 4,       // A value out of range.
+    CONTROL_UNSUPPORTED = 5, // Only possible with another build, e.g. a faster ODR.
+    CONTROL_BUSY = 6,        // Too many commands pending, or a rate change.
+};
+
+// Output tiers (see tiers.h).
+#define OUTPUT_FULL_WINDOWS 1 // Full rate blocks in windows around impacts.
+#define OUTPUT_MIDDLE 2       // The middle tier, while there is motion.
+#define OUTPUT_SLOW 4         // The slow tier.
+#define OUTPUT_FULL_ALL 8     // Every full rate block.
+#define OUTPUT_DEFAULT (OUTPUT_FULL_WINDOWS | OUTPUT_MIDDLE | OUTPUT_SLOW)
+#define OUTPUT_ALL_CHANNELS 0x3F
+
+// Trace levels.
+#define TRACE_DATA 0    // Only data lines.
+#define TRACE_INFO 1    // Also periodic reports, e.g. memory_report().
+#define TRACE_READS 2   // Also a line per FIFO read.
+
+/// @brief What the merger outputs, and at what rate.
+struct OutputSettings
+{
+    uint8_t outputs = OUTPUT_DEFAULT;
+    uint8_t channels = OUTPUT_ALL_CHANNELS;
+    uint8_t trace = TRACE_INFO;
+    uint16_t odr = 0;            // Sensor ODR, Hz.  ControlChannel starts it at the build's.
+    uint8_t gyro_decimation = 0; // Accelerometer samples per gyro sample.
+};
+
+/// @brief Parses command frames, a byte at a time, and holds accepted
+/// settings until the merger applies them at a block boundary.
+class ControlChannel
+{
+public:
+    /// @brief Acknowledgements go to sink as text lines.
+    typedef void (*Sink)(const void *data, size_t bytes, void *context);
+
+    /// @param odr, gyro_decimation The build's rates.  CONTROL_RATE can slow
+    /// the ODR, and the gyro, but not speed them up.
+    /// @param fixed_rate Reject CONTROL_RATE, e.g. when imu2 is read through
+    /// the sensor hub, at a fixed fraction of imu1's ODR.
+    ControlChannel(uint16_t odr, uint8_t gyro_decimation, bool fixed_rate = false);
+    void set_sink(Sink s, void *ctx)
+    {
+        sink = s;
+        context = ctx;
+    }
+
+    /// @brief Take a byte from the port.
+    /// @return false if the byte isn't part of a frame, e.g. console text.
+    bool feed(uint8_t byte, int64_t now);
+
+    /// @brief Apply the pending settings, and acknowledge them.
+    /// @param index Merged index of the next block, or -1 before merging starts.
+    /// @return Whether there were any.
+    bool apply(long index);
+    const OutputSettings &settings() const { return active; }
+    /// @brief The settings once the pending ones apply.
+    const OutputSettings &requested() const { return pending_count > 0 ? pending : active; }
+    /// @brief Whether the pending settings change the rate.  The merger then
+    /// holds them until the sensors are at the new rate, rather than apply()
+    /// them at the next block boundary.
+    bool rate_change() const
+    {
+        return requested().odr != active.odr || requested().gyro_decimation != active.gyro_decimation;
+    }
+
+    long frames = 0; // Frames accepted.
+    long errors = 0; // Frames rejected.
+
+private:
+    void execute(uint8_t seq, uint8_t command, const uint8_t *payload, uint8_t length);
+    void ack(uint8_t seq, uint8_t status, long index, const OutputSettings &now);
+    /// @brief Drop a bad frame, and look for the next one in what followed its sync byte.
+    void resync();
+
+    uint16_t build_odr;
+    uint8_t build_gyro_decimation;
+    bool fixed_rate;
+    OutputSettings active;
+    OutputSettings pending;
+    uint8_t pending_seq[CONTROL_MAX_PENDING];
+    int pending_count = 0;
+
+    uint8_t frame[4 + CONTROL_MAX_PAYLOAD + 1];
+    size_t received = 0; // Bytes of the frame so far, 0 when between frames.
+    int64_t frame_start = 0;
+
+    Sink sink;
+    void *context = nullptr;
+};
+
+/// @brief CRC-8, polynomial 0x07, initial value 0.
+uint8_t control_crc8(const uint8_t *data, size_t bytes);
+
+/// @brief Build a command frame in out, which needs 5 + CONTROL_MAX_PAYLOAD bytes.
+/// @return Frame bytes.
+size_t control_frame(uint8_t seq, uint8_t command, const void *payload, uint8_t length, uint8_t *out);
+
+/// @brief An acknowledgement, parsed from a `C ...` line.
+struct ControlAck
+{
+    int seq;
+    int status;
+    long index;
+    OutputSettings settings;
+};
+
+/// @brief Parse a `C <seq> <status> <index> <outputs> <channels> <trace> <odr> <gyro decimation>` line.
+bool parse_control_ack(const char *line, ControlAck *ack);
+
+void test_control();
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dashboard.h"
+
+// The classic 5x7 font, ' ' to 'Z'.  Lower case is shown as upper case.
+#define FONT_FIRST ' '
+#define FONT_LAST 'Z'
+
+static const uint8_t font[FONT_LAST - FONT_FIRST + 1][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x00, 0x00, 0x5F, 0x00, 0x00}, // !
+    {0x00, 0x07, 0x00, 0x07, 0x00}, // "
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, // #
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, // $
+    {0x23, 0x13, 0x08, 0x64, 0x62}, // %
+    {0x36, 0x49, 0x55, 0x22, 0x50}, // &
+    {0x00, 0x05, 0x03, 0x00, 0x00}, // '
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, // (
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, // )
+    {0x08, 0x2A, 0x1C, 0x2A, 0x08}, // *
+    {0x08, 0x08, 0x3E, 0x08, 0x08}, // +
+    {0x00, 0x50, 0x30, 0x00, 0x00}, // ,
+    {0x08, 0x08, 0x08, 0x08, 0x08}, // -
+    {0x00, 0x60, 0x60, 0x00, 0x00}, // .
+    {0x20, 0x10, 0x08, 0x04, 0x02}, // /
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, // 0
+    {0x00, 0x42, 0x7F, 0x40, 0x00}, // 1
+    {0x42, 0x61, 0x51, 0x49, 0x46}, // 2
+    {0x21, 0x41, 0x45, 0x4B, 0x31}, // 3
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, // 4
+    {0x27, 0x45, 0x45, 0x45, 0x39}, // 5
+    {0x3C, 0x4A, 0x49, 0x49, 0x30}, // 6
+    {0x01, 0x71, 0x09, 0x05, 0x03}, // 7
+    {0x36, 0x49, 0x49, 0x49, 0x36}, // 8
+    {0x06, 0x49, 0x49, 0x29, 0x1E}, // 9
+    {0x00, 0x36, 0x36, 0x00, 0x00}, // :
+    {0x00, 0x56, 0x36, 0x00, 0x00}, // ;
+    {0x00, 0x08, 0x14, 0x22, 0x41}, // <
+    {0x14, 0x14, 0x14, 0x14, 0x14}, // =
+    {0x41, 0x22, 0x14, 0x08, 0x00}, // >
+    {0x02, 0x01, 0x51, 0x09, 0x06}, // ?
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, // @
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, // A
+    {0x7F, 0x49, 0x49, 0x49, 0x36}, // B
+    {0x3E, 0x41, 0x41, 0x41, 0x22}, // C
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, // D
+    {0x7F, 0x49, 0x49, 0x49, 0x41}, // E
+    {0x7F, 0x09, 0x09, 0x09, 0x01}, // F
+    {0x3E, 0x41, 0x49, 0x49, 0x7A}, // G
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, // H
+    {0x00, 0x41, 0x7F, 0x41, 0x00}, // I
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, // J
+    {0x7F, 0x08, 0x14, 0x22, 0x41}, // K
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, // L
+    {0x7F, 0x02, 0x0C, 0x02, 0x7F}, // M
+    {0x7F, 0x04, 0x08, 0x10, 0x7F}, // N
+    {0x3E, 0x41, 0x41, 0x41, 0x3E}, // O
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, // P
+    {0x3E, 0x41, 0x51, 0x21, 0x5E}, // Q
+    {0x7F, 0x09, 0x19, 0x29, 0x46}, // R
+    {0x46, 0x49, 0x49, 0x49, 0x31}, // S
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, // T
+    {0x3F, 0x40, 0x40, 0x40, 0x3F}, // U
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, // V
+    {0x3F, 0x40, 0x38, 0x40, 0x3F}, // W
+    {0x63, 0x14, 0x08, 0x14, 0x63}, // X
+    {0x07, 0x08, 0x70, 0x08, 0x07}, // Y
+    {0x61, 0x51, 0x49, 0x45, 0x43}, // Z
+};
+
+const uint8_t *Dashboard::glyph(char c)
+{
+    c = toupper((unsigned char)c);
+    if (c < FONT_FIRST || c > FONT_LAST)
+        c = '?';
+    return font[c - FONT_FIRST];
+}
+
+Dashboard::Dashboard(DashboardPanel &panel, uint16_t *strips[2]) : panel(panel), strips{strips[0], strips[1]}
+{
+    memset(shown, 0, sizeof(shown));
+    memset(shown_color, 0, sizeof(shown_color));
+}
+
+uint16_t *Dashboard::next_strip()
+{
+    // Wrap safe: the strip is free once the panel has completed its last transfer.
+    while ((int32_t)(panel.done() - strip_transfer[strip]) < 0)
+        panel.wait();
+    return strips[strip];
+}
+
+bool Dashboard::submit(int x, int y, int w, int h, uint16_t *pixels)
+{
+    if (!panel.draw(x, y, w, h, pixels))
+    {
+        printf("Problem: dashboard transfer failed\n");
+        return false;
+    }
+    strip_transfer[strip] = ++submitted;
+    strip ^= 1;
+    transfers++;
+    this->pixels += w * h;
+    return true;
+}
+
+void Dashboard::clear()
+{
+    const int strip_w = DASHBOARD_STRIP_CELLS * DASHBOARD_CELL_W;
+    for (int y = 0; y < DASHBOARD_HEIGHT; y += DASHBOARD_CELL_H)
+        for (int x = 0; x < DASHBOARD_WIDTH; x += strip_w)
+        {
+            int w = std::min(strip_w, DASHBOARD_WIDTH - x);
+            int h = std::min(DASHBOARD_CELL_H, DASHBOARD_HEIGHT - y);
+            uint16_t *p = next_strip();
+            std::fill(p, p + w * h, DASHBOARD_BLACK);
+            submit(x, y, w, h, p);
+        }
+    // Blank, but in no colour, so the first update draws every row.
+    memset(shown, ' ', sizeof(shown));
+    memset(shown_color, 0, sizeof(shown_color));
+}
+
+void Dashboard::draw_run(int row, int col, int count, const char *text, uint16_t color)
+{
+    bool ok = true;
+    for (int first = 0; first < count; first += DASHBOARD_STRIP_CELLS)
+    {
+        int n = std::min(DASHBOARD_STRIP_CELLS, count - first);
+        int w = n * DASHBOARD_CELL_W;
+        uint16_t *p = next_strip();
+        uint16_t *out = p;
+        for (int y = 0; y < DASHBOARD_CELL_H; y++)
+        {
+            int gy = y / DASHBOARD_SCALE;
+            for (int i = 0; i < n; i++)
+            {
+                const uint8_t *g = glyph(text[first + i]);
+                for (int x = 0; x < DASHBOARD_CELL_W; x++)
+                {
+                    int gx = x / DASHBOARD_SCALE;
+                    bool on = gx < 5 && gy < 7 && (g[gx] >> gy & 1);
+                    *out++ = on ? color : DASHBOARD_BLACK;
+                }
+            }
+        }
+        ok &= submit((col + first) * DASHBOARD_CELL_W, row * DASHBOARD_CELL_H, w, DASHBOARD_CELL_H, p);
+    }
+    // After a failure, what's on screen is unknown, so the next update redraws it.
+    if (ok)
+        memcpy(&shown[row][col], text, count);
+    else
+        memset(&shown[row][col], 0, count);
+    shown_color[row] = color;
+}
+
+void Dashboard::show(const DashboardStats &stats)
+{
+    char lines[DASHBOARD_ROWS][DASHBOARD_COLS + 1];
+    uint16_t colors[DASHBOARD_ROWS];
+    format(stats, lines, colors);
+    for (int row = 0; row < DASHBOARD_ROWS; row++)
+    {
+        const char *text = lines[row];
+        if (colors[row] != shown_color[row])
+        {
+            draw_run(row, 0, DASHBOARD_COLS, text, colors[row]);
+            continue;
+        }
+        for (int col = 0; col < DASHBOARD_COLS;)
+        {
+            if (text[col] == shown[row][col])
+            {
+                col++;
+                continue;
+            }
+            // Extend the run over short stretches of unchanged cells.
+            int end = col + 1;
+            for (int c = end; c < DASHBOARD_COLS && c <= end + DASHBOARD_RUN_GAP; c++)
+                if (text[c] != shown[row][c])
+                    end = c + 1;
+            draw_run(row, col, end - col, text + col, colors[row]);
+            col = end;
+        }
+    }
+}
+
+void Dashboard::format(const DashboardStats &stats, char lines[DASHBOARD_ROWS][DASHBOARD_COLS + 1],
+                       uint16_t colors[DASHBOARD_ROWS])
+{
+    char text[DASHBOARD_ROWS][48];
+    if (stats.merging)
+    {
+        snprintf(text[0], sizeof(text[0]), "L %10.2f HZ", stats.left_hz);
+        snprintf(text[1], sizeof(text[1]), "R %10.2f HZ", stats.right_hz);
+        snprintf(text[2], sizeof(text[2]), "SKEW %+8.1f PPM", stats.skew_ppm);
+    }
+    else
+    {
+        snprintf(text[0], sizeof(text[0]), "L   FITTING");
+        snprintf(text[1], sizeof(text[1]), "R   FITTING");
+        snprintf(text[2], sizeof(text[2]), "SKEW");
+    }
+    colors[0] = colors[1] = colors[2] = stats.merging ? DASHBOARD_WHITE : DASHBOARD_YELLOW;
+
+    snprintf(text[3], sizeof(text[3]), "QUEUE %d/%d", stats.queued, stats.queue_depth);
+    colors[3] = stats.queued > stats.queue_depth / 2   ? DASHBOARD_RED
+                : stats.queued > stats.queue_depth / 4 ? DASHBOARD_YELLOW
+                                                       : DASHBOARD_GREEN;
+    snprintf(text[4], sizeof(text[4]), "LOST L %ld R %ld", stats.lost[0], stats.lost[1]);
+    colors[4] = stats.lost[0] + stats.lost[1] > 0 ? DASHBOARD_RED : DASHBOARD_GREEN;
+
+    snprintf(text[5], sizeof(text[5]), "STRIKES %ld", stats.strikes);
+    if (stats.last_strike >= 0)
+        snprintf(text[6], sizeof(text[6]), "LAST %5.0fS PK %5d", (stats.now - stats.last_strike) / 1e6,
+                 stats.strike_peak);
+    else
+        snprintf(text[6], sizeof(text[6]), "LAST -");
+    colors[5] = colors[6] = DASHBOARD_CYAN;
+
+    long seconds = (long)(stats.now / 1000000);
+    int n = snprintf(text[7], sizeof(text[7]), "UP %ld:%02ld:%02ld", seconds / 3600, seconds / 60 % 60,
+                     seconds % 60);
+    if (stats.has_angle)
+        snprintf(text[7] + n, sizeof(text[7]) - n, " A%+6.1f", stats.angle);
+    colors[7] = DASHBOARD_WHITE;
+
+    // Pad with spaces, so the whole row is compared.
+    for (int row = 0; row < DASHBOARD_ROWS; row++)
+    {
+        size_t len = std::min(strlen(text[row]), (size_t)DASHBOARD_COLS);
+        memcpy(lines[row], text[row], len);
+        memset(lines[row] + len, ' ', DASHBOARD_COLS - len);
+        lines[row][DASHBOARD_COLS] = 0;
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+
+// Standard C++ only, so the host tools can render the dashboard too.
+
+// The TFT, in landscape.
+#define DASHBOARD_WIDTH 240
+#define DASHBOARD_HEIGHT 135
+// 5x7 glyphs in 6x8 cells, doubled, so 20 columns by 8 rows.
+#define DASHBOARD_SCALE 2
+#define DASHBOARD_CELL_W (6 * DASHBOARD_SCALE)
+#define DASHBOARD_CELL_H (8 * DASHBOARD_SCALE)
+#define DASHBOARD_COLS (DASHBOARD_WIDTH / DASHBOARD_CELL_W)
+#define DASHBOARD_ROWS (DASHBOARD_HEIGHT / DASHBOARD_CELL_H)
+// Cells rendered per transfer.  Two strips of this size are the only
+// framebuffer: one is rendered while the other is on the bus.
+#define DASHBOARD_STRIP_CELLS 8
+#define DASHBOARD_STRIP_PIXELS (DASHBOARD_STRIP_CELLS * DASHBOARD_CELL_W * DASHBOARD_CELL_H)
+#define DASHBOARD_DMA_BYTES (2 * DASHBOARD_STRIP_PIXELS * sizeof(uint16_t))
+// Unchanged cells between two changed runs that are redrawn anyway, since
+// each transfer costs a window command as well as the pixels.
+#define DASHBOARD_RUN_GAP 2
+// Interval between stats updates, and so redraws.
+#define DASHBOARD_PERIOD_USEC 250000
+
+/// @brief RGB565 in the panel's byte order, which is big endian.
+constexpr uint16_t dashboard_color(uint8_t r, uint8_t g, uint8_t b)
+{
+    uint16_t c = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+    return (uint16_t)((c >> 8) | (c << 8));
+}
+
+#define DASHBOARD_BLACK dashboard_color(0, 0, 0)
+#define DASHBOARD_WHITE dashboard_color(255, 255, 255)
+#define DASHBOARD_GREEN dashboard_color(0, 255, 0)
+#define DASHBOARD_YELLOW dashboard_color(255, 255, 0)
+#define DASHBOARD_RED dashboard_color(255, 0, 0)
+#define DASHBOARD_CYAN dashboard_color(0, 255, 255)
+
+/// @brief A snapshot of the pipeline, published by the logger task.
+struct DashboardStats
+{
+    int64_t now{0};         // usec since boot.
+    bool merging{false};    // Whether the clock fits are valid.
+    float left_hz{0};       // Measured sensor rates, from the clock fits.
+    float right_hz{0};
+    float skew_ppm{0};      // Right clock relative to left.
+    int queued{0};          // Reads waiting for the logger.
+    int queue_depth{0};
+    long lost[2]{0, 0};     // Samples lost, left and right.
+    long strikes{0};        // Full rate windows opened.
+    int64_t last_strike{-1}; // usec time of the last strike, or -1.
+    int strike_peak{0};     // Largest sample step in the last strike.
+    bool has_angle{false};  // With BELL_ANGLE.
+    float angle{0};         // Bell angle, degrees.
+};
+
+/// @brief Where the dashboard draws.  Transfers may be asynchronous, like
+/// SPI DMA, so the pixels of a transfer must not change until done() has
+/// counted it.
+class DashboardPanel
+{
+public:
+    virtual ~DashboardPanel() {}
+
+    /// @brief Queue w x h pixels, row by row, for the rectangle at (x, y).
+    virtual bool draw(int x, int y, int w, int h, const uint16_t *pixels) = 0;
+    /// @brief Transfers completed so far.
+    virtual uint32_t done() const = 0;
+    /// @brief Wait for a transfer to complete.
+    virtual void wait() = 0;
+};
+
+/// @brief Text dashboard with dirty rectangle updates.
+///
+/// The screen is a grid of character cells.  Each update formats the stats
+/// into lines, compares them with what is on screen, and only redraws runs of
+/// changed cells, through two small strips, so a refresh is usually a few
+/// hundred bytes on the bus rather than the whole 64 kB screen.
+class Dashboard
+{
+public:
+    /// @param strips Two buffers of DASHBOARD_STRIP_PIXELS, which the panel
+    /// must be able to transfer from, e.g. DMA capable memory.
+    Dashboard(DashboardPanel &panel, uint16_t *strips[2]);
+
+    /// @brief Fill the screen with the background, and forget what was shown.
+    void clear();
+
+    /// @brief Redraw whatever changed since the last update.
+    void show(const DashboardStats &stats);
+
+    /// @brief Format the stats as they are shown, one line and colour per row.
+    static void format(const DashboardStats &stats, char lines[DASHBOARD_ROWS][DASHBOARD_COLS + 1],
+                       uint16_t colors[DASHBOARD_ROWS]);
+
+    /// @brief The 5 column glyph for c, one byte per column, bit 0 at the top.
+    static const uint8_t *glyph(char c);
+
+    long transfers = 0; // Transfers queued on the panel.
+    long pixels = 0;    // Pixels transferred.
+
+private:
+    /// @brief Draw count cells of text from (row, col), in strip sized pieces.
+    void draw_run(int row, int col, int count, const char *text, uint16_t color);
+    /// @brief The next strip, once the panel has finished with it.
+    uint16_t *next_strip();
+    bool submit(int x, int y, int w, int h, uint16_t *strip);
+
+    DashboardPanel &panel;
+    uint16_t *strips[2];
+    uint32_t strip_transfer[2] = {0, 0}; // Transfer number that last used each strip.
+    int strip = 0;                       // Strip to render into next.
+    uint32_t submitted = 0;
+
+    char shown[DASHBOARD_ROWS][DASHBOARD_COLS]; // What is on screen.  0 is unknown.
+    uint16_t shown_color[DASHBOARD_ROWS];
+};
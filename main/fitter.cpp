@@ -1,4 +1,5 @@
 #include "fitter.h"
+#include <cassert>
 #include <utility>
 #include <stdio.h>
 
@@ -71,9 +72,23 @@ std::pair<long, float> TimeFitter::sample_for(long t) const
 
 float TimeFitter::slope() const
 {
+    if (prior_weight > 0)
+    {
+        // Centered sums, with the prior added as extra variance at prior_slope.
+        float sxx = k2sum - ksum * ksum / n;
+        float sxy = ktsum - ksum * tsum / n;
+        return (sxy + prior_weight * prior_slope) / (sxx + prior_weight);
+    }
     return (n * ktsum - ksum * tsum) / (n * k2sum - ksum * ksum);
 }
 
+void TimeFitter::set_prior(float slope, float weight)
+{
+    prior_slope = slope;
+    prior_weight = weight;
+}
+
+#if SELF_TEST
 void test_fitter()
 {
     TimeFitter fitter(0.01f);
@@ -90,4 +105,15 @@ void test_fitter()
         auto [k, frac] = fitter.sample_for(t);
         printf("Sample %ld => time %ld => sample %ld + %f\n", i, t, k, frac);
     }
+
+    // A prior gives a usable slope from the first point, and gives way to the data.
+    TimeFitter seeded(0.01f);
+    seeded.set_prior(1002.0f, 1e4f);
+    seeded.coord(0, 500);
+    assert(seeded.slope() == 1002.0f);
+    assert(seeded.time_for(10) == 500 + 10020);
+    for (long i = 1; i < 200; i++)
+        seeded.coord(i * 8, i * 8000 + 500);
+    assert(seeded.slope() > 999.9f && seeded.slope() < 1000.1f);
 }
+#endif
@@ -37,6 +37,12 @@ public:
 
     float slope() const;
 
+    /// @brief Set a prior slope, e.g. from a saved clock model.  The prior acts
+    /// like weight units of sample variance at that slope, so it dominates
+    /// the first few points and fades as real data accumulates.  With a
+    /// prior, the fit is usable from the first point.
+    void set_prior(float slope, float weight);
+
 private:
     /// @brief Recenter the fitter around the current kbar/tbar.
     void recenter();
@@ -52,7 +58,10 @@ private:
     float alpha{0};
     float n{0};
 
-    int recenter_count;
+    float prior_slope{0};
+    float prior_weight{0};
+
+    int recenter_count{0};
 };
 
 void test_fitter();
@@ -0,0 +1,129 @@
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "IMU.h"
+#include "hub.h"
+#include "sim.h"
+
+#if SELF_TEST
+/// @brief Read sim through bus for reads periods, as the reader does, and
+/// pass each read to split(records, count, first).  first is found by value
+/// after an overrun.
+/// @return Bus bytes per imu1 sample.
+template <typename Split>
+static float hub_reads(SimulatedLSM &sim, MockBus &bus, LSMExtension &imu, int reads, int stall_at, Split split)
+{
+    alignas(4) static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    long next = 0; // The next accelerometer sample expected.
+    long start_bytes = bus.bytes;
+    int64_t now = 0;
+    for (int r = 0; r < reads; r++)
+    {
+        if (r == stall_at)
+            now += 2000LL * SIM_FIFO_DEPTH * 1000 / RATE.odr;
+        now += RATE.read_interval_usec();
+        sim.advance(now);
+        assert(imu.Read_FIFO_Batch(RATE.max_records, records, [](void *, int32_t) {}, nullptr) == LSM6DSV16X_OK);
+        uint16_t count;
+        assert(imu.Finish_FIFO_Batch(&count) == LSM6DSV16X_OK);
+        int i = 0;
+        while (i < count && records[i].tag.tag_sensor != LSM6DSV16X_XL_NC_TAG)
+            i++;
+        if (i < count && imu.FIFO_Overrun())
+        {
+            while (next < sim.samples() && (records[i].data[0] != sim.value(next, 0) ||
+                                            records[i].data[1] != sim.value(next, 1) ||
+                                            records[i].data[2] != sim.value(next, 2)))
+                next++;
+        }
+        assert(i == count || records[i].tag.tag_cnt == (next & 3));
+        split(records, count, next);
+        for (i = 0; i < count; i++)
+            next += records[i].tag.tag_sensor == LSM6DSV16X_XL_NC_TAG;
+    }
+    return (float)(bus.bytes - start_bytes) / next;
+}
+
+/// @brief Check that the sensor hub is configured to read imu2 into imu1's
+/// FIFO, that imu1 demultiplexes exactly, that imu2 is interpolated onto
+/// imu1's samples, with a gap after lost samples, and that one FIFO takes
+/// fewer bus bytes than two.
+void test_sensor_hub()
+{
+    const int reads = 2000;
+    const float skew = 1.01f;
+    static SimulatedLSM sim1(RATE.odr, 1.0f);
+    static SimulatedLSM sim2(RATE.odr, skew);
+    static MockBus bus(&sim1);
+    sim2.set_amplitude(2000);
+    sim1.set_hub_target(&sim2);
+
+    LSMExtension imu(&bus);
+    assert(imu.Write_Config(false) == LSM6DSV16X_OK);
+    assert(imu.Enable_Sensor_Hub(LSM6DSV16X_I2C_ADD_H) == LSM6DSV16X_OK);
+    assert(bus.hub_reg(LSM6DSV16X_SLV0_ADD) == (LSM6DSV16X_I2C_ADD_H | SLV0_ADD_READ));
+    assert(bus.hub_reg(LSM6DSV16X_SLV0_SUBADD) == LSM6DSV16X_OUTX_L_A);
+    assert(bus.hub_reg(LSM6DSV16X_SLV0_CONFIG) == (6 | SLV0_CONFIG_BATCH | HUB_ODR_CODE << SLV0_CONFIG_SHUB_ODR_SHIFT));
+    assert((bus.hub_reg(LSM6DSV16X_MASTER_CONFIG) & (MASTER_CONFIG_MASTER_ON | MASTER_CONFIG_PASS_THROUGH)) ==
+           MASTER_CONFIG_MASTER_ON);
+    assert((bus.reg(LSM6DSV16X_FUNC_CFG_ACCESS) & FUNC_CFG_SHUB_REG_ACCESS) == 0);
+
+    // Interpolation error is bounded by the slope over one sample, for the
+    // skew, plus the curvature over a hub interval.
+    const float w = 2.0f * (float)M_PI * 0.0113f; // Fastest simulated axis.
+    const float tolerance = 2000 * (2 * w + w * w * HUB_DECIMATION * HUB_DECIMATION / 8) + 2;
+    static HubDemux demux;
+    long left = 0, right = 0, exact = 0, gaps = 0, gap_samples = 0;
+    float worst = 0;
+    static UnpackedRecords unpacked;
+    float hub_bytes = hub_reads(sim1, bus, imu, reads, reads / 2, [&](const lsm6dsv16x_fifo_record_t *records, int count, long first) {
+        unpack_records(records, count, unpacked);
+        demux.split(
+            unpacked, first,
+            [&](int side, long k, const int16_t values[3]) {
+                if (side == 0)
+                {
+                    for (int a = 0; a < 3; a++)
+                        assert(values[a] == sim1.value(k, a));
+                    left++;
+                    return;
+                }
+                // imu2's latest sample at imu1 sample k.
+                long j = (long)floor(k * (double)skew);
+                bool hub_read = k % HUB_DECIMATION == 0;
+                bool matches = true;
+                for (int a = 0; a < 3; a++)
+                {
+                    float err = fabsf(values[a] - sim2.value(j, a));
+                    worst = fmaxf(worst, err);
+                    assert(err <= tolerance);
+                    matches &= values[a] == sim2.value(j, a) || values[a] == sim2.value(j - 1, a);
+                }
+                exact += hub_read && matches;
+                right++;
+            },
+            [&](long, long count) {
+                gaps++;
+                gap_samples += count;
+            });
+    });
+    assert(sim1.lost() > 0);
+    // A hub sample can outlive the accelerometer sample before it in the FIFO.
+    assert(gaps == 1 && labs(gap_samples - sim1.lost()) < HUB_DECIMATION);
+    assert(demux.hub_samples > 0 && exact >= demux.hub_samples * 9 / 10);
+    assert(labs(left - right) <= HUB_MAX_SPAN + gap_samples);
+
+    // The same reads, of two sensors, each with its own FIFO.
+    static SimulatedLSM plain(RATE.odr, 1.0f);
+    static MockBus plain_bus(&plain);
+    LSMExtension plain_imu(&plain_bus);
+    assert(plain_imu.Write_Config(false) == LSM6DSV16X_OK);
+    float plain_bytes = 2 * hub_reads(plain, plain_bus, plain_imu, reads, -1, [](const lsm6dsv16x_fifo_record_t *, int, long) {});
+
+    printf("Sensor hub: %ld hub samples, %ld imu2 samples, worst error %.0f LSB, %.1f bus bytes per merged sample, against %.1f\n",
+           demux.hub_samples, demux.interpolated, worst, hub_bytes, plain_bytes);
+    assert(hub_bytes < plain_bytes * 0.75f);
+}
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include "record.h"
+#include "rate.h"
+#include "unpack.h"
+
+// Sensor hub acquisition (SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB).
+// imu2 sits on imu1's auxiliary I2C master bus, and imu1 reads imu2's
+// accelerometer output registers on its own clock, batching them into its
+// FIFO as SENSORHUB_TARGET0 records.  Both sensors then arrive in one FIFO,
+// already on imu1's time base, so the reader reads one device and the merger
+// only has to demultiplex.
+//
+// The hub's fastest rate is 480 Hz, so imu2 is read every HUB_DECIMATION
+// imu1 samples, and interpolated linearly in between.  imu2's bandwidth is
+// then about 200 Hz, instead of the full ODR.
+
+// Compressed samples reach the FIFO late, so hub records couldn't be placed
+// by their tag_cnt.
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB && FIFO_COMPRESSION
+#error "Sensor hub acquisition doesn't support FIFO_COMPRESSION"
+#endif
+
+// Sensor hub read rate, Hz, and its SLV0_CONFIG SHUB_ODR code.
+#define HUB_ODR 480
+#define HUB_ODR_CODE 0x06
+#define HUB_DECIMATION (SENSOR_ODR / HUB_ODR)
+
+// Sensor hub bank registers (FUNC_CFG_ACCESS SHUB_REG_ACCESS).
+#define FUNC_CFG_SHUB_REG_ACCESS 0x40
+#define MASTER_CONFIG_AUX_SENS_MASK 0x03 // Targets less one.
+#define MASTER_CONFIG_MASTER_ON 0x04
+#define MASTER_CONFIG_PASS_THROUGH 0x10
+#define MASTER_CONFIG_START_CONFIG 0x20 // Trigger on INT2, rather than data ready.
+#define SLV0_ADD_READ 0x01
+#define SLV0_CONFIG_NUMOP_MASK 0x07
+#define SLV0_CONFIG_BATCH 0x08
+#define SLV0_CONFIG_SHUB_ODR_SHIFT 5
+
+// A hub sample more than this many imu1 samples after the last is taken to
+// follow lost samples, and isn't interpolated from.
+#define HUB_MAX_SPAN (2 * HUB_DECIMATION)
+
+/// @brief Splits sensor hub reads into the two sensors' samples, by imu1
+/// sample index.  imu1's accelerometer samples pass straight through.  Each
+/// hub sample is placed at the latest imu1 sample with its tag_cnt, and imu2
+/// is interpolated linearly between hub samples, so imu2's side lags by up to
+/// HUB_DECIMATION samples.
+class HubDemux
+{
+public:
+    /// @brief Split an unpacked read.
+    /// @param first Index of the first accelerometer sample in records.
+    /// @param put Called as put(side, index, const int16_t values[3]).
+    /// @param gap Called as gap(index, count) when imu2 samples can't be
+    /// interpolated, after lost samples.  put isn't called for them.
+    template <typename Put, typename Gap>
+    void split(const UnpackedRecords &records, long first, Put put, Gap gap)
+    {
+        long index = first - 1; // Last accelerometer sample seen.
+        for (int i = 0; i < records.count; i++)
+        {
+            uint8_t tag = records.tag[i];
+            int16_t values[3];
+            records.sample(i, values);
+            if (tag == LSM6DSV16X_XL_NC_TAG)
+                put(0, ++index, values);
+            else if (tag == LSM6DSV16X_SENSORHUB_TARGET0_TAG)
+                hub_sample(index - ((index - records.cnt[i]) & 3), values, put, gap);
+        }
+    }
+
+    /// @brief Forget the last imu2 sample, when the sample counts start again.
+    void restart() { have_last = false; }
+
+    long hub_samples = 0;  // Hub samples seen.
+    long interpolated = 0; // imu2 samples output.
+
+private:
+    template <typename Put, typename Gap>
+    void hub_sample(long at, const int16_t values[3], Put put, Gap gap)
+    {
+        hub_samples++;
+        if (have_last && at <= last_index)
+            return;
+        if (have_last && at - last_index <= HUB_MAX_SPAN)
+        {
+            float span = at - last_index;
+            for (long k = last_index + 1; k <= at; k++)
+            {
+                float f = (k - last_index) / span;
+                int16_t out[3];
+                for (int a = 0; a < 3; a++)
+                    out[a] = (int16_t)lroundf(last[a] + f * (values[a] - last[a]));
+                put(1, k, out);
+                interpolated++;
+            }
+        }
+        else
+        {
+            if (have_last)
+                gap(last_index + 1, at - last_index - 1);
+            put(1, at, values);
+            interpolated++;
+        }
+        for (int a = 0; a < 3; a++)
+            last[a] = values[a];
+        last_index = at;
+        have_last = true;
+    }
+
+    bool have_last = false;
+    long last_index = 0;
+    int16_t last[3] = {};
+};
+
+void test_sensor_hub();
@@ -22,22 +22,66 @@ processor will only require about 20% duty cycle to keep up.
 
 #include "Arduino.h"
 #include <stdio.h>
+#include <string.h>
 #include <string>
-#include "base64_encode.hpp"
 #include "esp_debug_helpers.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "driver/gpio.h"
 
 #include "LSM6DSV16XSensor.h"
 #include "IMU.h"
+#include "activity.h"
+#include "bell.h"
+#include "blackbox.h"
+#include "capture.h"
+#include "clock_model.h"
+#include "control.h"
+#include "memory.h"
 #include "merge.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "phase.h"
+#include "reader.h"
+#include "recording.h"
+#include "tiers.h"
+#include "tracker.h"
 #include "fitter.h"
+#include "hub.h"
+#include "transport.h"
+#include "unpack.h"
 
 #include "tft.h"
 
+// The FSM or MLC program for imu1, which defines activity_program (see activity.h).
+#ifdef ACTIVITY_PROGRAM
+#include ACTIVITY_PROGRAM
+#endif
+
+// Wakes the reader, at an interval set from the sensors' FIFO levels (see pacer.h).
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+static ReadPacer pacer(2, 1);
+#elif SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+static ReadPacer pacer(1, 1);
+#else
+static ReadPacer pacer(2, 2);
+#endif
+// The sensors read, imu1 then imu2.  Only imu1 through the sensor hub.
+static LSMExtension *paced[2];
+
+/// @brief Have the pacer take a sensor's finished read.
+static void pace_read(bool left)
+{
+    LSMExtension *imu = paced[left ? 0 : 1];
+    pacer.observe(left ? 0 : 1, imu->Read_Start(), imu->FIFO_Level(), imu->FIFO_Left());
+}
+
 /// @brief  Read many records from the FIFO and print them.
 ///  It appears that all records from a clock tick appear simultaneously.
 /// @param LSM
 /// @param avail
 /// @return
+#if SENSOR_TRANSPORT == TRANSPORT_WIRE
 int read_all(LSMExtension &imu, lsm6dsv16x_fifo_record_t *records, int max)
 {
     uint16_t actual;
@@ -50,6 +94,384 @@ int read_all(LSMExtension &imu, lsm6dsv16x_fifo_record_t *records, int max)
 
     return actual;
 }
+#else
+/// @brief Queue a message finished by the OverlappedReader for the logger task.
+static void enqueue(LoggerMsg &msg, void *q)
+{
+    pace_read(msg.imu);
+    xQueueSend((QueueHandle_t)q, &msg, 0);
+    if (LOGGER_QUEUE_DEPTH / 2 < uxQueueMessagesWaiting((QueueHandle_t)q))
+    {
+        printf("**********   Warning: logger queue has %d messages pending\n", uxQueueMessagesWaiting((QueueHandle_t)q));
+        vTaskSuspend(NULL);
+    }
+}
+#endif
+
+/// @brief Blink the LED at 0.5 Hz, to show the reader is running.
+static void update_led()
+{
+    static int led = HIGH;
+    auto ticks = xTaskGetTickCount();
+    if (ticks / 1000 % 2 != led)
+    {
+        led = led ^ 1;
+        digitalWrite(13, led);
+    }
+}
+
+// imu1's activity events go to the logger, from waking up, and with a
+// program loaded, while streaming (see activity.h).
+#if ACTIVITY_WAKE || defined(ACTIVITY_PROGRAM)
+#define ACTIVITY_EVENTS 1
+#else
+#define ACTIVITY_EVENTS 0
+#endif
+
+#if ACTIVITY_EVENTS
+// imu1's events, read but not yet sent to the logger.
+static ActivityEvent activity_events[ACTIVITY_MAX_EVENTS];
+static int activity_count = 0;
+
+/// @brief Whether imu1 has events for the logger, from waking up, or raised
+/// on INT1 since.  Only a GPIO read, so the reader checks every period.
+static bool activity_pending()
+{
+    return activity_count > 0 || gpio_get_level((gpio_num_t)SENSOR1_INT1) != 0;
+}
+
+/// @brief Read what raised INT1, unless events are already waiting.  The
+/// reader's transfers must all be finished.
+static void read_activity(LSMExtension &imu)
+{
+    if (activity_count == 0 && LSM6DSV16X_OK != imu.Read_Activity(activity_events, &activity_count))
+        activity_count = 0;
+}
+
+/// @brief Move the waiting events into msg, in place of its records.
+static void take_activity(LoggerMsg &msg)
+{
+    memcpy(msg.records, activity_events, activity_count * sizeof(ActivityEvent));
+    msg.events = activity_count;
+    msg.sample_count = 0;
+    activity_count = 0;
+}
+
+#if SENSOR_ACQUISITION != ACQUISITION_PARALLEL
+/// @brief Queue the waiting events for the logger, in the reader's first
+/// buffer, which is free once the reader's transfers are finished.
+static void queue_activity(QueueHandle_t q)
+{
+    if (activity_count == 0)
+        return;
+    LoggerMsg &msg = dma_arena.reader[0];
+    take_activity(msg);
+    xQueueSend(q, &msg, portMAX_DELAY);
+    msg.events = 0;
+}
+#endif
+#endif
+
+#if ACTIVITY_WAKE
+// Wake up threshold, in FS/256 (62.5 mg at 16 g).
+#define ACTIVITY_WAKE_THRESHOLD 4
+
+/// @brief Light sleep, with imu in Slow() mode, until it reports a swing or
+/// strike on INT1, leaving the events for the reader to send.  Then restore
+/// the streaming configuration, with the FIFO empty, and the wake up detector
+/// off INT1.
+static void sleep_until_activity(LSMExtension &imu, bool gyro)
+{
+    if (LSM6DSV16X_OK != imu.Slow() || LSM6DSV16X_OK != imu.Enable_Wake_Up(ACTIVITY_WAKE_THRESHOLD))
+    {
+        printf("LSM6DSV16X Sensor failed to enable activity detection\n");
+        return;
+    }
+    gpio_set_direction((gpio_num_t)SENSOR1_INT1, GPIO_MODE_INPUT);
+    gpio_wakeup_enable((gpio_num_t)SENSOR1_INT1, GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    printf("Sleeping until activity\n");
+
+    while (activity_count == 0)
+    {
+        Serial.flush();
+        esp_light_sleep_start();
+        read_activity(imu);
+    }
+    gpio_wakeup_disable((gpio_num_t)SENSOR1_INT1);
+
+    if (LSM6DSV16X_OK != imu.Write_Config(gyro) || LSM6DSV16X_OK != imu.Set_SFLP_ODR(LSM6DSV16X_SFLP_15Hz) ||
+        LSM6DSV16X_OK != imu.Disable_Wake_Up())
+    {
+        printf("LSM6DSV16X Sensor failed to configure after activity\n  Suspending!\n");
+        vTaskSuspend(NULL);
+    }
+}
+
+/// @brief Hand the logger an idle message, and wait while it saves the clock
+/// model and restarts the merger.  Then sleep until activity, and start the
+/// sensors and the pacer again, with both FIFOs empty.  The reader's
+/// transfers must all be finished.
+/// @param idle Sends the logger a message with idle set.
+template <typename Idle>
+static void idle_until_activity(LSMExtension &imu1, LSMExtension *imu2, Idle idle)
+{
+    printf("No motion for %d seconds\n", ACTIVITY_IDLE_SECONDS);
+    idle();
+    while (merger_wants_idle())
+        vTaskDelay(1);
+    sleep_until_activity(imu1, BELL_ANGLE);
+    imu1.FIFO_Flush();
+    if (imu2 != nullptr)
+        imu2->FIFO_Flush();
+    pacer.resume(esp_timer_get_time());
+}
+
+#if SENSOR_ACQUISITION != ACQUISITION_PARALLEL
+/// @brief Queue an idle message for the logger, in the reader's first buffer,
+/// which is free once the reader's transfers are finished.
+static void queue_idle(QueueHandle_t q)
+{
+    LoggerMsg &msg = dma_arena.reader[0];
+    msg.idle = true;
+    msg.sample_count = 0;
+    xQueueSend(q, &msg, portMAX_DELAY);
+    msg.idle = false;
+}
+#endif
+#endif
+
+#if SENSOR_ACQUISITION != ACQUISITION_SENSOR_HUB
+/// @brief Hand the logger a rate message, and wait while it restarts the
+/// merger.  Then configure both sensors for the rate merger_wants_rate()
+/// gave, which empties their FIFOs, and pace reads for it.  Through the
+/// sensor hub, the rate is fixed (see control.h).  The reader's transfers
+/// must all be finished.
+/// @param send Sends the logger a message with odr set.
+template <typename Send>
+static void change_rate(LSMExtension &imu1, LSMExtension &imu2, uint16_t odr, uint8_t gyro_decimation, Send send)
+{
+    send();
+    while (merger_wants_rate(nullptr, nullptr))
+        vTaskDelay(1);
+    imu1.Set_Rate(odr, gyro_decimation);
+    imu2.Set_Rate(odr, gyro_decimation);
+    if (LSM6DSV16X_OK != imu1.Write_Config(BELL_ANGLE) || LSM6DSV16X_OK != imu2.Write_Config(false))
+    {
+        printf("LSM6DSV16X Sensor failed to change rate\n  Suspending!\n");
+        vTaskSuspend(NULL);
+    }
+    pacer.set_rate(odr, gyro_decimation);
+    pacer.resume(esp_timer_get_time());
+    printf("Sensors at %u Hz, gyro at 1/%u\n", odr, gyro_decimation);
+}
+
+#if SENSOR_ACQUISITION != ACQUISITION_PARALLEL
+/// @brief Queue a rate message for the logger, in the reader's first buffer,
+/// which is free once the reader's transfers are finished.
+static void queue_rate(QueueHandle_t q, uint16_t odr, uint8_t gyro_decimation)
+{
+    LoggerMsg &msg = dma_arena.reader[0];
+    msg.odr = odr;
+    msg.gyro_decimation = gyro_decimation;
+    msg.sample_count = 0;
+    xQueueSend(q, &msg, portMAX_DELAY);
+    msg.odr = 0;
+}
+#endif
+#endif
+
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL || SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+struct ParallelRead
+{
+    TaskHandle_t task;
+    int64_t read_time; // Stamped when the transfer completes.
+};
+#endif
+
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+static void IRAM_ATTR parallel_done(void *arg, int32_t status)
+{
+    ParallelRead *r = (ParallelRead *)arg;
+    r->read_time = esp_timer_get_time();
+    notify_done(r->task);
+}
+
+/// @brief Read both sensors every period, concurrently on their own controllers,
+/// into per sensor rings.  Never returns.
+static void read_parallel(LSMExtension &imu1, LSMExtension &imu2)
+{
+    SensorRings &rings = dma_arena.rings;
+    TaskHandle_t logger = start_logger_task(pair_logger_task, (void *)&rings);
+
+    ParallelRead r1 = {xTaskGetCurrentTaskHandle(), 0};
+    ParallelRead r2 = {xTaskGetCurrentTaskHandle(), 0};
+    // Commit a pair with no records, which fill marks idle, or with a rate,
+    // or gives events.
+    auto send_pair = [&rings, logger](auto fill)
+    {
+        LoggerMsg *left = rings.left.claim();
+        LoggerMsg *right = rings.right.claim();
+        if (left == nullptr || right == nullptr)
+        {
+            printf("**********   Warning: sensor rings full\n");
+            vTaskSuspend(NULL);
+        }
+        left->idle = right->idle = false;
+        left->events = right->events = 0;
+        left->odr = right->odr = 0;
+        fill(*left, *right);
+        rings.left.commit();
+        rings.right.commit();
+        xTaskNotifyGive(logger);
+    };
+    pacer.begin(esp_timer_get_time());
+    while (1)
+    {
+        uint16_t odr;
+        uint8_t gyro_decimation;
+        if (merger_wants_rate(&odr, &gyro_decimation))
+            change_rate(imu1, imu2, odr, gyro_decimation,
+                        [&]()
+                        {
+                            send_pair(
+                                [&](LoggerMsg &l, LoggerMsg &r)
+                                {
+                                    l.odr = r.odr = odr;
+                                    l.gyro_decimation = r.gyro_decimation = gyro_decimation;
+                                    l.sample_count = r.sample_count = 0;
+                                });
+                        });
+#if ACTIVITY_WAKE
+        if (merger_wants_idle())
+            idle_until_activity(imu1, &imu2,
+                                [&]() { send_pair([](LoggerMsg &l, LoggerMsg &r) { l.idle = r.idle = true; }); });
+#endif
+#if ACTIVITY_EVENTS
+        if (activity_pending())
+        {
+            read_activity(imu1);
+            if (activity_count > 0)
+                send_pair(
+                    [](LoggerMsg &l, LoggerMsg &r)
+                    {
+                        take_activity(l);
+                        r.events = l.events;
+                        r.sample_count = 0;
+                    });
+        }
+#endif
+        bool delayed = pacer.wait();
+        LoggerMsg *left = rings.left.claim();
+        LoggerMsg *right = rings.right.claim();
+        if (left == nullptr || right == nullptr)
+        {
+            printf("**********   Warning: sensor rings full\n");
+            vTaskSuspend(NULL);
+        }
+
+        // Start both transfers, then wait for both to complete.
+        if (LSM6DSV16X_OK != imu1.Read_FIFO_Batch(RATE.max_records, left->records, parallel_done, &r1) ||
+            LSM6DSV16X_OK != imu2.Read_FIFO_Batch(RATE.max_records, right->records, parallel_done, &r2))
+        {
+            printf("LSM6DSV16X Sensor failed to queue FIFO read\n");
+            vTaskSuspend(NULL);
+        }
+        uint32_t done = 0;
+        while (done < 2)
+            done += ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        uint16_t count1 = 0;
+        uint16_t count2 = 0;
+        if (LSM6DSV16X_OK != imu1.Finish_FIFO_Batch(&count1) ||
+            LSM6DSV16X_OK != imu2.Finish_FIFO_Batch(&count2))
+        {
+            printf("LSM6DSV16X Sensor failed to read FIFO data\n");
+            vTaskSuspend(NULL);
+        }
+        pace_read(true);
+        pace_read(false);
+        left->imu = true;
+        left->idle = false;
+        left->events = 0;
+        left->odr = 0;
+        left->delayed = delayed;
+        left->sample_count = count1;
+        left->read_time = r1.read_time;
+        left->overrun = imu1.FIFO_Overrun();
+        left->backlog = imu1.FIFO_Backlog();
+        right->imu = false;
+        right->idle = false;
+        right->events = 0;
+        right->odr = 0;
+        right->delayed = left->delayed;
+        right->sample_count = count2;
+        right->read_time = r2.read_time;
+        right->overrun = imu2.FIFO_Overrun();
+        right->backlog = imu2.FIFO_Backlog();
+        rings.left.commit();
+        rings.right.commit();
+        xTaskNotifyGive(logger);
+
+        if (rings.right.size() > SENSOR_RING_DEPTH / 2)
+            printf("**********   Warning: sensor rings have %lu messages pending\n", (unsigned long)rings.right.size());
+
+        update_led();
+    }
+}
+#endif
+
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+static void IRAM_ATTR hub_done(void *arg, int32_t status)
+{
+    ParallelRead *r = (ParallelRead *)arg;
+    r->read_time = esp_timer_get_time();
+    notify_done(r->task);
+}
+
+/// @brief Read imu1 at each wake, with imu2's samples in its FIFO (see
+/// hub.h), and queue each read for the logger.  Never returns.
+static void read_hub(LSMExtension &imu1, QueueHandle_t q)
+{
+    ParallelRead r = {xTaskGetCurrentTaskHandle(), 0};
+    while (1)
+    {
+#if ACTIVITY_WAKE
+        if (merger_wants_idle())
+            idle_until_activity(imu1, nullptr, [q]() { queue_idle(q); });
+#endif
+#if ACTIVITY_EVENTS
+        if (activity_pending())
+        {
+            read_activity(imu1);
+            queue_activity(q);
+        }
+#endif
+        bool delayed = pacer.wait();
+        LoggerMsg &msg = dma_arena.reader[0];
+        uint16_t count = 0;
+        if (LSM6DSV16X_OK != imu1.Read_FIFO_Batch(RATE.max_records, msg.records, hub_done, &r))
+        {
+            printf("LSM6DSV16X Sensor failed to queue FIFO read\n");
+            vTaskSuspend(NULL);
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (LSM6DSV16X_OK != imu1.Finish_FIFO_Batch(&count))
+        {
+            printf("LSM6DSV16X Sensor failed to read FIFO data\n");
+            vTaskSuspend(NULL);
+        }
+        msg.imu = true;
+        msg.delayed = delayed;
+        msg.sample_count = count;
+        msg.read_time = r.read_time;
+        msg.overrun = imu1.FIFO_Overrun();
+        msg.backlog = imu1.FIFO_Backlog();
+        enqueue(msg, q);
+        update_led();
+    }
+}
+#endif
 
 extern "C" void app_main()
 {
@@ -61,13 +483,46 @@ extern "C" void app_main()
     // and idf.py monitor seem to be able to handle about 20k characters/sec,
     // which is only about 200 kbaud.
     Serial.begin(8 * 115200);
-    printf("Min stack: %d\n", uxTaskGetStackHighWaterMark(NULL));
+    memory_register_task("reader", xTaskGetCurrentTaskHandle(), READER_STACK_BYTES);
+    // Above the logger, which app_main's default priority isn't.
+    vTaskPrioritySet(NULL, READER_PRIORITY);
 
+#if SELF_TEST
     test_fitter();
-    printf("Min stack: %d\n", uxTaskGetStackHighWaterMark(NULL));
+    test_unpack_records();
     // test_reproject();
     test_imu_tracker();
-    printf("Min stack: %d\n", uxTaskGetStackHighWaterMark(NULL));
+    test_skew_scheduler();
+    test_gap_detection();
+    test_gyro_channel();
+    test_merger_control();
+    test_merger_restart();
+    test_merger_rate();
+    test_bell_integrator();
+    test_output_tiers();
+    test_recording();
+    test_capture();
+    test_blackbox();
+    test_control();
+    test_metrics();
+    test_transport();
+    test_spi_transport();
+    test_mock_bus();
+    test_overlapped_reader();
+    test_pacer_control();
+    test_read_pacer();
+    test_batched_config();
+    test_fifo_compression();
+    test_sensor_hub();
+    test_activity();
+    test_phase_estimator();
+    benchmark_merge();
+    benchmark_bell();
+    benchmark_phase();
+    benchmark_unpack();
+    benchmark_blackbox();
+#endif
+    memory_report();
     // vTaskSuspend(NULL);
 
     // turn on the TFT / I2C power supply
@@ -75,7 +530,7 @@ extern "C" void app_main()
     digitalWrite(TFT_I2C_POWER, HIGH);
     delay(100);
 
-    // setup_tft();
+    start_dashboard();
 
     pinMode(13, OUTPUT);
     digitalWrite(13, HIGH);
@@ -84,54 +539,196 @@ extern "C" void app_main()
 
     printf("TFT should show text now\n");
 
-    Wire.begin(3, 4, 1000000);
-    auto imu1 = init_lsm(&Wire, LSM6DSV16X_I2C_ADD_L);
-    auto imu2 = init_lsm(&Wire, LSM6DSV16X_I2C_ADD_H);
-    imu1.Disable_G();
-    imu2.Disable_G();
+#if SENSOR_TRANSPORT == TRANSPORT_WIRE
+    Wire.begin(SENSOR_SDA, SENSOR_SCL, SENSOR_I2C_HZ);
+    auto imu1 = init_lsm(&Wire, LSM6DSV16X_I2C_ADD_L, BELL_ANGLE, FIFO_COMPRESSION);
+    auto imu2 = init_lsm(&Wire, LSM6DSV16X_I2C_ADD_H, false, FIFO_COMPRESSION);
+#elif SENSOR_TRANSPORT == TRANSPORT_SPI
+    EspSpiPort::init_bus(SPI3_HOST, SENSOR_SPI_MOSI, SENSOR_SPI_MISO, SENSOR_SPI_SCK);
+    static EspSpiPort port1(SPI3_HOST, SENSOR1_CS);
+    static EspSpiPort port2(SPI3_HOST, SENSOR2_CS);
+    static SPITransport bus1(&port1);
+    static SPITransport bus2(&port2);
+    auto imu1 = init_lsm(&bus1, BELL_ANGLE, FIFO_COMPRESSION);
+    auto imu2 = init_lsm(&bus2, false, FIFO_COMPRESSION);
+#elif SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    // imu2 is on imu1's auxiliary bus.  It's configured through pass-through,
+    // then imu1's sensor hub reads it into imu1's FIFO.
+    auto bus = I2CMasterTransport::new_bus(I2C_NUM_0, SENSOR_SDA, SENSOR_SCL);
+    static I2CMasterTransport bus1(bus, LSM6DSV16X_I2C_ADD_L);
+    static I2CMasterTransport bus2(bus, LSM6DSV16X_I2C_ADD_H);
+    auto imu1 = init_lsm(&bus1, BELL_ANGLE);
+    imu1.Set_Sensor_Hub_Pass_Through(true);
+    auto imu2 = init_lsm(&bus2, false);
+    if (LSM6DSV16X_OK != imu1.Set_Sensor_Hub_Pass_Through(false) ||
+        LSM6DSV16X_OK != imu1.Enable_Sensor_Hub(LSM6DSV16X_I2C_ADD_H))
+    {
+        printf("LSM6DSV16X Sensor failed to start the sensor hub\n");
+        vTaskSuspend(NULL);
+    }
+#elif SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+    // Each sensor has its own controller, so the two can transfer concurrently.
+    static I2CMasterTransport bus1(I2CMasterTransport::new_bus(I2C_NUM_0, SENSOR_SDA, SENSOR_SCL), LSM6DSV16X_I2C_ADD_L);
+    static I2CMasterTransport bus2(I2CMasterTransport::new_bus(I2C_NUM_1, SENSOR2_SDA, SENSOR2_SCL), LSM6DSV16X_I2C_ADD_H);
+    auto imu1 = init_lsm(&bus1, BELL_ANGLE, FIFO_COMPRESSION);
+    auto imu2 = init_lsm(&bus2, false, FIFO_COMPRESSION);
+#else
+    auto bus = I2CMasterTransport::new_bus(I2C_NUM_0, SENSOR_SDA, SENSOR_SCL);
+    static I2CMasterTransport bus1(bus, LSM6DSV16X_I2C_ADD_L);
+    static I2CMasterTransport bus2(bus, LSM6DSV16X_I2C_ADD_H);
+    auto imu1 = init_lsm(&bus1, BELL_ANGLE, FIFO_COMPRESSION);
+    auto imu2 = init_lsm(&bus2, false, FIFO_COMPRESSION);
+#endif
     printf("LSM initialized\n");
+#ifdef ACTIVITY_PROGRAM
+    // Before imu1 first goes into Slow() mode, so the program runs asleep and streaming.
+    gpio_set_direction((gpio_num_t)SENSOR1_INT1, GPIO_MODE_INPUT);
+    if (LSM6DSV16X_OK != imu1.Load_Program(activity_program))
+    {
+        printf("LSM6DSV16X Sensor failed to load the activity program\n  Suspending!\n");
+        vTaskSuspend(NULL);
+    }
+#endif
+#if ACTIVITY_WAKE
+    // imu2 keeps running, so both sensors' FIFOs start empty below.
+    sleep_until_activity(imu1, BELL_ANGLE);
+#endif
+
+    // Start from the saved clock model if it matches these sensors, otherwise
+    // from the factory trim, so merging starts within a few reads.
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    // imu2 is sampled on imu1's clock, and is only reachable through the hub.
+    ClockModel seed = seed_clock_model(imu1.Get_Rate_Adjustment(), imu1.Get_Rate_Adjustment());
+#else
+    ClockModel seed = seed_clock_model(imu1.Get_Rate_Adjustment(), imu2.Get_Rate_Adjustment());
+#endif
+    ClockModel saved;
+    if (load_clock_model(&saved) && clock_model_plausible(saved, seed))
+        seed = saved;
+    printf("Clock model: %.3f %.3f usec, skew %.1f ppm\n", seed.left_period, seed.right_period, 1e6f * seed.skew);
+    seed_merger(seed);
+    // Saving writes NVS, which stalls the readers, so only on the way down.
+    esp_register_shutdown_handler([]() { save_merger_clock_model(); });
+#if SENSOR_ACQUISITION != ACQUISITION_SENSOR_HUB
+    // Through the hub, both sides are on imu1's clock, so there is no phase to refine.
+    static PhaseEstimator phase;
+    phase.task = start_phase_task(phase_task, &phase);
+    phase_merger(&phase);
+#endif
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    metrics_sensors(&imu1, nullptr);
+#else
+    metrics_sensors(&imu1, &imu2);
+#endif
+    // Keep the raw reads, for dumps, if there is PSRAM.
+    size_t blackbox_bytes;
+    if (uint8_t *storage = blackbox_storage(&blackbox_bytes))
+    {
+        static BlackBox blackbox;
+        blackbox.begin(storage, blackbox_bytes, RATE.odr, RATE.read_interval_usec(), print_dump,
+                       merger_output_bytes());
+        blackbox_merger(&blackbox);
+        printf("Black box: %u bytes\n", (unsigned)blackbox_bytes);
+    }
+
+    paced[0] = &imu1;
+#if SENSOR_ACQUISITION != ACQUISITION_SENSOR_HUB
+    paced[1] = &imu2;
+#endif
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+    imu1.FIFO_Flush();
+    imu2.FIFO_Flush();
+    read_parallel(imu1, imu2);
+#else
 
     // Start logger task
-    QueueHandle_t q = xQueueCreate(40, sizeof(LoggerMsg));
-    TaskHandle_t xHandle = NULL;
-    xTaskCreate(
-        logger_task, /* Function that implements the task. */
-        "LoggerTask",
-        8192,             /* Stack size in words, not bytes. */
-        (void *)q,        /* Parameter passed into the task. */
-        tskIDLE_PRIORITY, /* Priority at which the task is created. */
-        &xHandle);
-
-    int led = HIGH;
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    LoggerMsg msg;
-    while (read_all(imu1, msg.records, 32) > 4)
-        ;
-    while (read_all(imu2, msg.records, 32) > 4)
-        ;
-
-    xTaskDelayUntil(&xLastWakeTime, 2);
+    QueueHandle_t q = logger_queue();
+    start_logger_task(logger_task, (void *)q);
+
+    pacer.begin(esp_timer_get_time());
+    imu1.FIFO_Flush();
+#if SENSOR_ACQUISITION != ACQUISITION_SENSOR_HUB
+    imu2.FIFO_Flush();
+#endif
+
+    pacer.wait();
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    read_hub(imu1, q);
+#elif SENSOR_TRANSPORT != TRANSPORT_WIRE
+    // Each period starts one sensor's transfer, then queues the other's
+    // message while the bus is busy.
+    static OverlappedReader reader(imu1, imu2, dma_arena.reader, enqueue, q);
+    reader.begin();
+    while (1)
+    {
+        uint16_t odr;
+        uint8_t gyro_decimation;
+        if (merger_wants_rate(&odr, &gyro_decimation))
+        {
+            reader.drain();
+            change_rate(imu1, imu2, odr, gyro_decimation, [&]() { queue_rate(q, odr, gyro_decimation); });
+        }
+#if ACTIVITY_WAKE
+        if (merger_wants_idle())
+        {
+            reader.drain();
+            idle_until_activity(imu1, &imu2, [q]() { queue_idle(q); });
+        }
+#endif
+#if ACTIVITY_EVENTS
+        if (activity_pending())
+        {
+            // The status read needs the bus to itself.
+            reader.drain();
+            read_activity(imu1);
+            queue_activity(q);
+        }
+#endif
+        reader.step(pacer.wait());
+        update_led();
+    }
+#else
     bool toggle = false;
     while (1)
     {
-        auto delayed = xTaskDelayUntil(&xLastWakeTime, 2);
+        uint16_t odr;
+        uint8_t gyro_decimation;
+        if (merger_wants_rate(&odr, &gyro_decimation))
+            change_rate(imu1, imu2, odr, gyro_decimation, [&]() { queue_rate(q, odr, gyro_decimation); });
+#if ACTIVITY_WAKE
+        if (merger_wants_idle())
+            idle_until_activity(imu1, &imu2, [q]() { queue_idle(q); });
+#endif
+#if ACTIVITY_EVENTS
+        if (activity_pending())
+        {
+            read_activity(imu1);
+            queue_activity(q);
+        }
+#endif
+        bool delayed = pacer.wait();
         if (true)
         {
-            LoggerMsg msg;
+            LoggerMsg &msg = dma_arena.reader[0];
             int actual = 0;
             msg.imu = toggle;
-            msg.delayed = delayed == pdTRUE ? true : false;
+            msg.delayed = delayed;
             if (toggle)
             {
-                actual = read_all(imu1, msg.records, 32);
+                actual = read_all(imu1, msg.records, RATE.max_records);
+                msg.overrun = imu1.FIFO_Overrun();
+                msg.backlog = imu1.FIFO_Backlog();
             }
             else
             {
-                actual = read_all(imu2, msg.records, 32);
+                actual = read_all(imu2, msg.records, RATE.max_records);
+                msg.overrun = imu2.FIFO_Overrun();
+                msg.backlog = imu2.FIFO_Backlog();
             }
+            pace_read(toggle);
             toggle = !toggle;
             msg.read_time = esp_timer_get_time();
-            if (actual > 32)
+            if (actual > RATE.max_records)
             {
                 printf("Bad actual count %d\n", actual);
                 esp_backtrace_print(10);
@@ -140,18 +737,15 @@ extern "C" void app_main()
             msg.sample_count = actual;
             xQueueSend(q, &msg, 0);
 
-            if (20 < uxQueueMessagesWaiting(q))
+            if (LOGGER_QUEUE_DEPTH / 2 < uxQueueMessagesWaiting(q))
             {
                 printf("**********   Warning: logger queue has %d messages pending\n", uxQueueMessagesWaiting(q));
                 vTaskSuspend(NULL);
             }
         }
 
-        auto ticks = xTaskGetTickCount();
-        if (ticks / 1000 % 2 != led)
-        {
-            led = led ^ 1;
-            digitalWrite(13, led);
-        }
+        update_led();
     }
+#endif
+#endif
 }
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+
+#include "blackbox.h"
+#include "memory.h"
+
+DMA_ATTR DmaArena dma_arena;
+
+static StaticQueue_t logger_queue_state;
+static uint8_t logger_queue_storage[LOGGER_QUEUE_BYTES];
+static StackType_t logger_stack[LOGGER_STACK_BYTES];
+static StaticTask_t logger_task_state;
+static StaticQueue_t dashboard_mailbox_state;
+static uint8_t dashboard_mailbox_storage[sizeof(DashboardStats)];
+static StackType_t display_stack[DISPLAY_STACK_BYTES];
+static StaticTask_t display_task_state;
+static StackType_t phase_stack[PHASE_STACK_BYTES];
+static StaticTask_t phase_task_state;
+
+struct TrackedTask
+{
+    const char *name;
+    TaskHandle_t handle;
+    uint32_t stack_bytes;
+};
+
+static TrackedTask tasks[MEMORY_MAX_TASKS];
+static int task_count = 0;
+static size_t blackbox_bytes = 0;
+
+QueueHandle_t logger_queue()
+{
+    static QueueHandle_t queue = nullptr;
+    if (queue == nullptr)
+        queue = xQueueCreateStatic(LOGGER_QUEUE_DEPTH, sizeof(LoggerMsg), logger_queue_storage, &logger_queue_state);
+    return queue;
+}
+
+TaskHandle_t start_logger_task(TaskFunction_t task, void *arg)
+{
+    TaskHandle_t handle = xTaskCreateStatic(task, "LoggerTask", LOGGER_STACK_BYTES, arg, LOGGER_PRIORITY,
+                                            logger_stack, &logger_task_state);
+    memory_register_task("logger", handle, LOGGER_STACK_BYTES);
+    return handle;
+}
+
+QueueHandle_t dashboard_mailbox()
+{
+    static QueueHandle_t queue = nullptr;
+    if (queue == nullptr)
+        queue = xQueueCreateStatic(1, sizeof(DashboardStats), dashboard_mailbox_storage, &dashboard_mailbox_state);
+    return queue;
+}
+
+TaskHandle_t start_display_task(TaskFunction_t task, void *arg)
+{
+    TaskHandle_t handle = xTaskCreateStatic(task, "DisplayTask", DISPLAY_STACK_BYTES, arg, DISPLAY_PRIORITY,
+                                            display_stack, &display_task_state);
+    memory_register_task("display", handle, DISPLAY_STACK_BYTES);
+    return handle;
+}
+
+TaskHandle_t start_phase_task(TaskFunction_t task, void *arg)
+{
+    // Off the reader's core, and below the logger, which it must never hold up.
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(task, "PhaseTask", PHASE_STACK_BYTES, arg, PHASE_PRIORITY,
+                                                        phase_stack, &phase_task_state, PHASE_CORE);
+    memory_register_task("phase", handle, PHASE_STACK_BYTES);
+    return handle;
+}
+
+uint8_t *blackbox_storage(size_t *bytes)
+{
+#if CONFIG_SPIRAM
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    if (largest > BLACKBOX_RESERVE_BYTES + 4 * BLACKBOX_MAX_PACKED_BYTES)
+    {
+        *bytes = std::min((size_t)BLACKBOX_BYTES, largest - BLACKBOX_RESERVE_BYTES);
+        uint8_t *ring = (uint8_t *)heap_caps_malloc(*bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (ring != nullptr)
+        {
+            blackbox_bytes = *bytes;
+            return ring;
+        }
+    }
+    printf("Problem: black box off: %u bytes of PSRAM free\n", (unsigned)largest);
+#else
+    printf("Black box off: no PSRAM (enable CONFIG_SPIRAM)\n");
+#endif
+    *bytes = 0;
+    return nullptr;
+}
+
+void memory_register_task(const char *name, TaskHandle_t task, uint32_t stack_bytes)
+{
+    if (task_count == MEMORY_MAX_TASKS)
+    {
+        printf("Problem: more than %d tasks to track\n", MEMORY_MAX_TASKS);
+        return;
+    }
+    tasks[task_count++] = {name, task, stack_bytes};
+}
+
+void task_run_times(MetricsTotals &totals)
+{
+    totals.tasks_known = 0;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    for (int i = 0; i < task_count; i++)
+        for (int slot = 0; slot < METRICS_MAX_TASKS; slot++)
+            if (strcmp(tasks[i].name, metrics_task_names[slot]) == 0)
+            {
+                totals.task_usec[slot] = ulTaskGetRunTimeCounter(tasks[i].handle);
+                totals.tasks_known |= 1 << slot;
+            }
+#endif
+}
+
+void memory_report()
+{
+    printf("Memory plan: %u of %u bytes: DMA arena %u of %u, logger queue %u (%d x %u), logger stack %u, "
+           "display stack %u, phase estimator %u and stack %u, other statics %u\n",
+           (unsigned)STATIC_PLAN_BYTES, (unsigned)STATIC_SRAM_BUDGET_BYTES, (unsigned)sizeof(DmaArena),
+           (unsigned)DMA_BUDGET_BYTES, (unsigned)LOGGER_QUEUE_BYTES, LOGGER_QUEUE_DEPTH,
+           (unsigned)sizeof(LoggerMsg), (unsigned)LOGGER_STACK_BYTES, (unsigned)DISPLAY_STACK_BYTES,
+           (unsigned)sizeof(PhaseEstimator), (unsigned)PHASE_STACK_BYTES, (unsigned)PIPELINE_STATIC_BYTES);
+    for (int i = 0; i < task_count; i++)
+    {
+        // ESP-IDF counts stacks in bytes, so the high water mark is bytes never used.
+        uint32_t unused = uxTaskGetStackHighWaterMark(tasks[i].handle);
+        printf("  %-8s stack: %lu of %lu bytes used\n", tasks[i].name,
+               (unsigned long)(tasks[i].stack_bytes - unused), (unsigned long)tasks[i].stack_bytes);
+    }
+    printf("  heap: %u internal free (minimum %u), %u DMA capable, largest DMA block %u\n",
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_DMA),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DMA));
+    if (blackbox_bytes > 0)
+        printf("  black box: %u bytes of PSRAM\n", (unsigned)blackbox_bytes);
+#if !CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    printf("  CPU shares off: no run time stats (enable CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)\n");
+#endif
+}
+
+void maybe_report_memory(int64_t now)
+{
+    static int64_t next = MEMORY_REPORT_USEC;
+    if (now < next)
+        return;
+    next = now + MEMORY_REPORT_USEC;
+    memory_report();
+}
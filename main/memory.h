@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "IMU.h"
+#include "blackbox.h"
+#include "dashboard.h"
+#include "merge.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "phase.h"
+#include "rate.h"
+#include "reader.h"
+
+// The static memory plan.  Everything the acquisition pipeline uses is
+// allocated here, or sized here and checked with a static_assert where it is
+// defined, so that a faster rate profile or another sensor that doesn't fit
+// fails the build instead of the device.  Nothing in the pipeline allocates
+// after boot.  The black box's ring (see blackbox.h) is outside the plan: it
+// is allocated once, at boot, in PSRAM.  The self tests' fixtures are only
+// compiled in with SELF_TEST (see rate.h), so they take nothing here.
+
+// Reads the ping pong logger queue holds.  The reader stops at half of this.
+#define LOGGER_QUEUE_DEPTH 40
+// Task stacks, in bytes, as ESP-IDF's FreeRTOS counts them.  The logger runs
+// the merger and formats the output.
+#define LOGGER_STACK_BYTES 8192
+// The reader runs in app_main, whose stack is set in sdkconfig.
+#define READER_STACK_BYTES CONFIG_ESP_MAIN_TASK_STACK_SIZE
+// The dashboard only formats a few lines of text.
+#define DISPLAY_STACK_BYTES 3072
+// Task priorities.  The reader preempts the rest of the pipeline, and the
+// phase estimator, on the other core, yields to the logger, which must keep
+// up with the reader.  The display sleeps between updates, and the pixels go
+// by DMA, so it can share the logger's priority.
+#define READER_PRIORITY (tskIDLE_PRIORITY + 2)
+#define LOGGER_PRIORITY (tskIDLE_PRIORITY + 1)
+#define DISPLAY_PRIORITY LOGGER_PRIORITY
+#define PHASE_PRIORITY tskIDLE_PRIORITY
+
+// Budgets.  The ESP32-S3 has about 320 kB of DRAM for the application, and
+// Arduino, the drivers and the TFT take a good part of it, so the pipeline
+// keeps to a fixed share.  The largest profile, 7680 Hz with BELL_ANGLE, needs
+// about 13 kB for the merger, 15 kB of sensor rings with parallel acquisition,
+// 6 kB of dashboard strips and 5 kB for the black box's buffers, and 81 kB in
+// all.  Raising a budget is fine, as long as it's deliberate.
+#define MERGER_BUDGET_BYTES (16 * 1024)
+#define DMA_BUDGET_BYTES (24 * 1024)
+#define STATIC_SRAM_BUDGET_BYTES (88 * 1024)
+
+// Tasks memory_report() can track.
+#define MEMORY_MAX_TASKS 4
+// Interval between reports from the logger task.
+#define MEMORY_REPORT_USEC (600 * 1000000LL)
+
+/// @brief Buffers that DMA transfers read or write.  DMA_ATTR keeps them in
+/// internal RAM and word aligned, as the SPI driver needs for DMA.
+struct DmaArena
+{
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+    SensorRings rings; // The parallel reader fills ring entries in place.
+#elif SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    LoggerMsg reader[1]; // imu1's read in flight.  imu2 comes through its FIFO.
+#else
+    LoggerMsg reader[2]; // Reads in flight, one per sensor (see OverlappedReader).
+#endif
+    lsm6dsv16x_fifo_record_t slow[MAX_FIFO_BURST]; // LSMExtension::HandleSlow.
+    uint16_t display[2][DASHBOARD_STRIP_PIXELS];    // Dashboard strips, sent to the TFT.
+};
+
+extern DmaArena dma_arena;
+
+constexpr size_t LOGGER_QUEUE_BYTES = LOGGER_QUEUE_DEPTH * sizeof(LoggerMsg);
+// The rest of the pipeline's statics: the black box, with its packing buffers,
+// and its dump's line, the metrics, the reader's pacer, and the
+// OverlappedReader, which only ping pong over an async transport uses.
+constexpr size_t PIPELINE_STATIC_BYTES = sizeof(BlackBox) + BLACKBOX_DUMP_TEXT_BYTES + sizeof(Metrics) +
+                                         sizeof(ReadPacer) + sizeof(OverlappedReader);
+// The DMA arena, the logger's queue, receive buffer and stack, the merger,
+// the dashboard's mailbox and stack, the phase estimator and its stack, and
+// the rest.
+constexpr size_t STATIC_PLAN_BYTES = sizeof(DmaArena) + LOGGER_QUEUE_BYTES + sizeof(LoggerMsg) +
+                                     LOGGER_STACK_BYTES + MERGER_BUDGET_BYTES + sizeof(DashboardStats) +
+                                     DISPLAY_STACK_BYTES + sizeof(PhaseEstimator) + PHASE_STACK_BYTES +
+                                     PIPELINE_STATIC_BYTES;
+
+static_assert(sizeof(DmaArena) <= DMA_BUDGET_BYTES, "DMA buffers exceed the DMA budget");
+static_assert(STATIC_PLAN_BYTES <= STATIC_SRAM_BUDGET_BYTES, "The static memory plan exceeds its SRAM budget");
+
+/// @brief The ping pong logger queue, in static storage.  Created on the first call.
+QueueHandle_t logger_queue();
+
+/// @brief Start the logger task on its static stack.
+TaskHandle_t start_logger_task(TaskFunction_t task, void *arg);
+
+/// @brief The latest DashboardStats, a queue of one that the logger overwrites.
+QueueHandle_t dashboard_mailbox();
+
+/// @brief Start the display task on its static stack.
+TaskHandle_t start_display_task(TaskFunction_t task, void *arg);
+
+/// @brief Start the phase task (see phase.h) on its static stack, on PHASE_CORE.
+TaskHandle_t start_phase_task(TaskFunction_t task, void *arg);
+
+/// @brief Allocate the black box ring in PSRAM, up to BLACKBOX_BYTES, leaving
+/// BLACKBOX_RESERVE_BYTES.  PSRAM is enabled with CONFIG_SPIRAM, in
+/// sdkconfig.defaults.
+/// @return The ring, with its size in bytes, or nullptr without PSRAM.
+uint8_t *blackbox_storage(size_t *bytes);
+
+/// @brief Track a task's stack in memory_report().
+void memory_register_task(const char *name, TaskHandle_t task, uint32_t stack_bytes);
+
+/// @brief Each tracked task's run time, by METRICS_TASK_* slot, from FreeRTOS
+/// run time stats.  sdkconfig.defaults turns on
+/// CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, with the esp_timer as the clock,
+/// so run times are in usec.  Without them, no task is known.
+void task_run_times(MetricsTotals &totals);
+
+/// @brief Print the static plan, each tracked task's stack use, and the free heap.
+void memory_report();
+
+/// @brief memory_report() every MEMORY_REPORT_USEC.
+void maybe_report_memory(int64_t now);
@@ -1,443 +1,777 @@
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include "Arduino.h"
 #include <string>
-#include "esp_debug_helpers.h"
 
 #include "lsm6dsv16x_reg.h"
 #include "IMU.h"
 
+#include "activity.h"
+#include "bell.h"
+#include "blackbox.h"
+#include "capture.h"
+#include "clock_model.h"
+#include "control.h"
+#include "dashboard.h"
+#include "recording.h"
 #include "fitter.h"
+#include "hub.h"
+#include "memory.h"
 #include "merge.h"
+#include "metrics.h"
+#include "phase.h"
+#include "sim.h"
+#include "tiers.h"
+#include "tracker.h"
+#include "unpack.h"
 
-/// @brief Reproject samples using linear interpolation.
-/// @param last  The last sample prior to the message.
-/// @param msg The message to reproject.
-/// @param start The fractional start position (<= 1.0).
-/// @param increment The fractional step size (usually < 1.0).
+// This module merges data from two IMUs.  It leaves the faster
+// IMU data unchanged, and interpolates the slower IMU data to
+// match the timing of the faster IMU data.
+
+// Merged output ring, in blocks.  One side can run this far ahead of the other.
+#define MERGE_BLOCKS 4
+// Largest phase refinement offset, in reference samples.
+#define PHASE_MAX_OFFSET_SAMPLES PHASE_MAX_LAG
+
+static_assert(sizeof(lsm6dsv16x_fifo_record_t) == CAPTURE_RECORD_BYTES, "Captures store raw FIFO records");
+static_assert(ACTIVITY_MAX_EVENTS * sizeof(ActivityEvent) <= sizeof(LoggerMsg::records),
+              "A message carries a status read's events in place of its records");
+
+// Gyro samples kept for placing on merged blocks.  imu1 can be the ring of
+// blocks, and a read, ahead of the oldest block still to output.  A larger
+// decimation, after CONTROL_RATE, needs fewer.
+#define GYRO_RING_DEPTH ((MERGE_BLOCKS * RATE.block_samples + RATE.max_records) / GYRO_DECIMATION + 2)
+
+// The rate a CONTROL_RATE command is waiting for, as odr << 8 | gyro
+// decimation, or 0.  Set by the logger at a block boundary, and cleared when
+// it takes the reader's rate message.
+static std::atomic<uint32_t> rate_wanted{0};
+
+/// @brief imu1's gyro, batched at SENSOR_ODR / GYRO_DECIMATION, or slower
+/// after CONTROL_RATE.
 ///
-/// Performance - about 30 usec for 8 samples, with debug.
-LoggerMsg reproject(const int16_t last[3], const LoggerMsg &msg, float start, float increment)
+/// The gyro has its own sample count and clock model, and is placed on the
+/// merged index by time, interpolating between its samples, as the skew
+/// scheduler does for the other sensor.  Gyro sample j shares a FIFO time
+/// slot with accelerometer sample j * decimation, and follows it in the
+/// FIFO, which is how lost gyro samples, and those left in the FIFO, are
+/// counted.
+class GyroChannel
 {
-    LoggerMsg projected;
-    int16_t *a = (int16_t *)last;
-    int n = 0; // The output index.
+private:
+    int16_t ring[GYRO_RING_DEPTH][3]; // Sample j is at j % GYRO_RING_DEPTH.
+    long valid_from = 0;              // First sample in the ring since the last gap.
 
-    float alpha = start;
-    int k = (int)(alpha);
-    alpha -= k;
-    if (k == 0)
-    {
-        // printf("Reproject k=%d n=%d alpha=%f\n", k, n, alpha);
+public:
+    long count = 0;     // Gyro samples so far, including lost ones.
+    long lost = 0;      // Gyro samples lost.
+    long msg_count = 0; // Messages with gyro samples.
+    // Accelerometer samples per gyro sample, GYRO_DECIMATION, or more after CONTROL_RATE.
+    long decimation = GYRO_DECIMATION;
+    TimeFitter fitter;
 
-        int16_t *b = (int16_t *)msg.records[k].data;
-        int16_t *out = (int16_t *)projected.records[n++].data;
-        for (int i = 0; i < 3; i++)
-        {
-            float value = a[i] + alpha * (b[i] - a[i]);
-            out[i] = (int16_t)value;
-        }
-        alpha += increment;
-        if (alpha >= 1.0f)
-        {
-            k++;
-            a = b;
-            alpha -= 1.0f;
-        }
+    GyroChannel() : fitter(RATE.fit_alpha) {}
+
+    /// @brief Start the fitter from a known sample period, in usec per gyro sample.
+    void seed(float period)
+    {
+        fitter.set_prior(period, CLOCK_PRIOR_WEIGHT);
     }
 
-    while (k < msg.sample_count && n < 32)
+    /// @brief Count from zero again, with a fresh fitter, after the sensor
+    /// stopped streaming.  The losses carry on.
+    void restart()
     {
-        // printf("Reproject k=%d n=%d alpha=%f\n", k, n, alpha);
+        valid_from = 0;
+        count = 0;
+        msg_count = 0;
+        fitter = TimeFitter(RATE.fit_alpha);
+    }
 
-        int16_t *b = (int16_t *)msg.records[k].data;
-        int16_t *out = (int16_t *)projected.records[n++].data;
-        for (int i = 0; i < 3; i++)
+    /// @brief Add the gyro records of a message.
+    /// @param records The message's records, unpacked.
+    /// @param first Accelerometer sample index of the message's first
+    /// accelerometer record, counting lost samples.
+    void update(const LoggerMsg &msg, const UnpackedRecords &records, long first)
+    {
+        long xl = first; // Accelerometer samples before the current record.
+        bool any = false;
+        for (int i = 0; i < records.count; i++)
         {
-            float value = a[i] + alpha * (b[i] - a[i]);
-            out[i] = (int16_t)value;
+            uint8_t tag = records.tag[i];
+            if (tag == LSM6DSV16X_XL_NC_TAG)
+                xl++;
+            if (tag != LSM6DSV16X_GY_NC_TAG)
+                continue;
+            // The slot of the accelerometer sample this follows.
+            long j = xl > 0 ? (xl - 1) / decimation : 0;
+            if (j < count)
+                continue; // A duplicate, or a gyro record out of step.
+            if (j > count)
+            {
+                lost += j - count;
+                valid_from = j;
+            }
+            for (int a = 0; a < 3; a++)
+                ring[j % GYRO_RING_DEPTH][a] = records.axis[a][i];
+            count = j + 1;
+            any = true;
         }
-        alpha += increment;
-        if (alpha >= 1.0f)
+        if (!any)
+            return;
+        msg_count++;
+        // Gyro slots among the accelerometer samples left in the FIFO.
+        const long D = decimation;
+        long left = (xl + msg.backlog + D - 1) / D - (xl + D - 1) / D;
+        fitter.coord(count + left, msg.read_time);
+    }
+
+    /// @brief The gyro at merged time t, as Merger times samples.
+    /// @return false if t isn't in the ring, or the fit hasn't started.
+    bool at(int64_t t, int16_t out[3]) const
+    {
+        if (msg_count < 2)
+            return false;
+        // Merged sample n is timed at the end of sample n - 1, an accelerometer
+        // period before it is written.  Gyro sample j is written with
+        // accelerometer sample j * decimation, so at count j + 1.  The
+        // fit is of whole gyro counts, ceil(N / D) for N accelerometer
+        // samples written, which on average is N / D a gyro sample after it
+        // was written, (D - 1) / 2 accelerometer periods later than N / D.
+        float period = fitter.slope() / decimation;
+        auto [k, frac] = fitter.sample_for(t + lrintf(period * (decimation + 1) / 2));
+        long j = k - 1;
+        if (j < valid_from || j < count - GYRO_RING_DEPTH || j > count)
+            return false;
+        if (j + 1 < count)
         {
-            k++;
-            a = b;
-            alpha -= 1.0f;
+            const int16_t *a = ring[j % GYRO_RING_DEPTH];
+            const int16_t *b = ring[(j + 1) % GYRO_RING_DEPTH];
+            for (int i = 0; i < 3; i++)
+                out[i] = (int16_t)lrintf(a[i] + frac * (b[i] - a[i]));
+            return true;
         }
+        // Past the newest sample, whose successor comes with a later
+        // accelerometer sample.  Extrapolate along the last step, rather than
+        // hold, which would be up to a gyro period late.
+        long last = count - 1;
+        float steps = j - last + frac;
+        const int16_t *a = ring[last % GYRO_RING_DEPTH];
+        const int16_t *p = last > valid_from ? ring[(last - 1) % GYRO_RING_DEPTH] : a;
+        // A saturated axis can extrapolate past the int16 range; clamp it
+        // rather than let the narrowing wrap it to the opposite sign.
+        for (int i = 0; i < 3; i++)
+            out[i] = (int16_t)std::clamp(lrintf(a[i] + steps * (a[i] - p[i])), (long)INT16_MIN, (long)INT16_MAX);
+        return true;
     }
+};
 
-    projected.sample_count = n;
-    projected.read_time = msg.read_time;
+/// @brief Merges data from two IMUs.
+///
+/// The faster IMU is the reference, and its samples pass through unchanged.
+/// The other IMU is resampled onto the reference clock by a SkewScheduler.
+/// Merged samples are indexed by reference sample, so both streams land in
+/// the same slot of a fixed ring of blocks, and a block is output once both
+/// have filled it.
+///
+/// Merging starts once both trackers have seen warmup messages.  Unseeded,
+/// that is long enough for the fitters to settle.  Seeded from a saved
+/// ClockModel, the slopes are already known, and the fitters only need
+/// a couple of points to place the intercept.
+class Merger
+{
+private:
+    static constexpr int capacity = MERGE_BLOCKS * RATE.block_samples;
+    MergeMessage blocks[capacity]; // Ring of merged samples, by reference index.
+    bool started = false;
+    long origin = 0;          // Reference index of blocks[0], less resumed.
+    long resumed = 0;         // Merged index the output carries on from, after a restart.
+    long emitted = 0;         // Reference index of the next sample to output.
+    long filled[2] = {0, 0};  // Next reference index for each side, left then right.
+    bool left_faster = false; // Is left IMU faster?  Fixed once merging starts.
 
-    return projected;
-}
+    IMUTracker left_imu;
+    IMUTracker right_imu;
+    SkewScheduler scheduler;
+    UnpackedRecords unpacked;  // The message being processed, unpacked.
+    UnpackedRecords resampled; // The resampled side's samples, on the reference clock.
+    HubDemux hub;          // Splits sensor hub reads, which carry both sides.
+    bool hub_mode = false; // Whether reads come through the sensor hub.
+    OutputTiers tiers;
+    RecordingWriter *recorder = nullptr;
+    CaptureWriter *capture = nullptr; // Raw input, for offline re-merging.
+    BlackBox *blackbox = nullptr;     // Raw input, kept for dumps.
+    PhaseEstimator *phase = nullptr;  // Refines the resampled side's phase.
+    uint16_t sensor_odr = RATE.odr;   // RATE.odr, or slower after CONTROL_RATE.
+#if BELL_ANGLE
+    BellIntegrator bell; // Integrates imu1's gyro.
+    GyroChannel gyro;    // Places imu1's gyro on the merged blocks.
+    GyroBlock gyro_out;  // The gyro for the block being output.
+#endif
 
-void test_reproject()
-{
-    LoggerMsg msg;
-    msg.sample_count = 4;
-    for (int i = 0; i < msg.sample_count; i++)
+    bool last_imu = false; // Last IMU seen.
+    int warmup = RATE.warmup_msgs; // Messages per tracker before merging starts.
+
+    bool warm() const
     {
-        msg.records[i].data[0] = i * 100;
-        msg.records[i].data[1] = i * 100 + 1;
-        msg.records[i].data[2] = i * 100 + 2;
+        // Through the sensor hub, imu2 is on imu1's clock.
+        return left_imu.msg_count >= warmup && (hub_mode || right_imu.msg_count >= warmup);
     }
-    for (int i = 0; i < msg.sample_count; i++)
+
+    IMUTracker &reference() { return left_faster ? left_imu : right_imu; }
+    IMUTracker &resampled_imu() { return left_faster ? right_imu : left_imu; }
+
+    void output(const MergeMessage *msg, const GyroBlock *gyro_block = nullptr)
     {
-        printf("Initial[%d]: %d %d %d\n", i, msg.records[i].data[0], msg.records[i].data[1], msg.records[i].data[2]);
+        blocks_out++;
+        tiers.add(msg, !quiet, gyro_block);
     }
 
-    int16_t last[3] = {-100, -99, -98};
-    float start = 0.9f;
-    float increment = 0.85f;
-    LoggerMsg projected = reproject(last, msg, start, increment);
-    for (int i = 0; i < projected.sample_count; i++)
+    /// @brief Output a gap record: count merged samples from index, on one side,
+    /// have no data, because lost samples were lost from that IMU.
+    void output_gap(int side, long index, long count, int lost)
     {
-        printf("Projected[%d]: %d %d %d\n", i, projected.records[i].data[0], projected.records[i].data[1], projected.records[i].data[2]);
+        gap_records++;
+        // Keep the zeroed samples out of the phase estimate.
+        if (phase != nullptr)
+            phase->reset(index + count - emitted + RATE.block_samples);
+        if (quiet)
+            return;
+        output_bytes += printf("G %d %ld %ld %d\n", side, index - origin, count, lost);
     }
 
-    assert(projected.sample_count == 4);
-    assert(projected.records[0].data[0] == -10);
-    assert(projected.records[1].data[0] == 75);
-    assert(projected.records[2].data[0] == 160);
-    assert(projected.records[3].data[0] == 245);
-}
+    /// @brief Pass the block to the recorder, if there is one, with the time
+    /// model from the reference fitter.  The model is also printed once per
+    /// chunk, for host side recorders.
+    void record(const MergeMessage *block)
+    {
+        long index = emitted - origin;
+        bool model_due = index % RECORDING_CHUNK_SAMPLES < RATE.block_samples && !quiet;
+        if (!model_due && recorder == nullptr)
+            return;
+        RecordingTime time = {index, reference().time_for(emitted), reference().slope()};
+        if (model_due)
+            output_bytes += printf("T %ld %lld %.4f\n", index, (long long)time.usec, time.period);
+        if (recorder != nullptr)
+        {
+            recorder->set_time(time);
+            recorder->add(index, block->data, RATE.block_samples);
+        }
+    }
 
-// This module merges data from two IMUs.  It leaves the faster
-// IMU data unchanged, and interpolates the slower IMU data to
-// match the timing of the faster IMU data.
+    /// @brief Take up new output settings, from the control channel.
+    void apply_output()
+    {
+        const OutputSettings &settings = control.settings();
+        tiers.set_output(settings.outputs, settings.channels);
+    }
 
-struct MergeMessage
-{
-    int16_t data[6]; // This will translate into 16 bytes of base64.
-};
+    /// @brief Ask the reader for the rate the control channel is waiting on.
+    /// Its settings take effect once the merger is at the new rate (see
+    /// set_rate()).
+    void want_rate()
+    {
+        const OutputSettings &settings = control.requested();
+        rate_wanted.store((uint32_t)settings.odr << 8 | settings.gyro_decimation, std::memory_order_release);
+    }
 
-/// @brief Tracks an individual IMU's data and data rate.
-class IMUTracker
-{
-private:
-    int16_t last_record[3] = {0}; // Last record from previous message.
+    void output_block()
+    {
+        // Settings change between blocks, so every block is output whole.
+        if (control.rate_change())
+            want_rate();
+        else if (control.apply(emitted - origin))
+            apply_output();
+        // A block forced out early has no data yet for one side.
+        for (int side = 0; side < 2; side++)
+            for (long i = std::max(filled[side], emitted); i < emitted + RATE.block_samples; i++)
+                memset(blocks[(i - origin) % capacity].data + 3 * side, 0, 3 * sizeof(int16_t));
+        const MergeMessage *block = &blocks[(emitted - origin) % capacity];
+#if BELL_ANGLE
+        place_gyro(gyro_out);
+        output(block, &gyro_out);
+#else
+        output(block);
+#endif
+        record(block);
+        refine_phase(block);
+#if BELL_ANGLE
+        BellState state = bell.state();
+        if (!quiet)
+            output_bytes += printf("A %6d %6d\n", state.angle, state.rate);
+#endif
+        emitted += RATE.block_samples;
+    }
 
-public:
-    long msg_count = 0;  // Number of messages processed.
-    long base_count = 0; // Cumulative sample count of the first record in current_msg.
-    TimeFitter fitter;
-    LoggerMsg current_msg;
+#if BELL_ANGLE
+    /// @brief Fill out with imu1's gyro for the block at emitted, at merged
+    /// samples the gyro's decimation apart from origin.  Samples the gyro
+    /// hasn't got, e.g. after a gap, are zero.
+    void place_gyro(GyroBlock &out)
+    {
+        const long D = gyro.decimation;
+        long first = emitted + (D - (emitted - origin) % D) % D;
+        out.offset = (uint8_t)(first - emitted);
+        out.decimation = (uint8_t)D;
+        out.count = 0;
+        for (long i = first; i < emitted + RATE.block_samples; i += D)
+        {
+            int16_t *g = out.data[out.count++];
+            // imu1's phase offset applies to its gyro too.
+            if (!gyro.at(reference().time_for(i) + (int64_t)left_imu.time_offset, g))
+            {
+                g[0] = g[1] = g[2] = 0;
+                gyro_missing++;
+            }
+        }
+    }
+#endif
 
-    IMUTracker() : fitter(0.001f), current_msg(LoggerMsg()) {}
+    /// @brief Pass the block to the phase estimator, and apply any new
+    /// estimate to the resampled tracker, a fraction at a time.
+    void refine_phase(const MergeMessage *block)
+    {
+        if (phase == nullptr || hub_mode)
+            return;
+        phase->add(block, RATE.block_samples);
+        float lag;
+        if (!phase->take(&lag))
+            return;
+        // lag is how far imu2 lags imu1.  Sampling the resampled side later
+        // moves it earlier in the merged stream.
+        float step = fmaxf(-PHASE_MAX_STEP, fminf(PHASE_MAX_STEP, PHASE_GAIN * lag));
+        float period = reference().slope();
+        float limit = PHASE_MAX_OFFSET_SAMPLES * period;
+        float &offset = resampled_imu().time_offset;
+        offset = fmaxf(-limit, fminf(limit, offset + (left_faster ? step : -step) * period));
+    }
 
-    void update(LoggerMsg &msg)
+    /// @brief Store one side of the merged sample for reference index.
+    /// If one side stalls, the other can only get the ring ahead before
+    /// the oldest block is output incomplete.  Slots skipped by a gap are
+    /// zeroed, and described by a gap record.
+    void put(int side, long index, const int16_t *values)
     {
-        if (msg.sample_count == 0)
+        if (index < emitted)
+        {
+            late++;
             return;
-        msg_count++;
-        if (msg.sample_count >= 32)
+        }
+        // Clear this side of any slots skipped over by a gap.
+        for (long i = std::max(filled[side], emitted); i <= index; i++)
         {
-            printf("Problem: large IMU message size: %d\n", msg.sample_count);
-            esp_backtrace_print(10);
-            vTaskSuspend(NULL);
+            while (i >= emitted + capacity)
+            {
+                forced++;
+                if (phase != nullptr)
+                    phase->reset(capacity);
+                output_block();
+            }
+            if (i < index)
+                memset(blocks[(i - origin) % capacity].data + 3 * side, 0, 3 * sizeof(int16_t));
         }
+        int16_t *data = blocks[(index - origin) % capacity].data + 3 * side;
+        for (int i = 0; i < 3; i++)
+            data[i] = values[i];
+        filled[side] = index + 1;
+        while (std::min(filled[0], filled[1]) >= emitted + RATE.block_samples)
+            output_block();
+    }
 
-        base_count += current_msg.sample_count;
-        fitter.coord(base_count + msg.sample_count, msg.read_time);
+    /// @brief Start merging at the first reference sample after both current
+    /// messages, so both streams start with a fresh message.
+    void start()
+    {
+        IMUTracker &ref = reference();
+        IMUTracker &other = resampled_imu();
+        long ref_end = ref.base_count + ref.current.count;
+        long other_end = other.base_count + other.current.count;
+        int64_t t0 = std::max(ref.time_for(ref_end - 1), other.time_for(other_end - 1));
+        long first = ref.sample_for(t0).first + 1;
+        if (first < ref_end)
+            first = ref_end;
+        emitted = first;
+        filled[0] = filled[1] = first;
+        origin = first - resumed;
+
+        auto [k, frac] = other.sample_for(ref.time_for(first));
+        int16_t previous[3];
+        other.current.sample(other.current.count - 1, previous);
+        scheduler.start(first, k + frac - other_end, previous);
+        started = true;
+    }
+
+    /// @brief Pass a raw read to the capture and the black box, if any.
+    void keep_raw(bool left, const LoggerMsg &msg)
+    {
+        uint8_t flags = (msg.overrun ? CAPTURE_OVERRUN : 0) | (msg.delayed ? CAPTURE_DELAYED : 0);
+        if (capture != nullptr)
+            capture->add(left, msg.read_time, msg.backlog, flags, msg.records, msg.sample_count);
+        if (blackbox != nullptr)
+            blackbox->add(left, msg.read_time, msg.backlog, flags, msg.records, msg.sample_count);
+    }
+
+    void process(bool left, LoggerMsg &msg)
+    {
+        keep_raw(left, msg);
+        // Everything from here works on the unpacked, aligned fields.
+        unpack_records(msg.records, msg.sample_count, unpacked);
+        IMUTracker &imu = left ? left_imu : right_imu;
+        int missing = imu.gap(msg, unpacked);
+#if BELL_ANGLE
+        if (left)
+        {
+            bell.update(msg.records, msg.sample_count);
+            gyro.update(msg, unpacked, imu.base_count + imu.current.count + missing);
+        }
+#endif
+        if (!imu.update(msg, unpacked, missing))
+            return;
+        if (!warm())
+        {
+            // We only need to set the faster IMU once, and it doesn't matter
+            // whether we do that on a left or right message.
+            // This will set it multiple times, until we are ready to start
+            // merging.
+            if (left_imu.msg_count > warmup / 2 && right_imu.msg_count > warmup / 2)
+                left_faster = left_imu.slope() < right_imu.slope();
+            return;
+        }
+        if (!started)
+        {
+            start();
+            return;
+        }
 
-        // Update the fitter with the new data.
-        if (current_msg.sample_count > 0)
+        int side = left ? 0 : 1;
+        if (left == left_faster)
         {
-            if (current_msg.sample_count >= 20)
+            if (missing > 0)
+                output_gap(side, imu.base_count - missing, missing, missing);
+            int16_t values[3];
+            for (int i = 0; i < imu.current.count; i++)
             {
-                printf("Problem: large IMU message size: %d %p\n", current_msg.sample_count, &msg);
-                esp_backtrace_print(10);
-                vTaskSuspend(NULL);
+                imu.current.sample(i, values);
+                put(side, imu.base_count + i, values);
             }
-            for (int i = 0; i < 3; i++)
-                last_record[i] = current_msg.records[current_msg.sample_count - 1].data[i];
         }
         else
         {
-            for (int i = 0; i < 3; i++)
-                last_record[i] = msg.records[0].data[i];
+            IMUTracker &ref = reference();
+            float increment = ref.slope() / imu.slope();
+            if (missing > 0)
+            {
+                long skipped = scheduler.skip(missing, increment);
+                output_gap(side, scheduler.next_index - skipped, skipped, missing);
+            }
+            auto [k, frac] = imu.sample_for(ref.time_for(scheduler.next_index));
+            float target = k + frac - imu.base_count;
+            long first = scheduler.resample(imu.current, increment, target, resampled);
+            int16_t values[3];
+            for (int i = 0; i < resampled.count; i++)
+            {
+                resampled.sample(i, values);
+                put(side, first + i, values);
+            }
         }
-        current_msg = msg;
     }
 
-    float slope() const
+    /// @brief Process a read of imu1 carrying both sensors, through the
+    /// sensor hub (see hub.h).  There is only one clock to fit, and nothing
+    /// to resample, so merging is just demultiplexing.
+    void process_hub(LoggerMsg &msg)
     {
-        return fitter.slope();
+        hub_mode = true;
+        left_faster = true;
+        keep_raw(true, msg);
+        unpack_records(msg.records, msg.sample_count, unpacked);
+        int missing = left_imu.gap(msg, unpacked);
+        long first = left_imu.base_count + left_imu.current.count + missing;
+#if BELL_ANGLE
+        bell.update(msg.records, msg.sample_count);
+        gyro.update(msg, unpacked, first);
+#endif
+        if (started)
+        {
+            if (missing > 0)
+                output_gap(0, first - missing, missing, missing);
+            hub.split(
+                unpacked, first,
+                [this](int side, long index, const int16_t *values) { put(side, index, values); },
+                [this](long index, long count) { output_gap(1, index, count, count); });
+        }
+        left_imu.update(msg, unpacked, missing);
+        if (!started && warm())
+        {
+            // Start after this message, so both sides start together.
+            emitted = filled[0] = filled[1] = left_imu.base_count + left_imu.current.count;
+            origin = emitted - resumed;
+            started = true;
+        }
     }
 
-    // Time attributed to a given sample count.
-    int64_t time_for(long sample_count)
+public:
+    bool quiet = false; // Suppress output, e.g. for benchmarking.
+    // Runtime settings (see control.h).  Through the sensor hub, imu2 is read
+    // at a fixed fraction of imu1's ODR, so the rate can't change.
+    ControlChannel control{RATE.odr, GYRO_DECIMATION, SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB};
+    long blocks_out = 0; // Blocks output.
+    long late = 0;       // Samples that arrived after their block was output.
+    long forced = 0;     // Blocks output before both sides filled them.
+    long gap_records = 0; // Gap records output.
+    long gyro_missing = 0; // Gyro samples output as zero, for want of data.
+    uint32_t output_bytes = 0; // Bytes of lines printed here, and by others, e.g. dumps.  Wraps.
+
+    /// @brief Bytes of data lines printed, the tiers' included.
+    uint32_t bytes_out() const
     {
-        return fitter.time_for(sample_count);
+        return output_bytes + tiers.bytes_out;
     }
 
-    std::pair<long, float> sample_for(long t) const
+    /// @brief Add the skew scheduler's slips, and the samples lost, to
+    /// metrics totals.
+    void slip_totals(MetricsTotals &totals) const
     {
-        return fitter.sample_for(t);
+        totals.inserted = scheduler.inserted;
+        totals.dropped = scheduler.dropped;
+        totals.resyncs = scheduler.resyncs;
+        totals.lost = left_imu.lost + right_imu.lost;
     }
 
-    /// @brief Project this IMUTracker's data onto another IMUTracker's fitter.
-    /// @param other
-    /// @return the 'other' sample index of the first projected sample, and the projected values
-    /// starting from that sample.
-    /// @TODO - this takes quite a bit of stack space.  Can we reduce it?
-    std::pair<int64_t, LoggerMsg> project(const TimeFitter &other)
+    /// @brief Record merged blocks, as well as printing them.
+    void set_recorder(RecordingWriter *writer)
     {
-        // This is the time of the first sample in the current msg.
-        int64_t start_time = fitter.time_for(base_count);
-        // Find the corresponding sample location in the other IMU.
-        std::pair<int64_t, float> other_sample_base = other.sample_for(start_time);
-
-        // Compute the size of the other IMU step size in units of this IMU's sample count.
-        // NOTE: This should generally be less than 1.0, since we are projecting
-        // onto the faster IMU timebase.  It should also be very stable.
-        // Units are local steps per other step.
-        float increment = other.slope() / slope();
-
-        // This should always be less than 1.0.
-        float local_fraction = other_sample_base.second * increment;
+        recorder = writer;
+    }
 
-        LoggerMsg projected = reproject(
-            last_record, current_msg, local_fraction, increment);
-        return {other_sample_base.first, projected};
+    /// @brief Capture the raw messages, before merging.
+    void set_capture(CaptureWriter *writer)
+    {
+        capture = writer;
     }
-};
 
-LoggerMsg make_test_msg(int sample_count, int64_t read_time, int64_t time_step)
-{
-    LoggerMsg msg;
-    // At the end of the samples, the values should be equal to the read time / 500.
-    // And they should increment by either
-    auto start_time = read_time - time_step * sample_count;
-    msg.read_time = read_time;
-    msg.sample_count = sample_count;
-    for (int i = 0; i < sample_count; i++)
-    {
-        msg.records[i].data[0] = start_time;
-        msg.records[i].data[1] = start_time + 1;
-        msg.records[i].data[2] = start_time + 2;
-        start_time += time_step;
-    }
-    return msg;
-}
+    /// @brief Apply control commands straight away, while there are no blocks
+    /// to apply them at.
+    void poll_control()
+    {
+        if (started)
+            return;
+        if (control.rate_change())
+            want_rate();
+        else if (control.apply(-1))
+            apply_output();
+    }
 
-/// @brief This requires three IMU messages for each IMU.  The first
-/// provides the basis for last_record and the first time point.
-/// The second and third provide data to fit the timebase.
-void test_imu_tracker()
-{
-    IMUTracker left, right;
+    /// @brief Keep the raw messages in a black box, or stop if nullptr.
+    void set_blackbox(BlackBox *box)
+    {
+        blackbox = box;
+    }
+    BlackBox *black_box() const
+    {
+        return blackbox;
+    }
 
-    LoggerMsg msg1 = make_test_msg(8, 2000, 500);
-    left.update(msg1);
-    LoggerMsg msg2 = make_test_msg(7, 4000, 8 * 500 / 7);
-    right.update(msg2);
+    /// @brief Refine the phase with an estimator, or stop if nullptr.
+    void set_phase(PhaseEstimator *estimator)
+    {
+        phase = estimator;
+    }
 
-    msg1 = make_test_msg(8, 6000, 500);
-    left.update(msg1);
-    msg2 = make_test_msg(7, 8000, 8 * 500 / 7);
-    right.update(msg2);
+    /// @brief Start from a known clock model, so merging starts almost immediately.
+    void seed(const ClockModel &model)
+    {
+        left_imu.seed(model.left_period);
+        right_imu.seed(model.right_period);
+#if BELL_ANGLE
+        gyro.seed(model.left_period * gyro.decimation);
+#endif
+        left_faster = model.left_period < model.right_period;
+        warmup = 2;
+    }
 
-    msg1 = make_test_msg(8, 10000, 500);
-    left.update(msg1);
-    msg2 = make_test_msg(7, 12000, 8 * 500 / 7);
-    right.update(msg2);
+    /// @brief Merge afresh when the sensors start again after sleeping.  Their
+    /// sample counts start again, from the clock model fitted so far.  The
+    /// merged index carries on at the next recording chunk, so no chunk spans
+    /// the sleep, and the loss and slip totals carry on, for the metrics.
+    /// @param slower How many times longer the sample period is from now on,
+    /// after a rate change.
+    void restart(float slower = 1.0f)
+    {
+        ClockModel model;
+        bool fitted = clock_model(&model);
+        model.left_period *= slower;
+        model.right_period *= slower;
+        if (started)
+            resumed = (emitted - origin + RECORDING_CHUNK_SAMPLES - 1) / RECORDING_CHUNK_SAMPLES *
+                      RECORDING_CHUNK_SAMPLES;
+        // The chunk so far is timed by the model before the sleep.
+        if (recorder != nullptr)
+            recorder->flush();
+        tiers.resume(resumed);
+        if (phase != nullptr)
+            phase->reset(RATE.block_samples);
+        left_imu.restart();
+        right_imu.restart();
+        hub.restart();
+#if BELL_ANGLE
+        gyro.restart();
+#endif
+        started = false;
+        warmup = RATE.warmup_msgs;
+        if (fitted)
+            seed(model);
+    }
 
-    printf("Min stack in test_imu_tracker: %d\n", uxTaskGetStackHighWaterMark(NULL));
+    /// @brief Merge afresh at a new rate, once the reader has stopped the
+    /// sensors to change it, as after a sleep, and take up the settings that
+    /// waited for it, acknowledged at the index the output resumes at.
+    /// @param odr, gyro_decimation As CONTROL_RATE asked for.
+    void set_rate(uint16_t odr, uint8_t gyro_decimation)
+    {
+        float slower = (float)sensor_odr / odr;
+        sensor_odr = odr;
+#if BELL_ANGLE
+        gyro.decimation = gyro_decimation;
+        bell.set_gyro_periods(RATE.odr / odr * gyro_decimation / GYRO_DECIMATION);
+#endif
+        restart(slower);
+        if (control.apply(resumed))
+            apply_output();
+        rate_wanted.store(0, std::memory_order_release);
+    }
 
-    printf("Projecting right onto left fitter\n");
-    auto [offset, projected] = right.project(left.fitter);
-    printf("Min stack after project: %d\n", uxTaskGetStackHighWaterMark(NULL));
-    printf("Projected offset: %lld\n", offset);
-    // assert(projected.sample_count == 8);
-    printf("Left base %ld  Right base %ld\n", left.base_count, right.base_count);
-    for (int i = 0; i < projected.sample_count; i++)
+    /// @brief Send imu1's activity events, at the merged index the output
+    /// has reached, or will resume at after a sleep.  They count as activity,
+    /// so the sensors don't go idle.
+    void activity(const ActivityEvent *events, int count)
     {
-        printf("Left  [%d]: %5d %5d %5d", i, left.current_msg.records[i].data[0], left.current_msg.records[i].data[1], left.current_msg.records[i].data[2]);
-        printf("  Right [%d]: %5d %5d %5d", i, right.current_msg.records[i].data[0], right.current_msg.records[i].data[1], right.current_msg.records[i].data[2]);
-        printf("  Projected[%d]: %5d %5d %5d\n", i, projected.records[i].data[0], projected.records[i].data[1], projected.records[i].data[2]);
+        long index = started ? emitted - origin : resumed;
+        tiers.last_activity = tiers.samples_in;
+        if (quiet)
+            return;
+        for (int i = 0; i < count; i++)
+            output_bytes += printf("E %ld %d %d %d %d\n", index, events[i].type, events[i].source, events[i].slot,
+                                   events[i].detail);
     }
-}
 
-/// @brief Merges data from two IMUs.
-class Merger
-{
-private:
-    bool first_write = true;
-    MergeMessage ping_pong[20]; // About 10 msec of data.
-    int left_index = 0;         // Next entry to write left data into.
-    int right_index = 0;        // Next entry to write right data into.
-    bool left_faster = false;   // Is left IMU faster?
+    /// @brief Merged index of the next block out.
+    long output_index() const
+    {
+        return emitted - origin;
+    }
 
-    IMUTracker left_imu;
-    IMUTracker right_imu;
+    /// @brief The sensors' ODR, RATE.odr unless CONTROL_RATE slowed it.
+    uint16_t odr() const
+    {
+        return sensor_odr;
+    }
 
-    bool last_imu = false; // Last IMU seen.
+    /// @brief Merged samples since the tiers last saw motion or an impact.
+    long quiet_samples() const
+    {
+        return tiers.quiet_samples();
+    }
 
-    void output(const MergeMessage *msg)
+    /// @brief The current fitted clock model, once merging has started.
+    bool clock_model(ClockModel *model) const
     {
-        // Output the merged message.
-        // For now, just print it.
-        if (true)
-        {
-            printf("0 %5d %5d %5d %5d %5d %5d\n",
-                   msg->data[0], msg->data[1], msg->data[2],
-                   msg->data[3], msg->data[4], msg->data[5]);
-            msg += 5;
-            printf("5 %5d %5d %5d %5d %5d %5d\n",
-                   msg->data[0], msg->data[1], msg->data[2],
-                   msg->data[3], msg->data[4], msg->data[5]);
-        }
-        else
-        {
-            printf("%5d %5d\n", msg->data[2], msg->data[5]);
-            msg += 2;
-            printf("%5d %5d\n", msg->data[2], msg->data[5]);
-            msg += 2;
-            printf("%5d %5d\n", msg->data[2], msg->data[5]);
-            msg += 2;
-            printf("%5d %5d\n", msg->data[2], msg->data[5]);
-            msg += 2;
-            printf("%5d %5d\n", msg->data[2], msg->data[5]);
-            msg += 2;
-        }
+        if (!warm())
+            return false;
+        model->odr = sensor_odr;
+        model->left_period = left_imu.slope();
+        model->right_period = hub_mode ? left_imu.slope() : right_imu.slope();
+        model->skew = model->right_period / model->left_period - 1.0f;
+        return true;
     }
 
-public:
-    /// @brief Whenever we fill, we should only fill slots that have both left and right data.
-    /// @param msg
-    void fill_left(LoggerMsg &msg)
+    /// @brief Fill in the merger's part of the dashboard.
+    void dashboard_stats(DashboardStats &stats)
     {
-        int start_index = 0;
-        if (first_write)
+        stats.merging = started;
+        if (started && hub_mode)
         {
-            auto start_time = right_imu.time_for(right_imu.base_count + right_imu.current_msg.sample_count);
-            auto [left_sample, frac] = left_imu.sample_for(start_time);
-            start_index = left_sample - left_imu.base_count;
-            first_write = false;
+            // imu2 is read by the hub, on imu1's clock.
+            stats.left_hz = 1e6f / left_imu.slope();
+            stats.right_hz = stats.left_hz / HUB_DECIMATION;
+            stats.skew_ppm = 0;
         }
-        bool wrap10 = false;
-        bool wrap20 = false;
-        for (int i = 0; i < msg.sample_count; i++)
+        else if (started)
         {
-            auto left = msg.records[i];
-            auto merge = &ping_pong[left_index++];
-            if (left_index == 10)
-            {
-                wrap10 = true;
-            }
-            if (left_index >= 20)
-            {
-                left_index = 0;
-                wrap20 = true;
-            }
-            merge->data[0] = left.data[0];
-            merge->data[1] = left.data[1];
-            merge->data[2] = left.data[2];
+            stats.left_hz = 1e6f / left_imu.slope();
+            stats.right_hz = 1e6f / right_imu.slope();
+            stats.skew_ppm = 1e6f * (right_imu.slope() / left_imu.slope() - 1.0f);
         }
-        if (wrap10 && right_index >= 10)
-            output(&ping_pong[0]);
-        if (wrap20 && (right_index < 10))
-            output(&ping_pong[10]);
+        stats.lost[0] = left_imu.lost;
+        stats.lost[1] = right_imu.lost;
+        stats.strikes = tiers.windows;
+        stats.last_strike = tiers.last_impact < 0 ? -1 : reference().time_for(origin + tiers.last_impact);
+        stats.strike_peak = tiers.impact_peak;
+#if BELL_ANGLE
+        stats.has_angle = true;
+        stats.angle = bell.state().angle / 100.0f;
+#endif
     }
 
-    void fill_right(LoggerMsg &msg)
+    /// @brief Report the skew scheduler's slip counts.
+    void print_slips() const
     {
-        int start_index = 0;
-        if (first_write)
-        {
-            auto start_time = left_imu.time_for(left_imu.base_count + left_imu.current_msg.sample_count);
-            auto [right_sample, frac] = right_imu.sample_for(start_time);
-            start_index = right_sample - right_imu.base_count;
-            first_write = false;
-        }
-        bool wrap10 = false;
-        bool wrap20 = false;
-        for (int i = start_index; i < msg.sample_count; i++)
-        {
-            auto right = msg.records[i];
-            auto merge = &ping_pong[right_index++];
-            if (right_index == 10)
-                wrap10 = true;
-            if (right_index >= 20)
-                right_index = 0;
-            merge->data[3] = right.data[0];
-            merge->data[4] = right.data[1];
-            merge->data[5] = right.data[2];
-        }
-        if (wrap10 && left_index >= 10)
-            output(&ping_pong[0]);
-        if (wrap20 && (left_index < 10))
-            output(&ping_pong[10]);
+        printf("Merged %ld blocks, %s resampled: %ld inserted, %ld dropped, %ld resyncs, %ld late, %ld forced\n",
+               blocks_out, left_faster ? "right" : "left", scheduler.inserted, scheduler.dropped,
+               scheduler.resyncs, late, forced);
+        printf("  Lost samples: left %ld in %ld gaps, right %ld in %ld gaps\n",
+               left_imu.lost, left_imu.gaps, right_imu.lost, right_imu.gaps);
+#if BELL_ANGLE
+        if (gyro.count > 0)
+            printf("  Gyro: %ld samples at %.1f Hz, %ld lost, %ld output as zero\n", gyro.count,
+                   1e6f / gyro.fitter.slope(), gyro.lost, gyro_missing);
+#endif
+        if (hub_mode)
+            printf("  Sensor hub: %ld hub samples, %ld right samples interpolated\n", hub.hub_samples,
+                   hub.interpolated);
+        else if (phase != nullptr)
+            printf("  Phase: %ld estimates, %ld rejected, last lag %.2f samples, offset %.1f usec\n",
+                   phase->estimates, phase->rejected, phase->last_lag, left_faster ? right_imu.time_offset : left_imu.time_offset);
     }
 
-    /// @brief  Process left values.
-    /// @precondition left_faster has been initialized.
-    /// ### TODO ### We need to skip the initial unmatched samples.
     void process_left(LoggerMsg &left)
     {
-        left_imu.update(left);
-        if (left_imu.msg_count < 10 || right_imu.msg_count < 10)
-            return;
-
-        if (left_faster)
-        {
-            fill_left(left);
-        }
-        else
-        {
-            // The right side dictates timing, and where the left samples go.
-            // BUG - there may be a problem with number of samples here.
-            // Sometimes there should be same number and sometimes +1.
-            auto [start, interp] = left_imu.project(right_imu.fitter);
-            fill_left(interp);
-        }
+        process(true, left);
     }
 
     void process_right(LoggerMsg &right)
     {
-        right_imu.update(right);
-        if (left_imu.msg_count < 10 || right_imu.msg_count < 10)
-        {
-            // We only need to set the faster IMU once, and it doesn't matter
-            // whether we do that on a left or right message.
-            // This will set it multiple times, until we are ready to start
-            // merging.
-            if (left_imu.msg_count > 5 && right_imu.msg_count > 5)
-            {
-                // Determine which IMU is faster.
-                float left_slope = left_imu.slope();
-                float right_slope = right_imu.slope();
-                left_faster = left_slope < right_slope;
-            }
-            return;
-        }
+        process(false, right);
+    }
 
-        if (!left_faster)
-        {
-            fill_right(right);
-        }
-        else
-        {
-            auto [start, interp] = right_imu.project(left_imu.fitter);
-            fill_right(interp);
-        }
+    /// @brief Handle both sensors' reads from one parallel reader cycle.
+    /// The pair always arrives together, so there is no ordering to check.
+    void handle_pair(LoggerMsg &left, LoggerMsg &right)
+    {
+        process_left(left);
+        process_right(right);
+    }
+
+    /// @brief Handle a read through the sensor hub (ACQUISITION_SENSOR_HUB).
+    void handle_hub(LoggerMsg &msg)
+    {
+        process_hub(msg);
     }
 
     void handle(LoggerMsg &msg)
     {
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+        // Every message is imu1's, carrying both sensors.
+        handle_hub(msg);
+        return;
+#endif
         auto start = esp_timer_get_time();
-        // Rewrite the record, omitting unused sensor types.
-        int pack = 0;
-        for (int i = 0; i < msg.sample_count; i++)
-        {
-            auto tag = msg.records[i].tag.tag_sensor;
-            if (tag == 2)
-                msg.records[pack++] = msg.records[i];
-        }
-        msg.sample_count = pack;
 
         if (msg.imu == last_imu)
         {
@@ -458,22 +792,544 @@ public:
 };
 
 Merger merger;
+static_assert(sizeof(Merger) <= MERGER_BUDGET_BYTES, "The merger exceeds its memory budget");
+
+/// @brief Publish the dashboard stats every DASHBOARD_PERIOD_USEC.  The
+/// mailbox only holds the latest, so the display never holds up the logger.
+static void maybe_publish_dashboard(int64_t now, int queued, int depth)
+{
+    static int64_t next = 0;
+    if (now < next)
+        return;
+    next = now + DASHBOARD_PERIOD_USEC;
+    DashboardStats stats;
+    stats.now = now;
+    stats.queued = queued;
+    stats.queue_depth = depth;
+    merger.dashboard_stats(stats);
+    xQueueOverwrite(dashboard_mailbox(), &stats);
+}
+
+void seed_merger(const ClockModel &model)
+{
+    merger.seed(model);
+}
+
+void record_merger(RecordingWriter *writer)
+{
+    merger.set_recorder(writer);
+}
+
+void capture_merger(CaptureWriter *writer)
+{
+    merger.set_capture(writer);
+}
+
+void phase_merger(PhaseEstimator *estimator)
+{
+    merger.set_phase(estimator);
+}
+
+void blackbox_merger(BlackBox *box)
+{
+    merger.set_blackbox(box);
+}
+
+uint32_t *merger_output_bytes()
+{
+    return &merger.output_bytes;
+}
+
+static Metrics metrics;
+static const LSMExtension *metrics_imu[2] = {nullptr, nullptr};
+
+void metrics_sensors(const LSMExtension *imu1, const LSMExtension *imu2)
+{
+    metrics_imu[0] = imu1;
+    metrics_imu[1] = imu2;
+}
+
+/// @brief Print a metrics frame (see metrics.h) every METRICS_PERIOD_USEC.
+/// @param depth Reads the logger's queue, or ring, holds.
+static void maybe_emit_metrics(int64_t now, int depth)
+{
+    if (!metrics.due(now))
+        return;
+    MetricsTotals totals;
+    task_run_times(totals);
+    for (int i = 0; i < 2; i++)
+    {
+        totals.bus_usec[i] = metrics_imu[i] != nullptr ? metrics_imu[i]->bus_usec : 0;
+        totals.short_batches[i] = metrics_imu[i] != nullptr ? metrics_imu[i]->short_batches : 0;
+    }
+    totals.blocks = merger.blocks_out;
+    totals.output_bytes = merger.bytes_out();
+    merger.slip_totals(totals);
+    totals.queue_depth = depth;
+    MetricsFrame frame;
+    metrics.frame(now, totals, &frame);
+    merger.output_bytes += print_metrics(frame);
+}
+
+/// @brief Send some of a black box dump, only while the logger is keeping up,
+/// so a dump never costs merged output.
+static void maybe_dump_blackbox(int64_t now, int queued, int depth)
+{
+    BlackBox *box = merger.black_box();
+    if (box != nullptr && box->dumping() && queued <= depth / 4)
+        box->pump(now);
+}
+
+/// @brief Pass control frames (see control.h) to the merger, and collect
+/// console lines, running each when it is complete.
+static void maybe_read_console(int64_t now)
+{
+    static char line[64];
+    static int length = 0;
+    while (Serial.available() > 0)
+    {
+        int c = Serial.read();
+        if (merger.control.feed(c, now))
+        {
+            merger.poll_control();
+            continue;
+        }
+        if (c != '\n' && c != '\r')
+        {
+            if (length < (int)sizeof(line) - 1)
+                line[length++] = c;
+            continue;
+        }
+        if (length == 0)
+            continue;
+        line[length] = 0;
+        length = 0;
+        BlackBox *box = merger.black_box();
+        if (box == nullptr || !box->command(line, now))
+            printf("Problem: unknown command: %s\n", line);
+    }
+}
+
+bool save_merger_clock_model()
+{
+    ClockModel model;
+    if (!merger.clock_model(&model) || !save_clock_model(model))
+        return false;
+    printf("Saved clock model: %.3f %.3f usec, skew %.1f ppm\n",
+           model.left_period, model.right_period, 1e6f * model.skew);
+    return true;
+}
+
+// Set by the logger once the tiers have been quiet for ACTIVITY_IDLE_SECONDS,
+// and cleared when it takes the reader's idle message.
+static std::atomic<bool> idle_wanted{false};
+
+bool merger_wants_idle()
+{
+    return idle_wanted.load(std::memory_order_acquire);
+}
+
+/// @brief Ask the reader to stop the sensors, once the merger has been quiet
+/// for long enough.
+static void check_quiet()
+{
+    if (merger.quiet_samples() >= (long)ACTIVITY_IDLE_SECONDS * merger.odr())
+        idle_wanted.store(true, std::memory_order_release);
+}
+
+bool merger_wants_rate(uint16_t *odr, uint8_t *gyro_decimation)
+{
+    uint32_t wanted = rate_wanted.load(std::memory_order_acquire);
+    if (odr != nullptr)
+        *odr = wanted >> 8;
+    if (gyro_decimation != nullptr)
+        *gyro_decimation = wanted & 0xFF;
+    return wanted != 0;
+}
+
+/// @brief Take the reader's idle message.  The sensors are stopped until
+/// activity, so this is when the NVS write can't stall a read.  Then merge
+/// afresh when they start again.
+static void go_idle()
+{
+    save_merger_clock_model();
+    merger.restart();
+    idle_wanted.store(false, std::memory_order_release);
+}
+
+#if SELF_TEST
+/// @brief Run the gyro at its own rate beside the accelerometer, and check
+/// that its own clock model places it on the accelerometer's samples, across
+/// a FIFO overrun.
+void test_gyro_channel()
+{
+    static IMUTracker tracker;
+    static GyroChannel gyro;
+    static SimulatedLSM sim(RATE.odr, 1.002f);
+    static LoggerMsg msg;
+    static UnpackedRecords records;
+    sim.enable_bell(BELL_AXIS, 120.0f, 2.0f, 40, GYRO_DECIMATION);
+    const int64_t period = RATE.read_interval_usec();
+    // The bell's fastest change in gyro LSB per accelerometer sample, for
+    // the interpolation and timing error.
+    const float slope = 120.0f * powf(2 * (float)M_PI / (2.0f * RATE.odr), 2) * RATE.odr * 1000 / SIM_GYRO_MDPS;
+    const float tolerance = slope * GYRO_DECIMATION + 2;
+    int64_t now = 0;
+    float worst = 0;
+    long checked = 0;
+    for (int r = 0; r < 2000; r++)
+    {
+        if (r == 1000)
+            now += 2000LL * SIM_FIFO_DEPTH * 1000 / RATE.odr;
+        now += period;
+        read_sim(sim, msg, now, RATE.max_records);
+        unpack_records(msg.records, msg.sample_count, records);
+        int missing = tracker.gap(msg, records);
+        gyro.update(msg, records, tracker.base_count + tracker.current.count + missing);
+        tracker.update(msg, records, missing);
+        if (r < 100 || (r >= 1000 && r < 1100))
+            continue;
+        for (int i = 0; i < tracker.current.count; i++)
+        {
+            long n = tracker.base_count + i;
+            int16_t g[3];
+            assert(gyro.at(tracker.time_for(n), g));
+            float err = fabsf(g[BELL_AXIS] - sim.bell_rate(n));
+            worst = fmaxf(worst, err);
+            assert(err <= tolerance);
+            checked++;
+        }
+    }
+    printf("Gyro channel: %ld samples at 1/%d rate, %ld lost, worst error %.1f LSB over %ld samples\n",
+           gyro.count, GYRO_DECIMATION, gyro.lost, worst, checked);
+    assert(gyro.lost > 0 && labs(gyro.lost - sim.lost() / GYRO_DECIMATION) <= 1);
+    assert(fabsf(gyro.fitter.slope() / (tracker.slope() * GYRO_DECIMATION) - 1) < 1e-3f);
+}
+
+/// @brief Read the simulated IMUs for period i of a run, as the reader would
+/// in the configured acquisition mode.
+/// @return false if there is no read this period.
+static bool read_sims(SimulatedLSM &sim1, SimulatedLSM &sim2, LoggerMsg &msg, LoggerMsg &msg2, int i, int64_t now)
+{
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+    msg.imu = true;
+    read_sim(sim1, msg, now, RATE.max_records);
+    msg2.imu = false;
+    read_sim(sim2, msg2, now, RATE.max_records);
+#elif SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    // imu2 is read by imu1's hub, so only imu1 is read, every other period.
+    if (i % 2 == 0)
+        return false;
+    msg.imu = true;
+    read_sim(sim1, msg, now, RATE.max_records);
+#else
+    msg.imu = i % 2 == 0;
+    read_sim(msg.imu ? sim1 : sim2, msg, now, RATE.max_records);
+#endif
+    return true;
+}
+
+/// @brief Pass what read_sims() read to the merger.
+static void merge_sims(Merger &m, LoggerMsg &msg, LoggerMsg &msg2)
+{
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+    m.handle_pair(msg, msg2);
+#else
+    m.handle(msg);
+#endif
+}
+
+/// @brief Pair the simulated IMUs as the configured acquisition mode reads them.
+static void pair_sims(SimulatedLSM &sim1, SimulatedLSM &sim2)
+{
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    sim1.set_hub_target(&sim2);
+    sim1.set_hub(HUB_DECIMATION);
+#endif
+}
+
+/// @brief Change the channels through the control channel mid stream, and
+/// check the change takes effect at the next block boundary, on the block
+/// grid, and is acknowledged with that index.
+void test_merger_control()
+{
+    auto *m = new Merger;
+    auto *sim1 = new SimulatedLSM(RATE.odr, 1.0f);
+    auto *sim2 = new SimulatedLSM(RATE.odr, 1.004f);
+    auto *msg = new LoggerMsg;
+    auto *msg2 = new LoggerMsg;
+    m->quiet = true;
+    pair_sims(*sim1, *sim2);
+    std::string acks;
+    m->control.set_sink([](const void *data, size_t bytes, void *context)
+                        { ((std::string *)context)->append((const char *)data, bytes); },
+                        &acks);
+    const int64_t period = RATE.read_period_ticks * TICK_USEC;
+    long blocks_before = 0;
+    int64_t now = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        now += period;
+        if (i == 500)
+        {
+            uint8_t frame[5 + CONTROL_MAX_PAYLOAD];
+            uint8_t channels = 0x07;
+            size_t n = control_frame(1, CONTROL_CHANNELS, &channels, 1, frame);
+            for (size_t b = 0; b < n; b++)
+                m->control.feed(frame[b], now);
+            blocks_before = m->blocks_out;
+        }
+        if (read_sims(*sim1, *sim2, *msg, *msg2, i, now))
+            merge_sims(*m, *msg, *msg2);
+    }
+    ControlAck ack;
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 1 && ack.status == CONTROL_OK);
+    assert(ack.index == blocks_before * RATE.block_samples && ack.settings.channels == 0x07);
+    assert(m->control.settings().channels == 0x07);
+    printf("Merger control: channels changed at sample %ld\n", (long)ack.index);
+    delete msg2;
+    delete msg;
+    delete sim2;
+    delete sim1;
+    delete m;
+}
+
+/// @brief Stop the simulated IMUs for a while, as the sensors sleep, and
+/// check that the merger starts again from its clock model, carrying on at
+/// the next recording chunk, with no gap or loss for the sleep, and that an
+/// activity event keeps it from going idle.
+void test_merger_restart()
+{
+    auto *m = new Merger;
+    auto *sim1 = new SimulatedLSM(RATE.odr, 1.0f);
+    auto *sim2 = new SimulatedLSM(RATE.odr, 1.004f);
+    auto *msg = new LoggerMsg;
+    auto *msg2 = new LoggerMsg;
+    m->quiet = true;
+    pair_sims(*sim1, *sim2);
+    const int64_t period = RATE.read_period_ticks * TICK_USEC;
+    int64_t now = 0;
+    int i = 0;
+    for (; i < 1000; i++)
+    {
+        now += period;
+        if (read_sims(*sim1, *sim2, *msg, *msg2, i, now))
+            merge_sims(*m, *msg, *msg2);
+    }
+    long before = m->output_index();
+    MetricsTotals totals;
+    m->slip_totals(totals);
+    uint32_t lost = totals.lost;
+    m->restart();
+
+    // Asleep for 10 seconds, then the FIFOs are flushed.
+    now += 10000000;
+    for (SimulatedLSM *sim : {sim1, sim2})
+    {
+        sim->advance(now);
+        while (sim->read_fifo(msg->records, RATE.max_records) > 0)
+            ;
+    }
+    long blocks = m->blocks_out;
+    for (int end = i + 1000; i < end; i++)
+    {
+        now += period;
+        if (read_sims(*sim1, *sim2, *msg, *msg2, i, now))
+            merge_sims(*m, *msg, *msg2);
+    }
+    long resumed = (before + RECORDING_CHUNK_SAMPLES - 1) / RECORDING_CHUNK_SAMPLES * RECORDING_CHUNK_SAMPLES;
+    assert(m->blocks_out > blocks);
+    assert(m->output_index() == resumed + (m->blocks_out - blocks) * RATE.block_samples);
+    m->slip_totals(totals);
+    assert(totals.lost == lost);
+    ClockModel model;
+    assert(m->clock_model(&model));
+    // An event from the sensor counts as activity.
+    ActivityEvent event = {ACTIVITY_STRIKE, ACTIVITY_SOURCE_FSM, 1, 0x80};
+    m->activity(&event, 1);
+    assert(m->quiet_samples() == 0);
+    printf("Merger restart: carried on at sample %ld, from %ld\n", resumed, before);
+    delete msg2;
+    delete msg;
+    delete sim2;
+    delete sim1;
+    delete m;
+}
+
+/// @brief Slow the simulated IMUs through the control channel mid stream, as
+/// the reader does when the merger wants a new rate, and check that the
+/// merger carries on at the next recording chunk, acknowledges the rate
+/// there, and fits the slower clocks from the scaled clock model.
+void test_merger_rate()
+{
+    auto *m = new Merger;
+    auto *sim1 = new SimulatedLSM(RATE.odr, 1.0f);
+    auto *sim2 = new SimulatedLSM(RATE.odr, 1.004f);
+    auto *msg = new LoggerMsg;
+    auto *msg2 = new LoggerMsg;
+    m->quiet = true;
+    pair_sims(*sim1, *sim2);
+    std::string acks;
+    m->control.set_sink([](const void *data, size_t bytes, void *context)
+                        { ((std::string *)context)->append((const char *)data, bytes); },
+                        &acks);
+    const uint16_t odr = RATE.odr / 2;
+    const uint8_t rate[3] = {(uint8_t)(odr & 0xFF), (uint8_t)(odr >> 8), 8};
+    const int64_t period = RATE.read_period_ticks * TICK_USEC;
+    int64_t now = 0;
+    long before = -1;
+    long blocks = 0;
+    for (int i = 0; i < 3000; i++)
+    {
+        now += period;
+        if (i == 500)
+        {
+            uint8_t frame[5 + CONTROL_MAX_PAYLOAD];
+            size_t n = control_frame(1, CONTROL_RATE, rate, sizeof(rate), frame);
+            for (size_t b = 0; b < n; b++)
+                m->control.feed(frame[b], now);
+        }
+        uint16_t wanted_odr;
+        uint8_t wanted_decimation;
+        if (merger_wants_rate(&wanted_odr, &wanted_decimation))
+        {
+            assert(before < 0 && wanted_odr == odr && wanted_decimation == rate[2]);
+            // The reader hands over a rate message, then the sensors start
+            // again at the new rate, with their FIFOs empty.
+            before = m->output_index();
+            m->set_rate(wanted_odr, wanted_decimation);
+            assert(!merger_wants_rate(nullptr, nullptr));
+            for (SimulatedLSM *sim : {sim1, sim2})
+            {
+                sim->advance(now);
+                while (sim->read_fifo(msg->records, RATE.max_records) > 0)
+                    ;
+                sim->set_odr(odr);
+            }
+            blocks = m->blocks_out;
+        }
+        if (read_sims(*sim1, *sim2, *msg, *msg2, i, now))
+            merge_sims(*m, *msg, *msg2);
+    }
+    ControlAck ack;
+    assert(parse_control_ack(acks.c_str(), &ack) && ack.seq == 1);
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    // imu2 is read at a fixed fraction of imu1's ODR.
+    assert(ack.status == CONTROL_UNSUPPORTED && before < 0 && m->odr() == RATE.odr);
+#else
+    long resumed = (before + RECORDING_CHUNK_SAMPLES - 1) / RECORDING_CHUNK_SAMPLES * RECORDING_CHUNK_SAMPLES;
+    assert(ack.status == CONTROL_OK && ack.index == resumed);
+    assert(ack.settings.odr == odr && ack.settings.gyro_decimation == rate[2] && m->odr() == odr);
+    assert(m->blocks_out > blocks);
+    assert(m->output_index() == resumed + (m->blocks_out - blocks) * RATE.block_samples);
+    ClockModel model;
+    assert(m->clock_model(&model) && model.odr == odr);
+    assert(fabsf(model.left_period * odr / 1e6f - 1) < 1e-3f);
+    assert(fabsf(model.right_period * odr * 1.004f / 1e6f - 1) < 1e-3f);
+    printf("Merger rate: %u Hz from sample %ld, after %ld at %u Hz\n", odr, resumed, before, RATE.odr);
+#endif
+    delete msg2;
+    delete msg;
+    delete sim2;
+    delete sim1;
+    delete m;
+}
+
+/// @brief Run a Merger against two simulated IMUs, and report how much of
+/// the reader period the merge takes at the configured rate profile.
+void benchmark_merge()
+{
+    static Merger bench;
+    static SimulatedLSM sim1(RATE.odr, 1.0f);
+    static SimulatedLSM sim2(RATE.odr, 1.004f);
+    static LoggerMsg msg;
+    static LoggerMsg msg2;
+    bench.quiet = true;
+    pair_sims(sim1, sim2);
+
+    const int iterations = 2000;
+    const int64_t period = RATE.read_period_ticks * TICK_USEC;
+    int64_t now = 0;
+    int64_t busy = 0;
+    int64_t worst = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        now += period;
+        if (!read_sims(sim1, sim2, msg, msg2, i, now))
+            continue;
+        auto start = esp_timer_get_time();
+        merge_sims(bench, msg, msg2);
+        int64_t elapsed = esp_timer_get_time() - start;
+        if (i >= 2 * RATE.warmup_msgs)
+        {
+            busy += elapsed;
+            if (elapsed > worst)
+                worst = elapsed;
+        }
+    }
+    float mean = (float)busy / (iterations - 2 * RATE.warmup_msgs);
+    // Each record is 7 bytes, plus one timestamp record per 32 samples, at about
+    // 9 bits per byte on the 1 MHz bus.
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB
+    // One FIFO, with a hub record every HUB_DECIMATION samples.
+    float bus_load = RATE.odr * 7 * (33.0f / 32 + 1.0f / HUB_DECIMATION) * 9 / 1e6f;
+#else
+    float bus_load = 2.0f * RATE.odr * 7 * 33 / 32 * 9 / 1e6f;
+#endif
+    printf("Merge benchmark at %d Hz: mean %.1f usec, worst %lld usec per %lld usec period\n",
+           RATE.odr, mean, worst, period);
+    printf("  CPU headroom %.1f%%, estimated I2C load %.0f%%\n",
+           100.0f * (1.0f - mean / period), 100.0f * bus_load);
+    bench.print_slips();
+}
+
+#endif
 
 void logger_task(void *q)
 {
     QueueHandle_t queue = (QueueHandle_t)q;
 
+    // Static, so the stack only needs to cover the merger and output.
+    static LoggerMsg msg;
     while (1)
     {
-        LoggerMsg msg;
         if (xQueueReceive(queue, &msg, portMAX_DELAY) == pdTRUE)
         {
-            if (msg.sample_count > 20)
+            if (msg.idle)
+            {
+                go_idle();
+                continue;
+            }
+            if (msg.events > 0)
+            {
+                merger.activity((const ActivityEvent *)msg.records, msg.events);
+                continue;
+            }
+            if (msg.odr > 0)
+            {
+                merger.set_rate(msg.odr, msg.gyro_decimation);
+                continue;
+            }
+            if (msg.sample_count > RATE.large_read)
             {
                 printf("****************************************** Warning: large IMU message %d samples\n", msg.sample_count);
             }
+            int64_t start = esp_timer_get_time();
             merger.handle(msg);
-            // printf("Logger: IMU: %d Read %2d samples at %4ld usec (%d)\n", msg.imu, msg.sample_count, msg.read_time, msg.delayed);
+            metrics.add_read(uxQueueMessagesWaiting(queue), msg.backlog, esp_timer_get_time() - start);
+            check_quiet();
+            int trace = merger.control.settings().trace;
+            if (trace >= TRACE_INFO)
+            {
+                maybe_report_memory(msg.read_time);
+                maybe_emit_metrics(msg.read_time, LOGGER_QUEUE_DEPTH);
+            }
+            maybe_publish_dashboard(msg.read_time, uxQueueMessagesWaiting(queue), LOGGER_QUEUE_DEPTH);
+            maybe_read_console(msg.read_time);
+            maybe_dump_blackbox(msg.read_time, uxQueueMessagesWaiting(queue), LOGGER_QUEUE_DEPTH);
+            if (trace >= TRACE_READS)
+                printf("Logger: IMU: %d Read %2d samples at %4lld usec (%d)\n", msg.imu, msg.sample_count,
+                       (long long)msg.read_time, msg.delayed);
         }
         else
         {
@@ -481,3 +1337,65 @@ void logger_task(void *q)
         }
     }
 }
+
+void pair_logger_task(void *r)
+{
+    SensorRings *rings = (SensorRings *)r;
+
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // The reader commits left before right, so a right entry means the pair is complete.
+        while (rings->right.peek() != nullptr)
+        {
+            LoggerMsg *left = rings->left.peek();
+            LoggerMsg *right = rings->right.peek();
+            if (right->idle)
+            {
+                rings->left.release();
+                rings->right.release();
+                go_idle();
+                continue;
+            }
+            if (left->events > 0)
+            {
+                merger.activity((const ActivityEvent *)left->records, left->events);
+                rings->left.release();
+                rings->right.release();
+                continue;
+            }
+            if (left->odr > 0)
+            {
+                merger.set_rate(left->odr, left->gyro_decimation);
+                rings->left.release();
+                rings->right.release();
+                continue;
+            }
+            if (left->sample_count > RATE.large_read || right->sample_count > RATE.large_read)
+            {
+                printf("****************************************** Warning: large IMU message %d/%d samples\n",
+                       left->sample_count, right->sample_count);
+            }
+            int64_t start = esp_timer_get_time();
+            merger.handle_pair(*left, *right);
+            // The ring still holds this pair.
+            metrics.add_read(rings->right.size() - 1, std::max(left->backlog, right->backlog),
+                             esp_timer_get_time() - start);
+            check_quiet();
+            int trace = merger.control.settings().trace;
+            if (trace >= TRACE_INFO)
+            {
+                maybe_report_memory(right->read_time);
+                maybe_emit_metrics(right->read_time, SENSOR_RING_DEPTH);
+            }
+            maybe_publish_dashboard(right->read_time, rings->right.size(), SENSOR_RING_DEPTH);
+            maybe_read_console(right->read_time);
+            maybe_dump_blackbox(right->read_time, rings->right.size(), SENSOR_RING_DEPTH);
+            if (trace >= TRACE_READS)
+                printf("Logger: Read %2d/%2d samples at %lld usec\n", left->sample_count, right->sample_count,
+                       (long long)right->read_time);
+            rings->left.release();
+            rings->right.release();
+        }
+    }
+}
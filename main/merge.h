@@ -1,18 +1,97 @@
 #pragma once
 
 #include <stdio.h>
-#include "LSM6DSV16XSensor.h"
+#include "rate.h"
+#include "record.h"
+#include "ring.h"
 
 void logger_task(void *q);
 
 struct LoggerMsg
 {
-    lsm6dsv16x_fifo_record_t records[32]; // Up to 32 samples per read.
+    // Up to max_records samples per read.  Word aligned, so FIFO bursts can DMA straight in.
+    alignas(4) lsm6dsv16x_fifo_record_t records[RATE.max_records];
     int64_t read_time{0};                 // usec time at end of collection
     uint16_t sample_count{0};
-    bool delayed{false}; // Whether the vTaskDelayUntil was delayed.
+    uint16_t backlog{0};                  // Samples left in the FIFO after this read.
+    bool delayed{false}; // Whether the reader woke late (see ReadPacer).
+    bool overrun{false}; // Whether the FIFO overran before this read, losing samples.
     bool imu;            // Which IMU was collected.
+    bool idle{false};    // No records: the reader stops the sensors after this, until activity.
+    uint8_t events{0};   // No records: ActivityEvents from imu1 in their place (see activity.h).
+    // No records: the sensors restart at odr after this, with imu1's gyro at
+    // odr / gyro_decimation (see CONTROL_RATE).
+    uint16_t odr{0};
+    uint8_t gyro_decimation{0};
 };
 
-void test_reproject();
-void test_imu_tracker();
+/// @brief One merged sample: imu1 then imu2 accelerometer.
+struct MergeMessage
+{
+    int16_t data[6]; // This will translate into 16 bytes of base64.
+};
+
+// Gyro samples a merged block can carry, one per GYRO_DECIMATION merged samples.
+#define GYRO_BLOCK_SAMPLES ((RATE.block_samples + GYRO_DECIMATION - 1) / GYRO_DECIMATION)
+
+/// @brief imu1's gyro over one merged block, at the gyro's own rate.
+/// data[j] is at merged sample offset + j * decimation of the block.
+struct GyroBlock
+{
+    uint8_t offset = 0; // Merged samples before the first gyro sample.
+    uint8_t count = 0;
+    uint8_t decimation = GYRO_DECIMATION; // Merged samples per gyro sample, or more after CONTROL_RATE.
+    int16_t data[GYRO_BLOCK_SAMPLES][3];
+};
+
+// Per sensor ring depth for parallel acquisition, about 32 msec at 1920 Hz.
+#define SENSOR_RING_DEPTH 16
+
+/// @brief Per sensor rings filled by the parallel reader.  Entry n of each
+/// ring comes from the same reader cycle.
+struct SensorRings
+{
+    Ring<LoggerMsg, SENSOR_RING_DEPTH> left;  // imu1
+    Ring<LoggerMsg, SENSOR_RING_DEPTH> right; // imu2
+};
+
+/// @brief Logger task for parallel acquisition.  The reader notifies the task
+/// after committing each pair of messages.
+void pair_logger_task(void *rings);
+
+class RecordingWriter;
+/// @brief Also pass merged blocks to a recorder (see recording.h), or stop if nullptr.
+void record_merger(RecordingWriter *writer);
+class CaptureWriter;
+/// @brief Also pass the raw messages to a capture (see capture.h), or stop if nullptr.
+void capture_merger(CaptureWriter *writer);
+class PhaseEstimator;
+/// @brief Refine the resampled side's phase with estimator (see phase.h), or stop if nullptr.
+void phase_merger(PhaseEstimator *estimator);
+class BlackBox;
+/// @brief Also keep the raw messages in a black box (see blackbox.h), and take
+/// its console commands, or stop if nullptr.
+void blackbox_merger(BlackBox *box);
+/// @brief The merger's count of output bytes, for metrics (see metrics.h).
+/// Other output, e.g. print_dump(), may add to it.
+uint32_t *merger_output_bytes();
+class LSMExtension;
+/// @brief Report the bus time of the sensors' FIFO reads in the metrics.
+/// imu2 may be nullptr, e.g. behind the sensor hub.
+void metrics_sensors(const LSMExtension *imu1, const LSMExtension *imu2);
+/// @brief Whether the merged output has shown no motion or impact for
+/// ACTIVITY_IDLE_SECONDS (see activity.h), so the reader can stop the sensors.
+/// The reader then sends a message with idle set, and this stays true until
+/// the logger has taken it.
+bool merger_wants_idle();
+/// @brief Whether a CONTROL_RATE command is waiting for the sensors to change
+/// rate, at odr with imu1's gyro at odr / gyro_decimation, either of which may
+/// be nullptr.  The reader then sends a message with odr set, and this stays
+/// true until the logger has taken it.
+bool merger_wants_rate(uint16_t *odr, uint8_t *gyro_decimation);
+
+void test_gyro_channel();
+void test_merger_control();
+void test_merger_restart();
+void test_merger_rate();
+void benchmark_merge();
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cassert>
+#include <stdio.h>
+#include <string.h>
+
+#include "base64_encode.hpp"
+#include "metrics.h"
+
+const char *const metrics_task_names[METRICS_MAX_TASKS] = {"reader", "logger", "display", "phase"};
+
+const char *const metrics_field_names[METRICS_FIELDS] = {
+    "time_msec", "cpu_reader", "cpu_logger", "cpu_display", "cpu_phase", "bus_imu1", "bus_imu2",
+    "queue_high", "queue_depth", "fifo_high", "merge_usec", "merge_worst_usec", "blocks_per_sec",
+    "output_bytes_per_sec", "short_imu1", "short_imu2", "inserted", "dropped", "resyncs", "lost"};
+
+void Metrics::add_read(int queued, uint16_t backlog, uint32_t usec)
+{
+    queue_high = std::max(queue_high, (uint16_t)std::max(queued, 0));
+    fifo_high = std::max(fifo_high, backlog);
+    merge_usec += usec;
+    merge_worst = std::max(merge_worst, usec);
+}
+
+/// @brief delta as per mille of elapsed, capped below METRICS_UNKNOWN.
+static uint16_t per_mille(uint32_t delta, int64_t elapsed)
+{
+    return (uint16_t)std::min<int64_t>((int64_t)delta * 1000 / elapsed, METRICS_UNKNOWN - 1);
+}
+
+void Metrics::frame(int64_t now, const MetricsTotals &totals, MetricsFrame *out)
+{
+    int64_t elapsed = std::max<int64_t>(now - last, 1);
+    *out = MetricsFrame();
+    out->period_msec = (uint16_t)std::min<int64_t>(elapsed / 1000, UINT16_MAX);
+    out->time_msec = (uint32_t)(now / 1000);
+    for (int i = 0; i < METRICS_MAX_TASKS; i++)
+    {
+        // Unsigned differences, so counters that wrapped still count.
+        bool known = totals.tasks_known & previous.tasks_known & (1 << i);
+        out->cpu[i] = known ? per_mille(totals.task_usec[i] - previous.task_usec[i], elapsed) : METRICS_UNKNOWN;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        out->bus[i] = per_mille(totals.bus_usec[i] - previous.bus_usec[i], elapsed);
+        uint32_t cut = totals.short_batches[i] - previous.short_batches[i];
+        out->short_batches[i] = (uint16_t)std::min<uint32_t>(cut, UINT16_MAX);
+    }
+    uint32_t blocks = totals.blocks - previous.blocks;
+    out->queue_high = queue_high;
+    out->queue_depth = totals.queue_depth;
+    out->fifo_high = fifo_high;
+    out->merge_usec = blocks > 0 ? (uint16_t)std::min<uint32_t>(merge_usec / blocks, UINT16_MAX) : 0;
+    out->merge_worst_usec = (uint16_t)std::min<uint32_t>(merge_worst, UINT16_MAX);
+    out->blocks = (uint16_t)std::min<uint32_t>(blocks, UINT16_MAX);
+    out->output_bytes_per_sec = (uint32_t)((int64_t)(totals.output_bytes - previous.output_bytes) * 1000000 / elapsed);
+    auto delta = [](uint32_t now, uint32_t before) { return (uint16_t)std::min<uint32_t>(now - before, UINT16_MAX); };
+    out->inserted = delta(totals.inserted, previous.inserted);
+    out->dropped = delta(totals.dropped, previous.dropped);
+    out->resyncs = delta(totals.resyncs, previous.resyncs);
+    out->lost = delta(totals.lost, previous.lost);
+
+    previous = totals;
+    last = now;
+    next = now + METRICS_PERIOD_USEC;
+    queue_high = fifo_high = 0;
+    merge_usec = merge_worst = 0;
+    frames++;
+}
+
+bool metrics_row(const void *data, size_t bytes, int32_t row[METRICS_FIELDS])
+{
+    MetricsFrame f;
+    if (bytes != sizeof(f))
+        return false;
+    memcpy(&f, data, sizeof(f));
+    if (f.version != METRICS_VERSION)
+        return false;
+    auto known = [](uint16_t v) { return v == METRICS_UNKNOWN ? -1 : (int32_t)v; };
+    row[METRICS_TIME_MSEC] = (int32_t)f.time_msec;
+    for (int i = 0; i < METRICS_MAX_TASKS; i++)
+        row[METRICS_CPU_READER + i] = known(f.cpu[i]);
+    row[METRICS_BUS_IMU1] = f.bus[0];
+    row[METRICS_BUS_IMU2] = f.bus[1];
+    row[METRICS_QUEUE_HIGH] = f.queue_high;
+    row[METRICS_QUEUE_DEPTH] = f.queue_depth;
+    row[METRICS_FIFO_HIGH] = f.fifo_high;
+    row[METRICS_MERGE_USEC] = f.merge_usec;
+    row[METRICS_MERGE_WORST_USEC] = f.merge_worst_usec;
+    row[METRICS_BLOCKS_PER_SEC] = f.period_msec > 0 ? f.blocks * 1000 / f.period_msec : 0;
+    row[METRICS_OUTPUT_BYTES_PER_SEC] = (int32_t)f.output_bytes_per_sec;
+    row[METRICS_SHORT_IMU1] = f.short_batches[0];
+    row[METRICS_SHORT_IMU2] = f.short_batches[1];
+    row[METRICS_INSERTED] = f.inserted;
+    row[METRICS_DROPPED] = f.dropped;
+    row[METRICS_RESYNCS] = f.resyncs;
+    row[METRICS_LOST] = f.lost;
+    return true;
+}
+
+int print_metrics(const MetricsFrame &frame)
+{
+    static unsigned char text[(sizeof(MetricsFrame) + 2) / 3 * 4 + 1];
+    encode_base64((const unsigned char *)&frame, sizeof(frame), text);
+    return printf("P %s\n", text);
+}
+
+#if SELF_TEST
+/// @brief Two periods of made up totals: shares, wrapped counters, unknown
+/// tasks, high water marks that reset, and the row the host makes of a frame.
+void test_metrics()
+{
+    static Metrics metrics;
+    MetricsTotals totals;
+    MetricsFrame frame;
+    assert(!metrics.due(METRICS_PERIOD_USEC - 1) && metrics.due(METRICS_PERIOD_USEC));
+
+    // The first period only starts the task counters.
+    totals.tasks_known = 1 << METRICS_TASK_READER | 1 << METRICS_TASK_LOGGER;
+    totals.task_usec[METRICS_TASK_READER] = 0xFFFFFFFF - 99999; // Wraps in the next period.
+    totals.task_usec[METRICS_TASK_LOGGER] = 400000;
+    totals.bus_usec[0] = 300000;
+    totals.blocks = 240;
+    totals.output_bytes = 20000;
+    totals.queue_depth = 40;
+    totals.short_batches[1] = 5;
+    totals.inserted = 0xFFFFFFFF; // Wraps in the next period.
+    totals.dropped = 7;
+    metrics.add_read(3, 10, 50);
+    metrics.add_read(1, 12, 90);
+    metrics.frame(1000000, totals, &frame);
+    assert(frame.period_msec == 1000 && frame.time_msec == 1000 && frame.cpu[METRICS_TASK_READER] == METRICS_UNKNOWN);
+    assert(frame.bus[0] == 300 && frame.bus[1] == 0 && frame.blocks == 240 && frame.output_bytes_per_sec == 20000);
+    assert(frame.queue_high == 3 && frame.queue_depth == 40 && frame.fifo_high == 12);
+    assert(frame.merge_worst_usec == 90 && frame.merge_usec == 0);
+    assert(frame.short_batches[0] == 0 && frame.short_batches[1] == 5);
+    assert(!metrics.due(1999999) && metrics.due(2000000));
+
+    // Half a second later.
+    totals.task_usec[METRICS_TASK_READER] += 150000;
+    totals.task_usec[METRICS_TASK_LOGGER] += 100000;
+    totals.bus_usec[0] += 200000;
+    totals.bus_usec[1] += 50000;
+    totals.blocks += 120;
+    totals.output_bytes += 6000;
+    totals.short_batches[1] += 2;
+    totals.inserted += 3;
+    totals.resyncs += 1;
+    metrics.add_read(0, 4, 1200);
+    metrics.frame(1500000, totals, &frame);
+    assert(frame.period_msec == 500 && frame.cpu[METRICS_TASK_READER] == 300);
+    assert(frame.cpu[METRICS_TASK_LOGGER] == 200 && frame.cpu[METRICS_TASK_PHASE] == METRICS_UNKNOWN);
+    assert(frame.bus[0] == 400 && frame.bus[1] == 100 && frame.output_bytes_per_sec == 12000);
+    assert(frame.queue_high == 0 && frame.fifo_high == 4 && frame.merge_usec == 10 && frame.merge_worst_usec == 1200);
+    assert(frame.short_batches[0] == 0 && frame.short_batches[1] == 2);
+    assert(frame.inserted == 3 && frame.dropped == 0 && frame.resyncs == 1 && frame.lost == 0);
+    assert(metrics.frames == 2);
+
+    int32_t row[METRICS_FIELDS];
+    assert(metrics_row(&frame, sizeof(frame), row));
+    assert(row[METRICS_TIME_MSEC] == 1500 && row[METRICS_CPU_READER] == 300 && row[METRICS_CPU_DISPLAY] == -1);
+    assert(row[METRICS_BUS_IMU2] == 100 && row[METRICS_BLOCKS_PER_SEC] == 240 && row[METRICS_MERGE_USEC] == 10);
+    assert(row[METRICS_SHORT_IMU1] == 0 && row[METRICS_SHORT_IMU2] == 2);
+    assert(row[METRICS_INSERTED] == 3 && row[METRICS_RESYNCS] == 1);
+    assert(!metrics_row(&frame, sizeof(frame) - 1, row));
+    frame.version++;
+    assert(!metrics_row(&frame, sizeof(frame), row));
+    printf("Metrics: %d byte frames, %ld made\n", (int)sizeof(MetricsFrame), metrics.frames);
+}
+#endif
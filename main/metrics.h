@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared by the firmware and the host tools, so only standard headers here.
+//
+// Pipeline metrics.  The logger counts where the time and the link go, and
+// every METRICS_PERIOD_USEC, at trace level TRACE_INFO and above (see
+// control.h), prints a frame of them in band:
+//
+//     P <base64 MetricsFrame>
+//
+// Rates and shares are over the period since the last frame, and high water
+// marks are reset by each frame.  The host decoder writes each frame as a row
+// of METRICS_FIELDS int32 values to metrics.i32, which `metrics` plots.
+
+#define METRICS_VERSION 3
+#define METRICS_PERIOD_USEC 1000000
+// Tasks with CPU shares, by METRICS_TASK_* slot.
+#define METRICS_MAX_TASKS 4
+// A task or value with no measurement, e.g. CPU shares without FreeRTOS run
+// time stats.
+#define METRICS_UNKNOWN 0xFFFF
+
+enum MetricsTask : uint8_t
+{
+    METRICS_TASK_READER = 0,
+    METRICS_TASK_LOGGER = 1,
+    METRICS_TASK_DISPLAY = 2,
+    METRICS_TASK_PHASE = 3,
+};
+
+/// @brief Names of the METRICS_TASK_* slots, as memory_register_task() tracks them.
+extern const char *const metrics_task_names[METRICS_MAX_TASKS];
+
+/// @brief One frame, little endian, with no padding.
+struct MetricsFrame
+{
+    uint8_t version = METRICS_VERSION;
+    uint8_t reserved = 0;
+    uint16_t period_msec = 0;             // Since the last frame.
+    uint32_t time_msec = 0;               // Device time of the frame.
+    uint16_t cpu[METRICS_MAX_TASKS] = {}; // Per mille of a core, by METRICS_TASK_* slot.
+    uint16_t bus[2] = {};                 // Per mille of the time each sensor's FIFO reads were on the bus.
+    uint16_t queue_high = 0;              // Most reads waiting for the logger.
+    uint16_t queue_depth = 0;             // What the logger's queue, or ring, holds.
+    uint16_t fifo_high = 0;               // Largest sensor FIFO backlog after a read, in samples.
+    uint16_t merge_usec = 0;              // Mean logger time per merged block, output included.
+    uint16_t merge_worst_usec = 0;        // Longest logger time for one read.
+    uint16_t blocks = 0;                  // Merged blocks.
+    uint32_t output_bytes_per_sec = 0;    // Data lines sent.
+    uint16_t short_batches[2] = {};       // Each sensor's bursts cut to the FIFO level (see Read_FIFO_Batch).
+    uint16_t inserted = 0;                // Skew scheduler outputs that repeated a local sample.
+    uint16_t dropped = 0;                 // Local samples the skew scheduler skipped.
+    uint16_t resyncs = 0;                 // Skew scheduler phase jumps.
+    uint16_t lost = 0;                    // Samples lost from either sensor.
+};
+
+static_assert(sizeof(MetricsFrame) == 48, "MetricsFrame must have no padding");
+
+/// @brief Running totals, sampled for each frame.  Counters may wrap.
+struct MetricsTotals
+{
+    uint32_t task_usec[METRICS_MAX_TASKS] = {}; // Run time, by METRICS_TASK_* slot.
+    uint8_t tasks_known = 0;                    // Bit per slot with a run time.
+    uint32_t bus_usec[2] = {};                  // LSMExtension::bus_usec of imu1 and imu2.
+    uint32_t blocks = 0;                        // Merged blocks output.
+    uint32_t output_bytes = 0;                  // Data line bytes sent.
+    uint32_t short_batches[2] = {};             // LSMExtension::short_batches of imu1 and imu2.
+    uint32_t inserted = 0;                      // The merger's SkewScheduler counts.
+    uint32_t dropped = 0;
+    uint32_t resyncs = 0;
+    uint32_t lost = 0;                          // Samples lost, both sensors.
+    uint16_t queue_depth = 0;
+};
+
+/// @brief Collects the logger's per read measurements between frames, and
+/// turns totals into a frame.  Runs on the logger task.
+class Metrics
+{
+public:
+    /// @brief Count one read, or pair of reads, handled by the logger.
+    /// @param queued Reads still waiting for the logger.
+    /// @param backlog Samples left in the sensor's FIFO after the read.
+    /// @param usec Logger time for the read.
+    void add_read(int queued, uint16_t backlog, uint32_t usec);
+
+    bool due(int64_t now) const { return now >= next; }
+
+    /// @brief Fill in a frame for the period since the last one, and start
+    /// the next period.
+    void frame(int64_t now, const MetricsTotals &totals, MetricsFrame *out);
+
+    long frames = 0;
+
+private:
+    int64_t next = METRICS_PERIOD_USEC;
+    int64_t last = 0;
+    MetricsTotals previous;
+    uint16_t queue_high = 0;
+    uint16_t fifo_high = 0;
+    uint32_t merge_usec = 0;
+    uint32_t merge_worst = 0;
+};
+
+// Columns of a metrics.i32 row.  The cpu and bus fields are per mille, or
+// -1 if unknown.
+enum MetricsField
+{
+    METRICS_TIME_MSEC,
+    METRICS_CPU_READER,
+    METRICS_CPU_LOGGER,
+    METRICS_CPU_DISPLAY,
+    METRICS_CPU_PHASE,
+    METRICS_BUS_IMU1,
+    METRICS_BUS_IMU2,
+    METRICS_QUEUE_HIGH,
+    METRICS_QUEUE_DEPTH,
+    METRICS_FIFO_HIGH,
+    METRICS_MERGE_USEC,
+    METRICS_MERGE_WORST_USEC,
+    METRICS_BLOCKS_PER_SEC,
+    METRICS_OUTPUT_BYTES_PER_SEC,
+    METRICS_SHORT_IMU1,
+    METRICS_SHORT_IMU2,
+    METRICS_INSERTED,
+    METRICS_DROPPED,
+    METRICS_RESYNCS,
+    METRICS_LOST,
+    METRICS_FIELDS
+};
+
+/// @brief Short names of the MetricsField columns, for plots.
+extern const char *const metrics_field_names[METRICS_FIELDS];
+
+/// @brief Parse a decoded frame into a metrics.i32 row.
+/// @return false if it isn't a frame of this version.
+bool metrics_row(const void *frame, size_t bytes, int32_t row[METRICS_FIELDS]);
+
+/// @brief Print a frame as a `P <base64>` line.
+/// @return Bytes printed.
+int print_metrics(const MetricsFrame &frame);
+
+void test_metrics();
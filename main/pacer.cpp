@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <cassert>
+#include <stdio.h>
+#ifdef ESP_PLATFORM
+#include "freertos/task.h"
+
+#include "IMU.h"
+#include "sim.h"
+#endif
+#include "pacer.h"
+
+ReadPacer::ReadPacer(int devices, int wakes_per_read) : devices(devices), wakes_per_read(wakes_per_read)
+{
+    for (Sensor &s : sensors)
+    {
+        // Every record a sample could take, so the first intervals are short.
+        s.rate = RATE.odr * RECORDS_PER_SAMPLE / 1e6f;
+        s.interval = RATE.read_interval_usec();
+    }
+}
+
+#ifdef ESP_PLATFORM
+void ReadPacer::begin(int64_t now)
+{
+    sem = xSemaphoreCreateBinary();
+    esp_timer_create_args_t args = {};
+    args.callback = timer_done;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "pacer";
+    if (sem == nullptr || esp_timer_create(&args, &timer) != ESP_OK)
+    {
+        printf("Problem: no read pacer timer\n");
+        vTaskSuspend(NULL);
+    }
+    wake = now;
+}
+#endif
+
+void ReadPacer::resume(int64_t now)
+{
+    for (Sensor &s : sensors)
+        s.start = -1;
+    wake = now;
+}
+
+void ReadPacer::set_rate(uint16_t odr, uint8_t gyro_decimation)
+{
+    nominal = (float)RATE.read_interval_usec() * RATE.odr / odr;
+    // Only imu1 batches the gyro, and it sets the interval.
+    target = PACER_TARGET * (1.0f + (float)BELL_ANGLE / gyro_decimation) /
+             (1.0f + (float)BELL_ANGLE / GYRO_DECIMATION);
+    for (Sensor &s : sensors)
+    {
+        s = Sensor();
+        s.rate = odr * RECORDS_PER_SAMPLE / 1e6f;
+        s.interval = (uint32_t)nominal;
+    }
+}
+
+#ifdef ESP_PLATFORM
+void ReadPacer::timer_done(void *arg)
+{
+    xSemaphoreGive(((ReadPacer *)arg)->sem);
+}
+#endif
+
+uint32_t ReadPacer::read_interval() const
+{
+    uint32_t interval = sensors[0].interval;
+    for (int d = 1; d < devices; d++)
+        interval = std::min(interval, sensors[d].interval);
+    return interval;
+}
+
+void ReadPacer::observe(int device, int64_t start, uint16_t level, uint16_t left)
+{
+    Sensor &s = sensors[device];
+    worst_level = std::max(worst_level, level);
+    if (level >= PACER_LIMIT)
+        over++;
+    // An overrun or a flush can leave fewer entries than the last read did.
+    if (s.start >= 0 && start > s.start && level >= s.left)
+    {
+        float rate = (level - s.left) / (float)(start - s.start);
+        s.rate += std::max(PACER_RATE_GAIN, 1.0f / (s.reads + 1)) * (rate - s.rate);
+        s.reads++;
+        // Only while this sensor sets the interval, and isn't held at a
+        // bound, or the trim winds up.
+        if (!s.bounded && s.interval == read_interval())
+            s.trim = std::clamp(s.trim - PACER_TRIM_GAIN * (level - target), -target / 2, target / 2);
+    }
+    s.start = start;
+    s.left = left;
+
+    float low = nominal * PACER_MIN_STRETCH;
+    float high = nominal * PACER_MAX_STRETCH;
+    float interval = (target + s.trim - left) / s.rate;
+    s.bounded = interval <= low || interval >= high;
+    interval = std::clamp(interval, low, high);
+    // Time for the level to reach PACER_LIMIT, less the worst recent lateness.
+    float guard = (PACER_LIMIT - 1 - left) / s.rate - late_usec;
+    if (interval > guard)
+    {
+        interval = std::max(guard, low);
+        s.bounded = true;
+        limited++;
+    }
+    s.interval = (uint32_t)interval;
+}
+
+bool ReadPacer::woke(int64_t now)
+{
+    int64_t due = next_wake();
+    int64_t lateness = now - due;
+    // After a stall, start again from now, rather than catching up with
+    // wakes back to back.
+    wake = lateness > (int64_t)read_interval() ? now : due;
+    late_usec = std::max(late_usec * PACER_LATE_DECAY, (float)std::max<int64_t>(lateness, 0));
+    wakes++;
+    bool delayed = lateness > PACER_LATE_USEC;
+    if (delayed)
+        late++;
+    return delayed;
+}
+
+#ifdef ESP_PLATFORM
+bool ReadPacer::wait()
+{
+    int64_t now = esp_timer_get_time();
+    if (now >= next_report)
+    {
+        report();
+        next_report = now + PACER_REPORT_USEC;
+    }
+    int64_t due = next_wake();
+    if (due > now)
+    {
+        esp_timer_start_once(timer, due - now);
+        xSemaphoreTake(sem, portMAX_DELAY);
+    }
+    return woke(esp_timer_get_time());
+}
+#endif
+
+void ReadPacer::report() const
+{
+    printf("Read pacer: every %lu usec (nominal %lu), %ld wakes, %ld late (worst recent %.0f usec), "
+           "level worst %u of %d, %ld over, %ld limited\n",
+           (unsigned long)read_interval(), (unsigned long)nominal, wakes, late, late_usec,
+           worst_level, PACER_LIMIT, over, limited);
+}
+
+#if SELF_TEST
+/// @brief Drive observe() with FIFO levels worked out from two steady entry
+/// rates, through the ping pong schedule, with some wakes late, one stall,
+/// and some entries left behind by reads.  Check that the level of the sensor
+/// setting the interval settles on the target, with the interval set by the
+/// target rather than held at a bound, before the stall and again by the end,
+/// and longer than the nominal on average.  Again at a quarter of the ODR,
+/// with sparser gyro, as after CONTROL_RATE.
+void test_pacer_control()
+{
+    for (int slower : {1, 4})
+    {
+        ReadPacer pacer(2, 2);
+        const uint16_t odr = RATE.odr / slower;
+        const uint8_t decimation = slower == 1 ? GYRO_DECIMATION : 8;
+        if (slower > 1)
+            pacer.set_rate(odr, decimation);
+        // Entries a sample: imu1 also batches the gyro with BELL_ANGLE, and a
+        // still bell compresses three samples to an entry.
+        const float compression = FIFO_COMPRESSION ? FIFO_COMPRESSION_MAX : 1;
+        const float rate[2] = {(1.0f + (float)BELL_ANGLE / decimation) * odr / 1e6f / compression,
+                               1.0005f * odr / 1e6f / compression};
+        const float target = pacer.target_level();
+        const float nominal = pacer.nominal_interval();
+        long taken[2] = {0, 0};
+        double level_sum[2] = {0, 0};
+        int levels[2] = {0, 0};
+        int bounded[2] = {0, 0};
+        uint16_t highest = 0;
+
+        const int wakes = 4000;
+        const int settled = 1000;
+        const int recovered = wakes / 2 + 6; // Wake from which to average the interval.
+        int64_t since = 0;
+        int64_t t = 0;
+        for (int w = 0; w < wakes; w++)
+        {
+            t = pacer.next_wake();
+            if (w % 97 == 0)
+                t += 600;
+            if (w == wakes / 2)
+                t += pacer.read_interval();
+            pacer.woke(t);
+            if (w == recovered)
+                since = t;
+            int d = w & 1;
+            uint16_t level = (uint16_t)((long)(t * rate[d]) - taken[d]);
+            // A read takes at most PACER_LIMIT, and every third leaves an entry
+            // that arrived while it was on the bus.
+            uint16_t left = level > PACER_LIMIT ? level - PACER_LIMIT : 0;
+            if (w % 3 == 0 && level > left)
+                left++;
+            taken[d] += level - left;
+            pacer.observe(d, t, level, left);
+            // After the stall, the guard may hold the interval for a while.
+            if (w >= settled && w < wakes / 2)
+                bounded[d] += pacer.bounded(d);
+            // The reads just after the stall may find the limit or more.
+            if (w >= settled && (w < wakes / 2 || w > wakes / 2 + 4))
+            {
+                level_sum[d] += level;
+                levels[d]++;
+                highest = std::max(highest, level);
+            }
+        }
+        // The sensor setting the interval reaches the higher level.  With a
+        // target of a few entries the two intervals can tie, so go by that
+        // rather than by which is shorter at the end.
+        int setter = level_sum[0] / levels[0] >= level_sum[1] / levels[1] ? 0 : 1;
+        float mean = level_sum[setter] / levels[setter];
+        float other = level_sum[setter ^ 1] / levels[setter ^ 1];
+        // Levels are whole entries, and a compressed target only a few, where
+        // an entry left behind shortens the next interval a lot.  So allow a
+        // quarter of an entry, and check the mean interval since the stall.
+        float tolerance = std::max(target * 0.05f, 0.25f);
+        float every = (t - since) * 2.0f / (wakes - 1 - recovered);
+        assert(nominal == (float)RATE.read_interval_usec() * slower);
+        assert(mean > target - tolerance && mean < target + tolerance);
+        assert(other < mean + tolerance);
+        assert(bounded[setter] == 0 && !pacer.bounded(setter) && highest < PACER_LIMIT && pacer.over <= 2);
+        assert(pacer.read_interval() > nominal * PACER_MIN_STRETCH &&
+               pacer.read_interval() < nominal * PACER_MAX_STRETCH);
+        assert(every > nominal && every < nominal * PACER_MAX_STRETCH);
+        printf("Pacer control test at %u Hz: level mean %.1f, target %.1f, every %.0f usec (nominal %.0f)\n", odr, mean,
+               target, every, nominal);
+    }
+}
+
+#ifdef ESP_PLATFORM
+// Simulated time, for LSMExtension::Set_Clock.
+static int64_t pacer_now = 0;
+
+/// @brief Pace two simulated sensors through the ping pong schedule, with
+/// some wakes late, imu1 with its gyro at BELL_ANGLE, and check that the
+/// level of the sensor setting the interval settles on the target, with the
+/// interval off the stretch bounds, that levels stay below the limit except
+/// just after a stall nothing could foresee, and that it takes fewer wakes
+/// than the rate profile.
+void test_read_pacer()
+{
+    static SimulatedLSM sim1(RATE.odr, 1.0f);
+    static SimulatedLSM sim2(RATE.odr, 1.0005f, 300);
+    static MockBus bus1(&sim1);
+    static MockBus bus2(&sim2);
+    static LSMExtension imu1(&bus1);
+    static LSMExtension imu2(&bus2);
+    static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    static ReadPacer pacer(2, 2);
+    SimulatedLSM *sims[2] = {&sim1, &sim2};
+    LSMExtension *imus[2] = {&imu1, &imu2};
+    for (int d = 0; d < 2; d++)
+    {
+        // A still bell, which compresses well, so reads can stretch.
+        sims[d]->set_amplitude(200);
+        if (FIFO_COMPRESSION)
+            assert(imus[d]->Enable_FIFO_Compression() == LSM6DSV16X_OK);
+        assert(imus[d]->Write_Config(d == 0 && BELL_ANGLE) == LSM6DSV16X_OK);
+        imus[d]->Set_Clock([]() { return pacer_now; });
+    }
+
+    const int wakes = 4000;
+    const int settled = 1000;
+    double level_sum[2] = {0, 0};
+    int levels[2] = {0, 0};
+    uint16_t highest = 0;
+    long samples = 0;
+    for (int w = 0; w < wakes; w++)
+    {
+        int64_t t = pacer.next_wake();
+        // A late wake every so often, and one stall of a whole interval.
+        if (w % 97 == 0)
+            t += 600;
+        if (w == wakes / 2)
+            t += pacer.read_interval();
+        pacer.woke(t);
+        int d = w & 1;
+        sims[d]->advance(t);
+        uint16_t count;
+        pacer_now = t;
+        assert(imus[d]->Read_FIFO_Batch(RATE.max_records, records, [](void *, int32_t) {}, nullptr) ==
+               LSM6DSV16X_OK);
+        assert(imus[d]->Finish_FIFO_Batch(&count) == LSM6DSV16X_OK);
+        samples += count;
+        uint16_t level = imus[d]->FIFO_Level();
+        pacer.observe(d, t, level, imus[d]->FIFO_Left());
+        // The reads just after the stall may find the limit or more.
+        if (w >= settled && (w < wakes / 2 || w > wakes / 2 + 4))
+        {
+            level_sum[d] += level;
+            levels[d]++;
+            highest = std::max(highest, level);
+        }
+    }
+    // The sensor that needs reading soonest sets the interval, and reaches
+    // the target, the higher level (see test_pacer_control()).
+    int setter = level_sum[0] / levels[0] >= level_sum[1] / levels[1] ? 0 : 1;
+    float mean = level_sum[setter] / levels[setter];
+    assert(sim1.lost() == 0 && sim2.lost() == 0 && pacer.over <= 2 && highest < PACER_LIMIT);
+    assert(mean > PACER_TARGET * 0.9f && mean < PACER_TARGET * 1.1f);
+    assert(!pacer.bounded(setter));
+    assert(pacer.read_interval() > RATE.read_interval_usec() &&
+           pacer.read_interval() < RATE.read_interval_usec() * PACER_MAX_STRETCH);
+    assert(pacer.late > 0);
+    printf("Read pacer test: level mean %.1f, highest %u, target %.1f, limit %d, every %lu usec (nominal %lu), "
+           "%.1f samples per read\n",
+           mean, highest, PACER_TARGET, PACER_LIMIT, (unsigned long)pacer.read_interval(),
+           (unsigned long)RATE.read_interval_usec(), (float)samples / wakes);
+}
+#endif
+#endif
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#endif
+#include "compression.h"
+#include "rate.h"
+
+// Adaptive read pacing.  The reader used to wake every read_period_ticks,
+// whatever had arrived, and on the 1 msec tick.  ReadPacer wakes it on an
+// esp_timer instead, and sets the read interval from what each sensor's
+// reads find: the FIFO level when the read started, what it left, and so
+// the rate entries arrive at.  The level at each read then settles on
+// PACER_TARGET entries, which is fewer, larger reads than the rate profile's,
+// so fewer wake ups per sample.  observe() is only arithmetic, so the host
+// self test checks it without a sensor (see test_pacer_control()).  The interval is always short enough that
+// the level stays below PACER_LIMIT, even after the latest wake seen lately.
+//
+// The reader ping pongs, or reads the sensors together, so both are read at
+// the interval of the sensor that needs reading soonest.  The interval stays
+// within PACER_MIN_STRETCH and PACER_MAX_STRETCH of the rate profile's, so
+// the fitters' time constants and warm up stay close to what it planned.
+// After a CONTROL_RATE change, the nominal interval stretches with the
+// sample period, so reads carry as many samples as at the build's ODR.
+
+// FIFO level, in entries, the pacer aims for at each read: what imu1's
+// accelerometer, and gyro with BELL_ANGLE, put in over one and a half nominal
+// reads.  imu1 is the busiest sensor, so it sets the interval, at 1.5 times
+// the nominal, or a little less with the sensor hub's entries, inside the
+// stretch bounds with room for the trim.  It stays below RATE.large_read,
+// which flags a reader that fell behind.  With compression, it assumes a
+// still bell's samples go three to an entry, so it can be a fractional
+// level.  Samples that compress worse reach it sooner, down to the shortest
+// interval.  A read takes at most this many with the Wire transport, which
+// reads everything, and nearly all of it with async transports, which leave
+// what arrived while the last read was on the bus (see Read_FIFO_Batch).
+#define PACER_TARGET_ENTRIES (3 * RATE.samples_per_read * (GYRO_DECIMATION + BELL_ANGLE) / (2 * GYRO_DECIMATION))
+#define PACER_TARGET (PACER_TARGET_ENTRIES / (FIFO_COMPRESSION ? (float)FIFO_COMPRESSION_MAX : 1.0f))
+static_assert(PACER_TARGET_ENTRIES < RATE.large_read, "The pacer must aim below a large read");
+// FIFO level no read should find: the most one read can take.  Above it the
+// backlog grows from read to read, until the FIFO overruns.
+#define PACER_LIMIT (FIFO_COMPRESSION ? RATE.max_records / FIFO_COMPRESSION_MAX : RATE.max_records)
+#define PACER_MIN_STRETCH 0.5f
+#define PACER_MAX_STRETCH 2.0f
+// Filter gain for each sensor's entry rate, once it has a few reads.
+#define PACER_RATE_GAIN 0.05f
+// Integral gain on the level's error, in entries per entry.  It trims out
+// what the rate estimate and late wakes get wrong.
+#define PACER_TRIM_GAIN 0.02f
+// A wake later than this is flagged as delayed in its messages.
+#define PACER_LATE_USEC 200
+// How fast the worst recent lateness decays, per wake.
+#define PACER_LATE_DECAY 0.999f
+#define PACER_REPORT_USEC 60000000
+#define PACER_MAX_DEVICES 2
+
+/// @brief Closed loop read scheduler.  observe() each finished read, and
+/// wait() for each wake.  Runs on the reader task.
+class ReadPacer
+{
+public:
+    /// @param devices Sensors read: 1 through the sensor hub, otherwise 2.
+    /// @param wakes_per_read Wakes per read of each sensor: 2 when the reader
+    /// ping pongs, 1 when it reads every sensor at each wake.
+    ReadPacer(int devices, int wakes_per_read);
+
+    /// @brief Create the timer, and start the schedule at now.
+    void begin(int64_t now);
+    /// @brief Start the schedule again at now, after the sensors stopped,
+    /// forgetting each sensor's last read.
+    void resume(int64_t now);
+    /// @brief Pace the sensors at odr, with imu1's gyro at odr /
+    /// gyro_decimation, from scratch, from the next resume().
+    void set_rate(uint16_t odr, uint8_t gyro_decimation);
+
+    /// @brief Take a finished read of device.
+    /// @param start When the read started, by esp_timer_get_time().
+    /// @param level FIFO entries when the read started.
+    /// @param left FIFO entries known to be left after it.
+    void observe(int device, int64_t start, uint16_t level, uint16_t left);
+
+    /// @brief Usec between reads of each sensor: the shortest that any
+    /// sensor needs.
+    uint32_t read_interval() const;
+    /// @brief Usec between reads that device needs, on its own.
+    uint32_t device_interval(int device) const { return sensors[device].interval; }
+    /// @brief Whether device's interval is held at a stretch bound or the
+    /// guard, rather than set by the target.
+    bool bounded(int device) const { return sensors[device].bounded; }
+    /// @brief The rate profile's interval, stretched for the ODR.
+    uint32_t nominal_interval() const { return (uint32_t)nominal; }
+    /// @brief FIFO level the reads aim for: PACER_TARGET, with fewer gyro
+    /// entries after a rate change.
+    float target_level() const { return target; }
+    /// @brief When the reader should next wake.
+    int64_t next_wake() const { return wake + read_interval() / wakes_per_read; }
+
+    /// @brief Sleep until next_wake(), and start the next period.
+    /// @return Whether the wake was late, by more than PACER_LATE_USEC.
+    bool wait();
+    /// @brief Start the next period, woken at now.  wait() calls this, and
+    /// tests call it with simulated times.
+    bool woke(int64_t now);
+
+    void report() const;
+
+    long wakes = 0;
+    long late = 0;            // Wakes later than PACER_LATE_USEC.
+    long limited = 0;         // Intervals shortened to keep the level below PACER_LIMIT.
+    long over = 0;            // Reads that found PACER_LIMIT or more.
+    uint16_t worst_level = 0; // Highest level a read found.
+    float late_usec = 0;      // Worst recent lateness, decaying.
+
+private:
+    struct Sensor
+    {
+        float rate = 0;      // FIFO entries per usec.
+        float trim = 0;      // Correction to PACER_TARGET, in entries.
+        int64_t start = -1;  // Start of the last read, or -1 before the first.
+        uint16_t left = 0;   // Entries the last read left.
+        long reads = 0;
+        uint32_t interval = 0;
+        bool bounded = false; // The interval is held at a stretch bound or the guard.
+    };
+
+    static void timer_done(void *arg);
+
+    Sensor sensors[PACER_MAX_DEVICES];
+    int devices;
+    int wakes_per_read;
+    float nominal = RATE.read_interval_usec();
+    float target = PACER_TARGET;
+    int64_t wake = 0; // When the current period was due.
+    int64_t next_report = PACER_REPORT_USEC;
+#ifdef ESP_PLATFORM
+    esp_timer_handle_t timer = nullptr;
+    SemaphoreHandle_t sem = nullptr;
+#endif
+};
+
+void test_pacer_control();
+void test_read_pacer();
@@ -0,0 +1,213 @@
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include "esp_timer.h"
+
+#include "phase.h"
+
+bool estimate_lag(const MergeMessage *window, int n, float *lag, float *correlation)
+{
+    const int L = PHASE_MAX_LAG;
+    // Sum over axes of the magnitude of the normalised correlation at each lag.
+    float rho[2 * L + 1] = {};
+    int axes = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        // Sample to sample differences drop gravity and the slow swing, and
+        // leave the vibration.  Difference j is between samples j and j + 1.
+        int64_t c[2 * L + 1] = {};
+        int64_t left_energy = 0, right_energy = 0;
+        for (int j = L; j < n - 1 - L; j++)
+        {
+            int32_t dl = window[j + 1].data[a] - window[j].data[a];
+            int32_t dr = window[j + 1].data[3 + a] - window[j].data[3 + a];
+            left_energy += (int64_t)dl * dl;
+            right_energy += (int64_t)dr * dr;
+            for (int l = -L; l <= L; l++)
+                c[l + L] += (int64_t)dl * (window[j + 1 + l].data[3 + a] - window[j + l].data[3 + a]);
+        }
+        int64_t min_energy = (int64_t)PHASE_MIN_RMS * PHASE_MIN_RMS * (n - 1 - 2 * L);
+        if (left_energy < min_energy || right_energy < min_energy)
+            continue;
+        float norm = 1.0f / sqrtf((float)left_energy * (float)right_energy);
+        for (int i = 0; i < 2 * L + 1; i++)
+            rho[i] += fabsf(c[i] * norm);
+        axes++;
+    }
+    if (axes == 0)
+        return false;
+
+    int best = 0;
+    for (int i = 1; i < 2 * L + 1; i++)
+        if (rho[i] > rho[best])
+            best = i;
+    *correlation = rho[best] / axes;
+    if (best == 0 || best == 2 * L || *correlation < PHASE_MIN_CORRELATION)
+        return false;
+    float before = rho[best - 1], peak = rho[best], after = rho[best + 1];
+    float curvature = before - 2 * peak + after;
+    *lag = best - L + (curvature < 0 ? 0.5f * (before - after) / curvature : 0.0f);
+    return true;
+}
+
+void PhaseEstimator::add(const MergeMessage *samples, int count)
+{
+    if (state.load(std::memory_order_acquire) != FILLING)
+        return;
+    for (int i = 0; i < count; i++)
+    {
+        if (skip > 0)
+        {
+            skip--;
+            continue;
+        }
+        window[filled++] = samples[i];
+        if (filled < PHASE_WINDOW)
+            continue;
+        state.store(FULL, std::memory_order_release);
+        if (task != nullptr)
+            xTaskNotifyGive(task);
+        else
+            run();
+        return;
+    }
+}
+
+void PhaseEstimator::reset(long holdoff)
+{
+    if (state.load(std::memory_order_acquire) == FILLING)
+        filled = 0;
+    if (holdoff > skip)
+        skip = holdoff;
+}
+
+bool PhaseEstimator::take(float *result)
+{
+    if (state.load(std::memory_order_acquire) != DONE)
+        return false;
+    bool accepted = valid;
+    *result = lag;
+    filled = 0;
+    if (skip < (long)PHASE_INTERVAL_SECONDS * RATE.odr)
+        skip = (long)PHASE_INTERVAL_SECONDS * RATE.odr;
+    state.store(FILLING, std::memory_order_release);
+    return accepted;
+}
+
+void PhaseEstimator::run()
+{
+    if (state.load(std::memory_order_acquire) != FULL)
+        return;
+    int64_t start = esp_timer_get_time();
+    float correlation = 0;
+    valid = estimate_lag(window, PHASE_WINDOW, &lag, &correlation);
+    int64_t elapsed = esp_timer_get_time() - start;
+    busy_usec += elapsed;
+    if (elapsed > worst_usec)
+        worst_usec = elapsed;
+    if (valid)
+    {
+        estimates++;
+        last_lag = lag;
+        last_correlation = correlation;
+    }
+    else
+    {
+        rejected++;
+    }
+    state.store(DONE, std::memory_order_release);
+}
+
+void phase_task(void *arg)
+{
+    PhaseEstimator *estimator = (PhaseEstimator *)arg;
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        estimator->run();
+    }
+}
+
+#if SELF_TEST
+/// @brief Fill window with a broadband vibration on gravity and a slow
+/// swing, imu2's side delayed by delay samples, scaled, and with Y inverted.
+static void synthesize(MergeMessage *window, float delay, float amplitude)
+{
+    static const float freqs[4] = {0.05f, 0.09f, 0.13f, 0.19f}; // Cycles per sample.
+    static const float amps[4] = {1.0f, 0.7f, 0.5f, 0.35f};
+    for (int k = 0; k < PHASE_WINDOW; k++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            float t = side == 0 ? k : k - delay;
+            for (int a = 0; a < 3; a++)
+            {
+                float v = (a == 2 ? 2048 : 0) + 3 * t;
+                for (int i = 0; i < 4; i++)
+                    v += amplitude * amps[i] * sinf(2 * (float)M_PI * freqs[i] * t + 1.3f * i + a);
+                if (side == 1)
+                    v *= a == 1 ? -0.8f : 0.8f;
+                window[k].data[3 * side + a] = (int16_t)lrintf(v);
+            }
+        }
+    }
+}
+
+/// @brief Check the lag estimate against known delays, that a still window
+/// is rejected, and that the estimator hands windows over and skips the
+/// interval after each estimate.
+void test_phase_estimator()
+{
+    static MergeMessage window[PHASE_WINDOW];
+    float lag, correlation;
+    float worst = 0;
+    const float delays[] = {-1.6f, -0.5f, -0.25f, 0.0f, 0.1f, 0.3f, 0.75f, 1.2f, 2.0f};
+    for (float delay : delays)
+    {
+        synthesize(window, delay, 1000);
+        assert(estimate_lag(window, PHASE_WINDOW, &lag, &correlation));
+        assert(correlation > 0.9f);
+        worst = fmaxf(worst, fabsf(lag - delay));
+    }
+    assert(worst < 0.1f);
+    synthesize(window, 0.0f, 1000);
+    assert(estimate_lag(window, PHASE_WINDOW, &lag, &correlation) && fabsf(lag) < 0.01f);
+    // A still bell: only gravity, the swing and a little vibration.
+    synthesize(window, 0.5f, 0.5f);
+    assert(!estimate_lag(window, PHASE_WINDOW, &lag, &correlation));
+
+    // Inline, without a task: one estimate per window, then the interval is skipped.
+    static PhaseEstimator estimator;
+    synthesize(window, 0.4f, 1000);
+    for (int i = 0; i < PHASE_WINDOW; i += RATE.block_samples)
+        estimator.add(window + i, RATE.block_samples);
+    assert(estimator.take(&lag) && fabsf(lag - 0.4f) < 0.15f);
+    assert(!estimator.take(&lag));
+    long interval = (long)PHASE_INTERVAL_SECONDS * RATE.odr;
+    for (long i = 0; i < interval; i += RATE.block_samples)
+        estimator.add(window, RATE.block_samples);
+    assert(!estimator.take(&lag));
+    estimator.add(window, PHASE_WINDOW);
+    assert(estimator.take(&lag));
+    assert(estimator.estimates == 2 && estimator.rejected == 0);
+
+    printf("Phase estimator: worst error %.3f samples over delays from %.1f to %.1f\n", worst, delays[0],
+           delays[sizeof(delays) / sizeof(delays[0]) - 1]);
+}
+
+/// @brief Report the cost of an estimate, and its share of a CPU at the
+/// estimate interval.
+void benchmark_phase()
+{
+    static MergeMessage window[PHASE_WINDOW];
+    synthesize(window, 0.3f, 1000);
+    const int iterations = 100;
+    float lag, correlation;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+        estimate_lag(window, PHASE_WINDOW, &lag, &correlation);
+    float usec = (float)(esp_timer_get_time() - start) / iterations;
+    printf("Phase benchmark: %.0f usec per %d sample estimate, %.4f%% of one CPU every %d seconds\n", usec,
+           PHASE_WINDOW, 100.0f * usec / (PHASE_INTERVAL_SECONDS * 1e6f), PHASE_INTERVAL_SECONDS);
+}
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "merge.h"
+#include "rate.h"
+
+// Phase refinement.  The clock fits align the two sensors to within the
+// jitter of the read times, a good fraction of a sample.  Every few seconds
+// the merger hands a window of merged samples to PhaseEstimator, which
+// cross-correlates the two sides' vibration on the phase task, on the core
+// the reader doesn't use.  The lag it finds is fed back into the resampled
+// tracker's time offset (IMUTracker::time_offset), so the resampler lines the
+// sides up.  The mechanical propagation delay between the sensors is
+// measured along with the clock error, so the merged sides are aligned as the
+// frame's vibration reaches them.
+
+// Merged samples per estimate, about 67 msec at 1920 Hz.
+#define PHASE_WINDOW 128
+// Largest lag searched, in merged samples either way.
+#define PHASE_MAX_LAG 3
+// Seconds between estimates.  An estimate takes a small fraction of that.
+#define PHASE_INTERVAL_SECONDS 2
+// A side whose RMS change from sample to sample, in LSB, is below this on an
+// axis is too still on that axis to correlate.
+#define PHASE_MIN_RMS 4
+// Mean normalised correlation at the peak, below which an estimate is rejected.
+#define PHASE_MIN_CORRELATION 0.7f
+// Fraction of each estimate applied to the time offset, and the largest step,
+// in merged samples.
+#define PHASE_GAIN 0.5f
+#define PHASE_MAX_STEP 0.5f
+// The phase task only sums a few thousand products.
+#define PHASE_STACK_BYTES 2048
+// The core the reader doesn't run on.
+#define PHASE_CORE 1
+
+/// @brief Estimate how far imu2's side lags imu1's, in merged samples, from
+/// the cross-correlation of their sample to sample differences, axis by
+/// axis.  An axis may be inverted on one side.  The peak is refined to a
+/// fraction of a sample by fitting a parabola through it.
+/// @param correlation The mean normalised correlation at the peak.
+/// @return false if the window is too still, or the peak is weak, or at the
+/// end of the range searched.
+bool estimate_lag(const MergeMessage *window, int n, float *lag, float *correlation);
+
+/// @brief Runs estimate_lag on windows of the merged stream, off the logger.
+///
+/// The merger fills the window with add(), and once it is full, notifies the
+/// phase task, which runs run().  The merger picks the estimate up with
+/// take(), and the next window starts PHASE_INTERVAL_SECONDS later, so it
+/// reflects the correction.  The window changes hands through state, so
+/// nothing is locked or copied.  Without a task, run() is called inline.
+class PhaseEstimator
+{
+public:
+    TaskHandle_t task = nullptr; // Notified when a window is full.
+
+    // Written by run().
+    long estimates = 0;      // Estimates accepted.
+    long rejected = 0;       // Windows too still or too weakly correlated.
+    int64_t busy_usec = 0;   // Time in estimate_lag.
+    int64_t worst_usec = 0;  // Longest estimate_lag.
+    float last_lag = 0;      // The last accepted lag, in merged samples.
+    float last_correlation = 0;
+
+    /// @brief Add merged samples.  Ignored while an estimate is pending.
+    void add(const MergeMessage *samples, int count);
+
+    /// @brief Discard the window, and skip at least the next holdoff
+    /// samples, e.g. the zeroed samples of a gap.
+    void reset(long holdoff);
+
+    /// @brief Take the latest estimate.
+    /// @param lag How far imu2 lags imu1, in merged samples.
+    /// @return Whether there was a new, accepted estimate.
+    bool take(float *lag);
+
+    /// @brief Estimate the lag of a full window.
+    void run();
+
+private:
+    enum : uint8_t
+    {
+        FILLING, // The merger is filling the window.
+        FULL,    // The window is waiting for run().
+        DONE,    // The estimate is waiting for take().
+    };
+
+    MergeMessage window[PHASE_WINDOW];
+    int filled = 0;
+    long skip = 0; // Samples to skip before filling.
+    float lag = 0;
+    bool valid = false;
+    std::atomic<uint8_t> state{FILLING};
+};
+
+/// @brief Phase task body.  Runs arg's PhaseEstimator::run() when notified.
+void phase_task(void *arg);
+
+void test_phase_estimator();
+void benchmark_phase();
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+
+// Sensor ODR in Hz.  Supported values are 1920, 3840 and 7680.  Buffers are
+// sized for it, so the CONTROL_RATE command (see control.h) can only slow the
+// sensors at runtime, by powers of two.
+// Override at build time, e.g. with
+//   idf.py -DSENSOR_ODR=3840 build
+// or by adding a compile definition in main/CMakeLists.txt.
+#ifndef SENSOR_ODR
+#define SENSOR_ODR 1920
+#endif
+
+// Acquisition mode.  ACQUISITION_PING_PONG alternates between the two sensors
+// on one bus, so each is read every second period.  ACQUISITION_PARALLEL puts
+// each sensor on its own I2C controller and reads both every period, and needs
+// SENSOR_TRANSPORT == TRANSPORT_I2C_MASTER.  ACQUISITION_SENSOR_HUB has imu1
+// read imu2 through its sensor hub, into its own FIFO (see hub.h), and only
+// imu1 is read, every second period.
+#define ACQUISITION_PING_PONG 0
+#define ACQUISITION_PARALLEL 1
+#define ACQUISITION_SENSOR_HUB 2
+
+#ifndef SENSOR_ACQUISITION
+#define SENSOR_ACQUISITION ACQUISITION_PING_PONG
+#endif
+
+// Reader periods between reads of the same sensor.
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL
+#define PERIODS_PER_READ 1
+#else
+#define PERIODS_PER_READ 2
+#endif
+
+// Bell angle integration (see bell.h).  When enabled, imu1 also batches the
+// gyro into the FIFO, so it produces two records per sample.
+#ifndef BELL_ANGLE
+#define BELL_ANGLE 0
+#endif
+
+// The gyro's ODR and batch data rate are SENSOR_ODR / GYRO_DECIMATION, 1, 2,
+// 4 or 8.  The merger fits the gyro its own clock model, and sends it with
+// the full rate blocks at its own rate (see GyroChannel in merge.cpp).  The
+// bell swings slowly, so a quarter of the accelerometer rate is plenty.
+// CONTROL_RATE can raise it at runtime, up to 8.
+#ifndef GYRO_DECIMATION
+#define GYRO_DECIMATION 4
+#endif
+
+// FIFO records per sample, at most.  Sensor hub records, at most one in 4
+// samples, fit in the headroom max_records leaves over a nominal read.
+#define RECORDS_PER_SAMPLE (1 + BELL_ANGLE)
+
+// FIFO compression (see compression.h).  The sensors compress samples into
+// the FIFO, and the reader decodes them, for fewer bus bytes per sample.
+#ifndef FIFO_COMPRESSION
+#define FIFO_COMPRESSION 0
+#endif
+
+// Activity wake up (see activity.h).  The MCU light sleeps, with the sensors
+// in Slow() mode, until imu1 reports a swing or strike on INT1, then streams.
+#ifndef ACTIVITY_WAKE
+#define ACTIVITY_WAKE 0
+#endif
+
+// Boot self tests and benchmarks.  With SELF_TEST, app_main runs the unit
+// tests and benchmarks before starting the sensors.  Left out, their
+// fixtures take no memory and boot doesn't wait on them.
+#ifndef SELF_TEST
+#define SELF_TEST 0
+#endif
+
+// FreeRTOS tick period in usec.  The profile assumes CONFIG_FREERTOS_HZ=1000.
+#define TICK_USEC 1000
+
+// The Arduino I2C layer doesn't reliably transfer more than this many
+// records in a single transaction, so longer reads are split into bursts.
+#define MAX_FIFO_BURST 32
+
+/// @brief Everything in the pipeline that depends on the sensor ODR.
+/// All sizes are derived from the ODR, so that changing SENSOR_ODR
+/// produces a consistent build.
+struct RateProfile
+{
+    uint16_t odr;              // Sensor ODR and BDR, Hz.
+    uint8_t odr_code;          // ODR_XL and BDR_XL register code for odr.
+    uint8_t gyro_odr_code;     // ODR_G and BDR_GY register code for odr / GYRO_DECIMATION.
+    uint8_t read_period_ticks; // Reader wake period.  In ping pong mode the reader
+                               // alternates devices, so each is read every 2 periods.
+    uint8_t samples_per_read;  // Nominal samples per device read.
+    uint8_t max_records;       // Max records per read, and LoggerMsg capacity.  With
+                               // BELL_ANGLE, each sample is two records.
+    uint8_t large_read;        // Reads larger than this indicate the reader fell behind.
+    uint8_t block_samples;     // Merged samples per output block (about 5 msec).
+    uint8_t warmup_msgs;       // Messages each tracker needs before merging starts.
+    float fit_alpha;           // TimeFitter decay per message (about 4 second time constant).
+
+    constexpr uint32_t read_interval_usec() const { return PERIODS_PER_READ * read_period_ticks * TICK_USEC; }
+    constexpr uint32_t sample_usec() const { return 1000000 / odr; }
+};
+
+constexpr uint8_t rate_read_period_ticks(uint16_t odr)
+{
+    // At 1920 Hz, 2 msec gives about 8 samples per ping pong read.  Faster rates
+    // can't go below one tick, so 7680 Hz reads about 16 samples per read.
+    return odr <= 1920 ? 2 : 1;
+}
+
+/// @brief log2(n), for a power of two n.
+constexpr uint8_t rate_shift(uint32_t n)
+{
+    uint8_t shift = 0;
+    while (n > 1)
+    {
+        n >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/// @brief ODR_XL and BDR_XL register code for odr, 1920 Hz times a power of
+/// two.  Each code doubles the rate.
+constexpr uint8_t rate_odr_code(uint32_t odr)
+{
+    return odr >= 1920 ? 0x0A + rate_shift(odr / 1920) : 0x0A - rate_shift(1920 / odr);
+}
+
+constexpr RateProfile make_rate_profile(uint16_t odr)
+{
+    uint8_t period = rate_read_period_ticks(odr);
+    uint32_t interval = PERIODS_PER_READ * period * TICK_USEC;
+    uint8_t samples = (odr * interval + 999999) / 1000000;
+    uint8_t code = rate_odr_code(odr);
+    return RateProfile{
+        odr,
+        code,
+        (uint8_t)(code - rate_shift(GYRO_DECIMATION)),
+        period,
+        samples,
+        (uint8_t)(4 * samples * RECORDS_PER_SAMPLE),
+        (uint8_t)(5 * samples * RECORDS_PER_SAMPLE / 2),
+        (uint8_t)(odr / 192),
+        // About 40 msec of data, which is 10 messages at 1920 Hz.
+        (uint8_t)(40000 / interval),
+        (float)interval / 4000000.0f,
+    };
+}
+
+constexpr RateProfile RATE = make_rate_profile(SENSOR_ODR);
+
+static_assert(SENSOR_ODR == 1920 || SENSOR_ODR == 3840 || SENSOR_ODR == 7680,
+              "SENSOR_ODR must be 1920, 3840 or 7680");
+static_assert(RATE.max_records % MAX_FIFO_BURST == 0 || RATE.max_records < MAX_FIFO_BURST,
+              "Reads must split evenly into bursts");
+static_assert(RATE.block_samples >= RATE.samples_per_read,
+              "A merge block must hold at least one nominal read");
+static_assert(RATE.large_read < RATE.max_records, "large_read must be below max_records");
+static_assert(GYRO_DECIMATION == 1 || GYRO_DECIMATION == 2 || GYRO_DECIMATION == 4 || GYRO_DECIMATION == 8,
+              "GYRO_DECIMATION must be 1, 2, 4 or 8");
@@ -0,0 +1,201 @@
+#include <cassert>
+#include <stdio.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include "reader.h"
+#include "sim.h"
+
+OverlappedReader::OverlappedReader(LSMExtension &imu1, LSMExtension &imu2, LoggerMsg buffers[2], Emit emit,
+                                   void *context)
+    : emit(emit), context(context)
+{
+    slots[0].imu = &imu1;
+    slots[0].left = true;
+    slots[0].msg = &buffers[0];
+    slots[1].imu = &imu2;
+    slots[1].left = false;
+    slots[1].msg = &buffers[1];
+    for (Slot &slot : slots)
+    {
+        slot.reader = this;
+        slot.delayed = false;
+        slot.state = IDLE;
+    }
+}
+
+void IRAM_ATTR OverlappedReader::transfer_done(void *arg, int32_t status)
+{
+    // Stamp first, so the time is as close to the end of the transfer as the
+    // interrupt allows.  A failed batch is reported by Finish_FIFO_Batch.
+    Slot *slot = (Slot *)arg;
+    slot->msg->read_time = esp_timer_get_time();
+    slot->state = COMPLETE;
+    TaskHandle_t waiter = slot->reader->waiter;
+    if (waiter != nullptr)
+        notify_done(waiter);
+}
+
+void OverlappedReader::start(Slot &slot, bool delayed)
+{
+    slot.delayed = delayed;
+    // Set before submitting, since a synchronous transport completes in submit.
+    slot.state = IN_FLIGHT;
+    if (LSM6DSV16X_OK != slot.imu->Read_FIFO_Batch(RATE.max_records, slot.msg->records, transfer_done, &slot))
+    {
+        printf("LSM6DSV16X Sensor failed to queue FIFO read\n");
+        vTaskSuspend(NULL);
+    }
+    started++;
+}
+
+void OverlappedReader::wait(Slot &slot)
+{
+    if (slot.state != IN_FLIGHT)
+        return;
+    waits++;
+    while (slot.state == IN_FLIGHT)
+    {
+        if (waiter == nullptr)
+        {
+            printf("Problem: reader waiting for a transfer, without begin()\n");
+            vTaskSuspend(NULL);
+        }
+        // Either slot's completion wakes us, so check again.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+void OverlappedReader::finish(Slot &slot)
+{
+    uint16_t count = 0;
+    if (LSM6DSV16X_OK != slot.imu->Finish_FIFO_Batch(&count))
+    {
+        printf("LSM6DSV16X Sensor failed to read FIFO data\n");
+        vTaskSuspend(NULL);
+    }
+    LoggerMsg &msg = *slot.msg;
+    msg.imu = slot.left;
+    msg.delayed = slot.delayed;
+    msg.sample_count = count;
+    msg.overrun = slot.imu->FIFO_Overrun();
+    msg.backlog = slot.imu->FIFO_Backlog();
+    emit(msg, context);
+    slot.state = IDLE;
+    finished++;
+}
+
+void OverlappedReader::step(bool delayed)
+{
+    Slot &slot = slots[next];
+    Slot &other = slots[next ^ 1];
+    next ^= 1;
+    // This slot was started two periods ago, and finished one period ago,
+    // unless its transfer overran a whole period.
+    if (slot.state != IDLE)
+    {
+        wait(slot);
+        finish(slot);
+    }
+    start(slot, delayed);
+    // Post process the other sensor's read while this one is on the bus.
+    if (other.state != IDLE)
+    {
+        wait(other);
+        finish(other);
+    }
+}
+
+void OverlappedReader::drain()
+{
+    // The slot step() started last.
+    Slot &slot = slots[next ^ 1];
+    if (slot.state != IDLE)
+    {
+        wait(slot);
+        finish(slot);
+    }
+}
+
+#if SELF_TEST
+struct ReaderCheck
+{
+    OverlappedReader *reader;
+    SimulatedLSM *sims[2];
+    long next[2];     // Next expected sample, by side.
+    long messages;
+    bool last_left;
+    int64_t last_time;
+    bool draining; // Then nothing else is on the bus.
+};
+
+static void check_message(LoggerMsg &msg, void *context)
+{
+    ReaderCheck *check = (ReaderCheck *)context;
+    int side = msg.imu ? 0 : 1;
+    // Messages alternate, and each was finished while the other sensor's
+    // transfer was still on the bus.
+    assert(check->messages == 0 || msg.imu != check->last_left);
+    assert(check->draining || check->reader->state(!msg.imu) == OverlappedReader::IN_FLIGHT);
+    assert(msg.read_time >= check->last_time);
+    for (int i = 0; i < msg.sample_count; i++)
+    {
+        if (msg.records[i].tag.tag_sensor != SIM_TAG_XL_NC)
+            continue;
+        assert(msg.records[i].data[0] == check->sims[side]->value(check->next[side], 0));
+        check->next[side]++;
+    }
+    check->last_left = msg.imu;
+    check->last_time = msg.read_time;
+    check->messages++;
+}
+
+/// @brief Drive the reader over two deferred mock buses, completing each
+/// transfer only after the step that started it has returned.  Then drain
+/// it, as before the sensors sleep, and check it carries on alternating.
+void test_overlapped_reader()
+{
+    static SimulatedLSM sim1(RATE.odr, 1.0f);
+    static SimulatedLSM sim2(RATE.odr, 1.0001f, 300);
+    static MockBus bus1(&sim1);
+    static MockBus bus2(&sim2);
+    static LSMExtension imu1(&bus1);
+    static LSMExtension imu2(&bus2);
+    static ReaderCheck check = {nullptr, {&sim1, &sim2}, {0, 0}, 0, false, 0, false};
+    static LoggerMsg buffers[2];
+    static OverlappedReader reader(imu1, imu2, buffers, check_message, &check);
+    check.reader = &reader;
+    bus1.deferred = true;
+    bus2.deferred = true;
+
+    const int64_t period = RATE.read_interval_usec() / PERIODS_PER_READ;
+    const int cycles = 200;
+    for (int cycle = 0; cycle < 2 * cycles; cycle++)
+    {
+        int64_t t = (cycle + 1) * period;
+        sim1.advance(t);
+        sim2.advance(t);
+        reader.step(false);
+        // imu2 starts first, then they alternate.
+        bool left = cycle & 1;
+        assert(reader.state(left) == OverlappedReader::IN_FLIGHT);
+        (left ? bus1 : bus2).complete();
+        assert(reader.state(left) == OverlappedReader::COMPLETE);
+        if (cycle == cycles - 1)
+        {
+            assert(reader.started == cycles && reader.finished == cycles - 1 && reader.waits == 0);
+            check.draining = true;
+            reader.drain();
+            check.draining = false;
+            assert(reader.finished == cycles);
+            assert(reader.state(true) == OverlappedReader::IDLE && reader.state(false) == OverlappedReader::IDLE);
+        }
+    }
+    assert(reader.started == 2 * cycles && reader.finished == 2 * cycles - 1 && reader.waits == 0);
+    assert(check.next[0] > 0 && check.next[1] > 0);
+    printf("Overlapped reader test: %ld messages, %ld and %ld samples\n", check.messages, check.next[0],
+           check.next[1]);
+    bus1.deferred = false;
+    bus2.deferred = false;
+}
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "IMU.h"
+#include "merge.h"
+
+/// @brief Notify task from a bus done callback.  That is usually in the bus
+/// ISR, but a submit that fails part way calls it from the submitting task.
+static inline void IRAM_ATTR notify_done(TaskHandle_t task)
+{
+    if (!xPortInIsrContext())
+    {
+        xTaskNotifyGive(task);
+        return;
+    }
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/// @brief Ping pong reader as a state machine over async FIFO batches.
+///
+/// The serial reader waited in read_all for each transfer, then stamped the
+/// time, enqueued the message and slept, so the CPU sat idle while the bus
+/// was busy, and the read time included the task wake up.  Here each period
+/// starts one sensor's transfer first, and then, while the bus is busy,
+/// finishes the other sensor's, which completed during the previous period.
+/// Each sensor's slot cycles IDLE -> IN_FLIGHT -> COMPLETE -> IDLE, and the
+/// completion callback stamps the read time from the bus ISR.
+///
+/// Needs a transport with async batches (TRANSPORT_I2C_MASTER or TRANSPORT_SPI).
+class OverlappedReader
+{
+public:
+    /// @brief Called with each finished message, from the reader task.
+    typedef void (*Emit)(LoggerMsg &msg, void *context);
+
+    enum State : uint8_t
+    {
+        IDLE,      // Free, or finished and emitted.
+        IN_FLIGHT, // Batch queued on the bus.
+        COMPLETE,  // Batch done, and read_time stamped, but not yet finished.
+    };
+
+    /// @param buffers Two messages the transfers read into, in DMA capable
+    /// memory (see DmaArena).  Each is emitted in place.
+    OverlappedReader(LSMExtension &imu1, LSMExtension &imu2, LoggerMsg buffers[2], Emit emit, void *context);
+
+    /// @brief Have completions notify the calling task, so that step can
+    /// block until a transfer it needs is done.  Call from the reader task.
+    void begin() { waiter = xTaskGetCurrentTaskHandle(); }
+
+    /// @brief One read period: start the next sensor's transfer, then finish
+    /// the other's.
+    /// @param delayed As returned by ReadPacer::wait for this period.
+    void step(bool delayed);
+
+    /// @brief Wait for the transfer still on the bus, and emit it, so the
+    /// sensors can stop.  The next step() carries on alternating.
+    void drain();
+
+    State state(bool left) const { return slots[left ? 0 : 1].state; }
+
+    long started = 0;  // Transfers started.
+    long finished = 0; // Messages emitted.
+    long waits = 0;    // Times a step had to wait for a transfer to complete.
+
+private:
+    struct Slot
+    {
+        OverlappedReader *reader;
+        LSMExtension *imu;
+        bool left;
+        bool delayed; // Of the period that started the transfer.
+        volatile State state;
+        LoggerMsg *msg; // The transfer reads straight into msg->records.
+    };
+
+    static void transfer_done(void *arg, int32_t status);
+    void start(Slot &slot, bool delayed);
+    void finish(Slot &slot);
+    /// @brief Wait until slot's transfer completes.
+    void wait(Slot &slot);
+
+    Slot slots[2]; // imu1 (left), then imu2.
+    uint8_t next = 1; // Slot to start next.  imu2 first, as the serial reader did.
+    Emit emit;
+    void *context;
+    TaskHandle_t waiter = nullptr; // Task notified on completion, once begin() is called.
+};
+
+void test_overlapped_reader();
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include "lsm6dsv16x_reg.h"
+
+// Shared by the firmware and the host self tests, so only standard headers
+// and the sensor's register definitions, which are plain C, here.
+
+/// @brief A FIFO record as read from FIFO_DATA_OUT_TAG: the tag byte, then
+/// x, y and z.  Packed, so arrays of them match the bus bytes.
+typedef struct __attribute__((packed)) lsm6dsv16x_fifo_record_t
+{
+    lsm6dsv16x_fifo_data_out_tag_t tag;
+    int16_t data[3];
+} lsm6dsv16x_fifo_record_t;
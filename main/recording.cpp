@@ -0,0 +1,345 @@
+#include <cassert>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recording.h"
+
+static inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+static inline int bits_for(uint32_t v)
+{
+    return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+void RecordingWriter::begin(uint32_t odr, Sink s, void *ctx, bool keep)
+{
+    sink = s;
+    context = ctx;
+    keep_index = keep;
+    count = 0;
+    chunks = 0;
+    raw_bytes = 0;
+    offset = 0;
+    index.clear();
+    if (time.period == 0)
+        time.period = 1e6f / odr;
+    RecordingHeader header = {RECORDING_MAGIC, RECORDING_VERSION, RECORDING_CHANNELS, odr, RECORDING_CHUNK_SAMPLES};
+    send(&header, sizeof(header));
+}
+
+void RecordingWriter::send(const void *data, size_t bytes)
+{
+    sink(data, bytes, context);
+    offset += bytes;
+}
+
+void RecordingWriter::add(int64_t first, const int16_t *data, int n)
+{
+    if (sink == nullptr)
+        return;
+    while (n > 0)
+    {
+        if (count > 0 && first != first_index + count)
+            flush();
+        if (count == 0)
+            first_index = first;
+        int take = RECORDING_CHUNK_SAMPLES - count;
+        if (take > n)
+            take = n;
+        memcpy(&rows[count * RECORDING_CHANNELS], data, take * RECORDING_CHANNELS * sizeof(int16_t));
+        count += take;
+        first += take;
+        data += take * RECORDING_CHANNELS;
+        n -= take;
+        if (count == RECORDING_CHUNK_SAMPLES)
+            flush();
+    }
+}
+
+void RecordingWriter::flush()
+{
+    if (sink == nullptr || count == 0)
+        return;
+    ChunkHeader *h = (ChunkHeader *)packed;
+    memset(h, 0, sizeof(*h));
+    h->magic = RECORDING_CHUNK_MAGIC;
+    h->first_index = first_index;
+    h->first_usec = time.usec + (int64_t)((first_index - time.index) * (double)time.period);
+    h->period_usec = time.period;
+    h->samples = count;
+
+    uint8_t *out = packed + sizeof(ChunkHeader);
+    for (int c = 0; c < RECORDING_CHANNELS; c++)
+    {
+        const int16_t *x = &rows[c];
+        ColumnSummary &col = h->columns[c];
+        col.first = col.min = col.max = x[0];
+        uint32_t all = 0;
+        for (int i = 1; i < count; i++)
+        {
+            int16_t v = x[i * RECORDING_CHANNELS];
+            all |= zigzag(v - x[(i - 1) * RECORDING_CHANNELS]);
+            if (v < col.min)
+                col.min = v;
+            if (v > col.max)
+                col.max = v;
+        }
+        col.bits = bits_for(all);
+
+        // Pack least significant bit first.
+        uint64_t acc = 0;
+        int held = 0;
+        for (int i = 1; i < count && col.bits > 0; i++)
+        {
+            acc |= (uint64_t)zigzag(x[i * RECORDING_CHANNELS] - x[(i - 1) * RECORDING_CHANNELS]) << held;
+            held += col.bits;
+            while (held >= 8)
+            {
+                *out++ = (uint8_t)acc;
+                acc >>= 8;
+                held -= 8;
+            }
+        }
+        if (held > 0)
+            *out++ = (uint8_t)acc;
+    }
+    while ((out - packed) % 8 != 0)
+        *out++ = 0;
+    h->bytes = out - packed;
+
+    if (keep_index)
+    {
+        ChunkIndexEntry e;
+        e.offset = offset;
+        e.first_index = h->first_index;
+        e.first_usec = h->first_usec;
+        e.end_usec = h->first_usec + (int64_t)(count * (double)h->period_usec);
+        for (int c = 0; c < RECORDING_CHANNELS; c++)
+        {
+            e.min[c] = h->columns[c].min;
+            e.max[c] = h->columns[c].max;
+        }
+        index.push_back(e);
+    }
+    send(packed, h->bytes);
+    raw_bytes += count * RECORDING_CHANNELS * sizeof(int16_t);
+    chunks++;
+    count = 0;
+}
+
+void RecordingWriter::finish()
+{
+    if (sink == nullptr)
+        return;
+    flush();
+    if (keep_index)
+    {
+        RecordingTrailer trailer = {offset, (uint32_t)index.size(), RECORDING_INDEX_MAGIC};
+        if (!index.empty())
+            send(index.data(), index.size() * sizeof(ChunkIndexEntry));
+        send(&trailer, sizeof(trailer));
+    }
+    sink = nullptr;
+}
+
+/// @brief Check a chunk header, and that it fits.
+static bool chunk_ok(const uint8_t *base, size_t size, uint64_t offset)
+{
+    if (offset + sizeof(ChunkHeader) > size)
+        return false;
+    const ChunkHeader *h = (const ChunkHeader *)(base + offset);
+    return h->magic == RECORDING_CHUNK_MAGIC && h->bytes >= sizeof(ChunkHeader) && h->bytes % 8 == 0 &&
+           h->samples > 0 && h->samples <= RECORDING_CHUNK_SAMPLES && offset + h->bytes <= size;
+}
+
+bool RecordingReader::open(const void *data, size_t length)
+{
+    base = (const uint8_t *)data;
+    size = length;
+    index = nullptr;
+    count = 0;
+    rebuilt.clear();
+    if (size < sizeof(RecordingHeader) || header().magic != RECORDING_MAGIC ||
+        header().version != RECORDING_VERSION || header().channels != RECORDING_CHANNELS)
+        return false;
+
+    if (size >= sizeof(RecordingHeader) + sizeof(RecordingTrailer))
+    {
+        const RecordingTrailer *t = (const RecordingTrailer *)(base + size - sizeof(RecordingTrailer));
+        if (t->magic == RECORDING_INDEX_MAGIC &&
+            t->index_offset + (uint64_t)t->count * sizeof(ChunkIndexEntry) + sizeof(RecordingTrailer) == size)
+        {
+            index = (const ChunkIndexEntry *)(base + t->index_offset);
+            count = t->count;
+            return true;
+        }
+    }
+
+    // No index, so walk the chunks, as far as they are intact.
+    uint64_t offset = sizeof(RecordingHeader);
+    while (chunk_ok(base, size, offset))
+    {
+        const ChunkHeader *h = (const ChunkHeader *)(base + offset);
+        ChunkIndexEntry e;
+        e.offset = offset;
+        e.first_index = h->first_index;
+        e.first_usec = h->first_usec;
+        e.end_usec = h->first_usec + (int64_t)(h->samples * (double)h->period_usec);
+        for (int c = 0; c < RECORDING_CHANNELS; c++)
+        {
+            e.min[c] = h->columns[c].min;
+            e.max[c] = h->columns[c].max;
+        }
+        rebuilt.push_back(e);
+        offset += h->bytes;
+    }
+    index = rebuilt.data();
+    count = rebuilt.size();
+    return true;
+}
+
+size_t RecordingReader::find(int64_t usec) const
+{
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid].end_usec <= usec)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int64_t RecordingReader::time_of(size_t i, int k) const
+{
+    const ChunkHeader *h = (const ChunkHeader *)(base + index[i].offset);
+    return h->first_usec + (int64_t)(k * (double)h->period_usec);
+}
+
+int RecordingReader::decode(size_t i, int16_t *out) const
+{
+    if (i >= count || !chunk_ok(base, size, index[i].offset))
+        return -1;
+    const ChunkHeader *h = (const ChunkHeader *)(base + index[i].offset);
+    const uint8_t *in = (const uint8_t *)(h + 1);
+    const uint8_t *end = (const uint8_t *)h + h->bytes;
+    int n = h->samples;
+    for (int c = 0; c < RECORDING_CHANNELS; c++)
+    {
+        const ColumnSummary &col = h->columns[c];
+        if (col.bits > RECORDING_MAX_BITS || in + ((n - 1) * col.bits + 7) / 8 > end)
+            return -1;
+        uint32_t mask = (1u << col.bits) - 1;
+        int16_t v = col.first;
+        out[c] = v;
+        uint64_t acc = 0;
+        int held = 0;
+        for (int k = 1; k < n; k++)
+        {
+            while (held < col.bits)
+            {
+                acc |= (uint64_t)*in++ << held;
+                held += 8;
+            }
+            v += unzigzag((uint32_t)acc & mask);
+            acc >>= col.bits;
+            held -= col.bits;
+            out[k * RECORDING_CHANNELS + c] = v;
+        }
+    }
+    return n;
+}
+
+#if SELF_TEST
+static void append_to_vector(const void *data, size_t bytes, void *context)
+{
+    auto *v = (std::vector<uint8_t> *)context;
+    v->insert(v->end(), (const uint8_t *)data, (const uint8_t *)data + bytes);
+}
+
+/// @brief Record windows of a noisy signal with a gap, then seek to times in
+/// it, and check the decoded samples are exactly those recorded, with and
+/// without the index.
+void test_recording()
+{
+    static RecordingWriter writer;
+    static std::vector<uint8_t> file;
+    static int16_t block[10 * RECORDING_CHANNELS];
+    static int16_t rows[RECORDING_CHUNK_SAMPLES * RECORDING_CHANNELS];
+    const int odr = 1920;
+    const long samples = 3000;
+    auto value = [](long k, int c) {
+        // A slow swing with noise, and a full scale step now and then.
+        int32_t v = (int32_t)(2000 * c - 5000 + ((k * 37 + c) % 23) + (k / 100) % 50);
+        return (int16_t)(k % 1000 == 500 ? (c % 2 ? 32767 : -32768) : v);
+    };
+
+    file.clear();
+    writer.set_time({0, 1000000, 1e6f / odr});
+    writer.begin(odr, append_to_vector, &file);
+    for (long k = 0; k < samples; k += 10)
+    {
+        // A window break, as when the full rate tier closes.
+        if (k >= 1000 && k < 1400)
+            continue;
+        for (int i = 0; i < 10; i++)
+            for (int c = 0; c < RECORDING_CHANNELS; c++)
+                block[i * RECORDING_CHANNELS + c] = value(k + i, c);
+        writer.add(k, block, 10);
+    }
+    writer.flush();
+    size_t chunk_bytes = writer.offset;
+    writer.finish();
+    printf("Recording: %ld chunks, %lu bytes from %lu, %.2fx\n", writer.chunks,
+           (unsigned long)chunk_bytes, (unsigned long)writer.raw_bytes, (float)writer.raw_bytes / chunk_bytes);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        RecordingReader reader;
+        // The second pass drops the index, as if the recorder had been cut off.
+        assert(reader.open(file.data(), pass == 0 ? file.size() : chunk_bytes));
+        assert(reader.scanned() == (pass == 1));
+        assert(reader.chunks() == (size_t)writer.chunks);
+        long checked = 0;
+        for (size_t i = 0; i < reader.chunks(); i++)
+        {
+            int n = reader.decode(i, rows);
+            assert(n > 0);
+            const ChunkIndexEntry &e = reader.entry(i);
+            for (int k = 0; k < n; k++)
+                for (int c = 0; c < RECORDING_CHANNELS; c++)
+                {
+                    assert(rows[k * RECORDING_CHANNELS + c] == value(e.first_index + k, c));
+                    assert(e.min[c] <= rows[k * RECORDING_CHANNELS + c] && rows[k * RECORDING_CHANNELS + c] <= e.max[c]);
+                }
+            checked += n;
+        }
+        assert(checked == samples - 400);
+
+        // Seek to a few sample times, including the gap and past the end.
+        for (long k : {0L, 1L, 511L, 512L, 999L, 1200L, 1400L, samples - 1, samples + 5})
+        {
+            int64_t t = 1000000 + (int64_t)(k * 1e6 / odr) + 1;
+            size_t i = reader.find(t);
+            if (k >= samples)
+            {
+                assert(i == reader.chunks());
+                continue;
+            }
+            // A time in the gap finds the chunk after it.
+            long expect = (k >= 1000 && k < 1400) ? 1400 : k;
+            const ChunkIndexEntry &e = reader.entry(i);
+            assert(e.first_index <= expect && expect < e.first_index + RECORDING_CHUNK_SAMPLES);
+            if (expect == k)
+                assert(reader.time_of(i, k - e.first_index) <= t && t < reader.time_of(i, k - e.first_index + 1));
+        }
+    }
+    file.clear();
+    file.shrink_to_fit();
+}
+#endif
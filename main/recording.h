@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Shared by the firmware and the host tools, so only standard headers here.
+//
+// A recording is a RecordingHeader, then chunks, then optionally an index of
+// the chunks and a RecordingTrailer.  Each chunk holds up to
+// RECORDING_CHUNK_SAMPLES consecutive merged samples, with a linear time model
+// from the reference TimeFitter, and each channel is stored as a column of bit
+// packed, zigzag coded differences.  The index has each chunk's time range and
+// channel ranges, so a reader can binary search for a time, or find strikes,
+// without decoding anything.  A recording that was cut off before the index
+// was written can still be read, by walking the chunk headers.
+//
+// Everything is little endian, and every structure is a multiple of 8 bytes,
+// so a mapped file can be read in place.
+
+#define RECORDING_MAGIC 0x31525346u // "FSR1"
+#define RECORDING_CHUNK_MAGIC 0x4B4E4843u // "CHNK"
+#define RECORDING_INDEX_MAGIC 0x58444E49u // "INDX"
+#define RECORDING_VERSION 1
+#define RECORDING_CHANNELS 6
+
+// Merged samples per chunk.  About a quarter second at 1920 Hz, which keeps
+// the writer's buffers to about 13 kB.
+#define RECORDING_CHUNK_SAMPLES 512
+// Zigzag coded differences of int16 values need up to 17 bits.
+#define RECORDING_MAX_BITS 17
+
+struct RecordingHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t odr;
+    uint32_t chunk_samples;
+};
+
+/// @brief One channel of a chunk.  The packed differences follow the chunk
+/// header, one column after another.
+struct ColumnSummary
+{
+    int16_t first;
+    int16_t min;
+    int16_t max;
+    uint8_t bits; // Bits per packed difference.
+    uint8_t reserved;
+};
+
+/// @brief Sample k of the chunk was taken at first_usec + k * period_usec.
+struct ChunkHeader
+{
+    uint32_t magic;
+    uint32_t bytes; // Whole chunk, including this header and padding.
+    int64_t first_index; // Merged index of the first sample.
+    int64_t first_usec;
+    float period_usec;
+    uint16_t samples;
+    uint16_t reserved;
+    ColumnSummary columns[RECORDING_CHANNELS];
+};
+
+struct ChunkIndexEntry
+{
+    uint64_t offset; // Of the chunk header, from the start of the recording.
+    int64_t first_index;
+    int64_t first_usec;
+    int64_t end_usec; // Just after the last sample.
+    int16_t min[RECORDING_CHANNELS];
+    int16_t max[RECORDING_CHANNELS];
+};
+
+struct RecordingTrailer
+{
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t magic;
+};
+
+static_assert(sizeof(RecordingHeader) % 8 == 0 && sizeof(ChunkHeader) % 8 == 0 &&
+                  sizeof(ChunkIndexEntry) % 8 == 0 && sizeof(RecordingTrailer) % 8 == 0,
+              "Recording structures must keep 8 byte alignment");
+
+/// @brief A linear time model: merged sample index was taken at usec, and
+/// samples are period usec apart.
+struct RecordingTime
+{
+    int64_t index;
+    int64_t usec;
+    float period;
+};
+
+/// @brief Builds a recording from merged blocks, and passes it to a sink one
+/// piece at a time.
+class RecordingWriter
+{
+public:
+    typedef void (*Sink)(const void *data, size_t bytes, void *context);
+
+    /// @brief Start a recording, and send its header.
+    /// @param keep_index Whether to keep the chunk index for finish().  A
+    /// recorder that never finishes, e.g. a ring on the device, doesn't need it.
+    void begin(uint32_t odr, Sink sink, void *context, bool keep_index = true);
+    bool active() const { return sink != nullptr; }
+
+    /// @brief Set the time model for the chunks that follow.
+    void set_time(const RecordingTime &t) { time = t; }
+
+    /// @brief Add count merged samples, RECORDING_CHANNELS values each, starting
+    /// at merged index.  A break in the index starts a new chunk.
+    void add(int64_t index, const int16_t *rows, int count);
+
+    /// @brief Send the chunk in progress.
+    void flush();
+    /// @brief Send the chunk in progress, then the index and trailer.
+    void finish();
+
+    long chunks = 0;         // Chunks sent.
+    uint64_t raw_bytes = 0;  // Sample bytes before packing.
+    uint64_t offset = 0;     // Bytes sent.
+
+private:
+    void send(const void *data, size_t bytes);
+
+    Sink sink = nullptr;
+    void *context = nullptr;
+    bool keep_index = true;
+    RecordingTime time{0, 0, 0};
+    int64_t first_index = 0;
+    int count = 0;
+    int16_t rows[RECORDING_CHUNK_SAMPLES * RECORDING_CHANNELS];
+    alignas(8) uint8_t packed[sizeof(ChunkHeader) + RECORDING_CHANNELS * ((RECORDING_CHUNK_SAMPLES * RECORDING_MAX_BITS + 7) / 8) + 8];
+    std::vector<ChunkIndexEntry> index;
+};
+
+/// @brief Reads a recording in memory, e.g. a mapped file.
+class RecordingReader
+{
+public:
+    /// @brief Check the header, and find the index, or rebuild it from the
+    /// chunk headers if the recording has none.
+    bool open(const void *data, size_t size);
+
+    const RecordingHeader &header() const { return *(const RecordingHeader *)base; }
+    size_t chunks() const { return count; }
+    const ChunkIndexEntry &entry(size_t i) const { return index[i]; }
+    /// @brief Whether the index was rebuilt, because there was no trailer.
+    bool scanned() const { return !rebuilt.empty() || count == 0; }
+
+    /// @brief The first chunk that ends after usec, or chunks() if none does.
+    /// Binary search, so O(log n) in the number of chunks.
+    size_t find(int64_t usec) const;
+
+    /// @brief Decode chunk i into rows of RECORDING_CHANNELS values.
+    /// @param rows Room for RECORDING_CHUNK_SAMPLES rows.
+    /// @return The number of samples, or -1 if the chunk is corrupt.
+    int decode(size_t i, int16_t *rows) const;
+
+    /// @brief Time of sample k of chunk i.
+    int64_t time_of(size_t i, int k) const;
+
+private:
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    const ChunkIndexEntry *index = nullptr;
+    size_t count = 0;
+    std::vector<ChunkIndexEntry> rebuilt;
+};
+
+void test_recording();
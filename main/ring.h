@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+/// @brief Single producer, single consumer ring of fixed size entries.
+/// The producer fills entries in place with claim()/commit(), and the consumer
+/// reads them in place with peek()/release(), so nothing is copied.
+/// Safe between one producer task and one consumer task, on either core.
+template <typename T, uint32_t N>
+class Ring
+{
+    static_assert((N & (N - 1)) == 0, "Ring size must be a power of 2");
+
+public:
+    /// @brief The next entry to fill, or nullptr if the ring is full.
+    T *claim()
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+            return nullptr;
+        return &items[h & (N - 1)];
+    }
+
+    /// @brief Publish the entry returned by claim().
+    void commit()
+    {
+        uint32_t h = head.load(std::memory_order_relaxed) + 1;
+        head.store(h, std::memory_order_release);
+        uint32_t used = h - tail.load(std::memory_order_relaxed);
+        if (used > high_water)
+            high_water = used;
+    }
+
+    /// @brief The oldest entry, or nullptr if the ring is empty.
+    T *peek()
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t)
+            return nullptr;
+        return &items[t & (N - 1)];
+    }
+
+    /// @brief Free the entry returned by peek().
+    void release()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint32_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    static constexpr uint32_t capacity() { return N; }
+
+    uint32_t high_water = 0; // Most entries ever in use.  Written by the producer.
+
+private:
+    std::atomic<uint32_t> head{0}; // Next entry to fill.
+    std::atomic<uint32_t> tail{0}; // Next entry to read.
+    T items[N];
+};
@@ -0,0 +1,298 @@
+#include "sim.h"
+#include <math.h>
+#include <string.h>
+#include "activity.h"
+#include "hub.h"
+
+SimulatedLSM::SimulatedLSM(float odr, float skew, int64_t start_usec)
+    : period_usec(1e6 / (odr * skew)), next_sample_usec(start_usec), odr(odr)
+{
+}
+
+int16_t SimulatedLSM::value(long k, int i) const
+{
+    // Slow sine waves with a different period on each axis, well below Nyquist.
+    static const float cycles[3] = {0.0031f, 0.0047f, 0.0113f};
+    return (int16_t)(amplitude * sinf(2.0f * (float)M_PI * cycles[i] * k) + 1000 * i);
+}
+
+void SimulatedLSM::push(uint8_t tag, uint8_t cnt, const int16_t data[3])
+{
+    if (level == SIM_FIFO_DEPTH)
+    {
+        // Stream mode discards the oldest record.
+        bool gyro;
+        int samples = fifo_entry_samples(fifo[head].tag.tag_sensor, &gyro);
+        if (!gyro)
+            lost_samples += samples;
+        head = (head + 1) % SIM_FIFO_DEPTH;
+        level--;
+        overrun_flag = true;
+    }
+    lsm6dsv16x_fifo_record_t &rec = fifo[(head + level) % SIM_FIFO_DEPTH];
+    memset(&rec.tag, 0, sizeof(rec.tag));
+    rec.tag.tag_sensor = tag;
+    rec.tag.tag_cnt = cnt;
+    memcpy(rec.data, data, sizeof(rec.data));
+    level++;
+    written[tag & 0x1F]++;
+}
+
+void SimulatedLSM::push_sample(FifoCompressor &compressor, uint8_t tag, const int16_t data[3], long slot)
+{
+    if (!compression)
+    {
+        push(tag, sample_count & 3, data);
+        return;
+    }
+    lsm6dsv16x_fifo_record_t entries[3];
+    int n = compressor.add(slot, data, entries);
+    for (int i = 0; i < n; i++)
+    {
+        int16_t d[3];
+        memcpy(d, entries[i].data, sizeof(d));
+        push(entries[i].tag.tag_sensor, entries[i].tag.tag_cnt, d);
+    }
+}
+
+void SimulatedLSM::enable_bell(int axis, float amplitude, float period, int16_t bias, int decimation)
+{
+    bell = true;
+    bell_axis = axis;
+    bell_amplitude = amplitude;
+    bell_period = period;
+    gyro_bias = bias;
+    gyro_decimation = decimation;
+}
+
+float SimulatedLSM::bell_angle(long k) const
+{
+    return bell_amplitude * sinf(2.0f * (float)M_PI * k / (odr * bell_period));
+}
+
+int16_t SimulatedLSM::bell_rate(long k) const
+{
+    // Gyro rate is the derivative of the angle, at the actual sample rate.
+    double w = 2.0 * M_PI / (odr * bell_period);
+    double dps = bell_amplitude * w * cos(w * k) * 1e6 / period_usec;
+    return (int16_t)lround(dps * 1000 / SIM_GYRO_MDPS) + gyro_bias;
+}
+
+void SimulatedLSM::push_bell(uint8_t cnt)
+{
+    // The gyro is batched at its own rate.
+    if (sample_count % gyro_decimation == 0)
+    {
+        int16_t gyro[3] = {gyro_bias, gyro_bias, gyro_bias};
+        gyro[bell_axis] = bell_rate(sample_count);
+        push_sample(gy_compressor, SIM_TAG_GY_NC, gyro, sample_count / gyro_decimation);
+    }
+
+    // SFLP outputs at 15 Hz (see init_lsm).
+    if (sample_count % (long)(odr / 15) == 0)
+    {
+        float theta = bell_angle(sample_count) * (float)M_PI / 180;
+        int16_t gravity[3] = {0, 0, 0};
+        gravity[(bell_axis + 1) % 3] = (int16_t)lroundf(SIM_GRAVITY_LSB * sinf(theta));
+        gravity[(bell_axis + 2) % 3] = (int16_t)lroundf(SIM_GRAVITY_LSB * cosf(theta));
+        push(SIM_TAG_GRAVITY, cnt, gravity);
+        // The SFLP bias is at 125 dps sensitivity, 1/8 of a 1000 dps LSB.
+        int16_t bias[3] = {(int16_t)(8 * gyro_bias), (int16_t)(8 * gyro_bias), (int16_t)(8 * gyro_bias)};
+        push(SIM_TAG_GYRO_BIAS, cnt, bias);
+    }
+}
+
+void SimulatedLSM::advance(int64_t t_usec)
+{
+    while (next_sample_usec <= t_usec)
+    {
+        int16_t data[3] = {value(sample_count, 0), value(sample_count, 1), value(sample_count, 2)};
+        push_sample(xl_compressor, SIM_TAG_XL_NC, data, sample_count);
+        if (bell)
+            push_bell(sample_count & 3);
+        if (target != nullptr && hub_decimation > 0 && sample_count % hub_decimation == 0)
+        {
+            // The hub reads the target's output registers on this sensor's data ready.
+            int16_t hub[3];
+            target->advance((int64_t)next_sample_usec);
+            target->output(hub);
+            push(SIM_TAG_SENSORHUB_0, sample_count & 3, hub);
+        }
+        sample_count++;
+        // Timestamps are decimated by 32 (see init_lsm).
+        if (sample_count % 32 == 0)
+        {
+            // The device timestamp counts in 25 usec units.
+            uint32_t ticks = (uint32_t)(next_sample_usec / 25);
+            int16_t ts[3] = {(int16_t)(ticks & 0xFFFF), (int16_t)(ticks >> 16), 0};
+            push(SIM_TAG_TIMESTAMP, sample_count & 3, ts);
+        }
+        next_sample_usec += period_usec;
+    }
+}
+
+void SimulatedLSM::output(int16_t data[3]) const
+{
+    for (int i = 0; i < 3; i++)
+        data[i] = sample_count > 0 ? value(sample_count - 1, i) : 0;
+}
+
+uint16_t SimulatedLSM::fifo_samples() const
+{
+    uint16_t n = 0;
+    for (uint16_t i = 0; i < level; i++)
+    {
+        bool gyro;
+        int samples = fifo_entry_samples(fifo[(head + i) % SIM_FIFO_DEPTH].tag.tag_sensor, &gyro);
+        if (!gyro)
+            n += samples;
+    }
+    return n;
+}
+
+uint16_t SimulatedLSM::read_fifo(lsm6dsv16x_fifo_record_t *records, uint16_t max)
+{
+    uint16_t n = level < max ? level : max;
+    for (uint16_t i = 0; i < n; i++)
+        records[i] = fifo[(head + i) % SIM_FIFO_DEPTH];
+    head = (head + n) % SIM_FIFO_DEPTH;
+    level -= n;
+    overrun_flag = false;
+    return n;
+}
+
+MockBus::MockBus(SimulatedLSM *sim) : sim(sim)
+{
+    memset(regs, 0, sizeof(regs));
+    memset(hub_regs, 0, sizeof(hub_regs));
+    memset(emb_regs, 0, sizeof(emb_regs));
+    regs[LSM6DSV16X_WHO_AM_I] = 0x70;
+}
+
+uint8_t *MockBus::bank(uint8_t r)
+{
+    uint8_t access = regs[LSM6DSV16X_FUNC_CFG_ACCESS];
+    if (r == LSM6DSV16X_FUNC_CFG_ACCESS)
+        return regs;
+    if (access & FUNC_CFG_EMB_FUNC_REG_ACCESS)
+        return emb_regs;
+    return access & FUNC_CFG_SHUB_REG_ACCESS ? hub_regs : regs;
+}
+
+int32_t MockBus::read(uint8_t reg, uint8_t *data, uint16_t len)
+{
+    transactions++;
+    bytes += len;
+    if (reg == LSM6DSV16X_FIFO_DATA_OUT_TAG)
+    {
+        // Burst reads of the FIFO return successive 7 byte records.
+        uint16_t n = sim->read_fifo((lsm6dsv16x_fifo_record_t *)data, len / 7);
+        memset(data + n * 7, 0, len - n * 7);
+        return 0;
+    }
+    // The level field is 9 bits, so a full FIFO reads as 511.
+    uint16_t level = sim->fifo_level() < 0x1FF ? sim->fifo_level() : 0x1FF;
+    for (uint16_t i = 0; i < len; i++)
+    {
+        uint8_t r = reg + i;
+        if (r == LSM6DSV16X_FIFO_STATUS1)
+            data[i] = level & 0xFF;
+        else if (r == LSM6DSV16X_FIFO_STATUS2)
+            data[i] = ((level >> 8) & 0x01) | (sim->overrun() ? 0x48 : 0);
+        else
+            data[i] = bank(r)[r & 0x7F];
+    }
+    return 0;
+}
+
+int32_t MockBus::write(uint8_t reg, const uint8_t *data, uint16_t len)
+{
+    transactions++;
+    bytes += len;
+    bool hub = bank(reg) == hub_regs;
+    for (uint16_t i = 0; i < len; i++)
+        bank(reg + i)[(reg + i) & 0x7F] = data[i];
+    if (hub)
+    {
+        // Hub reads run while the master is on, and target 0 is batched.
+        uint8_t config = hub_regs[LSM6DSV16X_SLV0_CONFIG];
+        bool on = (hub_regs[LSM6DSV16X_MASTER_CONFIG] & MASTER_CONFIG_MASTER_ON) && (config & SLV0_CONFIG_BATCH);
+        int code = config >> SLV0_CONFIG_SHUB_ODR_SHIFT;
+        int rate = code == 0 ? 2 : code < HUB_ODR_CODE ? HUB_ODR >> (HUB_ODR_CODE - code) : HUB_ODR;
+        sim->set_hub(on ? RATE.odr / rate : 0);
+    }
+    else if (reg <= LSM6DSV16X_FIFO_CTRL2 && reg + len > LSM6DSV16X_FIFO_CTRL2)
+        sim->set_compression(regs[LSM6DSV16X_FIFO_CTRL2] & FIFO_CTRL2_COMPR_RT_EN);
+    return 0;
+}
+
+int32_t MockBus::submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg)
+{
+    if (!deferred)
+        return Transport::submit(batch, count, done, arg);
+    if (pending != nullptr)
+        return -1;
+    pending = batch;
+    pending_count = count;
+    pending_done = done;
+    pending_arg = arg;
+    return 0;
+}
+
+void MockBus::complete()
+{
+    for (int i = 0; i < queued; i++)
+        run(frames[i]);
+    queued = 0;
+    if (pending == nullptr)
+        return;
+    BusTransaction *batch = pending;
+    pending = nullptr;
+    Transport::submit(batch, pending_count, pending_done, pending_arg);
+}
+
+int32_t MockBus::transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    spi_frames++;
+    if (cmd & 0x80)
+        return read(cmd & 0x7F, rx, len);
+    return write(cmd & 0x7F, tx, len);
+}
+
+int32_t MockBus::queue(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                       BusDoneCallback complete, void *arg)
+{
+    if (!deferred)
+    {
+        run({cmd, tx, rx, len, complete, arg});
+        return 0;
+    }
+    if (queued >= queue_depth || queued >= (int)(sizeof(frames) / sizeof(frames[0])))
+        return -1;
+    frames[queued++] = {cmd, tx, rx, len, complete, arg};
+    return 0;
+}
+
+void MockBus::run(const Frame &f)
+{
+    bool hold = bounce && (f.cmd & 0x80) && held_count < (int)(sizeof(held) / sizeof(held[0])) &&
+                held_bytes + f.len <= sizeof(bounced);
+    if (!hold)
+    {
+        f.complete(f.arg, transfer(f.cmd, f.tx, f.rx, f.len));
+        return;
+    }
+    held[held_count++] = {f.rx, held_bytes, f.len};
+    int32_t status = transfer(f.cmd, f.tx, bounced + held_bytes, f.len);
+    held_bytes += f.len;
+    f.complete(f.arg, status);
+}
+
+int32_t MockBus::collect()
+{
+    for (int i = 0; i < held_count; i++)
+        memcpy(held[i].rx, bounced + held[i].offset, held[i].len);
+    held_count = 0;
+    held_bytes = 0;
+    return 0;
+}
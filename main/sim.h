@@ -0,0 +1,210 @@
+#pragma once
+
+#include <stdint.h>
+#include "compression.h"
+#include "record.h"
+#include "transport.h"
+
+// FIFO tags used by the simulator (see lsm6dsv16x_fifo_tag_t).
+#define SIM_TAG_XL_NC 0x02
+#define SIM_TAG_TIMESTAMP 0x04
+#define SIM_TAG_GY_NC 0x01
+#define SIM_TAG_GYRO_BIAS 0x16
+#define SIM_TAG_GRAVITY 0x17
+#define SIM_TAG_SENSORHUB_0 0x0E
+
+// SFLP gravity vector sensitivity, LSB per g (0.061 mg/LSB).
+#define SIM_GRAVITY_LSB 16393
+// Gyro sensitivity at 1000 dps full scale, mdps per LSB.
+#define SIM_GYRO_MDPS 35
+
+// The LSM6DSV16X FIFO level is reported in 9 bits.
+#define SIM_FIFO_DEPTH 512
+
+/// @brief Simulated LSM6DSV16X FIFO, for exercising the reader and merger
+/// without hardware.  Samples are produced at the ODR, scaled by the clock
+/// skew, and each axis carries a sine wave so that interpolation errors are
+/// visible.  Like the real device in stream mode, the oldest records are
+/// dropped when the FIFO is full.  Levels and depth count FIFO entries, which
+/// with compression can hold up to three samples each.
+class SimulatedLSM
+{
+public:
+    /// @param odr  Nominal output data rate, Hz.
+    /// @param skew  Clock rate relative to nominal, e.g. 1.01 for 1% fast.
+    /// @param start_usec  Time of the first sample.
+    SimulatedLSM(float odr, float skew, int64_t start_usec = 0);
+
+    /// @brief Produce samples at odr from now on, with the same skew, as after
+    /// a rate change.
+    void set_odr(float rate)
+    {
+        period_usec *= odr / rate;
+        odr = rate;
+    }
+
+    /// @brief Advance simulated time, pushing all samples produced up to t_usec into the FIFO.
+    void advance(int64_t t_usec);
+
+    /// @brief Pop up to max records from the FIFO.
+    /// @return the number of records read.
+    uint16_t read_fifo(lsm6dsv16x_fifo_record_t *records, uint16_t max);
+
+    uint16_t fifo_level() const { return level; }
+    /// @brief Accelerometer samples in the FIFO.
+    uint16_t fifo_samples() const;
+    bool overrun() const { return overrun_flag; }
+    long samples() const { return sample_count; }
+    long lost() const { return lost_samples; }
+
+    /// @brief The value of axis i for sample k, as the simulator generates it.
+    int16_t value(long k, int i) const;
+    /// @brief Set the peak of the accelerometer sine waves, 8000 by default.
+    /// Smaller values compress better.
+    void set_amplitude(float peak) { amplitude = peak; }
+
+    /// @brief Write samples to the FIFO compressed, as the device does with
+    /// FIFO_CTRL2 FIFO_COMPR_RT_EN set (see compression.h).
+    void set_compression(bool on) { compression = on; }
+    bool compressed() const { return compression; }
+
+    long written[32] = {}; // Entries written, by tag.
+
+    /// @brief Put target on this sensor's hub bus (see hub.h).
+    void set_hub_target(SimulatedLSM *sensor) { target = sensor; }
+    /// @brief Read the hub target's accelerometer every decimation samples,
+    /// into the FIFO, as the sensor hub does, or stop if 0.
+    void set_hub(int decimation) { hub_decimation = decimation; }
+    /// @brief The accelerometer output registers, the latest sample.
+    void output(int16_t data[3]) const;
+
+    /// @brief Also batch gyro, SFLP gravity and SFLP gyro bias records, for a
+    /// bell swinging about one axis, like init_lsm with the gyro enabled.
+    /// @param axis  The rotation axis.
+    /// @param amplitude  Peak swing angle, degrees.
+    /// @param period  Swing period, seconds.
+    /// @param bias  Gyro bias, in 1000 dps LSB.
+    /// @param decimation  Samples per gyro sample, as GYRO_DECIMATION.
+    void enable_bell(int axis, float amplitude, float period, int16_t bias, int decimation = GYRO_DECIMATION);
+
+    /// @brief The bell angle at sample k, degrees.
+    float bell_angle(long k) const;
+    /// @brief The gyro output about the bell axis at sample k, bias included.
+    int16_t bell_rate(long k) const;
+
+private:
+    void push(uint8_t tag, uint8_t cnt, const int16_t data[3]);
+    /// @brief Push a sample, through the compressor if compression is on.
+    /// @param slot The sample's index at its sensor's own batch rate.
+    void push_sample(FifoCompressor &compressor, uint8_t tag, const int16_t data[3], long slot);
+    void push_bell(uint8_t cnt);
+
+    double period_usec;
+    double next_sample_usec;
+    long sample_count = 0;
+    long lost_samples = 0; // Accelerometer samples discarded on overrun.
+
+    float odr;
+    float amplitude = 8000;
+    SimulatedLSM *target = nullptr;
+    int hub_decimation = 0;
+    bool compression = false;
+    FifoCompressor xl_compressor{false};
+    FifoCompressor gy_compressor{true};
+    bool bell = false;
+    int bell_axis = 0;
+    float bell_amplitude = 0;
+    float bell_period = 0;
+    int16_t gyro_bias = 0;
+    int gyro_decimation = 1;
+
+    lsm6dsv16x_fifo_record_t fifo[SIM_FIFO_DEPTH];
+    uint16_t head = 0; // Next record to read.
+    uint16_t level = 0;
+    bool overrun_flag = false;
+};
+
+/// @brief Register level model of an LSM6DSV16X on a bus, backed by a SimulatedLSM.
+/// FIFO status and data registers come from the simulator, and everything
+/// else reads back what was written.  The sensor hub and embedded function
+/// registers are separate banks, selected by FUNC_CFG_ACCESS, and turning the
+/// hub master on starts the simulator's hub reads.  In deferred mode, batches
+/// and SPI frames are held until complete() is called, to exercise async
+/// callers.  It can also act as an SpiPort, so SPITransport can be tested
+/// against the same model.  With bounce, queued SPI reads land in a buffer of
+/// the bus's own, and only reach the caller on collect(), as with the IDF
+/// driver's DMA bounce buffers.
+class MockBus : public Transport, public SpiPort
+{
+public:
+    explicit MockBus(SimulatedLSM *sim);
+
+    // SpiPort, decoding the LSM6DSV16X SPI framing.
+    int32_t transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len) override;
+    int32_t queue(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                  BusDoneCallback complete, void *arg) override;
+    int32_t collect() override;
+
+    int32_t read(uint8_t reg, uint8_t *data, uint16_t len) override;
+    int32_t write(uint8_t reg, const uint8_t *data, uint16_t len) override;
+    int32_t submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg) override;
+
+    /// @brief Execute a deferred batch, or deferred frames, and call their
+    /// done callbacks.
+    void complete();
+
+    /// @brief Current value of a register, as last written.
+    uint8_t reg(uint8_t r) const { return regs[r & 0x7F]; }
+    /// @brief Current value of a sensor hub bank register.
+    uint8_t hub_reg(uint8_t r) const { return hub_regs[r & 0x7F]; }
+    /// @brief Current value of an embedded functions bank register.
+    uint8_t emb_reg(uint8_t r) const { return emb_regs[r & 0x7F]; }
+    /// @brief Set a register as the device would, e.g. an interrupt source.
+    void set_reg(uint8_t r, uint8_t value, bool emb = false) { (emb ? emb_regs : regs)[r & 0x7F] = value; }
+
+    bool deferred = false;
+    int queue_depth = 8;   // Frames queue() holds in deferred mode, then fails.
+    bool bounce = false;
+    long transactions = 0; // Count of register transfers.
+    long bytes = 0;        // Count of bytes transferred.
+    long spi_frames = 0;   // Count of SPI frames.
+
+private:
+    /// @brief The register bank FUNC_CFG_ACCESS selects for r.
+    uint8_t *bank(uint8_t r);
+
+    SimulatedLSM *sim;
+    uint8_t regs[128];
+    uint8_t hub_regs[128];
+    uint8_t emb_regs[128];
+
+    BusTransaction *pending = nullptr;
+    uint8_t pending_count = 0;
+    BusDoneCallback pending_done = nullptr;
+    void *pending_arg = nullptr;
+
+    struct Frame
+    {
+        uint8_t cmd;
+        const uint8_t *tx;
+        uint8_t *rx;
+        uint16_t len;
+        BusDoneCallback complete;
+        void *arg;
+    };
+    Frame frames[8];
+    int queued = 0;
+    /// @brief Run a queued frame, into the bounce buffer with bounce.
+    void run(const Frame &f);
+
+    struct Held
+    {
+        uint8_t *rx;
+        uint16_t offset;
+        uint16_t len;
+    };
+    Held held[8];
+    int held_count = 0;
+    uint16_t held_bytes = 0;
+    uint8_t bounced[RATE.max_records * 7 + 8];
+};
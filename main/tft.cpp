@@ -1,43 +1,104 @@
+#include <stdio.h>
+#include "Arduino.h"
+#include "driver/spi_master.h"
+#include "esp_attr.h"
+#include "esp_lcd_panel_vendor.h"
+#include "freertos/queue.h"
+
+#include "memory.h"
 #include "tft.h"
 
-void init_SPI()
+bool TftPanel::begin()
 {
-    printf("Initializing SD card...\n");
-    SPI.begin(SCK, MISO, MOSI, TFT_CS);
-    SPI.setDataMode(SPI_MODE0);
-    SPI.setFrequency(16 * 1000 * 1000);
+    pinMode(TFT_BACKLITE, OUTPUT);
+    digitalWrite(TFT_BACKLITE, HIGH); // GPIO45 for S2/S3 backlight
+
+    spi_bus_config_t bus = {};
+    bus.mosi_io_num = MOSI;
+    bus.miso_io_num = -1;
+    bus.sclk_io_num = SCK;
+    bus.quadwp_io_num = -1;
+    bus.quadhd_io_num = -1;
+    bus.max_transfer_sz = DASHBOARD_STRIP_PIXELS * sizeof(uint16_t);
+    if (ESP_OK != spi_bus_initialize(SPI2_HOST, &bus, SPI_DMA_CH_AUTO))
+        return false;
+
+    esp_lcd_panel_io_spi_config_t io_config = {};
+    io_config.cs_gpio_num = TFT_CS;
+    io_config.dc_gpio_num = TFT_DC;
+    io_config.spi_mode = 0;
+    io_config.pclk_hz = TFT_SPI_HZ;
+    io_config.trans_queue_depth = 2; // One per dashboard strip.
+    io_config.on_color_trans_done = color_done;
+    io_config.user_ctx = this;
+    io_config.lcd_cmd_bits = 8;
+    io_config.lcd_param_bits = 8;
+    if (ESP_OK != esp_lcd_new_panel_io_spi((esp_lcd_spi_bus_handle_t)SPI2_HOST, &io_config, &io))
+        return false;
+
+    esp_lcd_panel_dev_config_t panel_config = {};
+    panel_config.reset_gpio_num = TFT_RST;
+    panel_config.rgb_ele_order = LCD_RGB_ELEMENT_ORDER_RGB;
+    panel_config.bits_per_pixel = 16;
+    if (ESP_OK != esp_lcd_new_panel_st7789(io, &panel_config, &panel))
+        return false;
+
+    // Landscape, as Adafruit_ST7789 rotation 3 (MADCTL MX | MV), with the
+    // 135x240 panel's offsets in the controller's 240x320 memory.
+    esp_lcd_panel_reset(panel);
+    esp_lcd_panel_init(panel);
+    esp_lcd_panel_invert_color(panel, true);
+    esp_lcd_panel_swap_xy(panel, true);
+    esp_lcd_panel_mirror(panel, true, false);
+    esp_lcd_panel_set_gap(panel, 40, 52);
+    return ESP_OK == esp_lcd_panel_disp_on_off(panel, true);
 }
 
-void setup_tft()
+bool IRAM_ATTR TftPanel::color_done(esp_lcd_panel_io_handle_t io, esp_lcd_panel_io_event_data_t *event,
+                                    void *context)
 {
-    init_SPI();
-    // Initialize TFT display
-    Adafruit_ST7789 tft = Adafruit_ST7789(&SPI, TFT_CS, 40, 41); // CS, DC, RST
-    pinMode(TFT_BACKLITE, OUTPUT);
-    digitalWrite(TFT_BACKLITE, HIGH); // GPIO45 for S2/S3 backlight
+    TftPanel *tft = (TftPanel *)context;
+    tft->completed = tft->completed + 1;
+    BaseType_t woken = pdFALSE;
+    if (tft->waiter != nullptr)
+        vTaskNotifyGiveFromISR(tft->waiter, &woken);
+    return woken == pdTRUE;
+}
 
-    // turn on the TFT / I2C power supply
-    pinMode(TFT_I2C_POWER, OUTPUT);
-    digitalWrite(TFT_I2C_POWER, HIGH);
-    delay(100);
-
-    // Hello world on the TFT
-    tft.init(135, 240); // Init ST7789 240x135
-    tft.setRotation(3);
-    auto start = esp_timer_get_time();
-    tft.fillScreen(ST77XX_BLACK);
-    printf("TFT black screen in %lld usec\n", esp_timer_get_time() - start);
-    tft.setCursor(0, 0);
-    tft.setTextColor(ST77XX_WHITE);
-    tft.setTextWrap(true);
-    tft.setTextSize(2);
-    start = esp_timer_get_time();
-    tft.print(
-        "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Curabitur "
-        "adipiscing ante sed nibh tincidunt feugiat. Maecenas enim massa, "
-        "fringilla sed malesuada et, malesuada sit amet turpis. Sed porttitor "
-        "neque ut ante pretium vitae malesuada nunc bibendum. Nullam aliquet "
-        "ultrices massa eu hendrerit. Ut sed nisi lorem. In vestibulum purus a "
-        "tortor imperdiet posuere. ");
-    printf("TFT text in %lld usec\n", esp_timer_get_time() - start);
-}
\ No newline at end of file
+bool TftPanel::draw(int x, int y, int w, int h, const uint16_t *pixels)
+{
+    // The window commands are sent from here, and the pixels are queued for DMA.
+    waiter = xTaskGetCurrentTaskHandle();
+    return ESP_OK == esp_lcd_panel_draw_bitmap(panel, x, y, x + w, y + h, pixels);
+}
+
+void TftPanel::wait()
+{
+    // Time out rather than trust that no completion slipped in before the wait.
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+}
+
+static void dashboard_task(void *d)
+{
+    Dashboard *dashboard = (Dashboard *)d;
+    dashboard->clear();
+    DashboardStats stats;
+    while (1)
+    {
+        if (xQueueReceive(dashboard_mailbox(), &stats, portMAX_DELAY) == pdTRUE)
+            dashboard->show(stats);
+    }
+}
+
+void start_dashboard()
+{
+    static TftPanel panel;
+    if (!panel.begin())
+    {
+        printf("Problem: TFT failed to start, no dashboard\n");
+        return;
+    }
+    static uint16_t *strips[2] = {dma_arena.display[0], dma_arena.display[1]};
+    static Dashboard dashboard(panel, strips);
+    start_display_task(dashboard_task, &dashboard);
+}
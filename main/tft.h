@@ -1,19 +1,50 @@
 #ifndef TFT_H
 #define TFT_H
 
-#include "Adafruit_ST7789.h"
-#include "Adafruit_GFX.h"
-#include <SPI.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_lcd_panel_io.h"
+#include "esp_lcd_panel_ops.h"
+
+#include "dashboard.h"
 
 #define MOSI 35
 #define SCK 36
 #define MISO 37
 #define TFT_CS 42
+#define TFT_DC 40
+#define TFT_RST 41
 
 #define TFT_I2C_POWER 7
 #define TFT_BACKLITE 45
 
-void init_SPI();
-void setup_tft();
+// The ST7789's serial write cycle is 16 nsec, so 40 MHz leaves some margin,
+// and a full screen still takes only 13 msec.
+#define TFT_SPI_HZ (40 * 1000 * 1000)
+
+/// @brief The Feather's ST7789, through esp_lcd, so that pixel transfers run
+/// from the SPI DMA queue, and the task that queued them doesn't wait for the bus.
+class TftPanel : public DashboardPanel
+{
+public:
+    /// @brief Initialize the panel, landscape, on SPI2_HOST.  TFT_I2C_POWER must be on.
+    bool begin();
+
+    bool draw(int x, int y, int w, int h, const uint16_t *pixels) override;
+    uint32_t done() const override { return completed; }
+    void wait() override;
+
+private:
+    static bool color_done(esp_lcd_panel_io_handle_t io, esp_lcd_panel_io_event_data_t *event, void *context);
+
+    esp_lcd_panel_io_handle_t io = nullptr;
+    esp_lcd_panel_handle_t panel = nullptr;
+    volatile uint32_t completed = 0;
+    TaskHandle_t waiter = nullptr; // The display task, notified on completion.
+};
+
+/// @brief Start the dashboard task, which redraws the TFT from the stats the
+/// logger publishes (see dashboard_mailbox).
+void start_dashboard();
 
 #endif // TFT_H
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base64_encode.hpp"
+#include "tiers.h"
+
+static_assert(TIER_DECIMATION == 8 && TIER_CIC_ORDER == 2 && TIER_CIC_SHIFT == 6,
+              "TIER_CIC_SHIFT must remove the CIC gain, TIER_DECIMATION^TIER_CIC_ORDER");
+
+bool CicDecimator::push(const int16_t in[6], int16_t out[6])
+{
+    for (int c = 0; c < 6; c++)
+    {
+        integrator[0][c] += (uint32_t)(int32_t)in[c];
+        for (int s = 1; s < TIER_CIC_ORDER; s++)
+            integrator[s][c] += integrator[s - 1][c];
+    }
+    if (++phase < TIER_DECIMATION)
+        return false;
+    phase = 0;
+    for (int c = 0; c < 6; c++)
+    {
+        uint32_t value = integrator[TIER_CIC_ORDER - 1][c];
+        for (int s = 0; s < TIER_CIC_ORDER; s++)
+        {
+            uint32_t diff = value - delay[s][c];
+            delay[s][c] = value;
+            value = diff;
+        }
+        out[c] = (int16_t)((int32_t)value >> TIER_CIC_SHIFT);
+    }
+    return true;
+}
+
+void OutputTiers::emit_block(const MergeBlock &block, const GyroBlock &gyro, long index, bool print)
+{
+    if (!(outputs & (OUTPUT_FULL_WINDOWS | OUTPUT_FULL_ALL)))
+        return;
+    samples_out[0] += RATE.block_samples;
+    gyro_out += gyro.count;
+    if (!print)
+        return;
+    const MergeBlock *out = &block;
+    static MergeBlock masked;
+    if (channel_mask != OUTPUT_ALL_CHANNELS)
+    {
+        masked = block;
+        for (int i = 0; i < RATE.block_samples; i++)
+            for (int c = 0; c < 6; c++)
+                if (!(channel_mask & 1 << c))
+                    masked.samples[i].data[c] = 0;
+        out = &masked;
+    }
+    // The full rate tier is most of the bandwidth, so the whole block goes out
+    // as base64, 4/3 of the raw size instead of about 3x as decimal text.
+    static unsigned char text[(sizeof(MergeBlock) + 2) / 3 * 4 + 1];
+    encode_base64((const unsigned char *)out->samples, sizeof(MergeBlock), text);
+    bytes_out += printf("B %ld %s\n", index, text);
+    // The gyro, at its own rate, on the same merged index.
+    if (gyro.count > 0)
+    {
+        encode_base64((const unsigned char *)gyro.data, gyro.count * sizeof(gyro.data[0]), text);
+        bytes_out += printf("Y %ld %d %s\n", index + gyro.offset, gyro.decimation, text);
+    }
+}
+
+void OutputTiers::emit_sample(int tier, const int16_t data[6], bool print)
+{
+    if (!(outputs & (tier == 1 ? OUTPUT_MIDDLE : OUTPUT_SLOW)))
+        return;
+    samples_out[tier]++;
+    if (!print)
+        return;
+    int16_t v[6];
+    for (int c = 0; c < 6; c++)
+        v[c] = channel_mask & 1 << c ? data[c] : 0;
+    bytes_out += printf("%c %5d %5d %5d %5d %5d %5d\n", tier == 1 ? 'M' : 'S', v[0], v[1], v[2], v[3], v[4], v[5]);
+}
+
+void OutputTiers::add(const MergeMessage *block, bool print, const GyroBlock *gyro)
+{
+    bool impact = false;
+    for (int i = 0; i < RATE.block_samples; i++)
+    {
+        const int16_t *data = block[i].data;
+        for (int c = 0; c < 6; c++)
+        {
+            int step = abs(data[c] - last[c]);
+            if (step > TIER_IMPACT_LEVEL && samples_in + i > 0)
+            {
+                // The first impact outside a window is a new strike.
+                if (!impact && post_blocks == 0)
+                {
+                    last_impact = samples_in + i;
+                    impact_peak = 0;
+                }
+                impact_peak = std::max(impact_peak, step);
+                impact = true;
+                last_activity = samples_in + i;
+            }
+            last[c] = data[c];
+        }
+
+        int16_t mid[6];
+        int16_t low[6];
+        if (!middle.push(data, mid))
+            continue;
+        if (motion_hold > 0)
+        {
+            motion_hold--;
+            emit_sample(1, mid, print);
+        }
+        if (!slow.push(mid, low))
+            continue;
+        emit_sample(2, low, print);
+        slow_samples++;
+        for (int c = 0; c < 6; c++)
+        {
+            bool moved = abs(low[c] - last_slow[c]) > TIER_MOTION_LEVEL;
+            if (moved && samples_out[2] > 1)
+                motion_hold = TIER_MOTION_HOLD;
+            // Whatever the tiers output, for quiet_samples().
+            if (moved && slow_samples > 1)
+                last_activity = samples_in + i;
+            last_slow[c] = low[c];
+        }
+    }
+    samples_in += RATE.block_samples;
+
+    const MergeBlock &current = *(const MergeBlock *)block;
+    static const GyroBlock no_gyro = {};
+    const GyroBlock &current_gyro = gyro != nullptr ? *gyro : no_gyro;
+    long index = samples_in - RATE.block_samples;
+    if (impact)
+    {
+        if (post_blocks == 0)
+        {
+            // Open a window, starting with the history, which runs up to the
+            // current block.
+            windows++;
+            long first = index - (long)history.size() * RATE.block_samples;
+            for (TierBlock *b = history.peek(); b != nullptr; b = history.peek())
+            {
+                emit_block(b->block, b->gyro, first, print);
+                first += RATE.block_samples;
+                history.release();
+            }
+        }
+        post_blocks = TIER_POST_BLOCKS;
+        emit_block(current, current_gyro, index, print);
+    }
+    else if (post_blocks > 0 || (outputs & OUTPUT_FULL_ALL))
+    {
+        if (post_blocks > 0)
+            post_blocks--;
+        emit_block(current, current_gyro, index, print);
+    }
+    else
+    {
+        if (history.claim() == nullptr)
+            history.release();
+        TierBlock *slot = history.claim();
+        slot->block = current;
+        slot->gyro = current_gyro;
+        history.commit();
+    }
+}
+
+void OutputTiers::resume(long index)
+{
+    while (history.peek() != nullptr)
+        history.release();
+    post_blocks = 0;
+    samples_in = index;
+    last_activity = index;
+}
+
+#if SELF_TEST
+/// @brief Feed a quiet minute with a few swings and strikes, and check the
+/// windows, the tier gains and the bandwidth saving.
+void test_output_tiers()
+{
+    static OutputTiers tiers;
+    static MergeMessage block[RATE.block_samples];
+    static GyroBlock gyro = {};
+    gyro.count = GYRO_BLOCK_SAMPLES;
+    const int blocks = 60 * RATE.odr / RATE.block_samples;
+    long strike_blocks = 0;
+    long n = 0;
+    for (int b = 0; b < blocks; b++)
+    {
+        for (int i = 0; i < RATE.block_samples; i++, n++)
+        {
+            float t = (float)n / RATE.odr;
+            // Swinging between 10 and 20 seconds, still otherwise.
+            float swing = (t > 10 && t < 20) ? 500 * sinf(2 * (float)M_PI * t / 2) : 0;
+            for (int c = 0; c < 6; c++)
+                block[i].data[c] = (int16_t)(1000 * c - 3000 + swing);
+            // A strike every 15 seconds.
+            if (n % (15 * RATE.odr) == 0 && n > 0)
+            {
+                block[i].data[0] += 4000;
+                strike_blocks++;
+            }
+        }
+        tiers.add(block, false, &gyro);
+    }
+
+    float bandwidth = (float)(tiers.samples_out[0] + tiers.samples_out[1] + tiers.samples_out[2]) / tiers.samples_in;
+    printf("Output tiers: %ld windows, %ld/%ld/%ld samples from %ld, %.1fx reduction\n",
+           tiers.windows, tiers.samples_out[0], tiers.samples_out[1], tiers.samples_out[2],
+           tiers.samples_in, 1 / bandwidth);
+    assert(tiers.windows == strike_blocks);
+    assert(tiers.last_impact == 45L * RATE.odr && tiers.impact_peak == 4000);
+    // The strike moves the slow tier too, a slow sample or two later.
+    long quiet = tiers.samples_in - 45L * RATE.odr;
+    assert(tiers.quiet_samples() < quiet && tiers.quiet_samples() > quiet - 3 * TIER_DECIMATION * TIER_DECIMATION);
+    // The strike steps up and back down.  If the step down falls in the next
+    // block, the window is one block longer.
+    long window = TIER_PRE_BLOCKS + 1 + TIER_POST_BLOCKS;
+    assert(tiers.samples_out[0] >= strike_blocks * window * RATE.block_samples);
+    assert(tiers.samples_out[0] <= strike_blocks * (window + 1) * RATE.block_samples);
+    assert(tiers.samples_out[2] == tiers.samples_in / (TIER_DECIMATION * TIER_DECIMATION));
+    // The gyro goes out with the blocks, pre-impact history included.
+    assert(tiers.gyro_out == tiers.samples_out[0] / RATE.block_samples * GYRO_BLOCK_SAMPLES);
+    assert(1 / bandwidth > 10);
+
+    // Every full rate block and the slow tier, as CONTROL_OUTPUTS can ask for.
+    static OutputTiers all;
+    all.set_output(OUTPUT_FULL_ALL | OUTPUT_SLOW, 0x07);
+    for (int b = 0; b < 64; b++)
+        all.add(block, false, &gyro);
+    assert(all.samples_out[0] == all.samples_in && all.samples_out[1] == 0);
+    assert(all.samples_out[2] == all.samples_in / (TIER_DECIMATION * TIER_DECIMATION));
+
+    // Constant input comes out of the CIC unchanged.
+    CicDecimator cic;
+    int16_t in[6] = {-32768, -1000, -1, 0, 1, 32767};
+    int16_t out[6];
+    for (int i = 0; i < 4 * TIER_DECIMATION; i++)
+        if (cic.push(in, out) && i > TIER_DECIMATION)
+            for (int c = 0; c < 6; c++)
+                assert(out[c] == in[c]);
+}
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+#include "control.h"
+#include "merge.h"
+#include "rate.h"
+#include "ring.h"
+
+// Decimation of each tier relative to the one above: 1920 -> 240 -> 30 Hz.
+#define TIER_DECIMATION 8
+// CIC order.  The gain is TIER_DECIMATION^2, removed with a shift.
+#define TIER_CIC_ORDER 2
+#define TIER_CIC_SHIFT 6
+
+// Full rate output opens when any accelerometer channel steps by more than
+// this between samples (about 0.5 g at 16 g full scale), e.g. a clapper strike.
+#define TIER_IMPACT_LEVEL 1000
+// The middle tier opens when the slow tier moves by more than this per sample
+// (about 10 mg per 33 msec), e.g. while the bell is swinging.
+#define TIER_MOTION_LEVEL 20
+
+// Blocks of history kept for, and output after, a full rate window.  At 1920 Hz
+// a block is about 5 msec, so this is 80 msec before and 200 msec after.
+#define TIER_PRE_BLOCKS 16
+#define TIER_POST_BLOCKS 40
+// Middle tier samples output after motion stops, about 2 seconds.
+#define TIER_MOTION_HOLD 480
+
+/// @brief Cascaded integrator comb decimator for the six merged channels.
+/// Integrators wrap, which the combs undo, so the arithmetic is exact.
+class CicDecimator
+{
+public:
+    /// @brief Add one sample.
+    /// @return true, with out filled, on every TIER_DECIMATION'th sample.
+    bool push(const int16_t in[6], int16_t out[6]);
+
+private:
+    uint32_t integrator[TIER_CIC_ORDER][6] = {};
+    uint32_t delay[TIER_CIC_ORDER][6] = {};
+    int phase = 0;
+};
+
+/// @brief A block of merged samples, as output by the Merger.
+struct MergeBlock
+{
+    MergeMessage samples[RATE.block_samples];
+};
+
+/// @brief A merged block, with imu1's gyro when BELL_ANGLE batches it.
+struct TierBlock
+{
+    MergeBlock block;
+    GyroBlock gyro;
+};
+
+/// @brief Splits the merged stream into rate tiers.
+///
+/// The slow tier (ODR/64) is always output.  The middle tier (ODR/8) is output
+/// while there is motion, and for a while after.  Full rate blocks are only
+/// output in a window around impacts, as `B <index> <base64>` lines, each
+/// followed by `Y <index> <decimation> <base64>` with the block's gyro, if it
+/// has any.  The last TIER_PRE_BLOCKS blocks are kept in a ring, so the window
+/// starts before the impact that opened it.
+class OutputTiers
+{
+public:
+    /// @brief Add one block of RATE.block_samples merged samples.
+    /// @param print Whether to print the output, or only count it.
+    /// @param gyro The block's gyro, if any, sent with it.
+    void add(const MergeMessage *block, bool print = true, const GyroBlock *gyro = nullptr);
+
+    /// @brief Choose the tiers output, OUTPUT_* in control.h, and the merged
+    /// channels.  Channels left out are output as zero, so lines keep their
+    /// layout, and the recording compresses them to almost nothing.
+    void set_output(uint8_t tiers, uint8_t channels)
+    {
+        outputs = tiers;
+        channel_mask = channels;
+    }
+
+    /// @brief Merged samples since the last motion or impact.
+    long quiet_samples() const { return samples_in - last_activity; }
+
+    /// @brief Carry on at merged index, after the sensors slept.  The history
+    /// isn't contiguous with what follows, so it is dropped, and the quiet
+    /// time counts from here.
+    void resume(long index);
+
+    long samples_in = 0;      // Merged samples added.
+    long samples_out[3] = {}; // Samples output per tier, full rate first.
+    long gyro_out = 0;        // Gyro samples output with full rate blocks.
+    long windows = 0;         // Full rate windows opened.
+    long last_impact = -1;    // Merged index of the impact that opened the last window.
+    int impact_peak = 0;      // Largest step in the last window, a measure of the strike.
+    uint32_t bytes_out = 0;   // Bytes of lines printed.  Wraps.
+    long last_activity = 0;   // Merged index of the last motion or impact.
+
+private:
+    /// @param index Merged index of the first sample in the block.
+    void emit_block(const MergeBlock &block, const GyroBlock &gyro, long index, bool print);
+    void emit_sample(int tier, const int16_t data[6], bool print);
+
+    CicDecimator middle;
+    CicDecimator slow;
+    Ring<TierBlock, TIER_PRE_BLOCKS> history;
+    int16_t last[6] = {};      // Last full rate sample, for impact detection.
+    int16_t last_slow[6] = {}; // Last slow sample, for motion detection.
+    int post_blocks = 0;       // Full rate blocks left in the current window.
+    int motion_hold = 0;       // Middle tier samples left to output.
+    long slow_samples = 0;     // Slow tier samples, output or not.
+    uint8_t outputs = OUTPUT_DEFAULT;
+    uint8_t channel_mask = OUTPUT_ALL_CHANNELS;
+};
+
+void test_output_tiers();
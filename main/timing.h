@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// Microseconds from a monotonic clock, for the benchmarks, which also run in
+// the host self tests.
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+
+static inline int64_t now_usec() { return esp_timer_get_time(); }
+#else
+#include <chrono>
+
+static inline int64_t now_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+#endif
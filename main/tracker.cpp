@@ -0,0 +1,278 @@
+#include <cassert>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+#include "sim.h"
+#include "tracker.h"
+
+UnpackedRecords reproject(const int16_t last[3], const UnpackedRecords &msg, float start, float increment)
+{
+    UnpackedRecords projected;
+    int16_t a[3] = {last[0], last[1], last[2]};
+    int n = 0; // The output index.
+
+    float alpha = start;
+    int k = (int)(alpha);
+    alpha -= k;
+    if (k == 0)
+    {
+        // printf("Reproject k=%d n=%d alpha=%f\n", k, n, alpha);
+
+        for (int i = 0; i < 3; i++)
+        {
+            float value = a[i] + alpha * (msg.axis[i][k] - a[i]);
+            projected.axis[i][n] = (int16_t)value;
+        }
+        n++;
+        alpha += increment;
+        if (alpha >= 1.0f)
+        {
+            msg.sample(k, a);
+            k++;
+            alpha -= 1.0f;
+        }
+    }
+
+    while (k < msg.count && n < RATE.max_records)
+    {
+        // printf("Reproject k=%d n=%d alpha=%f\n", k, n, alpha);
+
+        for (int i = 0; i < 3; i++)
+        {
+            float value = a[i] + alpha * (msg.axis[i][k] - a[i]);
+            projected.axis[i][n] = (int16_t)value;
+        }
+        n++;
+        alpha += increment;
+        if (alpha >= 1.0f)
+        {
+            msg.sample(k, a);
+            k++;
+            alpha -= 1.0f;
+        }
+    }
+
+    projected.count = n;
+
+    return projected;
+}
+
+void compact(const UnpackedRecords &in, UnpackedRecords &out)
+{
+    int n = 0;
+    for (int i = 0; i < in.count; i++)
+    {
+        if (in.tag[i] != LSM6DSV16X_XL_NC_TAG)
+            continue;
+        out.tag[n] = in.tag[i];
+        out.cnt[n] = in.cnt[i];
+        for (int a = 0; a < 3; a++)
+            out.axis[a][n] = in.axis[a][i];
+        n++;
+    }
+    out.count = n;
+}
+
+#if SELF_TEST
+LoggerMsg make_test_msg(int sample_count, int64_t read_time, int64_t time_step)
+{
+    LoggerMsg msg;
+    // At the end of the samples, the values should be equal to the read time / 500.
+    // And they should increment by either
+    auto start_time = read_time - time_step * sample_count;
+    msg.read_time = read_time;
+    msg.sample_count = sample_count;
+    for (int i = 0; i < sample_count; i++)
+    {
+        msg.records[i].tag.tag_sensor = LSM6DSV16X_XL_NC_TAG;
+        msg.records[i].data[0] = start_time;
+        msg.records[i].data[1] = start_time + 1;
+        msg.records[i].data[2] = start_time + 2;
+        start_time += time_step;
+    }
+    return msg;
+}
+
+void read_sim(SimulatedLSM &sim, LoggerMsg &msg, int64_t now, uint16_t max)
+{
+    sim.advance(now);
+    msg.overrun = sim.overrun();
+    msg.sample_count = sim.read_fifo(msg.records, max);
+    msg.backlog = sim.fifo_samples();
+    msg.read_time = now;
+}
+
+void test_reproject()
+{
+    UnpackedRecords msg;
+    msg.count = 4;
+    for (int i = 0; i < msg.count; i++)
+    {
+        msg.axis[0][i] = i * 100;
+        msg.axis[1][i] = i * 100 + 1;
+        msg.axis[2][i] = i * 100 + 2;
+    }
+    for (int i = 0; i < msg.count; i++)
+    {
+        printf("Initial[%d]: %d %d %d\n", i, msg.axis[0][i], msg.axis[1][i], msg.axis[2][i]);
+    }
+
+    int16_t last[3] = {-100, -99, -98};
+    float start = 0.9f;
+    float increment = 0.85f;
+    UnpackedRecords projected = reproject(last, msg, start, increment);
+    for (int i = 0; i < projected.count; i++)
+    {
+        printf("Projected[%d]: %d %d %d\n", i, projected.axis[0][i], projected.axis[1][i], projected.axis[2][i]);
+    }
+
+    assert(projected.count == 4);
+    assert(projected.axis[0][0] == -10);
+    assert(projected.axis[0][1] == 75);
+    assert(projected.axis[0][2] == 160);
+    assert(projected.axis[0][3] == 245);
+}
+
+/// @brief This requires three IMU messages for each IMU.  The first
+/// provides the basis for last_record and the first time point.
+/// The second and third provide data to fit the timebase.
+void test_imu_tracker()
+{
+    IMUTracker left, right;
+    static UnpackedRecords records;
+    auto update = [](IMUTracker &tracker, const LoggerMsg &msg)
+    {
+        unpack_records(msg.records, msg.sample_count, records);
+        tracker.update(msg, records);
+    };
+
+    update(left, make_test_msg(8, 2000, 500));
+    update(right, make_test_msg(7, 4000, 8 * 500 / 7));
+
+    update(left, make_test_msg(8, 6000, 500));
+    update(right, make_test_msg(7, 8000, 8 * 500 / 7));
+
+    update(left, make_test_msg(8, 10000, 500));
+    update(right, make_test_msg(7, 12000, 8 * 500 / 7));
+
+#ifdef ESP_PLATFORM
+    printf("Min stack in test_imu_tracker: %d\n", uxTaskGetStackHighWaterMark(NULL));
+#endif
+
+    printf("Projecting right onto left fitter\n");
+    auto [offset, projected] = right.project(left.fitter);
+#ifdef ESP_PLATFORM
+    printf("Min stack after project: %d\n", uxTaskGetStackHighWaterMark(NULL));
+#endif
+    printf("Projected offset: %lld\n", (long long)offset);
+    // assert(projected.sample_count == 8);
+    printf("Left base %ld  Right base %ld\n", left.base_count, right.base_count);
+    for (int i = 0; i < projected.count; i++)
+    {
+        printf("Left  [%d]: %5d %5d %5d", i, left.current.axis[0][i], left.current.axis[1][i], left.current.axis[2][i]);
+        printf("  Right [%d]: %5d %5d %5d", i, right.current.axis[0][i], right.current.axis[1][i], right.current.axis[2][i]);
+        printf("  Projected[%d]: %5d %5d %5d\n", i, projected.axis[0][i], projected.axis[1][i], projected.axis[2][i]);
+    }
+
+    // A time offset of one left sample period samples left one sample later.
+    auto [k0, frac0] = left.sample_for(9000);
+    left.time_offset = left.slope();
+    auto [k1, frac1] = left.sample_for(9000);
+    assert(fabsf(k1 + frac1 - (k0 + frac0) - 1.0f) < 0.01f);
+    assert(llabs(left.time_for(k1) + (int64_t)left.time_offset - left.fitter.time_for(k1)) <= 1);
+    left.time_offset = 0;
+}
+
+void test_skew_scheduler()
+{
+    // A ramp sampled 1% slower than the reference should come out as an
+    // exact ramp at the reference rate, with one insert per 100 samples.
+    SkewScheduler scheduler;
+    static UnpackedRecords msg, out;
+    const float increment = 0.99f;
+    const int16_t zero[3] = {0, 0, 0};
+    scheduler.start(0, -1.0f, zero);
+    long local = 0;
+    long produced = 0;
+    for (int m = 0; m < 250; m++)
+    {
+        msg.count = 8;
+        for (int i = 0; i < msg.count; i++, local++)
+            for (int j = 0; j < 3; j++)
+                msg.axis[j][i] = (int16_t)(10 * (local + 1) + j);
+        // The fitted target is the ideal phase, so steering is a no-op.
+        float target = scheduler.next_index * increment - 1 - (local - msg.count);
+        long first = scheduler.resample(msg, increment, target, out);
+        assert(first == produced);
+        for (int i = 0; i < out.count; i++, produced++)
+            assert(abs(out.axis[0][i] - 10.0f * produced * increment) <= 1.0f);
+    }
+    printf("Skew scheduler: %ld local, %ld out, %ld inserted, %ld dropped\n",
+           local, produced, scheduler.inserted, scheduler.dropped);
+    assert(abs(produced - local / increment) <= 2);
+    assert(abs(scheduler.inserted - (produced - local)) <= 1);
+    assert(scheduler.dropped == 0 && scheduler.resyncs == 0);
+}
+
+/// @brief Lose samples to FIFO overruns, after stalls of up to a second, and
+/// to a bus glitch, and check the tracker accounts for exactly what was lost.
+void test_gap_detection()
+{
+    static IMUTracker tracker;
+    static SimulatedLSM sim(RATE.odr, 1.002f);
+    static LoggerMsg msg;
+    static UnpackedRecords records;
+    const int64_t period = RATE.read_interval_usec();
+    int64_t now = 0;
+    auto read = [&](int drop)
+    {
+        now += period;
+        read_sim(sim, msg, now, RATE.max_records);
+        // Drop accelerometer records, as a bad read would.
+        for (int i = 0; drop > 0 && i < msg.sample_count; i++)
+        {
+            if (msg.records[i].tag.tag_sensor != LSM6DSV16X_XL_NC_TAG)
+                continue;
+            memmove(&msg.records[i], &msg.records[i + 1], (msg.sample_count - i - 1) * sizeof(msg.records[0]));
+            msg.sample_count--;
+            drop--;
+            i--;
+        }
+        unpack_records(msg.records, msg.sample_count, records);
+        int missing = tracker.gap(msg, records);
+        tracker.update(msg, records, missing);
+    };
+
+    for (int i = 0; i < 200; i++)
+        read(0);
+    assert(tracker.lost == 0);
+    // Stall long enough to overrun the FIFO, then drain it.
+    now += 2000LL * SIM_FIFO_DEPTH * 1000 / RATE.odr;
+    for (int i = 0; i < 200; i++)
+        read(0);
+    printf("Gap detection: sim lost %ld, tracker lost %ld in %ld gaps\n", sim.lost(), tracker.lost, tracker.gaps);
+    assert(sim.lost() > 0 && tracker.lost == sim.lost() && tracker.gaps == 1);
+    read(2);
+    for (int i = 0; i < 20; i++)
+        read(0);
+    assert(tracker.lost == sim.lost() + 2 && tracker.gaps == 2);
+
+    // The 0.4 and 1 second stalls the merger is meant to ride out.  The fit
+    // must still predict the count across them.
+    for (int64_t stall : {400000LL, 1000000LL})
+    {
+        now += stall;
+        for (int i = 0; i < 200; i++)
+            read(0);
+    }
+    printf("Gap detection: after stalls, sim lost %ld, tracker lost %ld in %ld gaps\n", sim.lost(), tracker.lost,
+           tracker.gaps);
+    assert(tracker.lost == sim.lost() + 2 && tracker.gaps == 4);
+}
+#endif
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+#include <utility>
+#include "capture.h"
+#include "clock_model.h"
+#include "fitter.h"
+#include "merge.h"
+#include "rate.h"
+#include "unpack.h"
+
+// Per sensor tracking and resampling for the merger (see merge.cpp): an
+// IMUTracker per sensor counts its samples, gaps included, and fits its
+// clock, and a SkewScheduler resamples the slower sensor onto the faster
+// one's samples.  Nothing here needs the device, so the host selftest runs
+// the tests too.
+
+// Fraction of the fitted phase error the skew scheduler corrects per message.
+#define SKEW_PHASE_GAIN 0.05f
+// Phase errors beyond this many samples mean a gap, and are corrected at once.
+#define SKEW_RESYNC_SAMPLES 2.0f
+
+/// @brief Reproject samples using linear interpolation.
+/// @param last  The last sample prior to the message.
+/// @param msg The samples to reproject.
+/// @param start The fractional start position (<= 1.0).
+/// @param increment The fractional step size (usually < 1.0).
+///
+/// Performance - about 30 usec for 8 samples, with debug.
+UnpackedRecords reproject(const int16_t last[3], const UnpackedRecords &msg, float start, float increment);
+
+/// @brief Copy in's accelerometer samples to out, omitting unused sensor types.
+void compact(const UnpackedRecords &in, UnpackedRecords &out);
+
+/// @brief Tracks an individual IMU's data and data rate.
+class IMUTracker
+{
+private:
+    int16_t last_record[3] = {0}; // Last record from previous message.
+    TagCounter tags;
+
+public:
+    long msg_count = 0;  // Number of messages processed.
+    long base_count = 0; // Cumulative sample count of the first sample in current.
+    long gaps = 0;       // Gaps detected.
+    long lost = 0;       // Samples lost in gaps.
+    float time_offset = 0; // usec this IMU's samples are late, from phase refinement (see phase.h).
+    TimeFitter fitter;
+    UnpackedRecords current; // The last message's accelerometer samples.
+
+    IMUTracker() : fitter(RATE.fit_alpha) {}
+
+    /// @brief Start the fitter from a known sample period, in usec per sample.
+    void seed(float period)
+    {
+        fitter.set_prior(period, CLOCK_PRIOR_WEIGHT);
+    }
+
+    /// @brief Count from zero again, with a fresh fitter, after the sensor
+    /// stopped streaming.  The gaps, losses and phase offset carry on.
+    void restart()
+    {
+        for (int i = 0; i < 3; i++)
+            last_record[i] = 0;
+        tags = TagCounter();
+        msg_count = 0;
+        base_count = 0;
+        fitter = TimeFitter(RATE.fit_alpha);
+        current.count = 0;
+    }
+
+    /// @brief Count the samples lost before, or within, a raw message.
+    /// Each accelerometer record carries a 2 bit tag_cnt, so gaps of up to 3
+    /// samples are exact from the tags alone.  After an overrun, the fitter
+    /// predicts the count, and the tags select the nearest consistent value,
+    /// which is exact while the prediction is within 2 samples.
+    /// @param records The message's records, unpacked.
+    int gap(const LoggerMsg &msg, const UnpackedRecords &records)
+    {
+        int tag_missing = 0;
+        int samples = 0;
+        for (int i = 0; i < records.count; i++)
+        {
+            if (records.tag[i] != LSM6DSV16X_XL_NC_TAG)
+                continue;
+            tag_missing += tags.next(records.cnt[i]);
+            samples++;
+        }
+        if (!msg.overrun || msg_count < 2)
+            return tag_missing;
+
+        auto [k, frac] = fitter.sample_for(msg.read_time);
+        long predicted = k + (frac >= 0.5f ? 1 : 0) - msg.backlog -
+                         (base_count + current.count + samples);
+        return (int)TagCounter::resolve(predicted, tag_missing);
+    }
+
+    /// @brief Add a message's accelerometer samples, as current.
+    /// @param records The message's records, unpacked.
+    /// @param missing Samples lost since the previous message, from gap().
+    /// @return false if the message had no accelerometer samples, or too
+    /// many, and was ignored.
+    bool update(const LoggerMsg &msg, const UnpackedRecords &records, int missing = 0)
+    {
+        int samples = 0;
+        for (int i = 0; i < records.count; i++)
+            samples += records.tag[i] == LSM6DSV16X_XL_NC_TAG;
+        if (samples == 0)
+            return false;
+        if (records.count > RATE.max_records)
+        {
+            printf("Problem: bad IMU message size: %d\n", records.count);
+            return false;
+        }
+        msg_count++;
+
+        // Missing samples still count, so the time base carries straight across a gap.
+        base_count += current.count + missing;
+        if (missing > 0)
+        {
+            gaps++;
+            lost += missing;
+        }
+        fitter.coord(base_count + samples + msg.backlog, msg.read_time);
+
+        // Update the fitter with the new data.
+        bool continues = current.count > 0 && missing == 0;
+        if (continues)
+            current.sample(current.count - 1, last_record);
+        compact(records, current);
+        if (!continues)
+            current.sample(0, last_record);
+        return true;
+    }
+
+    float slope() const
+    {
+        return fitter.slope();
+    }
+
+    // Time attributed to a given sample count, less the time offset.
+    int64_t time_for(long sample_count)
+    {
+        return fitter.time_for(sample_count) - (int64_t)time_offset;
+    }
+
+    std::pair<long, float> sample_for(long t) const
+    {
+        return fitter.sample_for(t + (long)time_offset);
+    }
+
+    /// @brief Project this IMUTracker's data onto another IMUTracker's fitter.
+    /// @param other
+    /// @return the 'other' sample index of the first projected sample, and the projected values
+    /// starting from that sample.
+    /// @TODO - this takes quite a bit of stack space.  Can we reduce it?
+    std::pair<int64_t, UnpackedRecords> project(const TimeFitter &other)
+    {
+        // This is the time of the first sample in the current msg.
+        int64_t start_time = time_for(base_count);
+        // Find the corresponding sample location in the other IMU.
+        std::pair<int64_t, float> other_sample_base = other.sample_for(start_time);
+
+        // Compute the size of the other IMU step size in units of this IMU's sample count.
+        // NOTE: This should generally be less than 1.0, since we are projecting
+        // onto the faster IMU timebase.  It should also be very stable.
+        // Units are local steps per other step.
+        float increment = other.slope() / slope();
+
+        // This should always be less than 1.0.
+        float local_fraction = other_sample_base.second * increment;
+
+        UnpackedRecords projected = reproject(
+            last_record, current, local_fraction, increment);
+        return {other_sample_base.first, projected};
+    }
+};
+
+/// @brief Resamples one IMU stream onto the reference IMU's sample clock.
+///
+/// The scheduler keeps a fractional phase: the position, in local samples,
+/// of the next output sample.  Every output advances the phase by the ratio
+/// of the sample periods, so exactly one sample is produced per reference
+/// sample, however long the run.  When the phase crosses no local sample,
+/// the output is an inserted sample, and when it crosses two, a local sample
+/// is dropped.  Each message the phase is steered a fraction of the way
+/// towards the fitted alignment, so errors in the ratio can't accumulate.
+class SkewScheduler
+{
+private:
+    int16_t last[3] = {0}; // Last sample of the previous message, at phase -1.
+    int last_k = -1;       // Local sample at or before the previous output.
+
+public:
+    long next_index = 0; // Reference sample index of the next output.
+    float phase = 0;     // Local position of the next output, relative to the next message.
+    long inserted = 0;   // Outputs that didn't advance past a new local sample.
+    long dropped = 0;    // Local samples skipped over.
+    long resyncs = 0;    // Phase jumps, after a gap in either stream.
+
+    /// @brief Start resampling.
+    /// @param index The reference index of the first output.
+    /// @param local_phase Its position relative to the next message.
+    /// @param previous The sample before the next message.
+    void start(long index, float local_phase, const int16_t previous[3])
+    {
+        next_index = index;
+        phase = local_phase < -1.0f ? -1.0f : local_phase;
+        last_k = (int)floorf(phase) - 1;
+        for (int i = 0; i < 3; i++)
+            last[i] = previous[i];
+    }
+
+    /// @brief Resample one message.
+    /// @param msg The local samples.
+    /// @param increment Local samples per reference sample.
+    /// @param target The fitted phase of next_index, for steering.
+    /// @param out Filled with one sample per reference sample covered by msg.
+    /// @return The reference index of out's first sample.
+    long resample(const UnpackedRecords &msg, float increment, float target, UnpackedRecords &out)
+    {
+        float error = target - phase;
+        if (fabsf(error) > SKEW_RESYNC_SAMPLES)
+        {
+            phase = target < -1.0f ? -1.0f : target;
+            last_k = (int)floorf(phase) - 1;
+            resyncs++;
+        }
+        else
+        {
+            phase += SKEW_PHASE_GAIN * error;
+            if (phase < -1.0f)
+                phase = -1.0f;
+        }
+
+        long first = next_index;
+        int n = 0;
+        while (phase < msg.count - 1 && n < RATE.max_records)
+        {
+            int k = (int)floorf(phase);
+            float alpha = phase - k;
+            for (int i = 0; i < 3; i++)
+            {
+                int16_t a = k < 0 ? last[i] : msg.axis[i][k];
+                out.axis[i][n] = (int16_t)(a + alpha * (msg.axis[i][k + 1] - a));
+            }
+            n++;
+
+            if (k == last_k)
+                inserted++;
+            else if (k > last_k + 1)
+                dropped += k - last_k - 1;
+            last_k = k;
+            phase += increment;
+        }
+        out.count = n;
+        next_index += n;
+
+        if (msg.count > 0)
+        {
+            phase -= msg.count;
+            last_k -= msg.count;
+            msg.sample(msg.count - 1, last);
+        }
+        return first;
+    }
+
+    /// @brief Account for local samples lost before the next message.
+    /// Outputs that fall inside the gap can't be interpolated, so are skipped.
+    /// @return The count of reference samples skipped.
+    long skip(int missing, float increment)
+    {
+        phase -= missing;
+        long skipped = 0;
+        if (phase < 0)
+        {
+            skipped = (long)ceilf(-phase / increment);
+            phase += skipped * increment;
+            next_index += skipped;
+        }
+        last_k = (int)floorf(phase) - 1;
+        return skipped;
+    }
+};
+
+class SimulatedLSM;
+/// @brief Read a simulated IMU into msg, the way the reader does.
+void read_sim(SimulatedLSM &sim, LoggerMsg &msg, int64_t now, uint16_t max);
+/// @brief A message of sample_count accelerometer records, time_step apart,
+/// ending at read_time, whose values are their times.
+LoggerMsg make_test_msg(int sample_count, int64_t read_time, int64_t time_step);
+
+void test_reproject();
+void test_imu_tracker();
+void test_skew_scheduler();
+void test_gap_detection();
@@ -0,0 +1,422 @@
+#include <cassert>
+#include <stdio.h>
+#include <string.h>
+#if SENSOR_TRANSPORT != TRANSPORT_WIRE
+#include "esp_attr.h"
+#endif
+
+#include "transport.h"
+#include "sim.h"
+
+int32_t Transport::submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg)
+{
+    int32_t status = 0;
+    for (uint8_t i = 0; i < count && status == 0; i++)
+    {
+        if (batch[i].write)
+            status = write(batch[i].reg, batch[i].data, batch[i].len);
+        else
+            status = read(batch[i].reg, batch[i].data, batch[i].len);
+    }
+    done(arg, status);
+    return 0;
+}
+
+void SPITransport::frame_done(void *arg, int32_t status)
+{
+    SPITransport *t = (SPITransport *)arg;
+    if (status != 0)
+        t->batch_status = status;
+    if (t->pending.fetch_sub(1) == 1)
+        t->done(t->done_arg, t->batch_status);
+}
+
+int32_t SPITransport::submit(BusTransaction *batch, uint8_t count, BusDoneCallback cb, void *arg)
+{
+    if (count == 0 || pending != 0)
+        return -1;
+    done = cb;
+    done_arg = arg;
+    batch_status = 0;
+    pending = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        BusTransaction &t = batch[i];
+        int32_t status;
+        if (t.write)
+            status = port->queue(t.reg & 0x7F, t.data, nullptr, t.len, frame_done, this);
+        else
+            status = port->queue(t.reg | 0x80, nullptr, t.data, t.len, frame_done, this);
+        if (status != 0)
+        {
+            // Frames already queued will still complete, and report the failure.
+            submit_failures++;
+            batch_status = status;
+            if (pending.fetch_sub(count - i) == count - i)
+                done(done_arg, batch_status);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+#if SENSOR_TRANSPORT == TRANSPORT_SPI
+bool EspSpiPort::init_bus(spi_host_device_t host, int mosi, int miso, int sck)
+{
+    spi_bus_config_t cfg = {};
+    cfg.mosi_io_num = mosi;
+    cfg.miso_io_num = miso;
+    cfg.sclk_io_num = sck;
+    cfg.quadwp_io_num = -1;
+    cfg.quadhd_io_num = -1;
+    cfg.max_transfer_sz = RATE.max_records * sizeof(lsm6dsv16x_fifo_record_t) + 4;
+    esp_err_t err = spi_bus_initialize(host, &cfg, SPI_DMA_CH_AUTO);
+    if (err != ESP_OK)
+    {
+        printf("spi_bus_initialize(%d) failed: %s\n", host, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+EspSpiPort::EspSpiPort(spi_host_device_t host, int cs, int hz)
+{
+    spi_device_interface_config_t cfg = {};
+    cfg.command_bits = 8;
+    cfg.mode = 3;
+    cfg.clock_speed_hz = hz;
+    cfg.spics_io_num = cs;
+    // Half duplex, so the command phase is followed by a pure read or write phase.
+    cfg.flags = SPI_DEVICE_HALFDUPLEX;
+    cfg.queue_size = SPI_QUEUE_DEPTH;
+    cfg.post_cb = post_cb;
+    esp_err_t err = spi_bus_add_device(host, &cfg, &dev);
+    if (err != ESP_OK)
+    {
+        printf("spi_bus_add_device(cs=%d) failed: %s\n", cs, esp_err_to_name(err));
+        dev = nullptr;
+    }
+}
+
+void IRAM_ATTR EspSpiPort::post_cb(spi_transaction_t *trans)
+{
+    Slot *slot = (Slot *)trans->user;
+    if (slot != nullptr && slot->complete != nullptr)
+        slot->complete(slot->arg, 0);
+}
+
+void EspSpiPort::fill(spi_transaction_t &t, uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    memset(&t, 0, sizeof(t));
+    t.cmd = cmd;
+    if (tx != nullptr)
+    {
+        t.length = len * 8;
+        t.tx_buffer = tx;
+    }
+    else
+    {
+        t.rxlength = len * 8;
+        if (len <= 4)
+            t.flags = SPI_TRANS_USE_RXDATA;
+        else
+            t.rx_buffer = rx;
+    }
+}
+
+void EspSpiPort::finish(const spi_transaction_t &t, uint8_t *rx)
+{
+    if (t.flags & SPI_TRANS_USE_RXDATA)
+        memcpy(rx, t.rx_data, t.rxlength / 8);
+}
+
+void EspSpiPort::reap(TickType_t ticks)
+{
+    spi_transaction_t *done;
+    while (outstanding > 0 && spi_device_get_trans_result(dev, &done, ticks) == ESP_OK)
+    {
+        outstanding--;
+        finish(*done, ((Slot *)done->user)->rx);
+    }
+}
+
+int32_t EspSpiPort::collect()
+{
+    // Called after the last frame's post_cb, so this doesn't wait long.
+    reap(portMAX_DELAY);
+    return 0;
+}
+
+int32_t EspSpiPort::transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    if (dev == nullptr)
+        return -1;
+    // spi_device_transmit can't be mixed with unfinished queued frames.
+    reap(portMAX_DELAY);
+    spi_transaction_t t;
+    fill(t, cmd, tx, rx, len);
+    if (spi_device_transmit(dev, &t) != ESP_OK)
+        return -1;
+    finish(t, rx);
+    return 0;
+}
+
+int32_t EspSpiPort::queue(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                          BusDoneCallback complete, void *arg)
+{
+    if (dev == nullptr)
+        return -1;
+    reap(0);
+    if (outstanding == SPI_QUEUE_DEPTH)
+        return -1;
+    Slot &slot = slots[next_slot];
+    next_slot = (next_slot + 1) % SPI_QUEUE_DEPTH;
+    fill(slot.trans, cmd, tx, rx, len);
+    slot.trans.user = &slot;
+    slot.rx = rx;
+    slot.complete = complete;
+    slot.arg = arg;
+    if (spi_device_queue_trans(dev, &slot.trans, 0) != ESP_OK)
+        return -1;
+    outstanding++;
+    return 0;
+}
+#endif
+
+#if SENSOR_TRANSPORT == TRANSPORT_I2C_MASTER
+
+i2c_master_bus_handle_t I2CMasterTransport::new_bus(i2c_port_num_t port, int sda, int scl)
+{
+    i2c_master_bus_config_t cfg = {};
+    cfg.i2c_port = port;
+    cfg.sda_io_num = (gpio_num_t)sda;
+    cfg.scl_io_num = (gpio_num_t)scl;
+    cfg.clk_source = I2C_CLK_SRC_DEFAULT;
+    cfg.glitch_ignore_cnt = 7;
+    // A non-zero queue depth puts the bus in async mode.
+    cfg.trans_queue_depth = I2C_BATCH_MAX;
+    cfg.flags.enable_internal_pullup = true;
+
+    i2c_master_bus_handle_t bus = nullptr;
+    esp_err_t err = i2c_new_master_bus(&cfg, &bus);
+    if (err != ESP_OK)
+    {
+        printf("i2c_new_master_bus(%d) failed: %s\n", port, esp_err_to_name(err));
+        return nullptr;
+    }
+    return bus;
+}
+
+I2CMasterTransport::I2CMasterTransport(i2c_master_bus_handle_t bus, uint8_t address, uint32_t hz)
+{
+    sem = xSemaphoreCreateBinary();
+
+    i2c_device_config_t cfg = {};
+    cfg.dev_addr_length = I2C_ADDR_BIT_LEN_7;
+    cfg.device_address = address >> 1;
+    cfg.scl_speed_hz = hz;
+    esp_err_t err = i2c_master_bus_add_device(bus, &cfg, &dev);
+    if (err != ESP_OK)
+    {
+        printf("i2c_master_bus_add_device(0x%02X) failed: %s\n", address, esp_err_to_name(err));
+        dev = nullptr;
+        return;
+    }
+
+    i2c_master_event_callbacks_t cbs = {};
+    cbs.on_trans_done = on_trans_done;
+    err = i2c_master_register_event_callbacks(dev, &cbs, this);
+    if (err != ESP_OK)
+        printf("i2c_master_register_event_callbacks failed: %s\n", esp_err_to_name(err));
+}
+
+bool IRAM_ATTR I2CMasterTransport::on_trans_done(i2c_master_dev_handle_t dev, const i2c_master_event_data_t *evt, void *arg)
+{
+    I2CMasterTransport *t = (I2CMasterTransport *)arg;
+    portENTER_CRITICAL_ISR(&t->lock);
+    if (evt->event != I2C_EVENT_DONE)
+        t->batch_status = -1;
+    bool last = --t->pending == 0;
+    portEXIT_CRITICAL_ISR(&t->lock);
+    if (last)
+        t->done(t->done_arg, t->batch_status);
+    // Any context switch is requested by the done callback.
+    return false;
+}
+
+void IRAM_ATTR I2CMasterTransport::wake(void *arg, int32_t status)
+{
+    I2CMasterTransport *t = (I2CMasterTransport *)arg;
+    t->sync_status = status;
+    // A failed submit calls this from the task that is about to wait.
+    if (!xPortInIsrContext())
+    {
+        xSemaphoreGive(t->sem);
+        return;
+    }
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(t->sem, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+int32_t I2CMasterTransport::read(uint8_t reg, uint8_t *data, uint16_t len)
+{
+    BusTransaction t = {reg, false, len, data};
+    int32_t status = submit(&t, 1, wake, this);
+    if (status != 0)
+        return status;
+    xSemaphoreTake(sem, portMAX_DELAY);
+    return sync_status;
+}
+
+int32_t I2CMasterTransport::write(uint8_t reg, const uint8_t *data, uint16_t len)
+{
+    BusTransaction t = {reg, true, len, (uint8_t *)data};
+    int32_t status = submit(&t, 1, wake, this);
+    if (status != 0)
+        return status;
+    xSemaphoreTake(sem, portMAX_DELAY);
+    return sync_status;
+}
+
+int32_t I2CMasterTransport::submit(BusTransaction *batch, uint8_t count, BusDoneCallback cb, void *arg)
+{
+    if (dev == nullptr || count == 0 || count > I2C_BATCH_MAX || pending != 0)
+        return -1;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (batch[i].write && batch[i].len > I2C_WRITE_MAX)
+            return -1;
+    }
+    done = cb;
+    done_arg = arg;
+    batch_status = 0;
+    pending = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        BusTransaction &t = batch[i];
+        esp_err_t err;
+        if (t.write)
+        {
+            tx[i][0] = t.reg;
+            memcpy(&tx[i][1], t.data, t.len);
+            err = i2c_master_transmit(dev, tx[i], t.len + 1, -1);
+        }
+        else
+        {
+            err = i2c_master_transmit_receive(dev, &t.reg, 1, t.data, t.len, -1);
+        }
+        if (err != ESP_OK)
+        {
+            // Transactions already queued will still complete, so account for
+            // the ones that won't and let the callback report the failure.
+            submit_failures++;
+            portENTER_CRITICAL(&lock);
+            batch_status = -1;
+            pending -= count - i;
+            bool last = pending == 0;
+            portEXIT_CRITICAL(&lock);
+            if (last)
+                done(done_arg, batch_status);
+            return 0;
+        }
+    }
+    return 0;
+}
+#endif
+
+#if SELF_TEST
+struct MockDone
+{
+    int calls = 0;
+    int32_t status = 1;
+};
+
+static void mock_done(void *arg, int32_t status)
+{
+    MockDone *d = (MockDone *)arg;
+    d->calls++;
+    d->status = status;
+}
+
+/// @brief Run SPITransport batches on a deferred MockBus, as the reader does,
+/// with and without bounce buffers, and a submit that fails part way, which
+/// must still call done just once.
+void test_mock_bus()
+{
+    SimulatedLSM *sim = new SimulatedLSM(RATE.odr, 1.0f);
+    MockBus *bus = new MockBus(sim);
+    SPITransport spi(bus);
+    lsm6dsv16x_fifo_record_t *records = new lsm6dsv16x_fifo_record_t[RATE.max_records];
+    uint8_t status[2];
+    bus->deferred = true;
+
+    long next = 0;
+    for (int cycle = 0; cycle < 20; cycle++)
+    {
+        // The second half holds the reads until collect().
+        bus->bounce = cycle >= 10;
+        memset(status, 0xA5, sizeof(status));
+        sim->advance((cycle + 1) * RATE.read_interval_usec());
+        uint16_t level = sim->fifo_level();
+        uint16_t n = level < RATE.max_records ? level : RATE.max_records;
+        BusTransaction batch[2] = {
+            {LSM6DSV16X_FIFO_STATUS1, false, 2, status},
+            {LSM6DSV16X_FIFO_DATA_OUT_TAG, false, (uint16_t)(n * 7), (uint8_t *)records},
+        };
+        MockDone done;
+        assert(spi.submit(batch, 2, mock_done, &done) == 0);
+        // Nothing happens until the frames finish.
+        assert(done.calls == 0);
+        bus->complete();
+        assert(done.calls == 1 && done.status == 0);
+        if (bus->bounce)
+        {
+            assert(status[0] == 0xA5 && status[1] == 0xA5);
+            assert(spi.collect() == 0);
+        }
+        assert((status[0] | (status[1] & 0x01) << 8) == level);
+        for (int i = 0; i < n; i++)
+        {
+            if (records[i].tag.tag_sensor != SIM_TAG_XL_NC)
+                continue;
+            assert(records[i].data[1] == sim->value(next, 1));
+            next++;
+        }
+    }
+    assert(next > 0);
+    bus->bounce = false;
+
+    // The second frame can't be queued, so done waits for the first.
+    BusTransaction batch[2] = {
+        {LSM6DSV16X_FIFO_STATUS1, false, 2, status},
+        {LSM6DSV16X_FIFO_DATA_OUT_TAG, false, 7, (uint8_t *)records},
+    };
+    MockDone done;
+    bus->queue_depth = 1;
+    assert(spi.submit(batch, 2, mock_done, &done) == 0);
+    assert(done.calls == 0);
+    bus->complete();
+    assert(done.calls == 1 && done.status != 0);
+    assert(spi.submit_failures == 1);
+
+    // Nothing can be queued, so submit calls done itself, from the task.
+    done = MockDone();
+    bus->queue_depth = 0;
+    assert(spi.submit(batch, 2, mock_done, &done) == 0);
+    assert(done.calls == 1 && done.status != 0);
+    assert(spi.submit_failures == 2);
+    // And the transport is free for the next batch.
+    done = MockDone();
+    bus->queue_depth = 8;
+    assert(spi.submit(batch, 2, mock_done, &done) == 0);
+    bus->complete();
+    assert(done.calls == 1 && done.status == 0);
+    assert(spi.submit_failures == 2);
+
+    printf("Mock bus test: %ld samples, %ld frames\n", next, bus->spi_frames);
+    delete[] records;
+    delete bus;
+    delete sim;
+}
+#endif
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include "rate.h"
+
+// Sensor bus transport, selected at build time, e.g. with
+//   idf.py -DSENSOR_TRANSPORT=1 build
+// TRANSPORT_WIRE uses the Arduino TwoWire driver through the stm32duino register context.
+// TRANSPORT_I2C_MASTER uses the ESP-IDF i2c_master driver directly, with async batches.
+#define TRANSPORT_WIRE 0
+#define TRANSPORT_I2C_MASTER 1
+// TRANSPORT_SPI uses the ESP-IDF spi_master driver, with DMA bursts from the FIFO.
+#define TRANSPORT_SPI 2
+
+#ifndef SENSOR_TRANSPORT
+#define SENSOR_TRANSPORT TRANSPORT_WIRE
+#endif
+
+// FIFO bursts are a multiple of this many records.  SPI DMA wants receive
+// buffers and lengths in whole words, and 4 records are 28 bytes.
+#if SENSOR_TRANSPORT == TRANSPORT_SPI
+#define SENSOR_BURST_RECORDS 4
+#else
+#define SENSOR_BURST_RECORDS 1
+#endif
+static_assert(RATE.max_records % SENSOR_BURST_RECORDS == 0, "Reads must split evenly into bursts");
+
+#if SENSOR_ACQUISITION == ACQUISITION_PARALLEL && SENSOR_TRANSPORT != TRANSPORT_I2C_MASTER
+#error "Parallel acquisition needs SENSOR_TRANSPORT == TRANSPORT_I2C_MASTER"
+#endif
+#if SENSOR_ACQUISITION == ACQUISITION_SENSOR_HUB && SENSOR_TRANSPORT != TRANSPORT_I2C_MASTER
+#error "Sensor hub acquisition needs SENSOR_TRANSPORT == TRANSPORT_I2C_MASTER"
+#endif
+
+// Pins and clock for the sensor bus.
+#define SENSOR_SDA 3
+#define SENSOR_SCL 4
+#define SENSOR_I2C_HZ 1000000
+
+// imu1's INT1, which wakes the MCU on activity (see activity.h).
+#define SENSOR1_INT1 8
+
+// Pins for the second controller, used by the second sensor in parallel acquisition.
+#define SENSOR2_SDA 5
+#define SENSOR2_SCL 6
+
+// The SPI option puts both sensors on SPI3_HOST, since the Arduino SPI driver
+// owns SPI2 for the TFT.  The LSM6DSV16X supports up to 10 MHz.
+#define SENSOR_SPI_SCK 14
+#define SENSOR_SPI_MOSI 15
+#define SENSOR_SPI_MISO 16
+#define SENSOR1_CS 17
+#define SENSOR2_CS 18
+#define SENSOR_SPI_HZ 10000000
+
+/// @brief One register transfer within a batch.
+/// The batch, and the buffers it points to, must stay valid until the batch completes.
+struct BusTransaction
+{
+    uint8_t reg;   // First register.  Registers auto-increment for len > 1.
+    bool write;    // Write data to the device, rather than reading.
+    uint16_t len;  // Bytes to transfer.
+    uint8_t *data; // Source or destination buffer.
+};
+
+/// @brief Called when a batch completes.  May be called from ISR context.
+/// @param status 0 if every transaction succeeded, an error code otherwise.
+typedef void (*BusDoneCallback)(void *arg, int32_t status);
+
+/// @brief Register level access to a single sensor.
+/// The signatures of read and write match the stmdev_ctx_t callbacks, so a
+/// Transport can stand in for the stm32duino bus code (see LSMExtension::Use_Transport).
+class Transport
+{
+public:
+    virtual ~Transport() {}
+
+    /// @brief Blocking register read.
+    virtual int32_t read(uint8_t reg, uint8_t *data, uint16_t len) = 0;
+    /// @brief Blocking register write.
+    virtual int32_t write(uint8_t reg, const uint8_t *data, uint16_t len) = 0;
+
+    /// @brief Queue a batch of transactions, to be executed back to back.
+    /// Only one batch may be in flight on a transport at a time.
+    /// The default implementation executes the batch synchronously, then calls done.
+    /// @return 0 if the batch was queued, an error code otherwise.  done is only
+    /// called if the batch was queued.
+    virtual int32_t submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg);
+    /// @brief Finish a batch, in the task, after done and before reading its
+    /// buffers.  Some transports only copy received data into place here.
+    /// @return 0, or an error code.
+    virtual int32_t collect() { return 0; }
+
+    /// @brief Batches submit() couldn't queue whole.  Each is reported to done
+    /// as a failed batch, never printed, since submit runs on the read path.
+    long submit_failures = 0;
+};
+
+/// @brief Exchanges SPI frames with one device.  A frame is a command byte
+/// followed by len data bytes, written from tx or read into rx.
+class SpiPort
+{
+public:
+    virtual ~SpiPort() {}
+
+    /// @brief Blocking frame.
+    virtual int32_t transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len) = 0;
+    /// @brief Queue a frame.  complete is called when it finishes, possibly from ISR context.
+    virtual int32_t queue(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                          BusDoneCallback complete, void *arg) = 0;
+    /// @brief Collect completed frames, in the task.  A queued frame's rx may
+    /// only hold its data after this.
+    virtual int32_t collect() { return 0; }
+};
+
+/// @brief LSM6DSV16X register access over SPI.  Bit 7 of the command selects a read.
+/// Batches are queued frame by frame, so a FIFO burst is a single DMA transfer.
+class SPITransport : public Transport
+{
+public:
+    explicit SPITransport(SpiPort *port) : port(port) {}
+
+    int32_t read(uint8_t reg, uint8_t *data, uint16_t len) override
+    {
+        return port->transfer(reg | 0x80, nullptr, data, len);
+    }
+    int32_t write(uint8_t reg, const uint8_t *data, uint16_t len) override
+    {
+        return port->transfer(reg & 0x7F, data, nullptr, len);
+    }
+    int32_t submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg) override;
+    int32_t collect() override { return port->collect(); }
+
+private:
+    static void frame_done(void *arg, int32_t status);
+
+    SpiPort *port;
+    // Frames still to finish, and the first failure.  Atomic, rather than a
+    // critical section, since frames finish in the ISR or, on the host, inline.
+    std::atomic<int> pending{0};
+    std::atomic<int32_t> batch_status{0};
+    BusDoneCallback done = nullptr;
+    void *done_arg = nullptr;
+};
+
+#if SENSOR_TRANSPORT == TRANSPORT_SPI
+#include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+
+// Frames that can be queued on one device.
+#define SPI_QUEUE_DEPTH 4
+
+/// @brief SpiPort on the ESP-IDF spi_master driver.  Data phases use DMA, so
+/// FIFO bursts go straight into the (word aligned, internal RAM) record buffers,
+/// in whole words (see SENSOR_BURST_RECORDS).  Reads of up to 4 bytes, like
+/// the FIFO status, use the transaction's own rx_data.  From IDF 5.5.1 the
+/// driver may still bounce a buffer, and copy it back in
+/// spi_device_get_trans_result, so frames are only complete after collect().
+class EspSpiPort : public SpiPort
+{
+public:
+    /// @brief Initialize the sensor SPI bus, once, before creating ports.
+    static bool init_bus(spi_host_device_t host, int mosi, int miso, int sck);
+
+    EspSpiPort(spi_host_device_t host, int cs, int hz = SENSOR_SPI_HZ);
+
+    int32_t transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len) override;
+    int32_t queue(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                  BusDoneCallback complete, void *arg) override;
+    int32_t collect() override;
+
+private:
+    struct Slot
+    {
+        spi_transaction_t trans;
+        uint8_t *rx;
+        BusDoneCallback complete;
+        void *arg;
+    };
+    static void post_cb(spi_transaction_t *trans);
+    static void fill(spi_transaction_t &t, uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint16_t len);
+    /// @brief Copy a short read out of the transaction's rx_data.
+    static void finish(const spi_transaction_t &t, uint8_t *rx);
+    /// @brief Collect finished frames, waiting up to ticks for each.
+    void reap(TickType_t ticks);
+
+    spi_device_handle_t dev = nullptr;
+    Slot slots[SPI_QUEUE_DEPTH];
+    uint8_t next_slot = 0;
+    uint8_t outstanding = 0;
+};
+#endif
+
+#if SENSOR_TRANSPORT == TRANSPORT_I2C_MASTER
+#include "driver/i2c_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Maximum transactions per batch, and the depth of the driver queue.
+#define I2C_BATCH_MAX 4
+// Largest register write, in bytes, that can be queued.
+#define I2C_WRITE_MAX 16
+
+/// @brief Transport built directly on the ESP-IDF i2c_master driver.
+/// The device is used in async mode, so that transfers proceed under interrupt
+/// while the CPU does other work.  Blocking reads and writes wait on a semaphore.
+class I2CMasterTransport : public Transport
+{
+public:
+    /// @brief Create a bus in async mode on the given controller.
+    static i2c_master_bus_handle_t new_bus(i2c_port_num_t port, int sda, int scl);
+
+    /// @param address  8 bit (read) address, as in LSM6DSV16X_I2C_ADD_L.
+    I2CMasterTransport(i2c_master_bus_handle_t bus, uint8_t address, uint32_t hz = SENSOR_I2C_HZ);
+
+    int32_t read(uint8_t reg, uint8_t *data, uint16_t len) override;
+    int32_t write(uint8_t reg, const uint8_t *data, uint16_t len) override;
+    int32_t submit(BusTransaction *batch, uint8_t count, BusDoneCallback done, void *arg) override;
+
+private:
+    static bool on_trans_done(i2c_master_dev_handle_t dev, const i2c_master_event_data_t *evt, void *arg);
+    static void wake(void *arg, int32_t status);
+
+    i2c_master_dev_handle_t dev = nullptr;
+    SemaphoreHandle_t sem = nullptr;
+    int32_t sync_status = 0;
+
+    // State of the batch in flight, shared with the ISR.
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t pending = 0;
+    int32_t batch_status = 0;
+    BusDoneCallback done = nullptr;
+    void *done_arg = nullptr;
+    // Writes need the register address and the data in one buffer.
+    uint8_t tx[I2C_BATCH_MAX][I2C_WRITE_MAX + 1];
+};
+#endif
+
+void test_mock_bus();
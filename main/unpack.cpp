@@ -0,0 +1,148 @@
+#include <cassert>
+#include <stdio.h>
+#include <string.h>
+
+#include "timing.h"
+#include "unpack.h"
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "The kernel shifts fields out of little endian words");
+static_assert(sizeof(lsm6dsv16x_fifo_record_t) == 7, "FIFO records are a tag byte and three int16");
+static_assert(RATE.max_records % 4 == 0, "The last group of four records may write past count, but not past the arrays");
+
+// The tag byte is bit 0 unused, then tag_cnt in 2 bits, then tag_sensor in 5.
+static inline void put_tag(UnpackedRecords &out, int i, uint32_t byte)
+{
+    out.tag[i] = (byte >> 3) & 0x1F;
+    out.cnt[i] = (byte >> 1) & 3;
+}
+
+static inline void put_axes(UnpackedRecords &out, int i, uint32_t x, uint32_t y, uint32_t z)
+{
+    out.axis[0][i] = (int16_t)x;
+    out.axis[1][i] = (int16_t)y;
+    out.axis[2][i] = (int16_t)z;
+}
+
+/// @brief Unpack records i to i + 3 from the seven words they fill.  Record
+/// r starts at byte 7r, so its fields are at bytes 7r, 7r + 1, 7r + 3 and
+/// 7r + 5, and three of the twelve int16 straddle two words.
+static inline void unpack4(const uint32_t w[7], UnpackedRecords &out, int i)
+{
+    put_tag(out, i, w[0]);
+    put_axes(out, i, w[0] >> 8, w[0] >> 24 | w[1] << 8, w[1] >> 8);
+    put_tag(out, i + 1, w[1] >> 24);
+    put_axes(out, i + 1, w[2], w[2] >> 16, w[3]);
+    put_tag(out, i + 2, w[3] >> 16);
+    put_axes(out, i + 2, w[3] >> 24 | w[4] << 8, w[4] >> 8, w[4] >> 24 | w[5] << 8);
+    put_tag(out, i + 3, w[5] >> 8);
+    put_axes(out, i + 3, w[5] >> 16, w[6], w[6] >> 16);
+}
+
+void unpack_records(const lsm6dsv16x_fifo_record_t *records, int count, UnpackedRecords &out)
+{
+    assert((uintptr_t)records % 4 == 0);
+    const uint8_t *bytes = (const uint8_t *)__builtin_assume_aligned(records, 4);
+    uint32_t w[7];
+    int i = 0;
+    for (; i + 4 <= count; i += 4, bytes += sizeof(w))
+    {
+        // Aligned, so these are seven word loads.
+        memcpy(w, bytes, sizeof(w));
+        unpack4(w, out, i);
+    }
+    if (i < count)
+    {
+        // The last few records, padded with zeros.
+        memset(w, 0, sizeof(w));
+        memcpy(w, bytes, (count - i) * sizeof(lsm6dsv16x_fifo_record_t));
+        unpack4(w, out, i);
+    }
+    out.count = count;
+}
+
+#if SELF_TEST
+/// @brief The same, a field at a time, through the packed struct.
+static void unpack_fields(const lsm6dsv16x_fifo_record_t *records, int count, UnpackedRecords &out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        out.tag[i] = records[i].tag.tag_sensor;
+        out.cnt[i] = records[i].tag.tag_cnt;
+        for (int a = 0; a < 3; a++)
+            out.axis[a][i] = records[i].data[a];
+    }
+    out.count = count;
+}
+
+/// @brief Fill records with pseudo random bytes.
+static void scramble(lsm6dsv16x_fifo_record_t *records, int count, uint32_t seed)
+{
+    uint8_t *bytes = (uint8_t *)records;
+    for (size_t i = 0; i < count * sizeof(lsm6dsv16x_fifo_record_t); i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        bytes[i] = seed >> 24;
+    }
+}
+
+/// @brief Check that the word kernel matches field by field access exactly,
+/// for every read length, including the extremes of each field.
+void test_unpack_records()
+{
+    alignas(4) static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    static UnpackedRecords expected, actual;
+    int checked = 0;
+    for (int count = 0; count <= RATE.max_records; count++)
+    {
+        for (uint32_t seed = 1; seed <= 4; seed++)
+        {
+            scramble(records, RATE.max_records, seed * 7919 + count);
+            if (seed == 4 && count > 0)
+            {
+                // All ones, then all zeros, in the last record.
+                memset(&records[count - 1], 0xFF, sizeof(records[0]));
+                if (count > 1)
+                    memset(&records[count - 2], 0, sizeof(records[0]));
+            }
+            unpack_fields(records, count, expected);
+            actual.count = 0xFFFF;
+            unpack_records(records, count, actual);
+            assert(actual.count == count);
+            for (int i = 0; i < count; i++)
+            {
+                assert(actual.tag[i] == expected.tag[i] && actual.cnt[i] == expected.cnt[i]);
+                for (int a = 0; a < 3; a++)
+                    assert(actual.axis[a][i] == expected.axis[a][i]);
+                checked++;
+            }
+        }
+    }
+    printf("Unpack: %d records bit exact, reads of 0 to %d records\n", checked, RATE.max_records);
+}
+
+/// @brief Compare the word kernel with field by field access, on a full read.
+void benchmark_unpack()
+{
+    alignas(4) static lsm6dsv16x_fifo_record_t records[RATE.max_records];
+    static UnpackedRecords out;
+    scramble(records, RATE.max_records, 12345);
+    const int iterations = 1000;
+    int64_t start = now_usec();
+    // The barriers keep the compiler from dropping the repeated, unused unpacks.
+    for (int i = 0; i < iterations; i++)
+    {
+        unpack_records(records, RATE.max_records, out);
+        asm volatile("" : : "r"(&out) : "memory");
+    }
+    int64_t words = now_usec() - start;
+    start = now_usec();
+    for (int i = 0; i < iterations; i++)
+    {
+        unpack_fields(records, RATE.max_records, out);
+        asm volatile("" : : "r"(&out) : "memory");
+    }
+    int64_t fields = now_usec() - start;
+    printf("Unpack benchmark: %.2f usec per %d record read, against %.2f field by field\n",
+           (float)words / iterations, RATE.max_records, (float)fields / iterations);
+}
+#endif
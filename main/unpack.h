@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "rate.h"
+#include "record.h"
+
+// FIFO records are 7 bytes, packed, so most of their int16 fields are
+// unaligned, and each access is assembled from byte loads.  The merger
+// unpacks each read once, as it arrives, into a tag array, a count array and
+// an aligned array per axis, and everything after that, gap counting,
+// compaction, fitting, resampling and demultiplexing, works on those.
+
+/// @brief A FIFO read, or a run of samples, split by field.
+struct UnpackedRecords
+{
+    uint16_t count = 0;
+    alignas(4) uint8_t tag[RATE.max_records];      // tag_sensor.
+    alignas(4) uint8_t cnt[RATE.max_records];      // tag_cnt.
+    alignas(4) int16_t axis[3][RATE.max_records];  // x, y, z.
+
+    /// @brief Copy record i's x, y, z into out.
+    void sample(int i, int16_t out[3]) const
+    {
+        out[0] = axis[0][i];
+        out[1] = axis[1][i];
+        out[2] = axis[2][i];
+    }
+};
+
+/// @brief Split count records into out.  Four records are 28 bytes, so they
+/// are loaded as seven aligned words, and each field is shifted out of the
+/// word or pair of words it lies in.
+/// @param records Word aligned, as LoggerMsg::records is.
+void unpack_records(const lsm6dsv16x_fifo_record_t *records, int count, UnpackedRecords &out);
+
+void test_unpack_records();
+void benchmark_unpack();